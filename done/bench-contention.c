@@ -0,0 +1,193 @@
+/**
+ * @file bench-contention.c
+ * @brief Benchmark of the server locking under a mixed read/insert load:
+ *        one mutex for everything vs reader/writer lock with the hashing
+ *        and decoding of inserted images done outside of it.
+ *
+ * Usage: ./bench-contention [image.jpg [nb_readers [seconds]]]
+ *        (default: ../provided/tests/data/foret.jpg 4 2)
+ *
+ * For each policy, a fresh imgFS holding the image is created; readers
+ * read it (original resolution) in a loop while one writer inserts it
+ * again under a new name and deletes it.
+ */
+
+#define _GNU_SOURCE // for PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP
+
+#include "imgfs.h"
+#include "util.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vips/vips.h>
+
+#define BENCH_IMGFS "/tmp/bench-contention.imgfs"
+#define MAX_READERS 64
+
+/********************************************************************/
+enum policy { SINGLE_MUTEX, RWLOCK };
+
+static struct imgfs_file imgfs_file;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t rwlock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP; // as the server
+static enum policy policy;
+static volatile int running;
+
+static char* image;
+static size_t image_size;
+
+struct counters {
+    uint64_t nb; // operations done
+    double max_ns; // slowest one
+};
+
+/********************************************************************/
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+/********************************************************************/
+static void count(struct counters* c, double start)
+{
+    const double t = now_ns() - start;
+    ++c->nb;
+    if (t > c->max_ns) c->max_ns = t;
+}
+
+/********************************************************************/
+static void* reader(void* arg)
+{
+    struct counters* c = arg;
+    while (running) {
+        char* buffer = NULL;
+        uint32_t size = 0;
+        const double start = now_ns();
+
+        if (policy == SINGLE_MUTEX) pthread_mutex_lock(&mutex);
+        else pthread_rwlock_rdlock(&rwlock);
+        const int ret = do_read("bench", ORIG_RES, &buffer, &size, &imgfs_file);
+        if (policy == SINGLE_MUTEX) pthread_mutex_unlock(&mutex);
+        else pthread_rwlock_unlock(&rwlock);
+
+        free(buffer);
+        if (ret != ERR_NONE) {
+            fprintf(stderr, "read failed: %s\n", ERR_MSG(ret));
+            exit(EXIT_FAILURE);
+        }
+        count(c, start);
+    }
+    return NULL;
+}
+
+/********************************************************************/
+static void* writer(void* arg)
+{
+    struct counters* c = arg;
+    int ret = ERR_NONE;
+    while (running && ret == ERR_NONE) {
+        const double start = now_ns();
+
+        if (policy == SINGLE_MUTEX) {
+            pthread_mutex_lock(&mutex);
+            ret = do_insert(image, image_size, "other", &imgfs_file);
+            pthread_mutex_unlock(&mutex);
+        } else {
+            // The expensive part without the lock
+            struct img_digest digest;
+            ret = do_insert_prepare(image, image_size, &digest);
+            if (ret != ERR_NONE) break;
+
+            pthread_rwlock_wrlock(&rwlock);
+            ret = do_insert_prepared(image, image_size, "other", &digest, &imgfs_file);
+            pthread_rwlock_unlock(&rwlock);
+        }
+
+        if (ret == ERR_NONE) {
+            if (policy == SINGLE_MUTEX) pthread_mutex_lock(&mutex);
+            else pthread_rwlock_wrlock(&rwlock);
+            ret = do_delete("other", &imgfs_file);
+            if (policy == SINGLE_MUTEX) pthread_mutex_unlock(&mutex);
+            else pthread_rwlock_unlock(&rwlock);
+        }
+        count(c, start);
+    }
+    if (ret != ERR_NONE) {
+        fprintf(stderr, "insert/delete failed: %s\n", ERR_MSG(ret));
+        exit(EXIT_FAILURE);
+    }
+    return NULL;
+}
+
+/********************************************************************/
+static void run(enum policy p, const char* name, unsigned nb_readers, double seconds)
+{
+    struct imgfs_file created = { .header.max_files = 10,
+                                  .header.resized_res = { 64, 64, 256, 256 } };
+    if (do_create(BENCH_IMGFS, &created) != ERR_NONE) exit(EXIT_FAILURE);
+    do_close(&created);
+    if (do_open(BENCH_IMGFS, "rb+", &imgfs_file) != ERR_NONE
+        || do_insert(image, image_size, "bench", &imgfs_file) != ERR_NONE) {
+        fprintf(stderr, "cannot create " BENCH_IMGFS "\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_t threads[MAX_READERS + 1];
+    struct counters counters[MAX_READERS + 1];
+    memset(counters, 0, sizeof(counters));
+    policy = p;
+    running = 1;
+
+    pthread_create(&threads[0], NULL, writer, &counters[0]);
+    for (unsigned i = 1; i <= nb_readers; ++i) pthread_create(&threads[i], NULL, reader, &counters[i]);
+
+    struct timespec duration = { (time_t) seconds, (long) ((seconds - (double) (time_t) seconds) * 1e9) };
+    nanosleep(&duration, NULL);
+    running = 0;
+    for (unsigned i = 0; i <= nb_readers; ++i) pthread_join(threads[i], NULL);
+
+    struct counters reads = { 0, 0 };
+    for (unsigned i = 1; i <= nb_readers; ++i) {
+        reads.nb += counters[i].nb;
+        if (counters[i].max_ns > reads.max_ns) reads.max_ns = counters[i].max_ns;
+    }
+    printf("%-12s %12.0f %14.3f %12.0f %14.3f\n", name,
+           (double) reads.nb / seconds, reads.max_ns / 1e6,
+           (double) counters[0].nb / seconds, counters[0].max_ns / 1e6);
+
+    do_close(&imgfs_file);
+    remove(BENCH_IMGFS);
+}
+
+/********************************************************************/
+int main(int argc, char* argv[])
+{
+    if (VIPS_INIT(argv[0])) return EXIT_FAILURE;
+
+    const char* path = argc > 1 ? argv[1] : "../provided/tests/data/foret.jpg";
+    unsigned nb_readers = argc > 2 ? (unsigned) atoi(argv[2]) : 4;
+    const double seconds = argc > 3 ? atof(argv[3]) : 2.0;
+    if (nb_readers < 1 || nb_readers > MAX_READERS) nb_readers = 4;
+
+    FILE* f = fopen(path, "rb");
+    if (f == NULL || fseek(f, 0, SEEK_END) != 0) return EXIT_FAILURE;
+    image_size = (size_t) ftell(f);
+    image = malloc(image_size);
+    if (image == NULL || fseek(f, 0, SEEK_SET) != 0 || fread(image, image_size, 1, f) != 1) return EXIT_FAILURE;
+    fclose(f);
+
+    printf("%s (%zu bytes), %u reader(s), %.1f s\n", path, image_size, nb_readers, seconds);
+    printf("%-12s %12s %14s %12s %14s\n", "policy", "reads/s", "max read ms", "inserts/s", "max insert ms");
+    run(SINGLE_MUTEX, "mutex", nb_readers, seconds);
+    run(RWLOCK, "rwlock", nb_readers, seconds);
+
+    free(image);
+    vips_shutdown();
+    return EXIT_SUCCESS;
+}
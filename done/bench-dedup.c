@@ -0,0 +1,159 @@
+/**
+ * @file bench-dedup.c
+ * @brief Benchmark of the content deduplication: content index vs former linear scan.
+ *
+ * Usage: ./bench-dedup [nb_files ...]   (default: 1000 10000 100000 1000000)
+ *
+ * For each size, an in-memory imgFS of nb_files valid images (random SHA) is
+ * built, then the last image is deduplicated repeatedly, once with a
+ * duplicated content (hit) and once with a new one (miss).
+ */
+
+#include "imgfs.h"
+#include "imgfs_index.h"
+#include "image_dedup.h"
+#include "util.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NB_LOOKUPS 2000
+
+/********************************************************************/
+static uint64_t rand_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t next_rand(void)
+{
+    // xorshift64
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    return rand_state;
+}
+
+/********************************************************************/
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+/********************************************************************
+ * Content deduplication as it was done before the content index.
+ */
+static int linear_content_dedup(struct imgfs_file* imgfs_file, uint32_t index)
+{
+    const unsigned char* sha = imgfs_file->metadata[index].SHA;
+    for (size_t i = 0; i < imgfs_file->header.max_files; ++i) {
+        if (imgfs_file->metadata[i].is_valid && i != index
+            && memcmp(sha, imgfs_file->metadata[i].SHA, SHA256_DIGEST_LENGTH) == 0) {
+            for (size_t j = 0; j < NB_RES; ++j) {
+                imgfs_file->metadata[index].offset[j] = imgfs_file->metadata[i].offset[j];
+                imgfs_file->metadata[index].size[j] = imgfs_file->metadata[i].size[j];
+            }
+            return ERR_NONE;
+        }
+    }
+    imgfs_file->metadata[index].offset[ORIG_RES] = 0;
+    return ERR_NONE;
+}
+
+/********************************************************************
+ * Average time (ns) of one deduplication of the last image.
+ */
+static double time_dedup(struct imgfs_file* imgfs_file, int indexed, unsigned nb)
+{
+    const uint32_t last = imgfs_file->header.max_files - 1;
+    const double start = now_ns();
+    for (unsigned n = 0; n < nb; ++n) {
+        const int ret = indexed ? do_name_and_content_dedup(imgfs_file, last)
+                        : linear_content_dedup(imgfs_file, last);
+        if (ret != ERR_NONE) {
+            fprintf(stderr, "dedup failed: %s\n", ERR_MSG(ret));
+            exit(EXIT_FAILURE);
+        }
+    }
+    return (now_ns() - start) / nb;
+}
+
+/********************************************************************/
+static int bench(uint32_t nb_files)
+{
+    struct imgfs_file imgfs_file;
+    zero_init_var(imgfs_file);
+    imgfs_file.header.max_files = nb_files;
+    imgfs_file.header.nb_files = nb_files;
+
+    imgfs_file.file = tmpfile();
+    imgfs_file.metadata = calloc(nb_files, sizeof(struct img_metadata));
+    if (imgfs_file.file == NULL || imgfs_file.metadata == NULL) return ERR_OUT_OF_MEMORY;
+
+    for (uint32_t i = 0; i < nb_files; ++i) {
+        struct img_metadata* md = &imgfs_file.metadata[i];
+        snprintf(md->img_id, sizeof(md->img_id), "pic%" PRIu32, i);
+        for (size_t b = 0; b < SHA256_DIGEST_LENGTH; b += sizeof(uint64_t)) {
+            const uint64_t r = next_rand();
+            memcpy(md->SHA + b, &r, sizeof(r));
+        }
+        md->offset[ORIG_RES] = 1000 + i;
+        md->is_valid = NON_EMPTY;
+    }
+
+    // No on-disk region (unused_64 == 0): the indexes are built in memory
+    double start = now_ns();
+    int ret = imgfs_index_load(&imgfs_file, 0);
+    const double build = now_ns() - start;
+    if (ret != ERR_NONE) return ret;
+
+    const unsigned nb = nb_files < NB_LOOKUPS ? nb_files : NB_LOOKUPS;
+    struct img_metadata* last = &imgfs_file.metadata[nb_files - 1];
+
+    // Hit: same content as the image in the middle (the linear scan stops halfway)
+    memcpy(last->SHA, imgfs_file.metadata[nb_files / 2].SHA, SHA256_DIGEST_LENGTH);
+    const double hit_linear = time_dedup(&imgfs_file, 0, nb);
+    const double hit_index = time_dedup(&imgfs_file, 1, nb);
+
+    // Miss: content found nowhere else
+    last->SHA[0] ^= 0xFF;
+    const double miss_linear = time_dedup(&imgfs_file, 0, nb);
+    const double miss_index = time_dedup(&imgfs_file, 1, nb);
+
+    printf("%10" PRIu32 " %12.1f %12.1f %12.1f %12.1f %12.2f\n", nb_files,
+           hit_linear, hit_index, miss_linear, miss_index, build / 1e6);
+
+    imgfs_index_free(&imgfs_file);
+    free(imgfs_file.metadata);
+    fclose(imgfs_file.file);
+    return ERR_NONE;
+}
+
+/********************************************************************/
+int main(int argc, char* argv[])
+{
+    static const uint32_t default_sizes[] = { 1000, 10000, 100000, 1000000 };
+
+    printf("%10s %12s %12s %12s %12s %12s\n", "nb_files",
+           "hit scan ns", "hit index ns", "miss scan ns", "miss index ns", "build ms");
+
+    int ret = ERR_NONE;
+    if (argc > 1) {
+        for (int i = 1; i < argc && ret == ERR_NONE; ++i) {
+            const uint32_t n = atouint32(argv[i]);
+            ret = n < 2 ? ERR_INVALID_ARGUMENT : bench(n);
+        }
+    } else {
+        for (size_t i = 0; i < sizeof(default_sizes) / sizeof(default_sizes[0]) && ret == ERR_NONE; ++i) {
+            ret = bench(default_sizes[i]);
+        }
+    }
+
+    if (ret != ERR_NONE) {
+        fprintf(stderr, "ERROR: %s\n", ERR_MSG(ret));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
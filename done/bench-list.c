@@ -0,0 +1,141 @@
+/**
+ * @file bench-list.c
+ * @brief Benchmark of the JSON listing: JSON writer vs former json-c tree.
+ *
+ * Usage: ./bench-list [nb_files ...]   (default: 10000 100000 1000000)
+ *
+ * For each size, an in-memory imgFS of nb_files valid images is built,
+ * then listed in JSON repeatedly, once by do_list() and once as it was
+ * done before (one json-c object per img_id, then serialized and copied).
+ * Both outputs are checked to be the same.
+ */
+
+#include "imgfs.h"
+#include "util.h"
+
+#include <inttypes.h>
+#include <json-c/json.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NB_ITEMS_LISTED 10000000 // per measure, over all the loops
+
+/********************************************************************/
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+/********************************************************************
+ * JSON listing as it was done before the JSON writer.
+ */
+static int json_c_list(const struct imgfs_file* imgfs_file, char** json)
+{
+    json_object* obj = json_object_new_object();
+    json_object* array = json_object_new_array();
+    if (obj == NULL || array == NULL || json_object_object_add(obj, "Images", array) != 0) {
+        return ERR_RUNTIME;
+    }
+
+    size_t remaining = imgfs_file->header.nb_files;
+    for (size_t i = 0; i < imgfs_file->header.max_files && remaining > 0; ++i) {
+        if (imgfs_file->metadata[i].is_valid) {
+            json_object* string = json_object_new_string(imgfs_file->metadata[i].img_id);
+            if (string == NULL) {
+                json_object_put(obj);
+                return ERR_RUNTIME;
+            }
+            json_object_array_add(array, string);
+            --remaining;
+        }
+    }
+
+    const char* str = json_object_to_json_string(obj);
+    *json = str == NULL ? NULL : calloc(strlen(str) + 1, 1);
+    if (*json != NULL) strcpy(*json, str);
+    json_object_put(obj);
+    return *json == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE;
+}
+
+/********************************************************************
+ * Average time (ns) of one listing; *json is the last one.
+ */
+static double time_list(const struct imgfs_file* imgfs_file, int writer, unsigned nb, char** json)
+{
+    *json = NULL;
+    const double start = now_ns();
+    for (unsigned n = 0; n < nb; ++n) {
+        free(*json);
+        const int ret = writer ? do_list(imgfs_file, JSON, json) : json_c_list(imgfs_file, json);
+        if (ret != ERR_NONE) {
+            fprintf(stderr, "list failed: %s\n", ERR_MSG(ret));
+            exit(EXIT_FAILURE);
+        }
+    }
+    return (now_ns() - start) / nb;
+}
+
+/********************************************************************/
+static int bench(uint32_t nb_files)
+{
+    struct imgfs_file imgfs_file;
+    zero_init_var(imgfs_file);
+    imgfs_file.header.max_files = nb_files;
+    imgfs_file.header.nb_files = nb_files;
+
+    imgfs_file.metadata = calloc(nb_files, sizeof(struct img_metadata));
+    if (imgfs_file.metadata == NULL) return ERR_OUT_OF_MEMORY;
+
+    for (uint32_t i = 0; i < nb_files; ++i) {
+        struct img_metadata* md = &imgfs_file.metadata[i];
+        snprintf(md->img_id, sizeof(md->img_id), "pic%07" PRIu32, i);
+        md->is_valid = NON_EMPTY;
+    }
+
+    const unsigned nb = nb_files < NB_ITEMS_LISTED ? NB_ITEMS_LISTED / nb_files : 1;
+    char* json_c = NULL;
+    char* json_writer = NULL;
+    const double json_c_ns = time_list(&imgfs_file, 0, nb, &json_c);
+    const double writer_ns = time_list(&imgfs_file, 1, nb, &json_writer);
+    const int same = strcmp(json_c, json_writer) == 0;
+
+    printf("%10" PRIu32 " %12.2f %12.2f %10.1fx %12zu %6s\n", nb_files,
+           json_c_ns / 1e6, writer_ns / 1e6, json_c_ns / writer_ns, strlen(json_writer),
+           same ? "yes" : "NO");
+
+    free(json_c);
+    free(json_writer);
+    free(imgfs_file.metadata);
+    return same ? ERR_NONE : ERR_RUNTIME;
+}
+
+/********************************************************************/
+int main(int argc, char* argv[])
+{
+    static const uint32_t default_sizes[] = { 10000, 100000, 1000000 };
+
+    printf("%10s %12s %12s %11s %12s %6s\n", "nb_files",
+           "json-c ms", "writer ms", "speedup", "bytes", "same");
+
+    int ret = ERR_NONE;
+    if (argc > 1) {
+        for (int i = 1; i < argc && ret == ERR_NONE; ++i) {
+            const uint32_t n = atouint32(argv[i]);
+            ret = n < 1 ? ERR_INVALID_ARGUMENT : bench(n);
+        }
+    } else {
+        for (size_t i = 0; i < sizeof(default_sizes) / sizeof(default_sizes[0]) && ret == ERR_NONE; ++i) {
+            ret = bench(default_sizes[i]);
+        }
+    }
+
+    if (ret != ERR_NONE) {
+        fprintf(stderr, "ERROR: %s\n", ERR_MSG(ret));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,138 @@
+/**
+ * @file bench-resize.c
+ * @brief Benchmark of the creation of the resized images: full decoding of
+ *        the original then resizing vs shrink-on-load (as create_resized_img()).
+ *
+ * Usage: ./bench-resize [nb_loops [image.jpg ...]]
+ *        (default: 20 ../provided/tests/data/{foret,papillon,coquelicots}.jpg)
+ *
+ * Each measure runs in its own process, so that its peak memory (maximum
+ * resident set size) is not the one of the previous measures. The baseline
+ * is the peak of that process before it resizes anything.
+ */
+
+#include "image_content.h"
+#include "imgfs.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <vips/vips.h>
+
+#define THUMB_SIZE 64
+#define SMALL_SIZE 256
+
+/********************************************************************/
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+/********************************************************************/
+static long peak_kb(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/********************************************************************
+ * Resizing as it was done before shrink-on-load.
+ */
+static int full_decode_resize(const char* image, size_t image_size, int width, int height,
+                              void** resized, size_t* resized_size)
+{
+    VipsImage* original = NULL;
+    VipsImage* thumb = NULL;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+    if (vips_jpegload_buffer((void*) image, image_size, &original, NULL) != 0) return ERR_IMGLIB;
+#pragma GCC diagnostic pop
+    if (vips_thumbnail_image(original, &thumb, width, "height", height, NULL) != 0) {
+        g_object_unref(original);
+        return ERR_IMGLIB;
+    }
+    const int err = vips_jpegsave_buffer(thumb, resized, resized_size, NULL);
+    g_object_unref(original);
+    g_object_unref(thumb);
+    return err != 0 ? ERR_IMGLIB : ERR_NONE;
+}
+
+/********************************************************************/
+static void measure(const char* name, const char* image, size_t image_size, int size, int nb_loops,
+                    int (*resize)(const char*, size_t, int, int, void**, size_t*))
+{
+    fflush(stdout);
+    const pid_t pid = fork();
+    if (pid < 0) exit(EXIT_FAILURE);
+    if (pid > 0) {
+        waitpid(pid, NULL, 0);
+        return;
+    }
+
+    const long baseline = peak_kb();
+    size_t resized_size = 0;
+    const double start = now_ns();
+    for (int i = 0; i < nb_loops; ++i) {
+        void* resized = NULL;
+        if (resize(image, image_size, size, size, &resized, &resized_size) != ERR_NONE) {
+            fprintf(stderr, "%s: resize failed\n", name);
+            _exit(EXIT_FAILURE);
+        }
+        g_free(resized);
+    }
+    const double ms = (now_ns() - start) / 1e6 / nb_loops;
+
+    printf("  %-16s %4dx%-4d %10.2f %12ld %12ld %10zu\n", name, size, size, ms,
+           baseline, peak_kb() - baseline, resized_size);
+    fflush(stdout);
+    _exit(EXIT_SUCCESS);
+}
+
+/********************************************************************/
+int main(int argc, char* argv[])
+{
+    if (VIPS_INIT(argv[0])) return EXIT_FAILURE;
+
+    static const char* const default_images[] = {
+        "../provided/tests/data/foret.jpg",
+        "../provided/tests/data/papillon.jpg",
+        "../provided/tests/data/coquelicots.jpg"
+    };
+    int nb_loops = argc > 1 ? atoi(argv[1]) : 20;
+    if (nb_loops < 1) nb_loops = 20;
+    const char* const* images = argc > 2 ? (const char* const*) argv + 2 : default_images;
+    const int nb_images = argc > 2 ? argc - 2 : (int) (sizeof(default_images) / sizeof(default_images[0]));
+
+    printf("%d loop(s) per measure\n", nb_loops);
+    for (int i = 0; i < nb_images; ++i) {
+        FILE* f = fopen(images[i], "rb");
+        if (f == NULL || fseek(f, 0, SEEK_END) != 0) return EXIT_FAILURE;
+        const size_t image_size = (size_t) ftell(f);
+        char* image = malloc(image_size);
+        if (image == NULL || fseek(f, 0, SEEK_SET) != 0 || fread(image, image_size, 1, f) != 1) return EXIT_FAILURE;
+        fclose(f);
+
+        uint32_t height = 0;
+        uint32_t width = 0;
+        if (get_resolution(&height, &width, image, image_size) != ERR_NONE) return EXIT_FAILURE;
+        printf("%s (%zu bytes, %" PRIu32 "x%" PRIu32 ")\n", images[i], image_size, width, height);
+        printf("  %-16s %9s %10s %12s %12s %10s\n", "path", "size", "ms/resize", "base KB", "peak +KB", "bytes");
+
+        const int sizes[] = { THUMB_SIZE, SMALL_SIZE };
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+            measure("full decode", image, image_size, sizes[s], nb_loops, full_decode_resize);
+            measure("shrink-on-load", image, image_size, sizes[s], nb_loops, create_resized_img);
+        }
+        free(image);
+    }
+
+    vips_shutdown();
+    return EXIT_SUCCESS;
+}
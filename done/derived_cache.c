@@ -0,0 +1,398 @@
+/**
+ * @file derived_cache.c
+ * @brief Size-bounded cache of images resized to arbitrary resolutions.
+ */
+
+#include "derived_cache.h"
+#include "util.h"
+
+#include <stdlib.h> // for calloc, malloc, free, qsort, strtoul
+#include <string.h> // for memcmp, memcpy, memset
+
+/********************************************************************/
+static uint64_t entries_offset(void)
+{
+    return sizeof(struct derived_cache_header);
+}
+
+/********************************************************************/
+static uint64_t data_offset(const struct derived_cache* cache)
+{
+    return entries_offset() + (uint64_t) cache->header.max_entries * sizeof(struct derived_entry);
+}
+
+/*******************************************************************
+ * Writes the entry i to the companion file.
+ */
+static int write_entry(struct derived_cache* cache, uint32_t i)
+{
+    return file_pwrite(cache->file, &cache->entries[i], sizeof(struct derived_entry),
+                       entries_offset() + (uint64_t) i * sizeof(struct derived_entry));
+}
+
+/*******************************************************************
+ * Home bucket of an image in a resolution. The SHA already is uniformly
+ * distributed: its first bytes are mixed with the resolution.
+ */
+static uint64_t home_bucket(const struct derived_cache* cache, const unsigned char* sha,
+                            uint16_t width, uint16_t height)
+{
+    uint64_t hash = 0;
+    memcpy(&hash, sha, sizeof(hash));
+    hash ^= (((uint64_t) width << 16) | height) * 0x9E3779B97F4A7C15ULL;
+    return hash & (cache->nb_buckets - 1);
+}
+
+/*******************************************************************
+ * Index of the entry of that image in that resolution, or max_entries.
+ */
+static uint32_t find_entry(const struct derived_cache* cache, const unsigned char* sha,
+                           uint16_t width, uint16_t height)
+{
+    const uint64_t mask = cache->nb_buckets - 1;
+    for (uint64_t bucket = home_bucket(cache, sha, width, height); cache->buckets[bucket] != 0;
+         bucket = (bucket + 1) & mask) {
+        const struct derived_entry* e = &cache->entries[cache->buckets[bucket] - 1];
+        if (e->width == width && e->height == height && memcmp(e->SHA, sha, SHA256_DIGEST_LENGTH) == 0) {
+            return cache->buckets[bucket] - 1;
+        }
+    }
+    return cache->header.max_entries;
+}
+
+/*******************************************************************
+ * Puts the (used) entry i in its first free bucket.
+ */
+static void place(struct derived_cache* cache, uint32_t i)
+{
+    const struct derived_entry* e = &cache->entries[i];
+    const uint64_t mask = cache->nb_buckets - 1;
+    uint64_t bucket = home_bucket(cache, e->SHA, e->width, e->height);
+
+    // There is always a free bucket, as nb_buckets > max_entries
+    while (cache->buckets[bucket] != 0) bucket = (bucket + 1) & mask;
+    cache->buckets[bucket] = i + 1;
+}
+
+/*******************************************************************
+ * Removes the (still used) entry i from the buckets
+ * (backward shift deletion, to keep probe sequences without holes).
+ */
+static void unplace(struct derived_cache* cache, uint32_t i)
+{
+    uint32_t* const buckets = cache->buckets;
+    const uint64_t mask = cache->nb_buckets - 1;
+    const struct derived_entry* e = &cache->entries[i];
+    uint64_t hole = home_bucket(cache, e->SHA, e->width, e->height);
+
+    while (buckets[hole] != 0 && buckets[hole] != i + 1) hole = (hole + 1) & mask;
+    if (buckets[hole] == 0) return;
+
+    // Move back the following entries that can fill the hole
+    buckets[hole] = 0;
+    for (uint64_t next = (hole + 1) & mask; buckets[next] != 0; next = (next + 1) & mask) {
+        const struct derived_entry* moved = &cache->entries[buckets[next] - 1];
+        const uint64_t home = home_bucket(cache, moved->SHA, moved->width, moved->height);
+        // The entry may move if its home is not (cyclically) in ]hole, next]
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            buckets[hole] = buckets[next];
+            buckets[next] = 0;
+            hole = next;
+        }
+    }
+}
+
+/********************************************************************/
+static int by_offset(const void* a, const void* b)
+{
+    const uint64_t x = (*(const struct derived_entry* const*) a)->offset;
+    const uint64_t y = (*(const struct derived_entry* const*) b)->offset;
+    return (x > y) - (x < y);
+}
+
+/*******************************************************************
+ * First room of size bytes in the data area (first fit), if any.
+ */
+static int find_room(struct derived_cache* cache, uint32_t size, uint64_t* offset)
+{
+    size_t nb = 0;
+    for (uint32_t i = 0; i < cache->header.max_entries; ++i) {
+        if (cache->entries[i].size != 0) cache->sorted[nb++] = &cache->entries[i];
+    }
+    qsort(cache->sorted, nb, sizeof(cache->sorted[0]), by_offset);
+
+    uint64_t pos = data_offset(cache);
+    for (size_t i = 0; i < nb; ++i) {
+        if (cache->sorted[i]->offset - pos >= size) break;
+        pos = cache->sorted[i]->offset + cache->sorted[i]->size;
+    }
+    if (pos + size > data_offset(cache) + cache->header.capacity) return 0;
+
+    *offset = pos;
+    return 1;
+}
+
+/*******************************************************************
+ * Evicts the least recently used entry (that is not being read).
+ */
+static int evict_lru(struct derived_cache* cache)
+{
+    uint32_t lru = cache->header.max_entries;
+    for (uint32_t i = 0; i < cache->header.max_entries; ++i) {
+        if (cache->entries[i].size != 0 && cache->pins[i] == 0
+            && (lru == cache->header.max_entries || cache->entries[i].last_used < cache->entries[lru].last_used)) {
+            lru = i;
+        }
+    }
+    if (lru == cache->header.max_entries) return ERR_RUNTIME; // nothing left to evict
+
+    unplace(cache, lru);
+    cache->nb_bytes -= cache->entries[lru].size;
+    memset(&cache->entries[lru], 0, sizeof(struct derived_entry));
+    // Forgotten on the disk before its space is reused
+    return write_entry(cache, lru);
+}
+
+/*******************************************************************
+ * Creates an empty companion file.
+ */
+static int reset_file(struct derived_cache* cache, const char* filename)
+{
+    if (cache->file != NULL) fclose(cache->file);
+    cache->file = fopen(filename, "wb+");
+    if (cache->file == NULL) return ERR_IO;
+
+    memset(cache->entries, 0, cache->header.max_entries * sizeof(struct derived_entry));
+    int ret = file_pwrite(cache->file, &cache->header, sizeof(cache->header), 0);
+    if (ret == ERR_NONE) {
+        ret = file_pwrite(cache->file, cache->entries, cache->header.max_entries * sizeof(struct derived_entry),
+                          entries_offset());
+    }
+    return ret;
+}
+
+/*******************************************************************
+ * Frees the entry i, in memory and in the companion file.
+ */
+static int drop_entry(struct derived_cache* cache, uint32_t i)
+{
+    memset(&cache->entries[i], 0, sizeof(struct derived_entry));
+    return write_entry(cache, i);
+}
+
+/*******************************************************************
+ * Places the entries read from the companion file, after dropping the
+ * ones that cannot be trusted: data out of the data area, overlapping
+ * the data of another entry (so nb_bytes stays within the capacity),
+ * or a key already seen.
+ */
+static int load_entries(struct derived_cache* cache)
+{
+    const uint64_t start = data_offset(cache);
+    const uint64_t capacity = cache->header.capacity;
+    int ret = ERR_NONE;
+
+    size_t nb = 0;
+    for (uint32_t i = 0; i < cache->header.max_entries; ++i) {
+        const struct derived_entry* e = &cache->entries[i];
+        if (e->size == 0) continue;
+        if (e->offset >= start && e->size <= capacity && e->offset - start <= capacity - e->size) {
+            cache->sorted[nb++] = &cache->entries[i];
+        } else {
+            const int dropped = drop_entry(cache, i);
+            if (ret == ERR_NONE) ret = dropped;
+        }
+    }
+    qsort(cache->sorted, nb, sizeof(cache->sorted[0]), by_offset);
+
+    uint64_t end = start;
+    for (size_t n = 0; n < nb; ++n) {
+        const struct derived_entry* e = cache->sorted[n];
+        const uint32_t i = (uint32_t) (e - cache->entries);
+        if (e->offset < end || find_entry(cache, e->SHA, e->width, e->height) != cache->header.max_entries) {
+            const int dropped = drop_entry(cache, i);
+            if (ret == ERR_NONE) ret = dropped;
+            continue;
+        }
+
+        place(cache, i);
+        cache->nb_bytes += e->size;
+        end = e->offset + e->size;
+        if (e->last_used > cache->tick) cache->tick = e->last_used;
+    }
+    return ret;
+}
+
+/********************************************************************/
+int derived_res_parse(const char* str, uint16_t* width, uint16_t* height)
+{
+    M_REQUIRE_NON_NULL(str);
+    M_REQUIRE_NON_NULL(width);
+    M_REQUIRE_NON_NULL(height);
+
+    if (*str < '1' || *str > '9') return ERR_RESOLUTIONS;
+    char* end = NULL;
+    const unsigned long w = strtoul(str, &end, 10);
+    unsigned long h = 0;
+    if (*end == 'x') {
+        const char* h_str = end + 1;
+        if (*h_str < '1' || *h_str > '9') return ERR_RESOLUTIONS;
+        h = strtoul(h_str, &end, 10);
+    }
+    if (*end != '\0' || w > DERIVED_RES_MAX || h > DERIVED_RES_MAX) return ERR_RESOLUTIONS;
+
+    *width = (uint16_t) w;
+    *height = (uint16_t) h;
+    return ERR_NONE;
+}
+
+/********************************************************************/
+int derived_cache_open(struct derived_cache* cache, const char* filename,
+                       uint32_t max_entries, uint64_t capacity)
+{
+    M_REQUIRE_NON_NULL(cache);
+    M_REQUIRE_NON_NULL(filename);
+    if (max_entries == 0 || capacity == 0) return ERR_INVALID_ARGUMENT;
+
+    memset(cache, 0, sizeof(*cache));
+    memcpy(cache->header.magic, DERIVED_CACHE_MAGIC, DERIVED_CACHE_MAGIC_LEN);
+    cache->header.max_entries = max_entries;
+    cache->header.capacity = capacity;
+
+    cache->nb_buckets = 1;
+    while (cache->nb_buckets < 2 * (uint64_t) max_entries) cache->nb_buckets <<= 1;
+
+    cache->entries = calloc(max_entries, sizeof(struct derived_entry));
+    cache->sorted = calloc(max_entries, sizeof(struct derived_entry*));
+    cache->buckets = calloc(cache->nb_buckets, sizeof(uint32_t));
+    cache->pins = calloc(max_entries, sizeof(uint32_t));
+    if (cache->entries == NULL || cache->sorted == NULL || cache->buckets == NULL || cache->pins == NULL) {
+        derived_cache_close(cache);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    // Reuse the existing cache if it was made with the same parameters
+    struct derived_cache_header on_disk;
+    cache->file = fopen(filename, "rb+");
+    int ret = cache->file != NULL
+              && file_pread(cache->file, &on_disk, sizeof(on_disk), 0) == ERR_NONE
+              && memcmp(&on_disk, &cache->header, sizeof(on_disk)) == 0
+              && file_pread(cache->file, cache->entries, max_entries * sizeof(struct derived_entry),
+                            entries_offset()) == ERR_NONE
+              ? ERR_NONE : reset_file(cache, filename);
+    if (ret == ERR_NONE) {
+        ret = pthread_mutex_init(&cache->mutex, NULL) == 0 ? ERR_NONE : ERR_THREADING;
+        cache->has_mutex = ret == ERR_NONE;
+    }
+    if (ret == ERR_NONE) ret = load_entries(cache);
+    if (ret != ERR_NONE) {
+        derived_cache_close(cache);
+        return ret;
+    }
+
+    return ERR_NONE;
+}
+
+/********************************************************************/
+int derived_cache_get(struct derived_cache* cache, const unsigned char* sha, uint16_t width, uint16_t height,
+                      char** buffer, uint32_t* size)
+{
+    M_REQUIRE_NON_NULL(cache);
+    M_REQUIRE_NON_NULL(cache->file);
+    M_REQUIRE_NON_NULL(sha);
+    M_REQUIRE_NON_NULL(buffer);
+    M_REQUIRE_NON_NULL(size);
+
+    if (pthread_mutex_lock(&cache->mutex) != 0) return ERR_THREADING;
+
+    const uint32_t i = find_entry(cache, sha, width, height);
+    if (i == cache->header.max_entries) {
+        pthread_mutex_unlock(&cache->mutex);
+        return ERR_IMAGE_NOT_FOUND;
+    }
+    // Only recorded in memory: written with the entry, if ever
+    cache->entries[i].last_used = ++cache->tick;
+    // Its data stays in place while it is read
+    ++cache->pins[i];
+    const uint64_t offset = cache->entries[i].offset;
+    *size = cache->entries[i].size;
+    pthread_mutex_unlock(&cache->mutex);
+
+    *buffer = malloc(*size);
+    int ret = *buffer == NULL ? ERR_OUT_OF_MEMORY : file_pread(cache->file, *buffer, *size, offset);
+    if (ret != ERR_NONE) {
+        free(*buffer); *buffer = NULL;
+    }
+
+    if (pthread_mutex_lock(&cache->mutex) != 0) {
+        free(*buffer); *buffer = NULL;
+        return ERR_THREADING;
+    }
+    --cache->pins[i];
+    pthread_mutex_unlock(&cache->mutex);
+    return ret;
+}
+
+/********************************************************************/
+int derived_cache_put(struct derived_cache* cache, const unsigned char* sha, uint16_t width, uint16_t height,
+                      const void* buffer, uint32_t size)
+{
+    M_REQUIRE_NON_NULL(cache);
+    M_REQUIRE_NON_NULL(cache->file);
+    M_REQUIRE_NON_NULL(sha);
+    M_REQUIRE_NON_NULL(buffer);
+    if (size == 0 || size > cache->header.capacity) return ERR_INVALID_ARGUMENT;
+
+    if (pthread_mutex_lock(&cache->mutex) != 0) return ERR_THREADING;
+
+    // Somebody else may have put it meanwhile
+    int ret = ERR_NONE;
+    if (find_entry(cache, sha, width, height) < cache->header.max_entries) {
+        pthread_mutex_unlock(&cache->mutex);
+        return ERR_NONE;
+    }
+
+    // Make room: a free entry and a free range in the data area
+    uint32_t free_entry = cache->header.max_entries;
+    uint64_t offset = 0;
+    while (ret == ERR_NONE) {
+        free_entry = cache->header.max_entries;
+        for (uint32_t i = 0; i < cache->header.max_entries && free_entry == cache->header.max_entries; ++i) {
+            if (cache->entries[i].size == 0) free_entry = i;
+        }
+        if (free_entry < cache->header.max_entries && find_room(cache, size, &offset)) break;
+        ret = evict_lru(cache);
+    }
+
+    // The data first: the entry only refers to complete data
+    if (ret == ERR_NONE) ret = file_pwrite(cache->file, buffer, size, offset);
+    if (ret == ERR_NONE) {
+        struct derived_entry* e = &cache->entries[free_entry];
+        memcpy(e->SHA, sha, SHA256_DIGEST_LENGTH);
+        e->width = width;
+        e->height = height;
+        e->size = size;
+        e->offset = offset;
+        e->last_used = ++cache->tick;
+        cache->nb_bytes += size;
+        place(cache, free_entry);
+        ret = write_entry(cache, free_entry);
+    }
+
+    pthread_mutex_unlock(&cache->mutex);
+    return ret;
+}
+
+/********************************************************************/
+void derived_cache_close(struct derived_cache* cache)
+{
+    if (cache == NULL) return;
+
+    if (cache->file != NULL) fclose(cache->file);
+    if (cache->has_mutex) pthread_mutex_destroy(&cache->mutex);
+    free(cache->entries);
+    free(cache->sorted);
+    free(cache->buckets);
+    free(cache->pins);
+    memset(cache, 0, sizeof(*cache));
+}
@@ -0,0 +1,139 @@
+/**
+ * @file derived_cache.h
+ * @brief Size-bounded cache of images resized to arbitrary resolutions.
+ *
+ * Besides the fixed THUMB_RES and SMALL_RES, an image can be read resized
+ * to any width and height (e.g. res=320x200 or res=320). Those derivatives
+ * are kept in a companion file of the imgFS (its name followed by
+ * DERIVED_CACHE_SUFFIX), so that the popular sizes are served from the
+ * disk after their first request.
+ *
+ * The companion file holds a header, a fixed table of entries, then the
+ * data area, whose size is bounded: when an entry or room in the data area
+ * is missing, the least recently used entries are evicted. Entries are
+ * keyed by the SHA of the image, not by its slot or name: an image that is
+ * deleted (or replaced) is never served from the cache, and its entries
+ * just age out.
+ */
+
+#pragma once
+
+#include "imgfs.h" // for SHA256_DIGEST_LENGTH, file_pread, file_pwrite
+
+#include <pthread.h>
+#include <stdint.h> // for uint16_t, uint32_t, uint64_t
+#include <stdio.h> // for FILE
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DERIVED_CACHE_SUFFIX ".derived"
+#define DERIVED_CACHE_MAGIC "IMGFSDC1"
+#define DERIVED_CACHE_MAGIC_LEN 8
+#define DERIVED_RES_MAX 4096 // largest width or height that can be asked for
+
+/**
+ * @brief On-disk header of the companion file.
+ */
+struct derived_cache_header {
+    char magic[DERIVED_CACHE_MAGIC_LEN];
+    uint32_t max_entries;
+    uint32_t unused_32;
+    uint64_t capacity; // size of the data area, in bytes
+    uint64_t unused_64;
+};
+
+/**
+ * @brief On-disk (and in-memory) entry of the companion file.
+ */
+struct derived_entry {
+    unsigned char SHA[SHA256_DIGEST_LENGTH]; // of the original image
+    uint16_t width;
+    uint16_t height; // 0 if only the width was asked for
+    uint32_t size; // 0 for a free entry
+    uint64_t offset; // of the resized image in the companion file
+    uint64_t last_used; // for the LRU eviction
+};
+
+/**
+ * @brief The open cache. Its functions may be called concurrently.
+ */
+struct derived_cache {
+    FILE* file;
+    struct derived_cache_header header;
+    struct derived_entry* entries; // header.max_entries of them
+    struct derived_entry** sorted; // scratch space to find room in the data area
+    uint32_t* buckets; // 1 + index of the entry hashed there, 0 if free (in memory only)
+    uint64_t nb_buckets; // a power of two, more than max_entries
+    uint32_t* pins; // readers of each entry: it is not evicted meanwhile
+    uint64_t tick; // last value of last_used
+    uint64_t nb_bytes; // used in the data area
+    pthread_mutex_t mutex; // protects everything above
+    int has_mutex; // the mutex was initialized
+};
+
+/**
+ * @brief Parses a resolution like "320x200", or "320" (width only).
+ *
+ * @param str The string to parse
+ * @param width Where to put the width
+ * @param height Where to put the height (0 for a width only)
+ * @return ERR_RESOLUTIONS if str is not such a resolution (or out of range), 0 if no error.
+ */
+int derived_res_parse(const char* str, uint16_t* width, uint16_t* height);
+
+/**
+ * @brief Opens the companion file (created, or reset if its parameters changed).
+ *        Entries out of the data area, overlapping another or with a key
+ *        already seen are dropped.
+ *
+ * @param cache The cache to open
+ * @param filename The companion file name
+ * @param max_entries The maximum number of cached images
+ * @param capacity The maximum total size of the cached images, in bytes
+ * @return Some error code. 0 if no error.
+ */
+int derived_cache_open(struct derived_cache* cache, const char* filename,
+                       uint32_t max_entries, uint64_t capacity);
+
+/**
+ * @brief Gets a cached resized image. It is read from the companion file
+ *        without holding the cache: its entry is only pinned meanwhile.
+ *
+ * @param cache The cache
+ * @param sha The SHA of the original image
+ * @param width The width of the resized image
+ * @param height The height of the resized image (0 for a width only)
+ * @param buffer Where to put the (allocated) resized image
+ * @param size Where to put its size
+ * @return ERR_IMAGE_NOT_FOUND if it is not in the cache, some other error code, 0 if no error.
+ */
+int derived_cache_get(struct derived_cache* cache, const unsigned char* sha, uint16_t width, uint16_t height,
+                      char** buffer, uint32_t* size);
+
+/**
+ * @brief Adds a resized image to the cache, evicting the least recently
+ *        used ones if needed.
+ *
+ * @param cache The cache
+ * @param sha The SHA of the original image
+ * @param width The width of the resized image
+ * @param height The height of the resized image (0 for a width only)
+ * @param buffer The resized image
+ * @param size Its size (at most the capacity of the cache)
+ * @return Some error code. 0 if no error.
+ */
+int derived_cache_put(struct derived_cache* cache, const unsigned char* sha, uint16_t width, uint16_t height,
+                      const void* buffer, uint32_t size);
+
+/**
+ * @brief Closes the companion file and frees the cache.
+ *
+ * @param cache The cache
+ */
+void derived_cache_close(struct derived_cache* cache);
+
+#ifdef __cplusplus
+}
+#endif
@@ -9,193 +9,496 @@
 #include <stdio.h>
 #include <sys/socket.h>
 #include <string.h>
+#include <strings.h> // for strncasecmp
 #include <stdint.h>
 #include <unistd.h>
 #include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
 
 #include "http_prot.h"
 #include "http_net.h"
 #include "socket_layer.h"
 #include "error.h"
 #include "util.h"
+#include "worker_pool.h"
 
 #include <pthread.h>
 
-static int passive_socket = -1;
+#define CONTENT_LEN_MAX_STRLEN 32
+#define CHUNK_SIZE_MAX_STRLEN 20
+#define CONNECTION_CLOSE "close"
+#define CONNECTION_CLOSE_HEADER "Connection: close" HTTP_LINE_DELIM
+#define EVENTS_PER_WAIT 64
+#define EVENT_LOOP_TICK 1000 // ms between two checks for idle connections (at most)
+
+struct event_loop;
+
+/*******************************************************************
+ * A connection and what was received of its next message. It belongs
+ * either to its event loop (waiting for data, in its idle list) or to a
+ * worker (while its messages are handled), never to both.
+ */
+struct http_conn {
+    int socket;
+    char* buf; // null-terminated, as the parser relies on it
+    size_t capacity;
+    size_t received;
+    struct http_parser parser; // of the message at the start of buf
+    struct http_message msg; // once it is complete
+    size_t msg_len;
+    unsigned nb_requests;
+    int registered; // in the epoll set of its loop
+    time_t last_active; // monotonic, in seconds
+    struct event_loop* loop;
+    struct http_conn* newer; // idle list of the loop
+    struct http_conn* older;
+};
+
+/*******************************************************************
+ * One event loop: waits for the connections and for the data of their
+ * next messages. The first one is run by http_receive(), the others by
+ * threads of their own.
+ */
+struct event_loop {
+    pthread_t thread;
+    int has_thread;
+    int passive_socket; // nonblocking, of its own (SO_REUSEPORT)
+    int epoll_fd;
+    pthread_mutex_t mutex; // protects the idle list and the re-arming of its connections
+    struct http_conn* newest;
+    struct http_conn* oldest;
+};
+
 static EventCallback event_callback;
+static unsigned keep_alive_timeout = HTTP_KEEP_ALIVE_TIMEOUT;
+static unsigned keep_alive_max_requests = HTTP_KEEP_ALIVE_MAX_REQUESTS;
+static size_t nb_workers = HTTP_DEFAULT_WORKERS;
+static size_t queue_size = HTTP_DEFAULT_QUEUE_SIZE;
+static size_t nb_acceptors = HTTP_DEFAULT_ACCEPTORS;
+static int backlog = HTTP_DEFAULT_BACKLOG;
+static struct event_loop loops[HTTP_MAX_ACCEPTORS];
+static size_t nb_loops = 0;
+static struct worker_pool workers;
+static atomic_int stopping = 0;
+static sigset_t receive_sigmask; // of the thread calling http_receive(), while it waits
+
+// Set while the last message of the connection of this thread is handled
+static _Thread_local int closing_connection = 0;
 
-#define MK_OUR_ERR(X) \
-static int our_ ## X = X
+/*******************************************************************
+ * Whether the client asked to close the connection after this message
+ * ("close" among the options of its Connection header).
+ */
+static int wants_close(const struct http_message* msg)
+{
+    struct http_string value;
+    if (http_get_header(msg, "Connection", &value) != 1) return 0;
 
-MK_OUR_ERR(ERR_NONE);
-MK_OUR_ERR(ERR_INVALID_ARGUMENT);
-MK_OUR_ERR(ERR_OUT_OF_MEMORY);
-MK_OUR_ERR(ERR_IO);
+    const size_t len = strlen(CONNECTION_CLOSE);
+    for (size_t i = 0; i + len <= value.len; ++i) {
+        if (strncasecmp(value.val + i, CONNECTION_CLOSE, len) == 0) return 1;
+    }
+    return 0;
+}
 
-#define CONTENT_LEN_MAX_STRLEN 32
+/********************************************************************/
+static time_t monotonic_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/********************************************************************/
+static void conn_free(struct http_conn* conn)
+{
+    close(conn->socket);
+    free(conn->buf);
+    free(conn);
+}
 
 /*******************************************************************
- * Handle connection
+ * Worker pool callback for a connection never served.
  */
-static void *handle_connection(void *arg)
+static void drop_connection(void* arg)
 {
-    sigset_t mask;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGINT );
-    sigaddset(&mask, SIGTERM);
-    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    conn_free(arg);
+}
 
-    // Check if the argument is null
-    if (arg == NULL) return &our_ERR_INVALID_ARGUMENT;
-    int* socket_id = (int*) arg;
+/*******************************************************************
+ * Unlinks conn from the idle list of its loop. Must be called with
+ * loop->mutex held.
+ */
+static void idle_unlink(struct http_conn* conn)
+{
+    struct event_loop* loop = conn->loop;
+    if (conn->newer != NULL) conn->newer->older = conn->older;
+    else loop->newest = conn->older;
+    if (conn->older != NULL) conn->older->newer = conn->newer;
+    else loop->oldest = conn->newer;
+    conn->newer = conn->older = NULL;
+}
 
-    // Check if callback is null
-    if (event_callback == NULL) {
-        close(*socket_id);
-        free(socket_id);
-        return &our_ERR_INVALID_ARGUMENT;
+/*******************************************************************
+ * Gives conn back to its loop, to wait for (the rest of) its next message.
+ * The linking and the re-arming are done at once, under loop->mutex, so
+ * that the loop cannot drop conn in between.
+ */
+static void loop_wait(struct http_conn* conn)
+{
+    struct event_loop* loop = conn->loop;
+    struct epoll_event event;
+    zero_init_var(event);
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = conn;
+
+    pthread_mutex_lock(&loop->mutex);
+    conn->last_active = monotonic_now();
+    conn->older = loop->newest;
+    conn->newer = NULL;
+    if (loop->newest != NULL) loop->newest->newer = conn;
+    loop->newest = conn;
+    if (loop->oldest == NULL) loop->oldest = conn;
+
+    const int op = conn->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    conn->registered = 1;
+    if (epoll_ctl(loop->epoll_fd, op, conn->socket, &event) == -1) {
+        idle_unlink(conn);
+        conn_free(conn);
     }
+    pthread_mutex_unlock(&loop->mutex);
+}
 
-    // Allocate memmory for the receive buffer (enough for the header)
-    char* rcvbuf = calloc(MAX_HEADER_SIZE, 1);
-    if (rcvbuf == NULL) {
-        close(*socket_id);
-        free(socket_id);
-        return &our_ERR_OUT_OF_MEMORY;
+/*******************************************************************
+ * Parses the message received so far, enlarging the buffer to hold its
+ * body if needed. Returns 1 if the message is complete (in conn->msg),
+ * 0 if more is needed, a negative error code otherwise.
+ */
+static int conn_parse(struct http_conn* conn)
+{
+    // Only what arrived since the previous call is parsed
+    const int ret = http_parser_feed(&conn->parser, conn->buf, conn->received, &conn->msg);
+    if (ret < 0 || conn->parser.content_len > MAX_REQUEST_SIZE) return ERR_IO;
+
+    if (ret == 1) {
+        conn->msg_len = conn->parser.header_len + conn->parser.content_len;
+        return 1;
     }
 
-    ssize_t curr_bytes_received = 0;
-    size_t total_bytes_received = 0;
-    size_t buff_len_allowed = MAX_HEADER_SIZE;
-    int done_parsing = 0;
-    int extended = 0;
-    struct http_message out;
-    zero_init_var(out);
-    int content_len = 0;
-
-    // Continue receiving bytes while the message hasn't been fully parsed
-    while(done_parsing != 1) {
-        // Read pack of bytes and store them at the correct offset in the buffer
-        curr_bytes_received = tcp_read(*socket_id, rcvbuf + total_bytes_received, buff_len_allowed);
-
-        // If the number of bytes received is negative or null, exit
-        if (curr_bytes_received <= 0) {
-            free(rcvbuf);
-            close(*socket_id);
-            free(socket_id);
-            return curr_bytes_received == 0 ? &our_ERR_NONE : &our_ERR_IO;
-        }
+    // The message must fit, with the null terminator
+    const size_t needed = MAX_HEADER_SIZE + conn->parser.content_len;
+    if (needed > conn->capacity) {
+        char* const temp = realloc(conn->buf, needed);
+        if (temp == NULL) return ERR_OUT_OF_MEMORY;
+        conn->buf = temp;
+        conn->capacity = needed;
+    }
+    if (conn->received + 1 >= conn->capacity) return ERR_IO; // header too long
+
+    return 0;
+}
 
-        // Increment buffer offset so the following read is stored at correct position
-        total_bytes_received += (size_t) curr_bytes_received;
-        // Parse the whole buffer again but with changed total_bytes_received
-        done_parsing = http_parse_message(rcvbuf, total_bytes_received, &out, &content_len);
-
-        // If parsing returns an error, exit
-        if (done_parsing < 0) {
-            free(rcvbuf); rcvbuf = NULL;
-            close(*socket_id);
-            free(socket_id);
-            return &our_ERR_IO;
+/*******************************************************************
+ * Worker: handles the message of conn, and the following ones already
+ * received, then gives it back to its loop (or closes it).
+ */
+static void serve_connection(void* arg)
+{
+    struct http_conn* conn = arg;
+
+    int ret = 1;
+    while (ret == 1) {
+        // The replies tell the client when this is the last one
+        ++conn->nb_requests;
+        closing_connection = conn->nb_requests >= keep_alive_max_requests || wants_close(&conn->msg);
+        if (event_callback == NULL || event_callback(&conn->msg, conn->socket) < 0 || closing_connection) {
+            conn_free(conn);
+            return;
         }
 
-        // If we have not yet extended the buffer, and that the content length is greater than zero, we extend it once
-        if (done_parsing == 0 && !extended && content_len > 0) {
-            // Increase buffer length allowed
-            buff_len_allowed += (size_t) content_len;
-            // Reallocate the buffer to a bigger memory area
-            char *temp = realloc(rcvbuf, buff_len_allowed);
-            if (temp == NULL) {
-                free(rcvbuf);
-                close(*socket_id);
-                free(socket_id);
-                return &our_ERR_OUT_OF_MEMORY;
+        // Keep what the client already sent of its next message
+        conn->received -= conn->msg_len;
+        memmove(conn->buf, conn->buf + conn->msg_len, conn->received);
+        conn->buf[conn->received] = '\0';
+        http_parser_init(&conn->parser);
+
+        // Do not hold on to the room of a big body
+        if (conn->capacity > MAX_HEADER_SIZE && conn->received < MAX_HEADER_SIZE) {
+            char* const temp = realloc(conn->buf, MAX_HEADER_SIZE);
+            if (temp != NULL) {
+                conn->buf = temp;
+                conn->capacity = MAX_HEADER_SIZE;
             }
-            rcvbuf = temp;
-            extended = 1; // set extended to 1 so that we dont extend again
         }
+
+        ret = conn_parse(conn);
     }
 
-    // We are done parsing so we can call the callback
-    int err = event_callback(&out, *socket_id);
-    // Close everything to prepare for a new round
-    free(rcvbuf);
-    close(*socket_id);
-    free(socket_id);
-    return err < 0 ? &our_ERR_IO : &our_ERR_NONE;
+    if (ret < 0) conn_free(conn);
+    else loop_wait(conn);
 }
 
+/*******************************************************************
+ * Accepts the pending connections (the passive socket is nonblocking).
+ */
+static void accept_connections(struct event_loop* loop)
+{
+    while (!stopping) {
+        const int socket = tcp_accept(loop->passive_socket);
+        if (socket < 0) return; // none left (or out of resources: retried at the next event)
+
+        struct http_conn* conn = calloc(1, sizeof(*conn));
+        char* buf = calloc(MAX_HEADER_SIZE, 1);
+        // Bounds the (blocking) sends of the replies by the workers
+        if (conn == NULL || buf == NULL || tcp_set_timeout(socket, keep_alive_timeout) != ERR_NONE) {
+            free(conn);
+            free(buf);
+            close(socket);
+            continue;
+        }
+        conn->socket = socket;
+        conn->buf = buf;
+        conn->capacity = MAX_HEADER_SIZE;
+        conn->loop = loop;
+        loop_wait(conn);
+    }
+}
 
 /*******************************************************************
- * Init connection
+ * Reads what arrived on conn, and hands it to the workers once its
+ * message is complete.
  */
-int http_init(uint16_t port, EventCallback callback)
+static void handle_event(struct event_loop* loop, struct http_conn* conn)
 {
-    passive_socket = tcp_server_init(port);
-    event_callback = callback;
-    return passive_socket;
+    pthread_mutex_lock(&loop->mutex);
+    idle_unlink(conn);
+    pthread_mutex_unlock(&loop->mutex);
+
+    const ssize_t bytes = tcp_read_nowait(conn->socket, conn->buf + conn->received,
+                                          conn->capacity - conn->received - 1);
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        loop_wait(conn);
+        return;
+    }
+    // Closed by the client, or broken
+    if (bytes <= 0) {
+        conn_free(conn);
+        return;
+    }
+    conn->received += (size_t) bytes;
+    conn->buf[conn->received] = '\0';
+
+    int ret = conn_parse(conn);
+    if (ret == 0) {
+        loop_wait(conn);
+        return;
+    }
+    if (ret == 1) ret = worker_pool_try_submit(&workers, conn);
+    if (ret == 1) return;
+
+    // Too many messages waiting already: the client should come back later
+    if (ret == 0) {
+        static const char busy[] = HTTP_PROTOCOL_ID HTTP_SERVICE_UNAVAILABLE HTTP_LINE_DELIM
+                                   "Retry-After: 1" HTTP_LINE_DELIM CONNECTION_CLOSE_HEADER
+                                   "Content-Length: 0" HTTP_HDR_END_DELIM;
+        send(conn->socket, busy, sizeof(busy) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    conn_free(conn);
 }
 
 /*******************************************************************
- * Close connection
+ * Closes the connections of loop that stayed idle for too long.
  */
-void http_close(void)
+static void close_idle(struct event_loop* loop)
 {
-    if (passive_socket > 0) {
-        if (close(passive_socket) == -1)
-            perror("close() in http_close()");
-        else
-            passive_socket = -1;
+    if (keep_alive_timeout == 0) return;
+
+    const time_t now = monotonic_now();
+    pthread_mutex_lock(&loop->mutex);
+    // Closing the socket also removes it from the epoll set
+    while (loop->oldest != NULL && now - loop->oldest->last_active > (time_t) keep_alive_timeout) {
+        struct http_conn* conn = loop->oldest;
+        idle_unlink(conn);
+        conn_free(conn);
     }
+    pthread_mutex_unlock(&loop->mutex);
 }
 
 /*******************************************************************
- * Receive content
+ * Waits for the events of loop (at most EVENT_LOOP_TICK) and handles them.
  */
-int http_receive(void)
+static int loop_round(struct event_loop* loop, const sigset_t* sigmask)
 {
-    pthread_attr_t attr;
-    pthread_t thread;
+    struct epoll_event events[EVENTS_PER_WAIT];
+    const int nb = epoll_pwait(loop->epoll_fd, events, EVENTS_PER_WAIT, EVENT_LOOP_TICK, sigmask);
+    if (nb < 0) return errno == EINTR ? ERR_NONE : ERR_IO;
 
-    // Store the active socket on the heap
-    int* active_socket = calloc(1, sizeof(int));
-    if (active_socket == NULL) return ERR_OUT_OF_MEMORY;
+    for (int i = 0; i < nb; ++i) {
+        if (events[i].data.ptr == NULL) accept_connections(loop);
+        else handle_event(loop, events[i].data.ptr);
+    }
+    close_idle(loop);
 
-    // Accept the TCP connection
-    *active_socket = tcp_accept(passive_socket);
-    if (*active_socket == -1) {
-        free(active_socket);
-        return ERR_IO;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Thread of the other event loops.
+ */
+static void* loop_main(void* arg)
+{
+    struct event_loop* loop = arg;
+    while (!stopping && loop_round(loop, NULL) == ERR_NONE);
+    return NULL;
+}
+
+/*******************************************************************
+ * Set keep-alive parameters
+ */
+void http_set_keep_alive(unsigned timeout, unsigned max_requests)
+{
+    keep_alive_timeout = timeout;
+    keep_alive_max_requests = max_requests == 0 ? 1 : max_requests;
+}
+
+/*******************************************************************
+ * Set the size of the worker pool
+ */
+int http_set_workers(size_t workers_wanted, size_t queue_size_wanted)
+{
+    if (workers_wanted == 0 || workers_wanted > WORKER_POOL_MAX_WORKERS || queue_size_wanted == 0) {
+        return ERR_INVALID_ARGUMENT;
     }
+    nb_workers = workers_wanted;
+    queue_size = queue_size_wanted;
+    return ERR_NONE;
+}
 
-    // Initialize attribute with default values
-    if (pthread_attr_init(&attr) != ERR_NONE) {
-        close(*active_socket);
-        free(active_socket);
-        return ERR_THREADING;
+/*******************************************************************
+ * Set the number of acceptors
+ */
+int http_set_acceptors(size_t acceptors_wanted, int backlog_wanted)
+{
+    if (acceptors_wanted == 0 || acceptors_wanted > HTTP_MAX_ACCEPTORS || backlog_wanted <= 0) {
+        return ERR_INVALID_ARGUMENT;
     }
+    nb_acceptors = acceptors_wanted;
+    backlog = backlog_wanted;
+    return ERR_NONE;
+}
 
-    // Set the detach state to the attribute
-    if (pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != ERR_NONE) {
-        close(*active_socket);
-        free(active_socket);
-        pthread_attr_destroy(&attr);
-        return ERR_THREADING;
+/*******************************************************************
+ * Creates the listening socket and the epoll set of loop (and frees
+ * them if it fails). Returns the socket, or a negative error code.
+ */
+static int loop_init(struct event_loop* loop, uint16_t port)
+{
+    memset(loop, 0, sizeof(*loop));
+    loop->passive_socket = tcp_server_init_with(port, backlog, 1);
+    if (loop->passive_socket < 0) return loop->passive_socket;
+
+    struct epoll_event event;
+    zero_init_var(event);
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+
+    int ret = tcp_set_nonblocking(loop->passive_socket);
+    if (ret == ERR_NONE) {
+        loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epoll_fd == -1) ret = ERR_IO;
+    }
+    if (ret == ERR_NONE && epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->passive_socket, &event) == -1) {
+        close(loop->epoll_fd);
+        ret = ERR_IO;
+    }
+    if (ret == ERR_NONE && pthread_mutex_init(&loop->mutex, NULL) != 0) {
+        close(loop->epoll_fd);
+        ret = ERR_THREADING;
     }
 
-    // Create a thread
-    if (pthread_create(&thread, &attr, handle_connection, (void *)active_socket) != ERR_NONE) {
-        close(*active_socket);
-        free(active_socket);
-        pthread_attr_destroy(&attr);
-        return ERR_THREADING;
+    if (ret != ERR_NONE) {
+        close(loop->passive_socket);
+        return ret;
     }
+    return loop->passive_socket;
+}
 
-    // Destroy the attribute object as it's no longer needed
-    pthread_attr_destroy(&attr);
+/*******************************************************************
+ * Init connection
+ */
+int http_init(uint16_t port, EventCallback callback)
+{
+    // The first socket tells whether the port can be used at all
+    int ret = loop_init(&loops[0], port);
+    if (ret < 0) return ret;
+    nb_loops = 1;
+    event_callback = callback;
+    stopping = 0;
 
-    return ERR_NONE;
+    // The signals only interrupt the wait of http_receive(): never a
+    // thread holding a lock. The threads created below inherit the mask.
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT );
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, &receive_sigmask);
+
+    ret = worker_pool_start(&workers, nb_workers, queue_size, serve_connection, drop_connection);
+
+    // The first loop is run by http_receive(), the others by threads of their own
+    for (size_t i = 1; i < nb_acceptors && ret == ERR_NONE; ++i) {
+        struct event_loop* loop = &loops[i];
+        ret = loop_init(loop, port);
+        if (ret < 0) break;
+        ++nb_loops;
+
+        ret = pthread_create(&loop->thread, NULL, loop_main, loop) == 0 ? ERR_NONE : ERR_THREADING;
+        if (ret == ERR_NONE) loop->has_thread = 1;
+    }
+
+    if (ret < 0) {
+        http_close();
+        return ret;
+    }
+    return loops[0].passive_socket;
+}
+
+/*******************************************************************
+ * Close connection
+ */
+void http_close(void)
+{
+    // The other loops stop within EVENT_LOOP_TICK, then the workers once
+    // done with their current message
+    stopping = 1;
+    for (size_t i = 0; i < nb_loops; ++i) {
+        if (loops[i].has_thread) pthread_join(loops[i].thread, NULL);
+    }
+    worker_pool_stop(&workers);
+
+    for (size_t i = 0; i < nb_loops; ++i) {
+        while (loops[i].oldest != NULL) {
+            struct http_conn* conn = loops[i].oldest;
+            idle_unlink(conn);
+            conn_free(conn);
+        }
+        close(loops[i].epoll_fd);
+        pthread_mutex_destroy(&loops[i].mutex);
+        if (close(loops[i].passive_socket) == -1) perror("close() in http_close()");
+    }
+    nb_loops = 0;
+}
 
+/*******************************************************************
+ * Receive content
+ */
+int http_receive(void)
+{
+    if (nb_loops == 0) return ERR_INVALID_ARGUMENT;
+    return loop_round(&loops[0], &receive_sigmask);
 }
 
 /*******************************************************************
@@ -250,6 +553,21 @@ int http_serve_file(int connection, const char* filename)
     return ret;
 }
 
+/*******************************************************************
+ * Sends the whole buffer (send() may send only part of it). more tells
+ * the kernel that more data follows at once, so that it is coalesced.
+ */
+static int send_all(int connection, const char* buffer, size_t len, int more)
+{
+    while (len > 0) {
+        const ssize_t sent = send(connection, buffer, len, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        if (sent <= 0) return ERR_IO;
+        buffer += sent;
+        len -= (size_t) sent;
+    }
+    return ERR_NONE;
+}
+
 /*******************************************************************
  * Create and send HTTP reply
  */
@@ -264,12 +582,16 @@ int http_reply(int connection, const char* status, const char* headers, const ch
     // Return error if snprintf fails
     if (content_length_str_len < 0) return ERR_IO;
 
+    // Tell the client if the connection is closed after this reply
+    const char* const connection_header = closing_connection ? CONNECTION_CLOSE_HEADER : "";
+
     // Total length of the message
     size_t total_length =
     strlen(HTTP_PROTOCOL_ID) +
     strlen(status) +
     strlen(HTTP_LINE_DELIM) +
     strlen(headers) +
+    strlen(connection_header) +
     (size_t) content_length_str_len +
     strlen(HTTP_HDR_END_DELIM) +
     body_len +
@@ -282,8 +604,8 @@ int http_reply(int connection, const char* status, const char* headers, const ch
     // Fill the header in the correct format
     int header_length =
     snprintf(
-    buffer, total_length, "%s%s%s%s%s%s",
-    HTTP_PROTOCOL_ID, status, HTTP_LINE_DELIM, headers, content_length_str, HTTP_HDR_END_DELIM
+    buffer, total_length, "%s%s%s%s%s%s%s",
+    HTTP_PROTOCOL_ID, status, HTTP_LINE_DELIM, headers, connection_header, content_length_str, HTTP_HDR_END_DELIM
     );
 
     // Return an err if snprintf fails
@@ -297,9 +619,51 @@ int http_reply(int connection, const char* status, const char* headers, const ch
         memcpy(buffer + header_length, body, body_len);
     }
 
-    // Send everything to the socket
-    int ret = (int) tcp_send(connection, buffer, (size_t) header_length + body_len);
+    // Send everything to the socket: a reply cut short (e.g. by the send
+    // timeout) would desynchronize the next ones of the connection
+    const size_t length = (size_t) header_length + body_len;
+    int ret = send_all(connection, buffer, length, 0);
     free(buffer); buffer = NULL;
     // Returns the number of bytes sent
+    return ret == ERR_NONE ? (int) length : ret;
+}
+
+/*******************************************************************
+ * Send the header of a chunked reply
+ */
+int http_reply_chunked(int connection, const char* status, const char* headers)
+{
+    M_REQUIRE_NON_NULL(status);
+    M_REQUIRE_NON_NULL(headers);
+
+    int ret = send_all(connection, HTTP_PROTOCOL_ID, strlen(HTTP_PROTOCOL_ID), 1);
+    if (ret == ERR_NONE) ret = send_all(connection, status, strlen(status), 1);
+    if (ret == ERR_NONE) ret = send_all(connection, HTTP_LINE_DELIM, strlen(HTTP_LINE_DELIM), 1);
+    if (ret == ERR_NONE) ret = send_all(connection, headers, strlen(headers), 1);
+    if (ret == ERR_NONE && closing_connection) {
+        ret = send_all(connection, CONNECTION_CLOSE_HEADER, strlen(CONNECTION_CLOSE_HEADER), 1);
+    }
+    // Not coalesced with the first chunk: the client gets its first bytes at once
+    if (ret == ERR_NONE) {
+        const char* const chunked = "Transfer-Encoding: chunked" HTTP_HDR_END_DELIM;
+        ret = send_all(connection, chunked, strlen(chunked), 0);
+    }
+    return ret;
+}
+
+/*******************************************************************
+ * Send a chunk (the last one if empty)
+ */
+int http_send_chunk(int connection, const char* data, size_t len)
+{
+    if (len > 0 && data == NULL) return ERR_INVALID_ARGUMENT;
+
+    char size_str[CHUNK_SIZE_MAX_STRLEN + 1];
+    const int size_len = snprintf(size_str, sizeof(size_str), "%zx" HTTP_LINE_DELIM, len);
+    if (size_len < 0) return ERR_IO;
+
+    int ret = send_all(connection, size_str, (size_t) size_len, 1);
+    if (ret == ERR_NONE && len > 0) ret = send_all(connection, data, len, 1);
+    if (ret == ERR_NONE) ret = send_all(connection, HTTP_LINE_DELIM, strlen(HTTP_LINE_DELIM), 0);
     return ret;
 }
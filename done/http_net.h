@@ -13,6 +13,15 @@
 #define MAX_REQUEST_SIZE 8388608 // 2^23 -> to handle images up to 8MB
 #define MAX_HEADER_SIZE    16384 // 2^14 -> to handle http headers
 
+#define HTTP_KEEP_ALIVE_TIMEOUT          5 // seconds a connection may stay idle
+#define HTTP_KEEP_ALIVE_MAX_REQUESTS   100 // per connection
+
+#define HTTP_DEFAULT_ACCEPTORS    2 // event loops, each with its own listening socket
+#define HTTP_MAX_ACCEPTORS       64
+#define HTTP_DEFAULT_BACKLOG    128 // pending connections, per listening socket
+#define HTTP_DEFAULT_WORKERS      8 // threads handling the messages (which may block)
+#define HTTP_DEFAULT_QUEUE_SIZE 256 // messages waiting for a worker (beyond: 503)
+
 typedef int (*EventCallback)(struct http_message*, int);
 
 /* **********************************************************************
@@ -26,10 +35,79 @@ typedef int (*EventCallback)(struct http_message*, int);
 
 int http_init(uint16_t port, EventCallback cb);
 
+/**
+ * @brief Sets the size of the pool of workers handling the messages, and
+ *        how many messages may wait for them: when that many already do,
+ *        the next ones are answered at once with 503 Service Unavailable
+ *        (and their connection is closed). To be called before http_init().
+ *        Default to HTTP_DEFAULT_WORKERS and HTTP_DEFAULT_QUEUE_SIZE.
+ *
+ * @param nb_workers The number of workers (between 1 and WORKER_POOL_MAX_WORKERS)
+ * @param queue_size The maximum number of waiting messages (at least 1)
+ * @return Some error code. 0 if no error.
+ */
+int http_set_workers(size_t nb_workers, size_t queue_size);
+
+/**
+ * @brief Sets the number of event loops waiting for the connections and
+ *        their messages, and the backlog of their listening sockets. Each
+ *        loop has its own socket on the port (SO_REUSEPORT), so that the
+ *        kernel spreads the connections among them. To be called before
+ *        http_init(). Default to HTTP_DEFAULT_ACCEPTORS and HTTP_DEFAULT_BACKLOG.
+ *
+ * @param nb_acceptors The number of loops (between 1 and HTTP_MAX_ACCEPTORS)
+ * @param backlog The maximum number of pending connections per socket (at least 1)
+ * @return Some error code. 0 if no error.
+ */
+int http_set_acceptors(size_t nb_acceptors, int backlog);
+
+/**
+ * @brief Waits (up to a second) for connections and messages, and hands the
+ *        complete messages to the workers, which call the EventCallback.
+ *        The calling thread runs the first of the event loops (see
+ *        http_set_acceptors()); it is the only one where SIGINT and SIGTERM
+ *        are delivered, while it waits.
+ *
+ * @return Some error code. 0 if no error.
+ */
 int http_receive(void);
 
+/**
+ * @brief Sets how long connections are kept open (HTTP/1.1 keep-alive).
+ *        A connection is closed once it has stayed idle for timeout seconds,
+ *        after its max_requests-th message, or when the client sends
+ *        "Connection: close". Defaults to HTTP_KEEP_ALIVE_TIMEOUT and
+ *        HTTP_KEEP_ALIVE_MAX_REQUESTS.
+ *
+ * @param timeout The idle timeout, in seconds (0 for none)
+ * @param max_requests The maximum number of messages per connection (1 to close after each)
+ */
+void http_set_keep_alive(unsigned timeout, unsigned max_requests);
+
 int http_serve_file(int connection, const char* filename);
 
 int http_reply(int connection, const char* status, const char* headers, const char* body, size_t body_len);
 
+/**
+ * @brief Sends the status line and headers of a reply whose body follows
+ *        as chunks (Transfer-Encoding: chunked), sent by http_send_chunk().
+ *
+ * @param connection The socket
+ * @param status The status (e.g. HTTP_OK)
+ * @param headers The other headers, each ending with HTTP_LINE_DELIM
+ * @return Some error code. 0 if no error.
+ */
+int http_reply_chunked(int connection, const char* status, const char* headers);
+
+/**
+ * @brief Sends one chunk of the body of a chunked reply. An empty one
+ *        (len 0) ends the body.
+ *
+ * @param connection The socket
+ * @param data The chunk
+ * @param len Its length
+ * @return Some error code. 0 if no error.
+ */
+int http_send_chunk(int connection, const char* data, size_t len);
+
 void http_close(void);
@@ -1,7 +1,9 @@
+#define _GNU_SOURCE // for memmem
 #include <stdio.h>
 #include <stdlib.h>
 #include "http_prot.h"
 #include <string.h>
+#include <strings.h> // for strncasecmp
 #include "error.h"
 #include "util.h"
 
@@ -31,6 +33,24 @@ int http_match_verb(const struct http_string* method, const char* verb)
     return strncmp(method->val, verb, verb_length) == 0 ? 1 : 0;
 }
 
+int http_get_header(const struct http_message* message, const char* name, struct http_string* value)
+{
+    M_REQUIRE_NON_NULL(message);
+    M_REQUIRE_NON_NULL(name);
+    M_REQUIRE_NON_NULL(value);
+
+    const size_t name_len = strlen(name);
+    for (size_t i = 0; i < message->num_headers; ++i) {
+        const struct http_string* key = &message->headers[i].key;
+        if (key->len == name_len && strncasecmp(key->val, name, name_len) == 0) {
+            *value = message->headers[i].value;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
 int http_get_var(const struct http_string* url, const char* name, char* out, size_t out_len)
 {
     M_REQUIRE_NON_NULL(url);
@@ -117,7 +137,7 @@ static const char* http_parse_headers(const char* header_start, struct http_mess
     struct http_string value;
 
     // Iterate while the number of headers is less than the max and we haven't reach the end of the header
-    while (output->num_headers <= MAX_HEADERS && strncmp(header_start, HTTP_LINE_DELIM, line_delim_len) != 0) {
+    while (output->num_headers < MAX_HEADERS && strncmp(header_start, HTTP_LINE_DELIM, line_delim_len) != 0) {
         zero_init_var(key);
         zero_init_var(value);
 
@@ -128,29 +148,29 @@ static const char* http_parse_headers(const char* header_start, struct http_mess
         // Fetch the value corresponding to the key
         const char* ptr_after_delim2 = get_next_token(ptr_after_delim1, HTTP_LINE_DELIM, &value);
         output->headers[output->num_headers].value = value;
+        if (ptr_after_delim2 == NULL) return NULL; // malformed header line
 
         // Increase the number of headers and prepare for the next iteration by moving the header pointer
         ++output->num_headers;
         header_start = ptr_after_delim2;
     }
+    // Too many headers
+    if (strncmp(header_start, HTTP_LINE_DELIM, line_delim_len) != 0) return NULL;
 
     // Return position where the body starts
     return header_start + line_delim_len;
 }
 
-int http_parse_message(const char *stream, size_t bytes_received, struct http_message *out, int *content_len)
+/*******************************************************************
+ * Parses the header at the start of stream (which holds all of it) into
+ * out, and writes its length, blank line included, to header_len.
+ */
+static int parse_header(const char* stream, struct http_message* out, int* content_len, size_t* header_len)
 {
-    M_REQUIRE_NON_NULL(stream);
-    M_REQUIRE_NON_NULL(out);
-    M_REQUIRE_NON_NULL(content_len);
-
     struct http_string third_token;
     zero_init_var(third_token);
     zero_init_ptr(out);
 
-    // Message could not be fully parsed as header is not yet received
-    if (strstr(stream, HTTP_HDR_END_DELIM) == NULL) return 0;
-
     const char* p1 = get_next_token(stream, WHITESPACE, &out->method);
     if (p1 == NULL) return ERR_IO;
 
@@ -164,7 +184,7 @@ int http_parse_message(const char *stream, size_t bytes_received, struct http_me
     if (strncmp("HTTP/1.1", third_token.val, third_token.len) != 0) return -1;
 
     const char* body_start = http_parse_headers(p3, out);
-    if (body_start == NULL) return ERR_IO; // DONT KNOW THE ERR
+    if (body_start == NULL) return ERR_IO;
 
     size_t found = 0;
     *content_len = 0;
@@ -175,18 +195,92 @@ int http_parse_message(const char *stream, size_t bytes_received, struct http_me
             found = 1;
         }
     }
+    if (*content_len < 0) return ERR_IO;
+
+    *header_len = (size_t) (body_start - stream);
+    return ERR_NONE;
+}
+
+int http_parse_message(const char *stream, size_t bytes_received, struct http_message *out, int *content_len)
+{
+    M_REQUIRE_NON_NULL(stream);
+    M_REQUIRE_NON_NULL(out);
+    M_REQUIRE_NON_NULL(content_len);
+
+    zero_init_ptr(out);
+
+    // Message could not be fully parsed as header is not yet received
+    if (strstr(stream, HTTP_HDR_END_DELIM) == NULL) return 0;
+
+    size_t header_len = 0;
+    const int err = parse_header(stream, out, content_len, &header_len);
+    if (err < 0) return err;
 
-    size_t header_len = (size_t) (body_start - stream);
     // Message could not be fully parsed as body is not fully received
-    if (header_len + (size_t) *content_len != bytes_received) return 0; // SUS
+    // (more bytes may follow it: the next message of the connection)
+    if (header_len + (size_t) *content_len > bytes_received) return 0;
     // If content length is zero, no bytes
     if (*content_len == 0) return 1;
 
     // Store the body
-    out->body.val = body_start;
+    out->body.val = stream + header_len;
     out->body.len = (size_t) *content_len;
 
     return 1;
 }
 
+void http_parser_init(struct http_parser* parser)
+{
+    if (parser != NULL) zero_init_ptr(parser);
+}
 
+int http_parser_feed(struct http_parser* parser, const char* stream, size_t bytes_received,
+                     struct http_message* out)
+{
+    M_REQUIRE_NON_NULL(parser);
+    M_REQUIRE_NON_NULL(stream);
+    M_REQUIRE_NON_NULL(out);
+    if (bytes_received < parser->scanned) return ERR_INVALID_ARGUMENT;
+
+    if (parser->stage == HTTP_PARSE_HEADER) {
+        // Only the new bytes are searched, from far enough back to find
+        // a delimiter split between two calls
+        const size_t delim_len = strlen(HTTP_HDR_END_DELIM);
+        const size_t from = parser->scanned >= delim_len ? parser->scanned - delim_len + 1 : 0;
+        const char* const end = memmem(stream + from, bytes_received - from, HTTP_HDR_END_DELIM, delim_len);
+        parser->scanned = bytes_received;
+        if (end == NULL) return 0;
+
+        int content_len = 0;
+        size_t header_len = 0;
+        const int err = parse_header(stream, out, &content_len, &header_len);
+        if (err < 0) return err;
+        // The header lines must end at the (first) blank line
+        if (header_len != (size_t) (end - stream) + delim_len) return ERR_IO;
+
+        parser->header_len = header_len;
+        parser->content_len = (size_t) content_len;
+        parser->stage = HTTP_PARSE_BODY;
+    }
+
+    if (parser->stage == HTTP_PARSE_BODY) {
+        const size_t body_bytes = bytes_received - parser->header_len;
+        parser->body_received = body_bytes < parser->content_len ? body_bytes : parser->content_len;
+        if (parser->body_received < parser->content_len) return 0;
+        parser->stage = HTTP_PARSE_DONE;
+    }
+
+    // The stream may have moved since its header was parsed (to make room
+    // for the body): the header is parsed again, and its tokens point to
+    // the stream as it is now.
+    int content_len = 0;
+    size_t header_len = 0;
+    const int err = parse_header(stream, out, &content_len, &header_len);
+    if (err < 0) return err;
+    if (parser->content_len > 0) {
+        out->body.val = stream + parser->header_len;
+        out->body.len = parser->content_len;
+    }
+
+    return 1;
+}
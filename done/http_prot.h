@@ -14,7 +14,9 @@
 #define HTTP_HDR_END_DELIM HTTP_LINE_DELIM HTTP_LINE_DELIM
 #define HTTP_PROTOCOL_ID   "HTTP/1.1 "
 #define HTTP_OK            "200 OK"
+#define HTTP_NOT_MODIFIED  "304 Not Modified"
 #define HTTP_BAD_REQUEST   "400 Bad Request"
+#define HTTP_SERVICE_UNAVAILABLE "503 Service Unavailable"
 
 #include <stddef.h>
 
@@ -56,10 +58,58 @@ int http_match_uri(const struct http_message *message, const char *target_uri);
  * Returns:
  *  a negative int if there was an error
  *  0 if the message has not been received completely (partial treatment)
- *  1 if the message was fully received and parsed
+ *  1 if the message was fully received and parsed (the bytes following it, if any,
+ *    belong to the next message of the connection)
  */
 int http_parse_message(const char *stream, size_t bytes_received, struct http_message *out, int *content_len);
 
+/**
+ * @brief Where an http_parser is in its message.
+ */
+enum http_parse_stage {
+    HTTP_PARSE_HEADER, // waiting for the end of the header
+    HTTP_PARSE_BODY,   // header parsed, waiting for the end of the body
+    HTTP_PARSE_DONE    // whole message received
+};
+
+/**
+ * @brief State of the incremental parsing of one HTTP message, as its
+ * bytes arrive (see http_parser_feed()).
+ */
+struct http_parser {
+    enum http_parse_stage stage;
+    size_t scanned;       // bytes of the stream already searched for the end of the header
+    size_t header_len;    // blank line included, once the header is parsed
+    size_t content_len;   // once the header is parsed
+    size_t body_received; // bytes of the body received so far
+};
+
+/**
+ * @brief Prepares parser for a new message.
+ */
+void http_parser_init(struct http_parser* parser);
+
+/**
+ * @brief Resumes the parsing of an HTTP message from where the previous
+ * call stopped.
+ *
+ * stream holds the bytes_received bytes of the message received so far
+ * (and possibly the following messages of the connection), null-terminated;
+ * it may have moved between two calls, but the bytes already passed must
+ * be unchanged. Only the bytes received since the previous call are
+ * searched for the end of the header, and the header is parsed once it is
+ * complete: then parser->header_len and parser->content_len are set, and
+ * parser->body_received tells how much of the body has arrived.
+ *
+ * Returns:
+ *  a negative int if there was an error
+ *  0 if the message has not been received completely
+ *  1 if the message was fully received: it is in out, pointing into stream,
+ *    and is parser->header_len + parser->content_len bytes long
+ */
+int http_parser_feed(struct http_parser* parser, const char* stream, size_t bytes_received,
+                     struct http_message* out);
+
 /**
  * @brief Writes the value of parameter `name` from URL in message to buffer out.
  *
@@ -72,3 +122,11 @@ int http_get_var(const struct http_string* url, const char* name, char* out, siz
  * @brief Compare method with verb and return 1 if they are equal, 0 otherwise
  */
 int http_match_verb(const struct http_string* method, const char* verb);
+
+/**
+ * @brief Finds the (first) header `name` of message (compared case-insensitively)
+ * and points value to its value.
+ *
+ * Returns: 1 if there is such a header, 0 if there is not, a negative int if there was an error.
+ */
+int http_get_header(const struct http_message* message, const char* name, struct http_string* value);
@@ -0,0 +1,274 @@
+/**
+ * @file image_cache.c
+ * @brief In-memory cache of the images most recently read, by (img_id, resolution).
+ */
+
+#include "image_cache.h"
+#include "util.h"
+
+#include <stdlib.h> // for malloc, free
+#include <string.h> // for memcpy, memset, strncmp, strncpy
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME        1099511628211ULL
+
+/*******************************************************************
+ * FNV-1a hash of an img_id. All the resolutions of an image hash alike,
+ * so that they live in the same bucket.
+ */
+static uint64_t hash_img_id(const char* img_id)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (size_t i = 0; i <= MAX_IMG_ID && img_id[i] != '\0'; ++i) {
+        hash ^= (unsigned char) img_id[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/********************************************************************/
+static struct image_cache_shard* shard_of(struct image_cache* cache, uint64_t hash)
+{
+    return &cache->shards[hash % IMAGE_CACHE_SHARDS];
+}
+
+/********************************************************************/
+static struct image_cache_entry** bucket_of(struct image_cache_shard* shard, uint64_t hash)
+{
+    return &shard->buckets[(hash / IMAGE_CACHE_SHARDS) % IMAGE_CACHE_BUCKETS];
+}
+
+/*******************************************************************
+ * Unlinks entry from the LRU list of shard.
+ */
+static void lru_unlink(struct image_cache_shard* shard, struct image_cache_entry* entry)
+{
+    if (entry->newer != NULL) entry->newer->older = entry->older;
+    else shard->newest = entry->older;
+    if (entry->older != NULL) entry->older->newer = entry->newer;
+    else shard->oldest = entry->newer;
+    entry->newer = entry->older = NULL;
+}
+
+/*******************************************************************
+ * Links entry as the most recently used of shard.
+ */
+static void lru_push(struct image_cache_shard* shard, struct image_cache_entry* entry)
+{
+    entry->older = shard->newest;
+    entry->newer = NULL;
+    if (shard->newest != NULL) shard->newest->newer = entry;
+    shard->newest = entry;
+    if (shard->oldest == NULL) shard->oldest = entry;
+}
+
+/*******************************************************************
+ * Removes entry from shard and frees it.
+ */
+static void drop_entry(struct image_cache_shard* shard, struct image_cache_entry* entry, uint64_t hash)
+{
+    struct image_cache_entry** link = bucket_of(shard, hash);
+    while (*link != entry) link = &(*link)->next_in_bucket;
+    *link = entry->next_in_bucket;
+    lru_unlink(shard, entry);
+
+    shard->nb_bytes -= entry->size;
+    --shard->nb_entries;
+    free(entry->data);
+    free(entry);
+}
+
+/*******************************************************************
+ * Entry of that image in that resolution, if any. Must be called with
+ * shard->mutex held.
+ */
+static struct image_cache_entry* find_entry(struct image_cache_shard* shard, uint64_t hash,
+                                            const char* img_id, int resolution)
+{
+    for (struct image_cache_entry* e = *bucket_of(shard, hash); e != NULL; e = e->next_in_bucket) {
+        if (e->resolution == resolution && strncmp(e->img_id, img_id, MAX_IMG_ID) == 0) return e;
+    }
+    return NULL;
+}
+
+/********************************************************************/
+int image_cache_init(struct image_cache* cache, size_t capacity, uint32_t version)
+{
+    M_REQUIRE_NON_NULL(cache);
+    if (capacity < IMAGE_CACHE_SHARDS) return ERR_INVALID_ARGUMENT;
+
+    memset(cache, 0, sizeof(*cache));
+    cache->shard_capacity = capacity / IMAGE_CACHE_SHARDS;
+    for (size_t i = 0; i < IMAGE_CACHE_SHARDS; ++i) {
+        cache->shards[i].version = version;
+        if (pthread_mutex_init(&cache->shards[i].mutex, NULL) != 0) {
+            while (i-- > 0) pthread_mutex_destroy(&cache->shards[i].mutex);
+            cache->shard_capacity = 0;
+            return ERR_THREADING;
+        }
+    }
+
+    return ERR_NONE;
+}
+
+/********************************************************************/
+int image_cache_get(struct image_cache* cache, const char* img_id, int resolution,
+                    char** buffer, uint32_t* size)
+{
+    M_REQUIRE_NON_NULL(cache);
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(buffer);
+    M_REQUIRE_NON_NULL(size);
+
+    const uint64_t hash = hash_img_id(img_id);
+    struct image_cache_shard* shard = shard_of(cache, hash);
+    if (pthread_mutex_lock(&shard->mutex) != 0) return ERR_THREADING;
+
+    int ret = ERR_IMAGE_NOT_FOUND;
+    struct image_cache_entry* entry = find_entry(shard, hash, img_id, resolution);
+    if (entry != NULL && entry->version != shard->version) {
+        drop_entry(shard, entry, hash);
+        entry = NULL;
+    }
+    if (entry != NULL) {
+        lru_unlink(shard, entry);
+        lru_push(shard, entry);
+
+        *buffer = malloc(entry->size);
+        if (*buffer == NULL) {
+            ret = ERR_OUT_OF_MEMORY;
+        } else {
+            memcpy(*buffer, entry->data, entry->size);
+            *size = entry->size;
+            ret = ERR_NONE;
+        }
+    }
+    if (ret == ERR_NONE) ++shard->hits;
+    else ++shard->misses;
+
+    pthread_mutex_unlock(&shard->mutex);
+    return ret;
+}
+
+/********************************************************************/
+int image_cache_put(struct image_cache* cache, const char* img_id, int resolution, uint32_t version,
+                    const char* buffer, uint32_t size)
+{
+    M_REQUIRE_NON_NULL(cache);
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(buffer);
+
+    // Too big to be worth it
+    if (size == 0 || size > cache->shard_capacity) return ERR_NONE;
+
+    // Copied before taking the lock
+    struct image_cache_entry* entry = calloc(1, sizeof(*entry));
+    char* data = malloc(size);
+    if (entry == NULL || data == NULL) {
+        free(entry);
+        free(data);
+        return ERR_OUT_OF_MEMORY;
+    }
+    strncpy(entry->img_id, img_id, MAX_IMG_ID);
+    entry->resolution = resolution;
+    entry->version = version;
+    entry->size = size;
+    entry->data = data;
+    memcpy(data, buffer, size);
+
+    const uint64_t hash = hash_img_id(img_id);
+    struct image_cache_shard* shard = shard_of(cache, hash);
+    if (pthread_mutex_lock(&shard->mutex) != 0) {
+        free(data);
+        free(entry);
+        return ERR_THREADING;
+    }
+
+    // Read before the imgFS changed: it may already be wrong
+    if (version != shard->version) {
+        pthread_mutex_unlock(&shard->mutex);
+        free(data);
+        free(entry);
+        return ERR_NONE;
+    }
+
+    // Replaces the one read by a concurrent miss, if any
+    struct image_cache_entry* old = find_entry(shard, hash, img_id, resolution);
+    if (old != NULL) drop_entry(shard, old, hash);
+    while (shard->nb_bytes + size > cache->shard_capacity) {
+        drop_entry(shard, shard->oldest, hash_img_id(shard->oldest->img_id));
+    }
+
+    struct image_cache_entry** bucket = bucket_of(shard, hash);
+    entry->next_in_bucket = *bucket;
+    *bucket = entry;
+    lru_push(shard, entry);
+    shard->nb_bytes += size;
+    ++shard->nb_entries;
+
+    pthread_mutex_unlock(&shard->mutex);
+    return ERR_NONE;
+}
+
+/********************************************************************/
+void image_cache_invalidate(struct image_cache* cache, const char* img_id)
+{
+    if (cache == NULL || img_id == NULL || cache->shard_capacity == 0) return;
+
+    const uint64_t hash = hash_img_id(img_id);
+    struct image_cache_shard* shard = shard_of(cache, hash);
+    pthread_mutex_lock(&shard->mutex);
+
+    struct image_cache_entry* e = *bucket_of(shard, hash);
+    while (e != NULL) {
+        struct image_cache_entry* next = e->next_in_bucket;
+        if (strncmp(e->img_id, img_id, MAX_IMG_ID) == 0) drop_entry(shard, e, hash);
+        e = next;
+    }
+
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+/********************************************************************/
+void image_cache_set_version(struct image_cache* cache, uint32_t version)
+{
+    if (cache == NULL || cache->shard_capacity == 0) return;
+
+    // The stale entries are dropped lazily (or age out)
+    for (size_t i = 0; i < IMAGE_CACHE_SHARDS; ++i) {
+        pthread_mutex_lock(&cache->shards[i].mutex);
+        cache->shards[i].version = version;
+        pthread_mutex_unlock(&cache->shards[i].mutex);
+    }
+}
+
+/********************************************************************/
+void image_cache_get_stats(struct image_cache* cache, struct image_cache_stats* stats)
+{
+    if (stats == NULL) return;
+    memset(stats, 0, sizeof(*stats));
+    if (cache == NULL || cache->shard_capacity == 0) return;
+
+    for (size_t i = 0; i < IMAGE_CACHE_SHARDS; ++i) {
+        struct image_cache_shard* shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->nb_entries += shard->nb_entries;
+        stats->nb_bytes += shard->nb_bytes;
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
+/********************************************************************/
+void image_cache_free(struct image_cache* cache)
+{
+    if (cache == NULL || cache->shard_capacity == 0) return;
+
+    for (size_t i = 0; i < IMAGE_CACHE_SHARDS; ++i) {
+        struct image_cache_shard* shard = &cache->shards[i];
+        while (shard->oldest != NULL) drop_entry(shard, shard->oldest, hash_img_id(shard->oldest->img_id));
+        pthread_mutex_destroy(&shard->mutex);
+    }
+    memset(cache, 0, sizeof(*cache));
+}
@@ -0,0 +1,152 @@
+/**
+ * @file image_cache.h
+ * @brief In-memory cache of the images most recently read, by (img_id, resolution).
+ *
+ * The cache is split into IMAGE_CACHE_SHARDS shards, each with its own
+ * mutex, hash table and LRU list, so that concurrent reads of different
+ * images seldom wait for each other, and never for the imgFS lock.
+ * Its memory is bounded: each shard holds at most capacity / IMAGE_CACHE_SHARDS
+ * bytes of images, the least recently used ones being evicted first.
+ *
+ * Entries are stamped with the header version of the imgFS they were read
+ * from: once the imgFS changes (image_cache_set_version()), older entries
+ * are misses, and they are dropped when met. image_cache_invalidate() drops
+ * the entries of a deleted image at once.
+ */
+
+#pragma once
+
+#include "imgfs.h" // for MAX_IMG_ID
+
+#include <pthread.h>
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define IMAGE_CACHE_SHARDS 16
+#define IMAGE_CACHE_BUCKETS 256 // per shard
+
+/**
+ * @brief One cached image.
+ */
+struct image_cache_entry {
+    char img_id[MAX_IMG_ID + 1];
+    int resolution;
+    uint32_t version; // of the imgFS it was read from
+    uint32_t size;
+    char* data;
+    struct image_cache_entry* next_in_bucket;
+    struct image_cache_entry* newer; // LRU list
+    struct image_cache_entry* older;
+};
+
+/**
+ * @brief One shard of the cache.
+ */
+struct image_cache_shard {
+    pthread_mutex_t mutex; // protects everything below
+    struct image_cache_entry* buckets[IMAGE_CACHE_BUCKETS];
+    struct image_cache_entry* newest;
+    struct image_cache_entry* oldest;
+    uint32_t version; // current version of the imgFS
+    size_t nb_bytes;
+    size_t nb_entries;
+    size_t hits;
+    size_t misses;
+};
+
+/**
+ * @brief The cache. Its functions may be called concurrently.
+ */
+struct image_cache {
+    struct image_cache_shard shards[IMAGE_CACHE_SHARDS];
+    size_t shard_capacity; // in bytes
+};
+
+/**
+ * @brief Counters of the cache, summed over its shards.
+ */
+struct image_cache_stats {
+    size_t hits;
+    size_t misses;
+    size_t nb_entries;
+    size_t nb_bytes;
+};
+
+/**
+ * @brief Initializes an empty cache.
+ *
+ * @param cache The cache to initialize
+ * @param capacity The maximum total size of the cached images, in bytes
+ * @param version The current header version of the imgFS
+ * @return Some error code. 0 if no error.
+ */
+int image_cache_init(struct image_cache* cache, size_t capacity, uint32_t version);
+
+/**
+ * @brief Gets a copy of a cached image.
+ *
+ * @param cache The cache
+ * @param img_id The image id
+ * @param resolution The resolution
+ * @param buffer Where to put the (allocated) image
+ * @param size Where to put its size
+ * @return ERR_IMAGE_NOT_FOUND if it is not in the cache (or stale), some other error code, 0 if no error.
+ */
+int image_cache_get(struct image_cache* cache, const char* img_id, int resolution,
+                    char** buffer, uint32_t* size);
+
+/**
+ * @brief Adds an image to the cache (unless it was read from an older
+ *        version of the imgFS, or is too big), evicting the least recently
+ *        used ones if needed.
+ *
+ * @param cache The cache
+ * @param img_id The image id
+ * @param resolution The resolution
+ * @param version The header version of the imgFS the image was read from
+ * @param buffer The image
+ * @param size Its size
+ * @return Some error code. 0 if no error (also when the image was not added).
+ */
+int image_cache_put(struct image_cache* cache, const char* img_id, int resolution, uint32_t version,
+                    const char* buffer, uint32_t size);
+
+/**
+ * @brief Drops the entries of an image, in all resolutions.
+ *
+ * @param cache The cache
+ * @param img_id The image id
+ */
+void image_cache_invalidate(struct image_cache* cache, const char* img_id);
+
+/**
+ * @brief Records the new header version of the imgFS: the entries read
+ *        from the previous ones are no longer served.
+ *
+ * @param cache The cache
+ * @param version The current header version of the imgFS
+ */
+void image_cache_set_version(struct image_cache* cache, uint32_t version);
+
+/**
+ * @brief Sums the counters of the shards.
+ *
+ * @param cache The cache
+ * @param stats Where to put them
+ */
+void image_cache_get_stats(struct image_cache* cache, struct image_cache_stats* stats);
+
+/**
+ * @brief Frees the cache.
+ *
+ * @param cache The cache
+ */
+void image_cache_free(struct image_cache* cache);
+
+#ifdef __cplusplus
+}
+#endif
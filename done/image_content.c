@@ -1,9 +1,58 @@
 #include <stdio.h>
+#include <string.h>
 #include "imgfs.h"
 #include "image_content.h"
+#include "imgfs_refs.h"
 #include <vips/vips.h>
 
 
+/*******************************************************************
+ * The resolutions among the given ones that the image misses.
+ */
+static unsigned missing_resolutions(const struct img_metadata* md, unsigned resolutions)
+{
+    unsigned missing = 0;
+    for (int res = 0; res < ORIG_RES; ++res) {
+        if ((resolutions & RES_BIT(res)) && (md->offset[res] == 0 || md->size[res] == 0)) missing |= RES_BIT(res);
+    }
+    return missing;
+}
+
+/*******************************************************************
+ * Creates the given resolutions of the image at index that it misses,
+ * reading and decoding its original once.
+ */
+static int resize_missing(unsigned resolutions, struct imgfs_file* imgfs_file, size_t index)
+{
+    const unsigned missing = missing_resolutions(&imgfs_file->metadata[index], resolutions);
+    // If the resolutions requested already exist, do nothing and return no error
+    if (missing == 0) return ERR_NONE;
+
+    size_t og_size = imgfs_file->metadata[index].size[ORIG_RES]; // Size of image in its original resolution
+    // Allocating memory for first buffer
+    char* buffer1 = calloc(og_size, 1);
+    if (buffer1 == NULL) return ERR_OUT_OF_MEMORY;
+
+    // Read image in its original resolution from file in the buffer
+    const uint64_t og_off = imgfs_file->metadata[index].offset[ORIG_RES]; // Offset in file of image in its original resolution
+    if (imgfs_pread(imgfs_file, buffer1, og_size, og_off) != ERR_NONE) {
+        free(buffer1); buffer1 = NULL;
+        return ERR_IO;
+    }
+
+    // Create the resized images
+    struct resized_imgs resized; // allocated by vips functions
+    int ret = create_resized_imgs(buffer1, og_size, imgfs_file->header.resized_res, missing, &resized);
+    free(buffer1); buffer1 = NULL; // Free the first buffer as no longer needed
+    if (ret != ERR_NONE) return ret;
+
+    // Write them and update the metadata
+    ret = store_resized_imgs(imgfs_file, index, imgfs_file->metadata[index].SHA, &resized);
+    free_resized_imgs(&resized); // Free the resized buffers after writing
+
+    return ret;
+}
+
 int lazily_resize(int resolution, struct imgfs_file* imgfs_file, size_t index)
 {
     M_REQUIRE_NON_NULL(imgfs_file);
@@ -19,89 +68,200 @@ int lazily_resize(int resolution, struct imgfs_file* imgfs_file, size_t index)
     // If resolution is ORIG_RES no need to do anything
     if (resolution == ORIG_RES) return ERR_NONE;
 
-    // If the resolution requested already exists, do nothing and return no error
-    if (imgfs_file->metadata[index].offset[resolution] != 0 && imgfs_file->metadata[index].size[resolution] != 0) {
-        return ERR_NONE;
-    }
+    return resize_missing(RES_BIT(resolution), imgfs_file, index);
+}
 
-    long og_off = (long) imgfs_file->metadata[index].offset[ORIG_RES]; // Offset in file of image in its original resolution
-    // Move file position indicator to image in database in its original resolution
-    if (fseek(imgfs_file->file, og_off, SEEK_SET) != 0) return ERR_IO;
+int lazily_resize_all(struct imgfs_file* imgfs_file, size_t index)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    // Check that index is in bounds and metadata at the index is valid
+    if (index >= imgfs_file->header.max_files || !imgfs_file->metadata[index].is_valid) return ERR_INVALID_IMGID;
 
-    size_t og_size = imgfs_file->metadata[index].size[ORIG_RES]; // Size of image in its original resolution
-    // Allocating memory for first buffer
-    void* buffer1 = calloc(og_size, 1);
-    if (buffer1 == NULL) return ERR_OUT_OF_MEMORY;
+    return resize_missing(RESIZED_RES_ALL, imgfs_file, index);
+}
 
-    // Read image from file in the buffer
-    if (fread(buffer1, 1, og_size, imgfs_file->file) != og_size) {
-        free(buffer1); buffer1 = NULL;
-        return ERR_IO;
-    }
+/*******************************************************************
+ * Resized vips image of a JPEG: it is shrunk while being decoded (DCT
+ * scaling), without decoding every pixel of the original.
+ */
+static int shrink_on_load(const char* image_buffer, size_t image_size, int width, int height, VipsImage** out)
+{
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+    const int err = vips_thumbnail_buffer((void*) image_buffer, image_size, out, width, "height", height, NULL);
+#pragma GCC diagnostic pop
+    return err != 0 ? ERR_IMGLIB : ERR_NONE;
+}
 
-    VipsImage* og_img = NULL; // Vips image corresponding to original image
-    // Load the buffer in the vips image corresponding to the original resolution
-    if (vips_jpegload_buffer(buffer1, og_size, &og_img, NULL) != 0) {
-        free(buffer1); buffer1 = NULL;
-        return ERR_IMGLIB;
-    }
+int create_resized_img(const char* image_buffer, size_t image_size, int width, int height,
+                       void** resized, size_t* resized_size)
+{
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(resized);
+    M_REQUIRE_NON_NULL(resized_size);
 
     VipsImage* thumb_img = NULL; // Vips image corresponding to resized image
-    // Create thumbnail vips image.
-    int width = imgfs_file->header.resized_res[2 * resolution];
-    int height = imgfs_file->header.resized_res[2 * resolution + 1];
-    if (vips_thumbnail_image(og_img, &thumb_img, width, "height", height, NULL) != 0) {
-        free(buffer1); buffer1 = NULL;
-        g_object_unref(VIPS_OBJECT(og_img)); og_img = NULL;
-        return ERR_IMGLIB;
+    if (shrink_on_load(image_buffer, image_size, width, height, &thumb_img) != ERR_NONE) return ERR_IMGLIB;
+
+    // Save constent from thumb_img to the buffer (allocated by vips)
+    const int err = vips_jpegsave_buffer(thumb_img, resized, resized_size, NULL);
+
+    g_object_unref(thumb_img); thumb_img = NULL; // No longer need thumbnail image obect
+
+    return err != 0 ? ERR_IMGLIB : ERR_NONE;
+}
+
+int create_resized_imgs(const char* image_buffer, size_t image_size, const uint16_t* resized_res,
+                        unsigned resolutions, struct resized_imgs* resized)
+{
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(resized_res);
+    M_REQUIRE_NON_NULL(resized);
+    memset(resized, 0, sizeof(*resized));
+
+    // The biggest resolution is shrunk from the original while decoding it,
+    // the smaller ones from that one: the original is decoded once
+    VipsImage* biggest = NULL;
+    int ret = ERR_NONE;
+    for (int res = ORIG_RES - 1; res >= 0 && ret == ERR_NONE; --res) {
+        if (!(resolutions & RES_BIT(res))) continue;
+
+        const int width = resized_res[2 * res];
+        const int height = resized_res[2 * res + 1];
+        VipsImage* img = NULL;
+        if (biggest == NULL) {
+            ret = shrink_on_load(image_buffer, image_size, width, height, &biggest);
+            // Keep its pixels if some smaller resolutions are made from it
+            if (ret == ERR_NONE && (resolutions & (RES_BIT(res) - 1))) {
+                VipsImage* in_memory = vips_image_copy_memory(biggest);
+                g_object_unref(biggest);
+                biggest = in_memory;
+                if (biggest == NULL) ret = ERR_IMGLIB;
+            }
+            img = biggest;
+        } else if (vips_thumbnail_image(biggest, &img, width, "height", height, NULL) != 0) {
+            ret = ERR_IMGLIB;
+        }
+
+        if (ret == ERR_NONE && vips_jpegsave_buffer(img, &resized->buffer[res], &resized->size[res], NULL) != 0) {
+            ret = ERR_IMGLIB;
+        }
+        if (img != NULL && img != biggest) g_object_unref(img);
     }
 
-    void* buffer2 = NULL; // Second buffer to save thumbnail (it is allocated by vips function)
-    size_t len = 0; // Length of thumbnail image to be modified by the vips method
-    // Save constent from thumb_img to the buffer
-    if (vips_jpegsave_buffer(thumb_img, &buffer2, &len, NULL) != 0) {
-        free(buffer1); buffer1 = NULL;
-        g_object_unref(VIPS_OBJECT(og_img)); og_img = NULL;
-        g_object_unref(VIPS_OBJECT(thumb_img)); thumb_img = NULL;
-        return ERR_IMGLIB;
+    if (biggest != NULL) g_object_unref(biggest);
+    if (ret != ERR_NONE) free_resized_imgs(resized);
+    return ret;
+}
+
+void free_resized_imgs(struct resized_imgs* resized)
+{
+    if (resized == NULL) return;
+    for (int res = 0; res < NB_RES; ++res) {
+        g_free(resized->buffer[res]);
+        resized->buffer[res] = NULL;
+        resized->size[res] = 0;
     }
+}
 
-    free(buffer1); buffer1 = NULL; // Free the first buffer as no longer needed
-    g_object_unref(VIPS_OBJECT(og_img)); og_img = NULL;// No longer need original image obect
-    g_object_unref(thumb_img); thumb_img = NULL; // No longer need thumbnail image obect
+int store_resized_imgs(struct imgfs_file* imgfs_file, size_t index, const unsigned char* sha,
+                       const struct resized_imgs* resized)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(sha);
+    M_REQUIRE_NON_NULL(resized);
 
-    // Move file position indicator to end of file
-    if (fseek(imgfs_file->file, 0, SEEK_END) != 0) {
-        g_free(buffer2); buffer2 = NULL;
-        return ERR_IO;
+    // The image may have been deleted (or replaced) since it was resized
+    if (index >= imgfs_file->header.max_files || !imgfs_file->metadata[index].is_valid
+        || memcmp(imgfs_file->metadata[index].SHA, sha, SHA256_DIGEST_LENGTH) != 0) {
+        return ERR_IMAGE_NOT_FOUND;
     }
 
-    long off = ftell(imgfs_file->file); // Offset of the end of file
-    // Set end of file offset with ftell
-    if (off == -1) {
-        g_free(buffer2); buffer2 = NULL;
-        return ERR_IO;
+    struct img_metadata* md = &imgfs_file->metadata[index];
+    int ret = ERR_NONE;
+    int changed = 0;
+    for (int res = 0; res < ORIG_RES && ret == ERR_NONE; ++res) {
+        // Not created, or resized by somebody else meanwhile: keep theirs
+        if (resized->buffer[res] == NULL || (md->offset[res] != 0 && md->size[res] != 0)) continue;
+
+        // Write contents of buffer in free space (or at the end of the file)
+        uint64_t off = 0;
+        ret = imgfs_write_blob(imgfs_file, resized->buffer[res], (uint32_t) resized->size[res], &off);
+        if (ret != ERR_NONE) break;
+
+        // We update metadata offset and size of image for the given resolution
+        md->offset[res] = off;
+        md->size[res] = (uint32_t) resized->size[res];
+        changed = 1;
+
+        // The new blob is only used by this image
+        if (imgfs_file->refs.offsets != NULL) ret = imgfs_refs_get(imgfs_file, off);
     }
 
-    // Write contents of buffer to the end of the file
-    if (fwrite(buffer2, len, 1, imgfs_file->file) != 1) {
-        g_free(buffer2); buffer2 = NULL;
-        return ERR_IO;
+    // Write the modified metadata to the file, once for all the resolutions
+    if (changed) {
+        const int err = imgfs_write_metadata(imgfs_file, index);
+        if (ret == ERR_NONE) ret = err;
     }
 
-    g_free(buffer2); buffer2 = NULL; // Free the thumbnail buffer after writing
+    return ret;
+}
 
-    // We update metadata offset and size of image for the given resolution
-    imgfs_file->metadata[index].offset[resolution] = (uint64_t) off;
-    imgfs_file->metadata[index].size[resolution] = (uint32_t) len;
+/*******************************************************************
+ * Big-endian 16-bit value at p.
+ */
+static uint32_t read_be16(const unsigned char* p)
+{
+    return (uint32_t) p[0] << 8 | p[1];
+}
 
-    size_t metadata_off = sizeof(struct imgfs_header) + index * sizeof(struct img_metadata); // offset of metadata at given index
-    // Move file position indicator to the correct metadata
-    if (fseek(imgfs_file->file, (long) metadata_off, SEEK_SET) != 0) return ERR_IO;
-    // Write the modified metadata to the file
-    if (fwrite(&imgfs_file->metadata[index], sizeof(struct img_metadata), 1, imgfs_file->file) != 1) return ERR_IO;
+int jpeg_header_resolution(uint32_t *height, uint32_t *width, const char *image_buffer, size_t image_size)
+{
+    M_REQUIRE_NON_NULL(height);
+    M_REQUIRE_NON_NULL(width);
+    M_REQUIRE_NON_NULL(image_buffer);
 
-    return ERR_NONE;
+    const unsigned char* jpeg = (const unsigned char*) image_buffer;
+    // SOI
+    if (image_size < 4 || jpeg[0] != 0xFF || jpeg[1] != 0xD8) return ERR_IMGLIB;
+
+    size_t pos = 2;
+    while (pos + 4 <= image_size) {
+        if (jpeg[pos] != 0xFF) return ERR_IMGLIB;
+        // Any number of fill bytes may precede a marker
+        while (pos < image_size && jpeg[pos] == 0xFF) ++pos;
+        if (pos + 3 > image_size) return ERR_IMGLIB;
+        const unsigned char marker = jpeg[pos++];
+
+        // Standalone markers (TEM, RSTn) have no length
+        if (marker == 0x01 || (0xD0 <= marker && marker <= 0xD7)) continue;
+        // The image data or its end before any frame header
+        if (marker == 0xDA || marker == 0xD9 || marker == 0xD8) return ERR_IMGLIB;
+
+        const size_t length = read_be16(jpeg + pos);
+        if (length < 2 || pos + length > image_size) return ERR_IMGLIB;
+
+        // Only the frames that libjpeg decodes (baseline, extended and progressive
+        // Huffman): the other ones are left to vips
+        if (marker == 0xC0 || marker == 0xC1 || marker == 0xC2) {
+            // precision (1), height (2), width (2), components (1)
+            if (length < 8) return ERR_IMGLIB;
+            *height = read_be16(jpeg + pos + 3);
+            *width = read_be16(jpeg + pos + 5);
+            // A height of 0 is only known at the end of the first scan (DNL)
+            return *height != 0 && *width != 0 ? ERR_NONE : ERR_IMGLIB;
+        }
+        if (0xC3 <= marker && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            return ERR_IMGLIB;
+        }
+
+        pos += length;
+    }
+
+    return ERR_IMGLIB;
 }
 
 int get_resolution(uint32_t *height, uint32_t *width, const char *image_buffer, size_t image_size)
@@ -110,6 +270,10 @@ int get_resolution(uint32_t *height, uint32_t *width, const char *image_buffer,
     M_REQUIRE_NON_NULL(width);
     M_REQUIRE_NON_NULL(image_buffer);
 
+    // The frame header is enough most of the time: no need to decode anything
+    if (jpeg_header_resolution(height, width, image_buffer, image_size) == ERR_NONE) return ERR_NONE;
+
+    // Otherwise (malformed or uncommon JPEG) vips tells
     VipsImage* original = NULL;
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wcast-qual"
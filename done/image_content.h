@@ -27,7 +27,34 @@ extern "C" {
 int get_resolution(uint32_t *height, uint32_t *width, const char *image_buffer, size_t image_size);
 
 /**
- * @brief Calls the create_resized_img function and updates the metadata on the disk
+ * @brief Gets the resolution of a JPEG image from its frame header (SOFn
+ *        segment) only, without decoding it. get_resolution() uses it first.
+ *
+ * @param height Where to put the image height.
+ * @param width Where to put the image width.
+ * @param image_buffer The content of the image.
+ * @param image_size The size of image_buffer.
+ * @return ERR_IMGLIB if the header is malformed or of an uncommon frame type, 0 if no error.
+ */
+int jpeg_header_resolution(uint32_t *height, uint32_t *width, const char *image_buffer, size_t image_size);
+
+/**
+ * @brief Set of resolutions, as a bit mask.
+ */
+#define RES_BIT(res) (1u << (res))
+#define RESIZED_RES_ALL (RES_BIT(THUMB_RES) | RES_BIT(SMALL_RES))
+
+/**
+ * @brief Resized versions of an image, indexed by resolution.
+ */
+struct resized_imgs {
+    void* buffer[NB_RES]; // NULL for the resolutions not created
+    size_t size[NB_RES];
+};
+
+/**
+ * @brief Creates the image in the given resolution, if it does not exist yet,
+ *        and updates the metadata on the disk.
  *
  * @param resolution
  * @param imgfs_file The main in-memory structure
@@ -36,6 +63,67 @@ int get_resolution(uint32_t *height, uint32_t *width, const char *image_buffer,
  */
 int lazily_resize(int resolution, struct imgfs_file* imgfs_file, size_t index);
 
+/**
+ * @brief Creates the image in all the resized resolutions it misses, reading
+ *        and decoding its original once, and updates the metadata on the disk
+ *        (once).
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param index The index of the image in the metadata array
+ * @return Some error code. 0 if no error.
+ */
+int lazily_resize_all(struct imgfs_file* imgfs_file, size_t index);
+
+/**
+ * @brief Creates a resized version of an image (no imgFS access: it can run
+ *        without holding any lock on it).
+ *
+ * @param image_buffer The content of the image in its original resolution
+ * @param image_size The size of image_buffer
+ * @param width The maximum width of the resized image
+ * @param height The maximum height of the resized image
+ * @param resized Where to put the resized (JPEG) image, to be freed with g_free()
+ * @param resized_size Where to put the size of the resized image
+ * @return Some error code. 0 if no error.
+ */
+int create_resized_img(const char* image_buffer, size_t image_size, int width, int height,
+                       void** resized, size_t* resized_size);
+
+/**
+ * @brief Creates several resized versions of an image, decoding it once
+ *        (no imgFS access: it can run without holding any lock on it).
+ *
+ * @param image_buffer The content of the image in its original resolution
+ * @param image_size The size of image_buffer
+ * @param resized_res The resized resolutions (as in struct imgfs_header)
+ * @param resolutions The resolutions to create (RES_BIT() of THUMB_RES and/or SMALL_RES)
+ * @param resized Where to put the resized (JPEG) images, to be freed with free_resized_imgs()
+ * @return Some error code. 0 if no error.
+ */
+int create_resized_imgs(const char* image_buffer, size_t image_size, const uint16_t* resized_res,
+                        unsigned resolutions, struct resized_imgs* resized);
+
+/**
+ * @brief Frees the images created by create_resized_imgs().
+ *
+ * @param resized The resized images
+ */
+void free_resized_imgs(struct resized_imgs* resized);
+
+/**
+ * @brief Writes the images created by create_resized_imgs() and updates the
+ *        metadata on the disk (once). Nothing is written for the resolutions
+ *        in which the image already exists.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param index The index of the image in the metadata array
+ * @param sha The SHA of the image that was resized (to detect a replaced image)
+ * @param resized The resized images
+ * @return ERR_IMAGE_NOT_FOUND if the image is no longer there, some other error code, 0 if no error.
+ */
+int store_resized_imgs(struct imgfs_file* imgfs_file, size_t index, const unsigned char* sha,
+                       const struct resized_imgs* resized);
+
 #ifdef __cplusplus
 }
 #endif
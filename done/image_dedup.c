@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 #include "image_dedup.h"
+#include "imgfs_index.h"
 
 int do_name_and_content_dedup(struct imgfs_file* imgfs_file, uint32_t index)
 {
@@ -14,23 +15,23 @@ int do_name_and_content_dedup(struct imgfs_file* imgfs_file, uint32_t index)
     const char* img_id = imgfs_file->metadata[index].img_id;
     const unsigned char* sha = imgfs_file->metadata[index].SHA;
 
-    for (size_t i = 0; i < imgfs_file->header.max_files ; ++i) {
-        // We must check if current metadata is valid and the i is not the index to check for duplication
-        if(imgfs_file->metadata[i].is_valid && i != index) {
-            // Duplicate image if the id's are equal
-            if (strcmp(img_id, imgfs_file->metadata[i].img_id) == 0) {
-                return ERR_DUPLICATE_ID;
-                // Check if hash code of the images are equal => we deduplicate
-            } else if (memcmp(sha, imgfs_file->metadata[i].SHA, SHA256_DIGEST_LENGTH) == 0) {
-                // To deduplicate, we modify metadata at index position to reference attributes of copy found
-                for (size_t j = 0; j < NB_RES; ++j) {
-                    imgfs_file->metadata[index].offset[j] = imgfs_file->metadata[i].offset[j];
-                    imgfs_file->metadata[index].size[j] = imgfs_file->metadata[i].size[j];
-                }
-                return ERR_NONE;
-            }
+    // Duplicate image if another valid image has the same id
+    size_t other = 0;
+    int ret = imgfs_index_find(imgfs_file, img_id, &other);
+    if (ret == ERR_NONE && other != index) return ERR_DUPLICATE_ID;
+    if (ret != ERR_NONE && ret != ERR_IMAGE_NOT_FOUND) return ret;
+
+    // Duplicate content if another valid image has the same SHA (one probe in the content index)
+    ret = imgfs_index_find_content(imgfs_file, sha, index, &other);
+    if (ret == ERR_NONE) {
+        // To deduplicate, we modify metadata at index position to reference attributes of copy found
+        for (size_t j = 0; j < NB_RES; ++j) {
+            imgfs_file->metadata[index].offset[j] = imgfs_file->metadata[other].offset[j];
+            imgfs_file->metadata[index].size[j] = imgfs_file->metadata[other].size[j];
         }
+        return ERR_NONE;
     }
+    if (ret != ERR_IMAGE_NOT_FOUND) return ret;
 
     // Set offset to zero if image at position index has no duplicate content
     imgfs_file->metadata[index].offset[ORIG_RES] = 0;
@@ -11,6 +11,12 @@
  * should be stored as raw bytes appended at the end of the imgFS
  * file and addressed by offsets in the metadata structure.
  *
+ * Files created by do_create() also reserve, right after the metadata,
+ * the lookup indexes: one index header followed by the buckets of the
+ * img_id index, then by the buckets of the content (SHA) index, then by
+ * the table of the free extents (space of deleted blobs to be reused).
+ * Its position is stored in imgfs_header.unused_64 (0 if there is none).
+ *
  * @author Mia Primorac
  */
 
@@ -42,6 +48,10 @@
 
 #define ORIG_RES_SIZE 2
 
+// On-disk lookup indexes
+#define IMGFS_INDEX_MAGIC "IMGFSIX3" // identifies a valid index region
+#define IMGFS_INDEX_MAGIC_SIZE 8
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -73,11 +83,73 @@ struct img_metadata {
     uint16_t unused_16; // unused but intended for future evolutions
 };
 
+// Structure stored (on disk) at the start of the index region
+struct imgfs_index_header {
+    char magic[IMGFS_INDEX_MAGIC_SIZE]; // IMGFS_INDEX_MAGIC (not null-terminated)
+    uint32_t version; // header version the index was last synchronized with
+    uint32_t unused_32; // unused but intended for future evolutions
+    uint64_t capacity; // number of buckets of each index following this header
+};
+
+// Structure representing an (in-memory) hash index
+struct imgfs_index {
+    uint32_t* buckets; // 1 + position in the metadata array of the image hashed there, 0 if free
+    uint64_t capacity; // number of buckets (a power of two)
+    uint64_t offset; // position of the buckets in the file, 0 if they are only kept in memory
+};
+
+// Structure representing the (in-memory) img_id order of the valid images
+struct imgfs_sorted {
+    uint32_t* slots; // positions in the metadata array, by increasing img_id
+    uint32_t nb; // number of images in slots
+};
+
+// Structure representing a free extent of the file (stored on disk in the index region)
+struct imgfs_extent {
+    uint64_t offset; // position of the extent in the file
+    uint32_t size; // size of the extent, 0 if this entry is unused
+    uint32_t unused_32; // unused but intended for future evolutions
+};
+
+// Number of size classes of the free extents (one per power of two of a uint32_t size)
+#define IMGFS_EXTENT_CLASSES 32
+
+// Structure representing the (in-memory) free extents allocator
+struct imgfs_extents {
+    struct imgfs_extent* table; // all the entries, as on disk
+    uint32_t* next; // 1 + next entry in the same list, 0 for the last one
+    uint32_t heads[IMGFS_EXTENT_CLASSES]; // 1 + first free extent of each size class, 0 if none
+    uint32_t unused; // 1 + first unused entry, 0 if none
+    uint64_t capacity; // number of entries
+    uint64_t offset; // position of the table in the file, 0 if it is only kept in memory
+};
+
+// Structure representing the (in-memory) bitmap of the free metadata slots
+struct imgfs_slots {
+    uint64_t* words; // one bit per metadata slot, set if the slot is free
+    size_t hint; // position of the first word that may have a bit set
+};
+
+// Structure representing the (in-memory) reference counts of the blobs
+struct imgfs_refs {
+    uint64_t* offsets; // offset of the blob hashed in each bucket, 0 if free
+    uint32_t* counts; // number of valid images using the blob of each bucket
+    uint64_t capacity; // number of buckets (a power of two)
+    uint64_t nb; // number of blobs
+};
+
 // Structure representing a file within the image file system
 struct imgfs_file {
     FILE* file; // file containing everything (on disk)
     struct imgfs_header header; // general information ("header") of the image database
     struct img_metadata* metadata; // "metadata" of the images in the database
+    struct imgfs_index index; // img_id -> metadata position lookup table
+    struct imgfs_index content_index; // SHA -> metadata position lookup table
+    void* map; // mapping of the header and metadata (NULL if the metadata was read in memory)
+    struct imgfs_slots free_slots; // free metadata slots, for do_insert
+    struct imgfs_extents extents; // free extents of the file, for new blobs
+    struct imgfs_refs refs; // reference counts of the (shared) blobs
+    struct imgfs_sorted sorted; // valid images by img_id, for paginated listings
 };
 
 /**
@@ -105,6 +177,107 @@ int do_open(const char* imgfs_filename,
             const char* open_mode,
             struct imgfs_file* imgfs_file);
 
+/**
+ * @brief Open imgFS file and map its header and metadata in memory
+ *        (instead of reading them): imgfs_file->metadata points into the
+ *        mapping, which is shared with the file if open_mode allows writing
+ *        and private otherwise.
+ *
+ * @param imgfs_filename Path to the imgFS file
+ * @param open_mode Mode for fopen(), eg.: "rb", "rb+", etc.
+ * @param imgfs_file Structure for header, metadata and file pointer.
+ */
+int do_open_mapped(const char* imgfs_filename,
+                   const char* open_mode,
+                   struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Reads size bytes of a file at offset (positional read: it does not
+ *        use nor move the file position, so concurrent reads need no locking).
+ *
+ * @param file The file (only its descriptor is used).
+ * @param buffer Where to put the bytes read.
+ * @param size The number of bytes to read.
+ * @param offset The position of the first byte in the file.
+ * @return Some error code. 0 if no error.
+ */
+int file_pread(FILE* file, void* buffer, size_t size, uint64_t offset);
+
+/**
+ * @brief Writes size bytes in a file at offset (positional write).
+ *
+ * @param file The file (only its descriptor is used).
+ * @param buffer The bytes to write.
+ * @param size The number of bytes to write.
+ * @param offset The position of the first byte in the file.
+ * @return Some error code. 0 if no error.
+ */
+int file_pwrite(FILE* file, const void* buffer, size_t size, uint64_t offset);
+
+/**
+ * @brief Reads size bytes of the imgFS file at offset (positional read:
+ *        it does not use nor move a shared file position, so concurrent
+ *        reads need no locking).
+ *
+ * @param imgfs_file Structure for header, metadata and file pointer.
+ * @param buffer Where to put the bytes read.
+ * @param size The number of bytes to read.
+ * @param offset The position of the first byte in the file.
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_pread(const struct imgfs_file* imgfs_file, void* buffer, size_t size, uint64_t offset);
+
+/**
+ * @brief Writes size bytes in the imgFS file at offset (positional write).
+ *
+ * @param imgfs_file Structure for header, metadata and file pointer.
+ * @param buffer The bytes to write.
+ * @param size The number of bytes to write.
+ * @param offset The position of the first byte in the file.
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_pwrite(struct imgfs_file* imgfs_file, const void* buffer, size_t size, uint64_t offset);
+
+/**
+ * @brief Size of the imgFS file (where new blobs are appended).
+ *
+ * @param imgfs_file Structure for header, metadata and file pointer.
+ * @param size Where to put the size of the file.
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_file_size(const struct imgfs_file* imgfs_file, uint64_t* size);
+
+/**
+ * @brief Writes the in-memory header back to the imgFS file
+ *        (through the mapping, synchronously flushed, if the file is mapped).
+ *
+ * @param imgfs_file Structure for header, metadata and file pointer.
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_write_header(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Writes the in-memory metadata at position index back to the imgFS file
+ *        (through the mapping, synchronously flushed, if the file is mapped).
+ *
+ * @param imgfs_file Structure for header, metadata and file pointer.
+ * @param index Position of the metadata in the metadata array.
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_write_metadata(struct imgfs_file* imgfs_file, size_t index);
+
+/**
+ * @brief Writes a blob in the imgFS file: in the space of a deleted blob
+ *        if one is large enough, at the end of the file otherwise.
+ *
+ * @param imgfs_file Structure for header, metadata and file pointer.
+ * @param buffer The content of the blob.
+ * @param size The size of the blob.
+ * @param offset Where to put the position of the blob in the file.
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_write_blob(struct imgfs_file* imgfs_file, const void* buffer, uint32_t size, uint64_t* offset);
+
 /**
  * @brief Do some clean-up for imgFS file handling.
  *
@@ -135,6 +308,44 @@ enum do_list_mode {
 int do_list(const struct imgfs_file* imgfs_file,
             enum do_list_mode output_mode, char** json);
 
+#define LIST_MAX_LIMIT 1000 // most images listed by a single page
+
+/**
+ * @brief Lists (in JSON format) one page of the img_id of the images, in
+ *        increasing img_id order: { "Images": [ ... ], "next": "<img_id>" }.
+ *        "next" is only there if there are more images to list: it is the
+ *        after of the next page.
+ *
+ * @param imgfs_file In memory structure with header and metadata.
+ * @param prefix Only list the img_id starting with it (NULL or "" for all of them).
+ * @param after Only list the img_id that come after it (NULL or "" from the first one).
+ * @param limit The most img_id to list (between 1 and LIST_MAX_LIMIT).
+ * @param json A pointer to the (dynamically allocated) list in JSON format.
+ * @return some error code.
+ */
+int do_list_page(const struct imgfs_file* imgfs_file, const char* prefix, const char* after,
+                 size_t limit, char** json);
+
+#define LIST_NDJSON_MAX_RECORD 1024 // enough for any record, its img_id escaped
+
+/**
+ * @brief Lists the img_id of the images, in increasing img_id order, as
+ *        newline-delimited JSON records ({"img_id":"<img_id>"}), one buffer
+ *        at a time: each call fills buffer with the records that follow
+ *        cursor, then moves cursor to the last of them.
+ *
+ * @param imgfs_file In memory structure with header and metadata.
+ * @param prefix Only list the img_id starting with it (NULL or "" for all of them).
+ * @param cursor The last img_id listed (MAX_IMG_ID + 1 chars, "" to start from the first one).
+ * @param buffer Where to write the records (not null-terminated).
+ * @param size Its size (at least LIST_NDJSON_MAX_RECORD).
+ * @param len Where to put the length of the records written.
+ * @param done Where to put whether the listing is over.
+ * @return some error code.
+ */
+int do_list_ndjson(const struct imgfs_file* imgfs_file, const char* prefix, char* cursor,
+                   char* buffer, size_t size, size_t* len, int* done);
+
 /**
  * @brief Creates the imgFS called imgfs_filename. Writes the header and the
  *        preallocated empty metadata array to imgFS file.
@@ -144,13 +355,25 @@ int do_list(const struct imgfs_file* imgfs_file,
  */
 int do_create(const char* imgfs_filename, struct imgfs_file* imgfs_file);
 
+/**
+ * @brief Same as do_create(), without printing anything (e.g. for the server).
+ *
+ * @param imgfs_filename Path to the imgFS file
+ * @param imgfs_file In memory structure with header and metadata.
+ * @param nb_items Where to put the number of items written, header and
+ *        metadata (may be NULL).
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_create(const char* imgfs_filename, struct imgfs_file* imgfs_file, size_t* nb_items);
+
 /**
  * @brief Deletes an image from a imgFS imgFS.
  *
  * Effectively, it only invalidates the is_valid field and updates the
  * metadata.  The raw data content is not erased, it stays where it
- * was (and  new content is always appended to the end; no garbage
- * collection).
+ * was: the blobs no other (deduplicated) image refers to become free
+ * extents, reused by the next inserts, and do_gbcollect() compacts the
+ * file.
  *
  * @param img_id The ID of the image to be deleted.
  * @param imgfs_file The main in-memory data structure
@@ -191,6 +414,38 @@ int do_read(const char* img_id, int resolution, char** image_buffer,
 int do_insert(const char* image_buffer, size_t image_size,
               const char* img_id, struct imgfs_file* imgfs_file);
 
+// What do_insert() computes from the image content alone (no imgFS access)
+struct img_digest {
+    unsigned char SHA[SHA256_DIGEST_LENGTH]; // hash code of the image
+    uint32_t orig_res[2]; // width and height of the image
+};
+
+/**
+ * @brief Computes the SHA and resolution of an image to be inserted
+ *        (the expensive part of do_insert, which needs no imgFS: it can
+ *        run without holding any lock on it).
+ *
+ * @param image_buffer Pointer to the raw image content
+ * @param image_size Image size
+ * @param digest Where to put the SHA and resolution
+ * @return Some error code. 0 if no error.
+ */
+int do_insert_prepare(const char* image_buffer, size_t image_size, struct img_digest* digest);
+
+/**
+ * @brief Insert image in the imgFS file, with its digest already computed
+ *        by do_insert_prepare().
+ *
+ * @param image_buffer Pointer to the raw image content
+ * @param image_size Image size
+ * @param img_id Image ID
+ * @param digest The SHA and resolution of the image
+ * @param imgfs_file The main in-memory data structure
+ * @return Some error code. 0 if no error.
+ */
+int do_insert_prepared(const char* image_buffer, size_t image_size, const char* img_id,
+                       const struct img_digest* digest, struct imgfs_file* imgfs_file);
+
 /**
  * @brief Removes the deleted images by moving the existing ones
  *
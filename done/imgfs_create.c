@@ -1,17 +1,31 @@
 #include <stdio.h>
 #include "imgfs.h"
+#include "imgfs_index.h"
+#include "imgfs_refs.h"
+#include "imgfs_slots.h"
 #include "util.h"
 #include <stdlib.h>
 #include <string.h>
 
-int do_create(const char* imgfs_filename, struct imgfs_file* imgfs_file)
+int imgfs_create(const char* imgfs_filename, struct imgfs_file* imgfs_file, size_t* nb_items)
 {
     M_REQUIRE_NON_NULL(imgfs_file);
     M_REQUIRE_NON_NULL(imgfs_filename);
 
     size_t items_written = 0; // items written (header and number of metatada)
+    if (nb_items != NULL) *nb_items = 0;
+    int ret = ERR_NONE;
     imgfs_file->header.version = 0;
     imgfs_file->header.nb_files = 0;
+    // The img_id and content indexes are stored right after the metadata
+    imgfs_file->header.unused_64 = sizeof(struct imgfs_header) + imgfs_file->header.max_files * sizeof(struct img_metadata);
+    zero_init_var(imgfs_file->index);
+    zero_init_var(imgfs_file->content_index);
+    zero_init_var(imgfs_file->sorted);
+    zero_init_var(imgfs_file->free_slots);
+    zero_init_var(imgfs_file->extents);
+    zero_init_var(imgfs_file->refs);
+    imgfs_file->map = NULL;
 
     // Open file in "write binary" mode
     imgfs_file->file = fopen(imgfs_filename, "wb");
@@ -25,23 +39,39 @@ int do_create(const char* imgfs_filename, struct imgfs_file* imgfs_file)
     if(imgfs_file->metadata == NULL) return ERR_OUT_OF_MEMORY;
 
     // Write the header to the imgfs_file
-    if(fwrite(&(imgfs_file->header), sizeof(struct imgfs_header), 1, imgfs_file->file) != 1) return ERR_IO;
+    if(imgfs_pwrite(imgfs_file, &(imgfs_file->header), sizeof(struct imgfs_header), 0) != ERR_NONE) return ERR_IO;
 
     ++items_written; // header was written successfully so increase items_written
+    if (nb_items != NULL) *nb_items = items_written;
 
     // Write the metadata to the imgfs_file
-    size_t nb_metadata = fwrite(imgfs_file->metadata, sizeof(struct img_metadata), imgfs_file->header.max_files, imgfs_file->file);
+    size_t nb_metadata = imgfs_file->header.max_files;
+    ret = imgfs_pwrite(imgfs_file, imgfs_file->metadata, nb_metadata * sizeof(struct img_metadata), sizeof(struct imgfs_header));
 
-    // If unsuccessfull write, still print because header was successfully written
-    if(nb_metadata != imgfs_file->header.max_files) {
-        printf("%zu item(s) written\n", items_written);
-        return ERR_IO;
-    }
+    // If unsuccessfull write, the header still was successfully written
+    if(ret != ERR_NONE) return ERR_IO;
 
     items_written += nb_metadata; // metadata was written successfully so increase items_written
+    if (nb_items != NULL) *nb_items = items_written;
+
+    // All the slots are free
+    ret = imgfs_slots_build(imgfs_file);
+    if (ret != ERR_NONE) return ret;
+
+    // No blob is used yet
+    ret = imgfs_refs_build(imgfs_file);
+    if (ret != ERR_NONE) return ret;
 
-    printf("%zu item(s) written\n", items_written);
+    // Write the (empty) img_id and content indexes
+    return imgfs_index_create(imgfs_file);
+}
 
-    return ERR_NONE;
+int do_create(const char* imgfs_filename, struct imgfs_file* imgfs_file)
+{
+    size_t items_written = 0;
+    const int ret = imgfs_create(imgfs_filename, imgfs_file, &items_written);
 
+    // Printed as soon as the header was written
+    if (items_written > 0) printf("%zu item(s) written\n", items_written);
+    return ret;
 }
@@ -1,5 +1,9 @@
 #include <stdio.h>
 #include "imgfs.h"
+#include "imgfs_extents.h"
+#include "imgfs_index.h"
+#include "imgfs_refs.h"
+#include "imgfs_slots.h"
 #include <string.h>
 
 int do_delete(const char* img_id, struct imgfs_file* imgfs_file)
@@ -9,40 +13,57 @@ int do_delete(const char* img_id, struct imgfs_file* imgfs_file)
     M_REQUIRE_NON_NULL(imgfs_file->file);
     M_REQUIRE_NON_NULL(imgfs_file->metadata);
 
-    size_t i;
-    size_t j;
-    int found = 0;
+    size_t i = 0;
     // Find index of metadata that has the same "img_id" as the one passed as argument
-    for (j = 0; j < (imgfs_file->header).max_files && !found; ++j) {
-        if (strncmp(img_id, imgfs_file->metadata[j].img_id, MAX_IMG_ID + 1) == 0 && imgfs_file->metadata[j].is_valid) {
-            found = 1;
-            i = j;
-        }
-    }
-
-    // Check that index is in bounds and that metadata found is valid
-    if (!found) return ERR_IMAGE_NOT_FOUND;
+    int ret = imgfs_index_find(imgfs_file, img_id, &i);
+    if (ret != ERR_NONE) return ret;
 
     imgfs_file->metadata[i].is_valid = EMPTY; // set valid to 0
 
-    long off = (long)(sizeof(struct imgfs_header) + i * sizeof(struct img_metadata));
-    // Move file position indicator to the location of the metadata corresponding to index i
-    if (fseek(imgfs_file->file, off, SEEK_SET) != 0) return ERR_IO;
-
     // Rewrite metadata with the changed "is_valid" parameter in file
-    size_t nb_metadata = fwrite(&imgfs_file->metadata[i], sizeof(struct img_metadata), 1, imgfs_file->file);
-    if (nb_metadata != 1) return ERR_IO;
+    ret = imgfs_write_metadata(imgfs_file, i);
+    if (ret != ERR_NONE) {
+        // The image is still there (e.g. the file is read-only)
+        imgfs_file->metadata[i].is_valid = NON_EMPTY;
+        return ret;
+    }
 
     // Metadata write is successfull so modify header
     imgfs_file->header.nb_files -= 1;
     imgfs_file->header.version += 1;
 
-    // Move file position indicator at the begining of the file
-    if (fseek(imgfs_file->file, 0, SEEK_SET) != 0) return ERR_IO;
-
     // Write modifies header to file
-    size_t nb_header = fwrite(&(imgfs_file->header), sizeof(struct imgfs_header), 1, imgfs_file->file);
-    if (nb_header != 1) return ERR_IO;
+    ret = imgfs_write_header(imgfs_file);
+    if (ret != ERR_NONE) {
+        // Put the image back as the header still counts it
+        imgfs_file->header.nb_files += 1;
+        imgfs_file->header.version -= 1;
+        imgfs_file->metadata[i].is_valid = NON_EMPTY;
+        imgfs_write_metadata(imgfs_file, i);
+        return ret;
+    }
+
+    // The image is gone: from now on, every step runs and the first error is reported
+    // (the indexes must not keep a dead slot)
+    imgfs_slots_release(imgfs_file, i);
+
+    // Drop the references to its blobs: the ones no other (deduplicated) image uses are garbage
+    const struct img_metadata* md = &imgfs_file->metadata[i];
+    for (size_t r = 0; r < NB_RES && imgfs_file->refs.offsets != NULL; ++r) {
+        int dead = 0;
+        int err = imgfs_refs_put(imgfs_file, md->offset[r], &dead);
+
+        // Their space can be reused at once
+        if (err == ERR_NONE && dead && md->size[r] != 0 && imgfs_file->extents.table != NULL) {
+            err = imgfs_extents_release(imgfs_file, md->offset[r], md->size[r]);
+        }
+        if (ret == ERR_NONE) ret = err;
+    }
+
+    // Remove the image from the img_id and content indexes and mark them as up to date
+    const int removed = imgfs_index_remove(imgfs_file, i);
+    if (ret == ERR_NONE) ret = removed;
+    if (ret != ERR_NONE) return ret;
 
-    return ERR_NONE;
+    return imgfs_index_sync(imgfs_file);
 }
@@ -0,0 +1,259 @@
+/**
+ * @file imgfs_extents.c
+ * @brief Allocator of the free extents of an imgFS file.
+ */
+
+#include "imgfs_extents.h"
+#include "util.h"
+
+#include <stdlib.h> // for calloc, free, qsort
+#include <string.h> // for memset
+
+/*******************************************************************
+ * Size class of an extent: the position of its highest bit.
+ */
+static int size_class(uint32_t size)
+{
+    return 31 - __builtin_clz(size);
+}
+
+/*******************************************************************
+ * Puts entry e at the front of the list.
+ */
+static void push(struct imgfs_extents* extents, uint32_t* head, uint32_t e)
+{
+    extents->next[e] = *head;
+    *head = e + 1;
+}
+
+/*******************************************************************
+ * Puts entry e in the list it belongs to (size class or unused).
+ */
+static void push_entry(struct imgfs_extents* extents, uint32_t e)
+{
+    const uint32_t size = extents->table[e].size;
+    push(extents, size == 0 ? &extents->unused : &extents->heads[size_class(size)], e);
+}
+
+/*******************************************************************
+ * Builds all the lists from the table (in table order).
+ */
+static void build_lists(struct imgfs_extents* extents)
+{
+    extents->unused = 0;
+    for (size_t c = 0; c < IMGFS_EXTENT_CLASSES; ++c) extents->heads[c] = 0;
+
+    for (uint64_t e = extents->capacity; e > 0; --e) push_entry(extents, (uint32_t) (e - 1));
+}
+
+/*******************************************************************
+ * Writes a single entry of the table to the file (if on disk).
+ */
+static int write_entry(struct imgfs_file* imgfs_file, uint32_t e)
+{
+    const struct imgfs_extents* extents = &imgfs_file->extents;
+    if (extents->offset == 0) return ERR_NONE;
+
+    return imgfs_pwrite(imgfs_file, &extents->table[e], sizeof(struct imgfs_extent),
+                        extents->offset + e * sizeof(struct imgfs_extent));
+}
+
+/*******************************************************************
+ * Writes the whole table to the file.
+ */
+static int write_table(struct imgfs_file* imgfs_file)
+{
+    const struct imgfs_extents* extents = &imgfs_file->extents;
+
+    return imgfs_pwrite(imgfs_file, extents->table, extents->capacity * sizeof(struct imgfs_extent), extents->offset);
+}
+
+/*******************************************************************
+ * Allocates the (empty) table.
+ */
+static int alloc_table(struct imgfs_file* imgfs_file, uint64_t offset)
+{
+    struct imgfs_extents* extents = &imgfs_file->extents;
+    zero_init_ptr(extents);
+
+    extents->capacity = imgfs_extents_capacity(imgfs_file->header.max_files);
+    extents->offset = offset;
+    extents->table = calloc(extents->capacity, sizeof(struct imgfs_extent));
+    extents->next = calloc(extents->capacity, sizeof(uint32_t));
+    if (extents->table == NULL || extents->next == NULL) return ERR_OUT_OF_MEMORY;
+
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Adds a free extent to the table (dropped if the table is full).
+ */
+static void add_gap(struct imgfs_extents* extents, uint64_t* nb, uint64_t offset, uint64_t size)
+{
+    // An extent cannot be larger than a blob can
+    while (size > 0 && *nb < extents->capacity) {
+        const uint32_t part = size > UINT32_MAX ? UINT32_MAX : (uint32_t) size;
+        extents->table[*nb].offset = offset;
+        extents->table[*nb].size = part;
+        ++*nb;
+        offset += part;
+        size -= part;
+    }
+}
+
+/*******************************************************************
+ * Order of the blobs by offset, for qsort.
+ */
+static int compare_offsets(const void* a, const void* b)
+{
+    const struct imgfs_extent* x = a;
+    const struct imgfs_extent* y = b;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+/*******************************************************************
+ * Rebuilds the free extents from the gaps between the live blobs
+ * (data starts right after the table).
+ */
+static int rebuild_from_gaps(struct imgfs_file* imgfs_file)
+{
+    struct imgfs_extents* extents = &imgfs_file->extents;
+
+    uint64_t end = 0;
+    int ret = imgfs_file_size(imgfs_file, &end);
+    if (ret != ERR_NONE) return ret;
+
+    // All the live blobs (the deduplicated ones several times)
+    struct imgfs_extent* blobs = calloc((size_t) imgfs_file->header.max_files * NB_RES + 1, sizeof(struct imgfs_extent));
+    if (blobs == NULL) return ERR_OUT_OF_MEMORY;
+
+    size_t nb_blobs = 0;
+    for (size_t i = 0; i < imgfs_file->header.max_files; ++i) {
+        const struct img_metadata* md = &imgfs_file->metadata[i];
+        for (size_t r = 0; md->is_valid && r < NB_RES; ++r) {
+            if (md->offset[r] != 0 && md->size[r] != 0) {
+                blobs[nb_blobs].offset = md->offset[r];
+                blobs[nb_blobs].size = md->size[r];
+                ++nb_blobs;
+            }
+        }
+    }
+    qsort(blobs, nb_blobs, sizeof(struct imgfs_extent), compare_offsets);
+
+    uint64_t nb = 0;
+    uint64_t cursor = extents->offset + extents->capacity * sizeof(struct imgfs_extent);
+    for (size_t b = 0; b < nb_blobs; ++b) {
+        if (blobs[b].offset > cursor) add_gap(extents, &nb, cursor, blobs[b].offset - cursor);
+        if (blobs[b].offset + blobs[b].size > cursor) cursor = blobs[b].offset + blobs[b].size;
+    }
+    if (end > cursor) add_gap(extents, &nb, cursor, end - cursor);
+
+    free(blobs);
+    return ERR_NONE;
+}
+
+uint64_t imgfs_extents_capacity(uint32_t max_files)
+{
+    // As many as the blobs the images can have (and never none)
+    return NB_RES * (uint64_t) max_files + 1;
+}
+
+int imgfs_extents_create(struct imgfs_file* imgfs_file, uint64_t offset)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+
+    int ret = alloc_table(imgfs_file, offset);
+    if (ret != ERR_NONE) return ret;
+
+    build_lists(&imgfs_file->extents);
+    return offset != 0 ? write_table(imgfs_file) : ERR_NONE;
+}
+
+int imgfs_extents_load(struct imgfs_file* imgfs_file, uint64_t offset, int up_to_date, int writable)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+
+    int ret = alloc_table(imgfs_file, offset);
+    if (ret != ERR_NONE) return ret;
+
+    struct imgfs_extents* extents = &imgfs_file->extents;
+    if (offset != 0 && up_to_date) {
+        ret = imgfs_pread(imgfs_file, extents->table, extents->capacity * sizeof(struct imgfs_extent), offset);
+        if (ret != ERR_NONE) return ret;
+    } else if (offset != 0) {
+        // Stale: find the free space again
+        ret = rebuild_from_gaps(imgfs_file);
+        if (ret == ERR_NONE && writable) ret = write_table(imgfs_file);
+        if (ret != ERR_NONE) return ret;
+    }
+
+    build_lists(extents);
+    return ERR_NONE;
+}
+
+int imgfs_extents_alloc(struct imgfs_file* imgfs_file, uint32_t size, uint64_t* offset)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->extents.table);
+    M_REQUIRE_NON_NULL(offset);
+
+    struct imgfs_extents* extents = &imgfs_file->extents;
+    *offset = 0;
+    if (size == 0) return ERR_NONE;
+
+    // First fit in the class of size, then any extent of a larger class fits
+    for (int c = size_class(size); c < IMGFS_EXTENT_CLASSES; ++c) {
+        uint32_t* link = &extents->heads[c];
+        while (*link != 0) {
+            const uint32_t e = *link - 1;
+            struct imgfs_extent* extent = &extents->table[e];
+            if (extent->size >= size) {
+                *link = extents->next[e];
+                *offset = extent->offset;
+
+                // The rest of the extent stays free (maybe in another class)
+                extent->offset += size;
+                extent->size -= size;
+                if (extent->size == 0) extent->offset = 0;
+                push_entry(extents, e);
+
+                return write_entry(imgfs_file, e);
+            }
+            link = &extents->next[e];
+        }
+    }
+
+    return ERR_NONE;
+}
+
+int imgfs_extents_release(struct imgfs_file* imgfs_file, uint64_t offset, uint32_t size)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->extents.table);
+
+    struct imgfs_extents* extents = &imgfs_file->extents;
+    if (offset == 0 || size == 0) return ERR_NONE;
+
+    // Full table: the space stays lost until the next compaction
+    if (extents->unused == 0) return ERR_NONE;
+
+    const uint32_t e = extents->unused - 1;
+    extents->unused = extents->next[e];
+    extents->table[e].offset = offset;
+    extents->table[e].size = size;
+    push_entry(extents, e);
+
+    return write_entry(imgfs_file, e);
+}
+
+void imgfs_extents_free(struct imgfs_file* imgfs_file)
+{
+    if (imgfs_file != NULL) {
+        free(imgfs_file->extents.table);
+        free(imgfs_file->extents.next);
+        zero_init_var(imgfs_file->extents);
+    }
+}
@@ -0,0 +1,82 @@
+/**
+ * @file imgfs_extents.h
+ * @brief Allocator of the free extents of an imgFS file.
+ *
+ * The space of the blobs freed by do_delete() is kept as free extents,
+ * chained in lists by size class (power of two), and given first-fit to
+ * new blobs (the rest of a larger extent stays free). The table of the
+ * extents is persisted at the end of the index region; files without such
+ * a region only get an in-memory allocator, fed by the deletions.
+ * When full, freed extents are dropped (do_gbcollect() gets them back).
+ */
+
+#pragma once
+
+#include "imgfs.h" // for struct imgfs_file, struct imgfs_extents
+
+#include <stdint.h> // for uint32_t, uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Number of free extents that can be kept for max_files images.
+ *
+ * @param max_files The maximum number of images of the imgFS.
+ * @return The number of entries of the table.
+ */
+uint64_t imgfs_extents_capacity(uint32_t max_files);
+
+/**
+ * @brief Creates an empty allocator and writes its table at offset.
+ *
+ * @param imgfs_file The main in-memory structure (header already filled)
+ * @param offset The position of the table in the file.
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_extents_create(struct imgfs_file* imgfs_file, uint64_t offset);
+
+/**
+ * @brief Loads the allocator of an opened imgFS. If the table is stale, the
+ *        free extents are rebuilt from the gaps between the live blobs
+ *        (and rewritten if the file is writable).
+ *
+ * @param imgfs_file The main in-memory structure (header and metadata already read)
+ * @param offset The position of the table in the file, 0 if there is none.
+ * @param up_to_date Whether the table on disk is up to date.
+ * @param writable Whether the imgFS file was opened for writing.
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_extents_load(struct imgfs_file* imgfs_file, uint64_t offset, int up_to_date, int writable);
+
+/**
+ * @brief Takes size bytes from the first free extent that is large enough.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param size The size of the blob to be written.
+ * @param offset Where to put the position of the space, 0 if no free extent fits.
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_extents_alloc(struct imgfs_file* imgfs_file, uint32_t size, uint64_t* offset);
+
+/**
+ * @brief Gives back the space of a blob that is no longer used.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param offset The position of the blob.
+ * @param size The size of the blob.
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_extents_release(struct imgfs_file* imgfs_file, uint64_t offset, uint32_t size);
+
+/**
+ * @brief Frees the in-memory allocator.
+ *
+ * @param imgfs_file The main in-memory structure
+ */
+void imgfs_extents_free(struct imgfs_file* imgfs_file);
+
+#ifdef __cplusplus
+}
+#endif
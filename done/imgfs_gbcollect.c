@@ -0,0 +1,249 @@
+/**
+ * @file imgfs_gbcollect.c
+ * @brief Incremental compaction (garbage collection) of an imgFS.
+ */
+
+#include "imgfs_gbcollect.h"
+#include "imgfs_index.h"
+#include "imgfs_slots.h"
+#include "util.h"
+
+#include <stdio.h>    // for FILE, rename, remove
+#include <stdlib.h>   // for calloc, free
+#include <string.h>   // for memcmp, memset, strdup
+#include <unistd.h>   // for fsync
+
+#define OFFSET_HASH_MULTIPLIER 0x9E3779B97F4A7C15ULL
+
+/*******************************************************************
+ * Tag of the content of a blob: its resolution and the SHA of its image
+ * (freed space is reused, so an offset alone does not tell the blob).
+ */
+static uint64_t blob_tag(const struct img_metadata* md, size_t resolution)
+{
+    uint64_t tag = 0;
+    memcpy(&tag, md->SHA, sizeof(tag));
+    return tag ^ resolution;
+}
+
+/*******************************************************************
+ * Position of the (old, tag, new) entry of the blob at old offset:
+ * either the entry itself or the free one where it would go.
+ */
+static uint64_t offset_slot(const struct imgfs_gc* gc, uint64_t old, uint64_t tag)
+{
+    const uint64_t mask = gc->capacity - 1;
+    uint64_t i = (old * OFFSET_HASH_MULTIPLIER) & mask;
+
+    // Blob offsets are never 0 (the header is there): 0 marks a free entry
+    while (gc->offsets[3 * i] != 0 && (gc->offsets[3 * i] != old || gc->offsets[3 * i + 1] != tag)) {
+        i = (i + 1) & mask;
+    }
+
+    return i;
+}
+
+/*******************************************************************
+ * Copies (once) the blob at old offset to the end of the compacted copy.
+ */
+static int copy_blob(struct imgfs_gc* gc, uint64_t old, uint64_t tag, uint32_t size, uint64_t* new_offset)
+{
+    // Already copied (shared by deduplicated images): share the copy too
+    const uint64_t slot = offset_slot(gc, old, tag);
+    if (gc->offsets[3 * slot] == old) {
+        *new_offset = gc->offsets[3 * slot + 2];
+        return ERR_NONE;
+    }
+
+    char* buffer = calloc(size, 1);
+    if (buffer == NULL) return ERR_OUT_OF_MEMORY;
+
+    // Read the blob from the source, then append it to the compacted copy
+    uint64_t off = 0;
+    int ret = imgfs_pread(gc->src, buffer, size, old);
+    if (ret == ERR_NONE) ret = imgfs_file_size(&gc->dst, &off);
+    if (ret == ERR_NONE) ret = imgfs_pwrite(&gc->dst, buffer, size, off);
+    free(buffer);
+    if (ret != ERR_NONE) return ret;
+
+    gc->offsets[3 * slot] = old;
+    gc->offsets[3 * slot + 1] = tag;
+    gc->offsets[3 * slot + 2] = off;
+    *new_offset = off;
+
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Copies the slot at position index (metadata and live blobs).
+ */
+static int copy_slot(struct imgfs_gc* gc, size_t index)
+{
+    struct img_metadata* md = &gc->dst.metadata[index];
+
+    // Copied before and changed since: forget the previous copy
+    if (md->is_valid) {
+        int ret = imgfs_index_remove(&gc->dst, index);
+        if (ret != ERR_NONE) return ret;
+        imgfs_slots_release(&gc->dst, index);
+    }
+
+    gc->copied[index] = gc->src->metadata[index];
+
+    if (!gc->copied[index].is_valid) {
+        // Nothing to keep from a free slot
+        memset(md, 0, sizeof(struct img_metadata));
+        return imgfs_write_metadata(&gc->dst, index);
+    }
+
+    *md = gc->copied[index];
+    for (size_t r = 0; r < NB_RES; ++r) {
+        if (md->offset[r] != 0 && md->size[r] != 0) {
+            int ret = copy_blob(gc, md->offset[r], blob_tag(md, r), md->size[r], &md->offset[r]);
+            if (ret != ERR_NONE) return ret;
+        } else {
+            md->offset[r] = 0;
+            md->size[r] = 0;
+        }
+    }
+
+    int ret = imgfs_write_metadata(&gc->dst, index);
+    if (ret != ERR_NONE) return ret;
+
+    imgfs_slots_take(&gc->dst, index);
+    return imgfs_index_insert(&gc->dst, index);
+}
+
+int imgfs_gc_start(struct imgfs_gc* gc, struct imgfs_file* src, const char* tmp_path)
+{
+    M_REQUIRE_NON_NULL(gc);
+    zero_init_ptr(gc);
+    M_REQUIRE_NON_NULL(src);
+    M_REQUIRE_NON_NULL(src->file);
+    M_REQUIRE_NON_NULL(src->metadata);
+    M_REQUIRE_NON_NULL(tmp_path);
+
+    gc->src = src;
+    gc->dst_path = strdup(tmp_path);
+    gc->copied = calloc(src->header.max_files, sizeof(struct img_metadata));
+
+    // At most one blob per resolution per slot, copied twice (once more when catching up),
+    // with a load factor of at most 1/2
+    gc->capacity = 1;
+    while (gc->capacity < 4 * NB_RES * (uint64_t) src->header.max_files) gc->capacity <<= 1;
+    gc->offsets = calloc(3 * gc->capacity, sizeof(uint64_t));
+
+    if (gc->dst_path == NULL || gc->copied == NULL || gc->offsets == NULL) return ERR_OUT_OF_MEMORY;
+
+    // Same layout as the source
+    gc->dst.header.max_files = src->header.max_files;
+    memcpy(gc->dst.header.resized_res, src->header.resized_res, sizeof(src->header.resized_res));
+
+    return imgfs_create(tmp_path, &gc->dst, NULL);
+}
+
+int imgfs_gc_step(struct imgfs_gc* gc, size_t nb_slots, int* done)
+{
+    M_REQUIRE_NON_NULL(gc);
+    M_REQUIRE_NON_NULL(gc->src);
+    M_REQUIRE_NON_NULL(gc->dst.file);
+    M_REQUIRE_NON_NULL(done);
+
+    const size_t max_files = gc->src->header.max_files;
+    for (size_t n = 0; n < nb_slots && gc->next < max_files; ++n, ++gc->next) {
+        int ret = copy_slot(gc, gc->next);
+        if (ret != ERR_NONE) return ret;
+    }
+
+    *done = gc->next >= max_files;
+    return ERR_NONE;
+}
+
+int imgfs_gc_finish(struct imgfs_gc* gc, const char* imgfs_path, struct imgfs_file* compacted,
+                    int64_t* reclaimed)
+{
+    M_REQUIRE_NON_NULL(gc);
+    M_REQUIRE_NON_NULL(gc->src);
+    M_REQUIRE_NON_NULL(gc->dst.file);
+    M_REQUIRE_NON_NULL(imgfs_path);
+
+    // Copy the slots not handled yet
+    int done = 0;
+    int ret = ERR_NONE;
+    while (!done && ret == ERR_NONE) ret = imgfs_gc_step(gc, IMGFS_GC_STEP_SLOTS, &done);
+
+    // Catch up with the slots changed while the other ones were being copied
+    for (size_t i = 0; i < gc->src->header.max_files && ret == ERR_NONE; ++i) {
+        if (memcmp(&gc->src->metadata[i], &gc->copied[i], sizeof(struct img_metadata)) != 0) {
+            ret = copy_slot(gc, i);
+        }
+    }
+    if (ret != ERR_NONE) return ret;
+
+    // The content changed place: it is a new version
+    gc->dst.header.nb_files = gc->src->header.nb_files;
+    gc->dst.header.version = gc->src->header.version + 1;
+    ret = imgfs_write_header(&gc->dst);
+    if (ret == ERR_NONE) ret = imgfs_index_sync(&gc->dst);
+    if (ret != ERR_NONE) return ret;
+
+    uint64_t old_size = 0;
+    uint64_t new_size = 0;
+    ret = imgfs_file_size(gc->src, &old_size);
+    if (ret == ERR_NONE) ret = imgfs_file_size(&gc->dst, &new_size);
+    if (ret != ERR_NONE) return ret;
+
+    // The compacted copy must be on disk before it replaces the source
+    if (fsync(fileno(gc->dst.file)) != 0) return ERR_IO;
+    do_close(&gc->dst);
+
+    // Opened before it replaces the source: if it cannot be, the source stays
+    if (compacted != NULL) {
+        ret = do_open_mapped(gc->dst_path, "rb+", compacted);
+        if (ret != ERR_NONE) return ret;
+    }
+
+    // Atomic replacement
+    if (rename(gc->dst_path, imgfs_path) != 0) {
+        if (compacted != NULL) do_close(compacted);
+        return ERR_IO;
+    }
+    free(gc->dst_path);
+    gc->dst_path = NULL;
+
+    if (reclaimed != NULL) *reclaimed = (int64_t) old_size - (int64_t) new_size;
+    return ERR_NONE;
+}
+
+void imgfs_gc_abort(struct imgfs_gc* gc)
+{
+    if (gc == NULL) return;
+
+    if (gc->dst.file != NULL) do_close(&gc->dst);
+    if (gc->dst_path != NULL) remove(gc->dst_path);
+
+    free(gc->dst_path);
+    free(gc->copied);
+    free(gc->offsets);
+    zero_init_ptr(gc);
+}
+
+int do_gbcollect(const char* imgfs_path, const char* imgfs_tmp_bkp_path)
+{
+    M_REQUIRE_NON_NULL(imgfs_path);
+    M_REQUIRE_NON_NULL(imgfs_tmp_bkp_path);
+
+    struct imgfs_file imgfs_file;
+    zero_init_var(imgfs_file);
+    int ret = do_open(imgfs_path, "rb", &imgfs_file);
+    if (ret != ERR_NONE) return ret;
+
+    // Nobody else uses imgfs_file: everything can be copied at once
+    struct imgfs_gc gc;
+    ret = imgfs_gc_start(&gc, &imgfs_file, imgfs_tmp_bkp_path);
+    if (ret == ERR_NONE) ret = imgfs_gc_finish(&gc, imgfs_path, NULL, NULL);
+
+    imgfs_gc_abort(&gc);
+    do_close(&imgfs_file);
+    return ret;
+}
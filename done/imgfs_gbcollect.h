@@ -0,0 +1,87 @@
+/**
+ * @file imgfs_gbcollect.h
+ * @brief Incremental compaction (garbage collection) of an imgFS.
+ *
+ * The live blobs (originals and resized variants) of an opened imgFS are
+ * copied, a few slots at a time, into a new imgFS; blobs shared by several
+ * (deduplicated) images are copied once and stay shared. Between two steps,
+ * the source imgFS can still be used; imgfs_gc_finish() then catches up
+ * with the slots changed meanwhile and renames the new file over the old one.
+ */
+
+#pragma once
+
+#include "imgfs.h" // for struct imgfs_file, struct img_metadata
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for int64_t, uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Default number of slots copied by one imgfs_gc_step()
+#define IMGFS_GC_STEP_SLOTS 64
+
+// Structure representing an ongoing compaction
+struct imgfs_gc {
+    struct imgfs_file* src; // imgFS being compacted (opened by the caller)
+    struct imgfs_file dst; // compacted copy being built
+    char* dst_path; // path of the compacted copy
+    struct img_metadata* copied; // source metadata as it was when copied
+    uint64_t* offsets; // (old offset, content tag, new offset) of the blobs already copied
+    uint64_t capacity; // number of entries in offsets (a power of two)
+    size_t next; // next slot to be copied
+};
+
+/**
+ * @brief Starts the compaction of an opened imgFS: creates the (empty)
+ *        compacted copy at tmp_path.
+ *
+ * @param gc The compaction to start
+ * @param src The imgFS to compact (opened for reading)
+ * @param tmp_path The path of the compacted copy (overwritten)
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_gc_start(struct imgfs_gc* gc, struct imgfs_file* src, const char* tmp_path);
+
+/**
+ * @brief Copies the live blobs of the next nb_slots slots.
+ *
+ * @param gc The ongoing compaction
+ * @param nb_slots The number of slots to handle.
+ * @param done Set to 1 once all the slots were handled, 0 otherwise.
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_gc_step(struct imgfs_gc* gc, size_t nb_slots, int* done);
+
+/**
+ * @brief Copies again the slots changed since they were copied, then
+ *        replaces the file at imgfs_path by the compacted copy.
+ *        The source imgFS must not be modified during this call. If it is
+ *        still to be used afterwards, compacted must be given: the
+ *        compacted copy is opened (mapped, for reading and writing) before
+ *        it replaces the source, so that nothing is replaced if it cannot
+ *        be; on success, the source must then be closed by the caller,
+ *        and compacted used instead.
+ *
+ * @param gc The ongoing compaction (all steps done)
+ * @param imgfs_path The path of the source imgFS
+ * @param compacted Where to open the compacted copy (may be NULL).
+ * @param reclaimed Where to put the number of bytes reclaimed (may be NULL).
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_gc_finish(struct imgfs_gc* gc, const char* imgfs_path, struct imgfs_file* compacted,
+                    int64_t* reclaimed);
+
+/**
+ * @brief Stops a compaction: removes the compacted copy and frees everything.
+ *        Also frees the resources of a finished (or failed to start) compaction.
+ *
+ * @param gc The compaction to stop
+ */
+void imgfs_gc_abort(struct imgfs_gc* gc);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,466 @@
+/**
+ * @file imgfs_index.c
+ * @brief Hash indexes from img_id and from content (SHA) to position in the metadata array.
+ */
+
+#include "imgfs_index.h"
+#include "imgfs_extents.h"
+#include "util.h"
+
+#include <stdlib.h> // for calloc, free, qsort
+#include <string.h> // for memcmp, memcpy, memmove, strncmp
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME        1099511628211ULL
+
+/*******************************************************************
+ * FNV-1a hash of an img_id (stable, as it is stored on disk).
+ */
+static uint64_t hash_img_id(const char* img_id)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (size_t i = 0; i <= MAX_IMG_ID && img_id[i] != '\0'; ++i) {
+        hash ^= (unsigned char) img_id[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/*******************************************************************
+ * Hash of a SHA: it already is uniformly distributed, so take its first bytes.
+ */
+static uint64_t hash_sha(const unsigned char* sha)
+{
+    uint64_t hash = 0;
+    memcpy(&hash, sha, sizeof(hash));
+    return hash;
+}
+
+/*******************************************************************
+ * Home bucket, in the given table, of the image at position index.
+ */
+static uint64_t home_bucket(const struct imgfs_file* imgfs_file, const struct imgfs_index* table, size_t index)
+{
+    const struct img_metadata* md = &imgfs_file->metadata[index];
+    const uint64_t hash = table == &imgfs_file->content_index ? hash_sha(md->SHA) : hash_img_id(md->img_id);
+    return hash & (table->capacity - 1);
+}
+
+/*******************************************************************
+ * Writes a single bucket of the given table to the file (if on disk).
+ */
+static int write_bucket(struct imgfs_file* imgfs_file, const struct imgfs_index* table, uint64_t bucket)
+{
+    if (table->offset == 0) return ERR_NONE;
+
+    return imgfs_pwrite(imgfs_file, &table->buckets[bucket], sizeof(uint32_t), table->offset + bucket * sizeof(uint32_t));
+}
+
+/*******************************************************************
+ * Writes the index header, stamped with the current header version.
+ */
+static int write_index_header(struct imgfs_file* imgfs_file)
+{
+    struct imgfs_index_header index_header;
+    zero_init_var(index_header);
+    memcpy(index_header.magic, IMGFS_INDEX_MAGIC, IMGFS_INDEX_MAGIC_SIZE);
+    index_header.version = imgfs_file->header.version;
+    index_header.capacity = imgfs_file->index.capacity;
+
+    return imgfs_pwrite(imgfs_file, &index_header, sizeof(index_header), imgfs_file->header.unused_64);
+}
+
+/*******************************************************************
+ * Writes the index header followed by the buckets of both tables.
+ */
+static int write_region(struct imgfs_file* imgfs_file)
+{
+    int ret = write_index_header(imgfs_file);
+    if (ret != ERR_NONE) return ret;
+
+    // The buckets directly follow the header
+    const struct imgfs_index* tables[] = { &imgfs_file->index, &imgfs_file->content_index };
+    for (size_t t = 0; t < sizeof(tables) / sizeof(tables[0]) && ret == ERR_NONE; ++t) {
+        ret = imgfs_pwrite(imgfs_file, tables[t]->buckets, tables[t]->capacity * sizeof(uint32_t), tables[t]->offset);
+    }
+
+    return ret;
+}
+
+/*******************************************************************
+ * Puts the image at position index in its first free bucket of the table.
+ */
+static uint64_t place(const struct imgfs_file* imgfs_file, struct imgfs_index* table, size_t index)
+{
+    const uint64_t mask = table->capacity - 1;
+    uint64_t bucket = home_bucket(imgfs_file, table, index);
+
+    // There is always a free bucket, as capacity > max_files
+    while (table->buckets[bucket] != 0) bucket = (bucket + 1) & mask;
+
+    table->buckets[bucket] = (uint32_t) (index + 1);
+    return bucket;
+}
+
+/*******************************************************************
+ * Removes the image at position index from the table
+ * (backward shift deletion, to keep probe sequences without holes).
+ */
+static int unplace(struct imgfs_file* imgfs_file, struct imgfs_index* table, size_t index)
+{
+    uint32_t* const buckets = table->buckets;
+    const uint64_t mask = table->capacity - 1;
+    uint64_t hole = home_bucket(imgfs_file, table, index);
+
+    // Find the bucket of the image
+    while (buckets[hole] != 0 && buckets[hole] != index + 1) hole = (hole + 1) & mask;
+    if (buckets[hole] == 0) return ERR_IMAGE_NOT_FOUND;
+
+    // Move back the following entries that can fill the hole
+    // (all of them, even if a write fails, so that the table in memory stays right)
+    buckets[hole] = 0;
+    int ret = ERR_NONE;
+    for (uint64_t next = (hole + 1) & mask; buckets[next] != 0; next = (next + 1) & mask) {
+        const uint64_t home = home_bucket(imgfs_file, table, buckets[next] - 1);
+        // The entry may move if its home is not (cyclically) in ]hole, next]
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            buckets[hole] = buckets[next];
+            buckets[next] = 0;
+            const int written = write_bucket(imgfs_file, table, hole);
+            if (ret == ERR_NONE) ret = written;
+            hole = next;
+        }
+    }
+
+    const int written = write_bucket(imgfs_file, table, hole);
+    return ret != ERR_NONE ? ret : written;
+}
+
+/*******************************************************************
+ * Allocates the (empty) buckets of both tables.
+ */
+static int alloc_buckets(struct imgfs_file* imgfs_file)
+{
+    const uint64_t capacity = imgfs_index_capacity(imgfs_file->header.max_files);
+    struct imgfs_index* tables[] = { &imgfs_file->index, &imgfs_file->content_index };
+
+    for (size_t t = 0; t < sizeof(tables) / sizeof(tables[0]); ++t) {
+        tables[t]->capacity = capacity;
+        tables[t]->buckets = calloc(capacity, sizeof(uint32_t));
+        if (tables[t]->buckets == NULL) return ERR_OUT_OF_MEMORY;
+    }
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Whether buckets read from the file can be probed: each one is free or
+ * names a slot of the metadata, and one at least is free so that probing ends.
+ */
+static int buckets_valid(const struct imgfs_file* imgfs_file, const struct imgfs_index* table)
+{
+    int has_free = 0;
+    for (uint64_t b = 0; b < table->capacity; ++b) {
+        if (table->buckets[b] > imgfs_file->header.max_files) return 0;
+        if (table->buckets[b] == 0) has_free = 1;
+    }
+    return has_free;
+}
+
+/*******************************************************************
+ * Sets the position of the buckets of both tables in the region at offset.
+ */
+static void set_offsets(struct imgfs_file* imgfs_file, uint64_t offset)
+{
+    imgfs_file->index.offset = offset + sizeof(struct imgfs_index_header);
+    imgfs_file->content_index.offset = imgfs_file->index.offset + imgfs_file->index.capacity * sizeof(uint32_t);
+}
+
+/*******************************************************************
+ * Position of the table of the free extents, after the buckets.
+ */
+static uint64_t extents_offset(const struct imgfs_file* imgfs_file)
+{
+    if (imgfs_file->content_index.offset == 0) return 0;
+    return imgfs_file->content_index.offset + imgfs_file->content_index.capacity * sizeof(uint32_t);
+}
+
+/*******************************************************************
+ * Allocates the (empty) array of the images sorted by img_id.
+ */
+static int alloc_sorted(struct imgfs_file* imgfs_file)
+{
+    imgfs_file->sorted.nb = 0;
+    imgfs_file->sorted.slots = calloc(imgfs_file->header.max_files + 1, sizeof(uint32_t));
+    return imgfs_file->sorted.slots == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE;
+}
+
+// An image of the metadata array and its img_id, to sort them
+struct sorted_entry {
+    const char* img_id;
+    uint32_t slot;
+};
+
+/********************************************************************/
+static int by_img_id(const void* a, const void* b)
+{
+    return strncmp(((const struct sorted_entry*) a)->img_id, ((const struct sorted_entry*) b)->img_id, MAX_IMG_ID + 1);
+}
+
+/*******************************************************************
+ * Sorts the valid images by img_id (at load time: O(n log n)).
+ */
+static int build_sorted(struct imgfs_file* imgfs_file)
+{
+    struct sorted_entry* entries = calloc(imgfs_file->header.max_files + 1, sizeof(struct sorted_entry));
+    if (entries == NULL) return ERR_OUT_OF_MEMORY;
+
+    size_t nb = 0;
+    for (uint32_t i = 0; i < imgfs_file->header.max_files; ++i) {
+        if (imgfs_file->metadata[i].is_valid) {
+            entries[nb].img_id = imgfs_file->metadata[i].img_id;
+            entries[nb].slot = i;
+            ++nb;
+        }
+    }
+    qsort(entries, nb, sizeof(struct sorted_entry), by_img_id);
+
+    for (size_t i = 0; i < nb; ++i) imgfs_file->sorted.slots[i] = entries[i].slot;
+    imgfs_file->sorted.nb = (uint32_t) nb;
+    free(entries);
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Adds the image at position index to the sorted images.
+ */
+static void sorted_insert(struct imgfs_file* imgfs_file, size_t index)
+{
+    struct imgfs_sorted* sorted = &imgfs_file->sorted;
+    const size_t rank = imgfs_index_rank(imgfs_file, imgfs_file->metadata[index].img_id, 0);
+    memmove(&sorted->slots[rank + 1], &sorted->slots[rank], (sorted->nb - rank) * sizeof(uint32_t));
+    sorted->slots[rank] = (uint32_t) index;
+    ++sorted->nb;
+}
+
+/*******************************************************************
+ * Removes the image at position index from the sorted images.
+ */
+static void sorted_remove(struct imgfs_file* imgfs_file, size_t index)
+{
+    struct imgfs_sorted* sorted = &imgfs_file->sorted;
+    size_t rank = imgfs_index_rank(imgfs_file, imgfs_file->metadata[index].img_id, 0);
+    // Its img_id should have led to it: otherwise look for it
+    if (rank >= sorted->nb || sorted->slots[rank] != index) {
+        for (rank = 0; rank < sorted->nb && sorted->slots[rank] != index; ++rank);
+        if (rank == sorted->nb) return;
+    }
+    memmove(&sorted->slots[rank], &sorted->slots[rank + 1], (sorted->nb - rank - 1) * sizeof(uint32_t));
+    --sorted->nb;
+}
+
+uint64_t imgfs_index_capacity(uint32_t max_files)
+{
+    uint64_t capacity = 1;
+    while (capacity < 2 * (uint64_t) max_files) capacity <<= 1;
+    return capacity;
+}
+
+uint64_t imgfs_index_region_size(uint32_t max_files)
+{
+    return sizeof(struct imgfs_index_header) + 2 * imgfs_index_capacity(max_files) * sizeof(uint32_t)
+           + imgfs_extents_capacity(max_files) * sizeof(struct imgfs_extent);
+}
+
+
+int imgfs_index_create(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+
+    int ret = alloc_buckets(imgfs_file);
+    if (ret == ERR_NONE) ret = alloc_sorted(imgfs_file);
+    if (ret != ERR_NONE) return ret;
+
+    set_offsets(imgfs_file, imgfs_file->header.unused_64);
+    ret = write_region(imgfs_file);
+    if (ret != ERR_NONE) return ret;
+
+    return imgfs_extents_create(imgfs_file, extents_offset(imgfs_file));
+}
+
+int imgfs_index_load(struct imgfs_file* imgfs_file, int writable)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+
+    zero_init_var(imgfs_file->index);
+    zero_init_var(imgfs_file->content_index);
+    zero_init_var(imgfs_file->sorted);
+    int ret = alloc_buckets(imgfs_file);
+    if (ret == ERR_NONE) ret = alloc_sorted(imgfs_file);
+    if (ret == ERR_NONE) ret = build_sorted(imgfs_file);
+    if (ret != ERR_NONE) return ret;
+
+    // Try to use the on-disk indexes (only if the region is one of ours)
+    const uint64_t offset = imgfs_file->header.unused_64;
+    const uint64_t capacity = imgfs_file->index.capacity;
+    struct imgfs_index_header index_header;
+    if (offset != 0
+        && imgfs_pread(imgfs_file, &index_header, sizeof(index_header), offset) == ERR_NONE
+        && memcmp(index_header.magic, IMGFS_INDEX_MAGIC, IMGFS_INDEX_MAGIC_SIZE) == 0
+        && index_header.capacity == capacity) {
+        set_offsets(imgfs_file, offset);
+
+        // Up to date: the buckets (and free extents) can be used as they are
+        if (index_header.version == imgfs_file->header.version
+            && imgfs_pread(imgfs_file, imgfs_file->index.buckets, capacity * sizeof(uint32_t),
+                           imgfs_file->index.offset) == ERR_NONE
+            && imgfs_pread(imgfs_file, imgfs_file->content_index.buckets, capacity * sizeof(uint32_t),
+                           imgfs_file->content_index.offset) == ERR_NONE
+            && buckets_valid(imgfs_file, &imgfs_file->index)
+            && buckets_valid(imgfs_file, &imgfs_file->content_index)) {
+            return imgfs_extents_load(imgfs_file, extents_offset(imgfs_file), 1, writable);
+        }
+    }
+
+    // Missing, stale or corrupted indexes: rebuild them from the metadata
+    memset(imgfs_file->index.buckets, 0, capacity * sizeof(uint32_t));
+    memset(imgfs_file->content_index.buckets, 0, capacity * sizeof(uint32_t));
+    for (size_t i = 0; i < imgfs_file->header.max_files; ++i) {
+        if (imgfs_file->metadata[i].is_valid) {
+            place(imgfs_file, &imgfs_file->index, i);
+            place(imgfs_file, &imgfs_file->content_index, i);
+        }
+    }
+
+    if (imgfs_file->index.offset != 0 && writable) {
+        ret = write_region(imgfs_file);
+        if (ret != ERR_NONE) return ret;
+    }
+
+    return imgfs_extents_load(imgfs_file, extents_offset(imgfs_file), 0, writable);
+}
+
+int imgfs_index_find(const struct imgfs_file* imgfs_file, const char* img_id, size_t* index)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(imgfs_file->index.buckets);
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(index);
+
+    const struct imgfs_index* table = &imgfs_file->index;
+    const uint64_t mask = table->capacity - 1;
+    uint64_t bucket = hash_img_id(img_id) & mask;
+
+    // Probe until a free bucket; entries are checked against the metadata
+    while (table->buckets[bucket] != 0) {
+        const size_t i = table->buckets[bucket] - 1;
+        if (imgfs_file->metadata[i].is_valid
+            && strncmp(img_id, imgfs_file->metadata[i].img_id, MAX_IMG_ID + 1) == 0) {
+            *index = i;
+            return ERR_NONE;
+        }
+        bucket = (bucket + 1) & mask;
+    }
+
+    return ERR_IMAGE_NOT_FOUND;
+}
+
+int imgfs_index_find_content(const struct imgfs_file* imgfs_file, const unsigned char* sha,
+                             size_t except, size_t* index)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(imgfs_file->content_index.buckets);
+    M_REQUIRE_NON_NULL(sha);
+    M_REQUIRE_NON_NULL(index);
+
+    const struct imgfs_index* table = &imgfs_file->content_index;
+    const uint64_t mask = table->capacity - 1;
+    uint64_t bucket = hash_sha(sha) & mask;
+
+    // Probe until a free bucket; entries are checked against the metadata
+    while (table->buckets[bucket] != 0) {
+        const size_t i = table->buckets[bucket] - 1;
+        if (i != except && imgfs_file->metadata[i].is_valid
+            && memcmp(sha, imgfs_file->metadata[i].SHA, SHA256_DIGEST_LENGTH) == 0) {
+            *index = i;
+            return ERR_NONE;
+        }
+        bucket = (bucket + 1) & mask;
+    }
+
+    return ERR_IMAGE_NOT_FOUND;
+}
+
+int imgfs_index_insert(struct imgfs_file* imgfs_file, size_t index)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(imgfs_file->index.buckets);
+    M_REQUIRE_NON_NULL(imgfs_file->content_index.buckets);
+    M_REQUIRE_NON_NULL(imgfs_file->sorted.slots);
+    if (index >= imgfs_file->header.max_files) return ERR_INVALID_ARGUMENT;
+
+    // Both tables in memory are updated even if a write fails
+    sorted_insert(imgfs_file, index);
+    const int ret = write_bucket(imgfs_file, &imgfs_file->index, place(imgfs_file, &imgfs_file->index, index));
+    const int written = write_bucket(imgfs_file, &imgfs_file->content_index,
+                                     place(imgfs_file, &imgfs_file->content_index, index));
+    return ret != ERR_NONE ? ret : written;
+}
+
+int imgfs_index_remove(struct imgfs_file* imgfs_file, size_t index)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(imgfs_file->index.buckets);
+    M_REQUIRE_NON_NULL(imgfs_file->content_index.buckets);
+    M_REQUIRE_NON_NULL(imgfs_file->sorted.slots);
+    if (index >= imgfs_file->header.max_files) return ERR_INVALID_ARGUMENT;
+
+    // Both tables in memory are updated even if a write fails
+    sorted_remove(imgfs_file, index);
+    const int ret = unplace(imgfs_file, &imgfs_file->index, index);
+    const int removed = unplace(imgfs_file, &imgfs_file->content_index, index);
+    return ret != ERR_NONE ? ret : removed;
+}
+
+size_t imgfs_index_rank(const struct imgfs_file* imgfs_file, const char* img_id, int after)
+{
+    if (imgfs_file == NULL || imgfs_file->sorted.slots == NULL || img_id == NULL) return 0;
+
+    // Binary search of the first one not before img_id (or after it)
+    size_t low = 0;
+    size_t high = imgfs_file->sorted.nb;
+    while (low < high) {
+        const size_t mid = low + (high - low) / 2;
+        const int cmp = strncmp(imgfs_file->metadata[imgfs_file->sorted.slots[mid]].img_id, img_id, MAX_IMG_ID + 1);
+        if (cmp < 0 || (after && cmp == 0)) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+int imgfs_index_sync(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    if (imgfs_file->index.offset == 0) return ERR_NONE;
+
+    return write_index_header(imgfs_file);
+}
+
+void imgfs_index_free(struct imgfs_file* imgfs_file)
+{
+    if (imgfs_file != NULL) {
+        free(imgfs_file->index.buckets);
+        free(imgfs_file->content_index.buckets);
+        zero_init_var(imgfs_file->index);
+        zero_init_var(imgfs_file->content_index);
+        free(imgfs_file->sorted.slots);
+        zero_init_var(imgfs_file->sorted);
+        imgfs_extents_free(imgfs_file);
+    }
+}
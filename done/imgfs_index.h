@@ -0,0 +1,135 @@
+/**
+ * @file imgfs_index.h
+ * @brief Hash indexes from img_id and from content (SHA) to position in the metadata array.
+ *
+ * Two open addressing (linear probing) tables whose buckets store
+ * 1 + the position of an image in the metadata array (0 = free bucket):
+ * one keyed by img_id, one keyed by SHA (for deduplication).
+ * Files created by do_create() persist them right after the metadata;
+ * older files only get an in-memory copy, rebuilt by do_open().
+ *
+ * A third, in-memory only, index keeps the positions of the valid images
+ * sorted by img_id, so that listings can be paginated and filtered by
+ * prefix without scanning all the metadata.
+ */
+
+#pragma once
+
+#include "imgfs.h" // for struct imgfs_file, struct imgfs_index
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t, uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Number of buckets used to index max_files images.
+ *
+ * @param max_files The maximum number of images of the imgFS.
+ * @return The smallest power of two that is at least twice max_files.
+ */
+uint64_t imgfs_index_capacity(uint32_t max_files);
+
+/**
+ * @brief Size (in bytes) of the on-disk index region of an imgFS.
+ *
+ * @param max_files The maximum number of images of the imgFS.
+ * @return The size of the index header, the buckets of both tables and the free extents table.
+ */
+uint64_t imgfs_index_region_size(uint32_t max_files);
+
+/**
+ * @brief Creates an empty index and writes it at imgfs_file->header.unused_64.
+ *
+ * @param imgfs_file The main in-memory structure (header already filled)
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_index_create(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Loads the index of an opened imgFS. If the on-disk index is
+ *        missing or stale (version differs from header.version), it is
+ *        rebuilt from the metadata (and rewritten if the file is writable).
+ *
+ * @param imgfs_file The main in-memory structure (header and metadata already read)
+ * @param writable Whether the imgFS file was opened for writing.
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_index_load(struct imgfs_file* imgfs_file, int writable);
+
+/**
+ * @brief Finds the (valid) image with the given img_id.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param img_id The ID of the image to look for.
+ * @param index Where to put the position of the image in the metadata array.
+ * @return ERR_NONE if found, ERR_IMAGE_NOT_FOUND otherwise (or some other error code).
+ */
+int imgfs_index_find(const struct imgfs_file* imgfs_file, const char* img_id, size_t* index);
+
+/**
+ * @brief Finds a (valid) image, other than the one at position except, with the given SHA.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param sha The SHA256 of the content to look for.
+ * @param except The position of an image to ignore (e.g. the one being inserted).
+ * @param index Where to put the position of the image in the metadata array.
+ * @return ERR_NONE if found, ERR_IMAGE_NOT_FOUND otherwise (or some other error code).
+ */
+int imgfs_index_find_content(const struct imgfs_file* imgfs_file, const unsigned char* sha,
+                             size_t except, size_t* index);
+
+/**
+ * @brief Adds the image at position index (whose img_id and SHA are set) to the indexes.
+ *        The indexes in memory are updated even if writing them to the file fails.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param index The position of the image in the metadata array.
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_index_insert(struct imgfs_file* imgfs_file, size_t index);
+
+/**
+ * @brief Removes the image at position index from the indexes.
+ *        The indexes in memory are updated even if writing them to the file fails.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param index The position of the image in the metadata array.
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_index_remove(struct imgfs_file* imgfs_file, size_t index);
+
+/**
+ * @brief Rank, in img_id order, of the first image whose img_id is at least
+ *        (or, if after, greater than) the given one.
+ *        Its position in the metadata array is then imgfs_file->sorted.slots[rank]
+ *        (if rank < imgfs_file->sorted.nb).
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param img_id The img_id to compare to.
+ * @param after Whether an image with that very img_id is skipped.
+ * @return The rank, imgfs_file->sorted.nb if there is no such image.
+ */
+size_t imgfs_index_rank(const struct imgfs_file* imgfs_file, const char* img_id, int after);
+
+/**
+ * @brief Stamps the on-disk indexes with the current header version.
+ *        To be called once the header has been written.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_index_sync(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Frees the in-memory indexes.
+ *
+ * @param imgfs_file The main in-memory structure
+ */
+void imgfs_index_free(struct imgfs_file* imgfs_file);
+
+#ifdef __cplusplus
+}
+#endif
@@ -2,6 +2,31 @@
 #include <stdlib.h>
 #include "image_content.h"
 #include "image_dedup.h"
+#include "imgfs_extents.h"
+#include "imgfs_index.h"
+#include "imgfs_refs.h"
+#include "imgfs_slots.h"
+
+int do_insert_prepare(const char* image_buffer, size_t image_size, struct img_digest* digest)
+{
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(digest);
+
+    // Calculate the SHA code of the image_buffer
+    SHA256((const unsigned char *) image_buffer, image_size, digest->SHA);
+
+    // Width and height of the image
+    uint32_t width = 0;
+    uint32_t height = 0;
+    // Get the width and height of image with the get_resolution method
+    int ret = get_resolution(&height, &width, image_buffer, image_size);
+    if(ret) return ret;
+
+    digest->orig_res[0] = width;
+    digest->orig_res[1] = height;
+
+    return ERR_NONE;
+}
 
 int do_insert(const char* image_buffer, size_t image_size, const char* img_id, struct imgfs_file* imgfs_file)
 {
@@ -13,12 +38,86 @@ int do_insert(const char* image_buffer, size_t image_size, const char* img_id, s
     // If we can't insert any more files return error
     if (imgfs_file->header.nb_files >= imgfs_file->header.max_files) return ERR_IMGFS_FULL;
 
+    struct img_digest digest;
+    int ret = do_insert_prepare(image_buffer, image_size, &digest);
+    if (ret != ERR_NONE) return ret;
+
+    return do_insert_prepared(image_buffer, image_size, img_id, &digest, imgfs_file);
+}
+
+// What an insertion already changed, to undo it when a later step fails
+struct insert_undo {
+    struct img_metadata previous; // the free slot before it was filled
+    uint32_t nb_files; // header before the insertion
+    uint32_t version;
+    int own_blob; // the original was written by this insertion (not shared with a duplicate)
+    size_t nb_refs; // references taken on the blobs, by increasing resolution
+    int taken; // the slot was marked as used
+    int indexed; // the image was (maybe partly) added to the indexes
+};
+
+/*******************************************************************
+ * Gives back what a failed insertion in slot index took, then restores
+ * its metadata and the header, in memory and as far as possible in the
+ * file (it may already hold them, e.g. when mapped).
+ */
+static void undo_insert(struct imgfs_file* imgfs_file, size_t index, const struct insert_undo* undo)
+{
+    const struct img_metadata* md = &imgfs_file->metadata[index];
+
+    // Both need the metadata of the new image
+    if (undo->indexed) imgfs_index_remove(imgfs_file, index);
+    for (size_t r = 0, n = 0; r < NB_RES && n < undo->nb_refs; ++r) {
+        if (md->offset[r] != 0) {
+            int dead = 0;
+            imgfs_refs_put(imgfs_file, md->offset[r], &dead);
+            ++n;
+        }
+    }
+    if (undo->taken) imgfs_slots_release(imgfs_file, index);
+
+    // The space of the original can be reused at once
+    if (undo->own_blob && imgfs_file->extents.table != NULL) {
+        imgfs_extents_release(imgfs_file, md->offset[ORIG_RES], md->size[ORIG_RES]);
+    }
+
+    imgfs_file->metadata[index] = undo->previous;
+    imgfs_file->header.nb_files = undo->nb_files;
+    imgfs_file->header.version = undo->version;
+    imgfs_write_header(imgfs_file);
+    imgfs_write_metadata(imgfs_file, index);
+}
+
+int do_insert_prepared(const char* image_buffer, size_t image_size, const char* img_id,
+                       const struct img_digest* digest, struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(digest);
+
+    // If we can't insert any more files return error
+    if (imgfs_file->header.nb_files >= imgfs_file->header.max_files) return ERR_IMGFS_FULL;
+
     size_t i = 0;
-    // Find index where the metadata is not valid
-    while (i < imgfs_file->header.max_files && imgfs_file->metadata[i].is_valid) ++i;
+    // Find index where the metadata is not valid (in the bitmap of the free slots)
+    int ret = imgfs_slots_find(imgfs_file, &i);
+    if (ret == ERR_IMGFS_FULL) {
+        // Not full according to the header: some metadata was freed behind our back
+        ret = imgfs_slots_build(imgfs_file);
+        if (ret == ERR_NONE) ret = imgfs_slots_find(imgfs_file, &i);
+    }
+    if (ret != ERR_NONE) return ret;
+
+    struct insert_undo undo = {
+        .previous = imgfs_file->metadata[i],
+        .nb_files = imgfs_file->header.nb_files,
+        .version = imgfs_file->header.version
+    };
 
-    // Calculate the SHA code of the image_buffer and copy it to the metadata
-    SHA256((const unsigned char *) image_buffer, image_size, imgfs_file->metadata[i].SHA);
+    // Copy the SHA code of the image_buffer to the metadata
+    memcpy(imgfs_file->metadata[i].SHA, digest->SHA, SHA256_DIGEST_LENGTH);
 
     // Copy the given image id to the metadata
     strncpy(imgfs_file->metadata[i].img_id, img_id, MAX_IMG_ID + 1);
@@ -28,36 +127,31 @@ int do_insert(const char* image_buffer, size_t image_size, const char* img_id, s
     imgfs_file->metadata[i].size[SMALL_RES] = 0;
     imgfs_file->metadata[i].size[THUMB_RES] = 0;
 
-    // Width and height of the image
-    uint32_t width = 0;
-    uint32_t height = 0;
-    // Get the width and height of image with the get_resolution method
-    int ret = get_resolution(&height, &width, image_buffer, image_size);
-    if(ret) return ret;
-
     // Update width and height in the metadata
-    imgfs_file->metadata[i].orig_res[0] = width;
-    imgfs_file->metadata[i].orig_res[1] = height;
+    imgfs_file->metadata[i].orig_res[0] = digest->orig_res[0];
+    imgfs_file->metadata[i].orig_res[1] = digest->orig_res[1];
 
     // Check for if the duplicate of this image exists
     ret = do_name_and_content_dedup(imgfs_file, (uint32_t) i);
-    if(ret) return ret;
+    if (ret != ERR_NONE) {
+        undo_insert(imgfs_file, i, &undo);
+        return ret;
+    }
 
     // If there are no duplicates, we have to update the offset of the image
     if(imgfs_file->metadata[i].offset[ORIG_RES] == 0) {
-        // Move file position indicator to the end of the file (where we add the new image)
-        if (fseek(imgfs_file->file, 0, SEEK_END) != 0) return ERR_IO;
-
-        long off = ftell(imgfs_file->file); // Offset of the end of the file
-        if (off == -1) return ERR_IO;
-
         // Update offset field of the metadata
         imgfs_file->metadata[i].offset[THUMB_RES] = 0;
         imgfs_file->metadata[i].offset[SMALL_RES] = 0;
-        imgfs_file->metadata[i].offset[ORIG_RES] = (uint64_t) off;
 
-        // Write the contents of the buffer at the end of the file
-        if (fwrite(image_buffer, image_size, 1, imgfs_file->file) != 1) return ERR_IO;
+        // Write the contents of the buffer in free space (or at the end of the file)
+        ret = imgfs_write_blob(imgfs_file, image_buffer, (uint32_t) image_size, &imgfs_file->metadata[i].offset[ORIG_RES]);
+        if (ret != ERR_NONE) {
+            imgfs_file->metadata[i].offset[ORIG_RES] = 0;
+            undo_insert(imgfs_file, i, &undo);
+            return ret;
+        }
+        undo.own_blob = 1;
     }
 
     // Set the valid field of the metadata to 1
@@ -67,18 +161,31 @@ int do_insert(const char* image_buffer, size_t image_size, const char* img_id, s
     imgfs_file->header.nb_files += 1;
     imgfs_file->header.version += 1;
 
-    // Put the file position indicator at the start of the file (header start)
-    if (fseek(imgfs_file->file, 0, SEEK_SET) != 0) return ERR_IO;
+    // Write the contents of the header to the file
+    ret = imgfs_write_header(imgfs_file);
 
-    // Write the contents of the header from the file
-    if (fwrite(&(imgfs_file->header), sizeof(struct imgfs_header), 1, imgfs_file->file) != 1) return ERR_IO;
+    // Write the contents of the metadata at index i to the file
+    if (ret == ERR_NONE) ret = imgfs_write_metadata(imgfs_file, i);
 
-    // Put the file position indicator at the correct position in the metadata
-    long off = (long) (sizeof(struct imgfs_header) + i * sizeof(struct img_metadata));
-    if (fseek(imgfs_file->file, off, SEEK_SET) != 0) return ERR_IO;
+    // The slot is now used, and so are its blobs (maybe shared with a duplicate)
+    if (ret == ERR_NONE) {
+        imgfs_slots_take(imgfs_file, i);
+        undo.taken = 1;
+    }
+    for (size_t r = 0; r < NB_RES && ret == ERR_NONE; ++r) {
+        if (imgfs_file->metadata[i].offset[r] != 0) {
+            ret = imgfs_refs_get(imgfs_file, imgfs_file->metadata[i].offset[r]);
+            if (ret == ERR_NONE) ++undo.nb_refs;
+        }
+    }
 
-    // Write the contents of the metadata at index i from the file
-    if (fwrite(&imgfs_file->metadata[i], sizeof(struct img_metadata), 1, imgfs_file->file) != 1) return ERR_IO;
+    // Add the image to the img_id and content indexes and mark them as up to date
+    if (ret == ERR_NONE) {
+        undo.indexed = 1;
+        ret = imgfs_index_insert(imgfs_file, i);
+    }
+    if (ret == ERR_NONE) ret = imgfs_index_sync(imgfs_file);
 
-    return ERR_NONE;
+    if (ret != ERR_NONE) undo_insert(imgfs_file, i, &undo);
+    return ret;
 }
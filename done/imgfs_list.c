@@ -1,8 +1,27 @@
 #include "imgfs.h"
+#include "imgfs_index.h"
 #include "util.h"
-#include<json-c/json.h>
+#include "json_writer.h"
 #include <string.h>
 
+// Room for the list of nb images, most of the time
+#define LIST_JSON_SIZE_HINT(nb) (32 + (size_t) (nb) * 16)
+
+/**********************************************************************
+ * Hands the text of writer over to *json (or frees it on error).
+ ********************************************************************** */
+static int to_json_string(struct json_writer* writer, char** json)
+{
+    const int ret = json_writer_finish(writer);
+    if (ret != ERR_NONE) {
+        json_writer_free(writer);
+        return ret;
+    }
+
+    *json = writer->buffer;
+    return ERR_NONE;
+}
+
 int do_list(const struct imgfs_file* imgfs_file, enum do_list_mode output_mode, char** json)
 {
     M_REQUIRE_NON_NULL(imgfs_file);
@@ -28,65 +47,136 @@ int do_list(const struct imgfs_file* imgfs_file, enum do_list_mode output_mode,
         }
         break;
     case JSON: {
-        //Create json object using proper function
-        json_object* obj = json_object_new_object();
-        if (obj == NULL) return ERR_RUNTIME;
-
-        //Create json array using proper function
-        json_object* array = json_object_new_array();
-        if (array == NULL) {
-            json_object_put(obj);
-            return ERR_RUNTIME;
-        }
+        M_REQUIRE_NON_NULL(json);
 
-        // Add the array to the JSON object
-        if (json_object_object_add(obj, "Images", array) != 0) {
-            json_object_put(array);
-            json_object_put(obj);
-            return ERR_RUNTIME;
-        }
-
-        //Iterate to find a valid metadata in the imgfs_file
+        // Written straight into one buffer (same text as json-c's spaced format)
+        struct json_writer writer;
+        const int ret = json_writer_init(&writer, LIST_JSON_SIZE_HINT(imgfs_file->header.nb_files));
+        if (ret != ERR_NONE) return ret;
+        json_writer_literal(&writer, "{ \"Images\": [ ");
 
         size_t remaining = imgfs_file->header.nb_files; // number of existing files
 
-        // Look for metadata and exit loop if all metadata has been printed
+        // Look for metadata and exit loop if all metadata has been written
         for (size_t i = 0 ; i < imgfs_file->header.max_files && remaining > 0; ++i) {
             if(imgfs_file->metadata[i].is_valid) {
-                // If you find a valide metadata create a json_string
-                json_object* string = json_object_new_string(imgfs_file->metadata[i].img_id);
-                if (string == NULL) {
-                    json_object_put(obj);
-                    return ERR_RUNTIME;
-                }
-                // Add the string to the array
-                json_object_array_add(array, string);
+                if (remaining != imgfs_file->header.nb_files) json_writer_literal(&writer, ", ");
+                json_writer_string(&writer, imgfs_file->metadata[i].img_id, MAX_IMG_ID + 1);
                 --remaining;
             }
         }
+        if (remaining != imgfs_file->header.nb_files) json_writer_literal(&writer, " ");
+        json_writer_literal(&writer, "] }");
 
-        // Now need to convert the json_ojec to json_string
-        const char* str = json_object_to_json_string(obj);
-        if(str == NULL) {
-            json_object_put(obj);
-            return ERR_RUNTIME;
-        }
+        return to_json_string(&writer, json);
+    }
+    default:
+        break;
+    }
 
-        *json = calloc(strlen(str) + 1, 1);
-        if (*json == NULL) {
-            json_object_put(obj);
-            return ERR_OUT_OF_MEMORY;
-        }
+    return ERR_NONE;
+}
+
+int do_list_page(const struct imgfs_file* imgfs_file, const char* prefix, const char* after,
+                 size_t limit, char** json)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(imgfs_file->sorted.slots);
+    M_REQUIRE_NON_NULL(json);
+    if (limit == 0 || limit > LIST_MAX_LIMIT) return ERR_INVALID_ARGUMENT;
+    if (prefix == NULL) prefix = "";
+    if (after == NULL) after = "";
+    const size_t prefix_len = strlen(prefix);
 
-        strcpy(*json, str);
+    struct json_writer writer;
+    const int ret = json_writer_init(&writer, LIST_JSON_SIZE_HINT(limit));
+    if (ret != ERR_NONE) return ret;
+    json_writer_literal(&writer, "{ \"Images\": [ ");
 
-        //Free the the json_obj
-        json_object_put(obj);
-        break;
+    // Start at the first img_id with the prefix, or after the cursor if that is further
+    const struct imgfs_sorted* sorted = &imgfs_file->sorted;
+    size_t rank = imgfs_index_rank(imgfs_file, prefix, 0);
+    if (*after != '\0') {
+        const size_t after_rank = imgfs_index_rank(imgfs_file, after, 1);
+        if (after_rank > rank) rank = after_rank;
     }
-    default:
-        break;
+
+    // The img_id with the prefix are contiguous in that order
+    size_t nb = 0;
+    const char* last = NULL;
+    for (; rank < sorted->nb && nb < limit; ++rank, ++nb) {
+        const char* img_id = imgfs_file->metadata[sorted->slots[rank]].img_id;
+        if (strncmp(img_id, prefix, prefix_len) != 0) break;
+
+        if (nb > 0) json_writer_literal(&writer, ", ");
+        json_writer_string(&writer, img_id, MAX_IMG_ID + 1);
+        last = img_id;
+    }
+    json_writer_literal(&writer, nb > 0 ? " ]" : "]");
+
+    // Tell where the next page starts, if there is one
+    if (nb == limit && rank < sorted->nb
+        && strncmp(imgfs_file->metadata[sorted->slots[rank]].img_id, prefix, prefix_len) == 0) {
+        json_writer_literal(&writer, ", \"next\": ");
+        json_writer_string(&writer, last, MAX_IMG_ID + 1);
+    }
+    json_writer_literal(&writer, " }");
+
+    return to_json_string(&writer, json);
+}
+
+/**********************************************************************
+ * Writes the NDJSON record of img_id (JSON-escaped) into record, which
+ * has room for LIST_NDJSON_MAX_RECORD chars. Returns its length.
+ ********************************************************************** */
+static size_t ndjson_record(const char* img_id, char* record)
+{
+    struct json_writer writer;
+    json_writer_init_buffer(&writer, record, LIST_NDJSON_MAX_RECORD);
+    json_writer_literal(&writer, "{\"img_id\":");
+    json_writer_string(&writer, img_id, MAX_IMG_ID + 1);
+    json_writer_literal(&writer, "}\n");
+    return writer.len;
+}
+
+int do_list_ndjson(const struct imgfs_file* imgfs_file, const char* prefix, char* cursor,
+                   char* buffer, size_t size, size_t* len, int* done)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(imgfs_file->sorted.slots);
+    M_REQUIRE_NON_NULL(cursor);
+    M_REQUIRE_NON_NULL(buffer);
+    M_REQUIRE_NON_NULL(len);
+    M_REQUIRE_NON_NULL(done);
+    if (size < LIST_NDJSON_MAX_RECORD) return ERR_INVALID_ARGUMENT;
+    if (prefix == NULL) prefix = "";
+    const size_t prefix_len = strlen(prefix);
+
+    // Resume after the cursor: the images may have changed since the previous call
+    const struct imgfs_sorted* sorted = &imgfs_file->sorted;
+    size_t rank = imgfs_index_rank(imgfs_file, prefix, 0);
+    if (*cursor != '\0') {
+        const size_t after_rank = imgfs_index_rank(imgfs_file, cursor, 1);
+        if (after_rank > rank) rank = after_rank;
+    }
+
+    *len = 0;
+    *done = 0;
+    // Stop while there is still room for any record: the next call goes on
+    while (size - *len >= LIST_NDJSON_MAX_RECORD) {
+        if (rank == sorted->nb) break;
+        const char* img_id = imgfs_file->metadata[sorted->slots[rank]].img_id;
+        if (strncmp(img_id, prefix, prefix_len) != 0) break;
+
+        *len += ndjson_record(img_id, buffer + *len);
+        strncpy(cursor, img_id, MAX_IMG_ID);
+        cursor[MAX_IMG_ID] = '\0';
+        ++rank;
     }
+    *done = rank == sorted->nb
+            || strncmp(imgfs_file->metadata[sorted->slots[rank]].img_id, prefix, prefix_len) != 0;
 
     return ERR_NONE;
 }
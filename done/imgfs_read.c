@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "image_content.h"
+#include "imgfs_index.h"
 
 int do_read(const char* img_id, int resolution, char** image_buffer, uint32_t* image_size, struct imgfs_file* imgfs_file)
 {
@@ -12,19 +13,14 @@ int do_read(const char* img_id, int resolution, char** image_buffer, uint32_t* i
 
     size_t i = 0;
     // Find index of metadata that has the same "img_id" as the one passed as argument
+    int ret = imgfs_index_find(imgfs_file, img_id, &i);
+    if (ret != ERR_NONE) return ret;
 
-    while (i < imgfs_file->header.max_files
-           && strcmp(img_id, imgfs_file->metadata[i].img_id) != 0) {
-        ++i;
-    }
-    // No image with the same image image id found
-    if (i >= imgfs_file->header.max_files) return ERR_IMAGE_NOT_FOUND;
-
-    int ret = ERR_NONE; // Return value of lazily_resize
     if (resolution == SMALL_RES || resolution == THUMB_RES) {
-        // If image doesn't exist in the requested resolution call lazily_resize
+        // If image doesn't exist in the requested resolution, create it (and the
+        // other missing ones at the same time: the original is decoded anyway)
         if (imgfs_file->metadata[i].offset[resolution] == 0 || imgfs_file->metadata[i].size[resolution] == 0) {
-            ret = lazily_resize(resolution, imgfs_file, i);
+            ret = lazily_resize_all(imgfs_file, i);
             // Return error if laziliy resize failed
             if (ret) return ret;
         }
@@ -37,11 +33,9 @@ int do_read(const char* img_id, int resolution, char** image_buffer, uint32_t* i
     *image_buffer = calloc(1, size); // Dynamically allocate memory region to read contents of image file
     if (*image_buffer == NULL) return ERR_OUT_OF_MEMORY;
 
-    // Move file position indicator to the image we want to read
-    if (fseek(imgfs_file->file, (long) off, SEEK_SET) != 0) return ERR_IO;
-
-    // Read image file and place its contents in the buffer
-    if (fread(*image_buffer, size, 1, imgfs_file->file) != 1) return ERR_IO;
+    // Read image file at its offset (positional read) and place its contents in the buffer
+    ret = imgfs_pread(imgfs_file, *image_buffer, size, off);
+    if (ret != ERR_NONE) return ret;
 
     // As no errors have occured, correctly change the image size field
     *image_size = (uint32_t) size;
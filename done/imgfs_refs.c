@@ -0,0 +1,146 @@
+/**
+ * @file imgfs_refs.c
+ * @brief Reference counts of the blobs of an imgFS.
+ */
+
+#include "imgfs_refs.h"
+#include "util.h"
+
+#include <stdlib.h> // for calloc, free
+#include <string.h> // for memset
+
+#define OFFSET_HASH_MULTIPLIER 0x9E3779B97F4A7C15ULL
+
+/*******************************************************************
+ * Home bucket of the blob at offset.
+ */
+static uint64_t home_bucket(const struct imgfs_refs* refs, uint64_t offset)
+{
+    return (offset * OFFSET_HASH_MULTIPLIER) & (refs->capacity - 1);
+}
+
+/*******************************************************************
+ * Bucket of the blob at offset: either its own or the free one where it would go.
+ */
+static uint64_t find_bucket(const struct imgfs_refs* refs, uint64_t offset)
+{
+    const uint64_t mask = refs->capacity - 1;
+    uint64_t bucket = home_bucket(refs, offset);
+
+    // Blob offsets are never 0 (the header is there): 0 marks a free bucket
+    while (refs->offsets[bucket] != 0 && refs->offsets[bucket] != offset) bucket = (bucket + 1) & mask;
+
+    return bucket;
+}
+
+/*******************************************************************
+ * Removes the blob in the given bucket
+ * (backward shift deletion, to keep probe sequences without holes).
+ */
+static void remove_bucket(struct imgfs_refs* refs, uint64_t hole)
+{
+    const uint64_t mask = refs->capacity - 1;
+
+    refs->offsets[hole] = 0;
+    refs->counts[hole] = 0;
+    for (uint64_t next = (hole + 1) & mask; refs->offsets[next] != 0; next = (next + 1) & mask) {
+        const uint64_t home = home_bucket(refs, refs->offsets[next]);
+        // The entry may move if its home is not (cyclically) in ]hole, next]
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            refs->offsets[hole] = refs->offsets[next];
+            refs->counts[hole] = refs->counts[next];
+            refs->offsets[next] = 0;
+            refs->counts[next] = 0;
+            hole = next;
+        }
+    }
+    --refs->nb;
+}
+
+int imgfs_refs_build(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+
+    struct imgfs_refs* refs = &imgfs_file->refs;
+    zero_init_ptr(refs);
+
+    // At most one blob per resolution per image, with a load factor of at most 1/2
+    refs->capacity = 1;
+    while (refs->capacity < 2 * NB_RES * (uint64_t) imgfs_file->header.max_files) refs->capacity <<= 1;
+    refs->offsets = calloc(refs->capacity, sizeof(uint64_t));
+    refs->counts = calloc(refs->capacity, sizeof(uint32_t));
+    if (refs->offsets == NULL || refs->counts == NULL) return ERR_OUT_OF_MEMORY;
+
+    for (size_t i = 0; i < imgfs_file->header.max_files; ++i) {
+        const struct img_metadata* md = &imgfs_file->metadata[i];
+        for (size_t r = 0; md->is_valid && r < NB_RES; ++r) {
+            if (md->offset[r] != 0) {
+                int ret = imgfs_refs_get(imgfs_file, md->offset[r]);
+                if (ret != ERR_NONE) return ret;
+            }
+        }
+    }
+
+    return ERR_NONE;
+}
+
+int imgfs_refs_get(struct imgfs_file* imgfs_file, uint64_t offset)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->refs.offsets);
+    if (offset == 0) return ERR_INVALID_ARGUMENT;
+
+    struct imgfs_refs* refs = &imgfs_file->refs;
+    const uint64_t bucket = find_bucket(refs, offset);
+
+    if (refs->offsets[bucket] == 0) {
+        // Keep a free bucket, so that probing always ends
+        if (refs->nb + 1 >= refs->capacity) return ERR_IMGFS_FULL;
+
+        refs->offsets[bucket] = offset;
+        ++refs->nb;
+    }
+    ++refs->counts[bucket];
+
+    return ERR_NONE;
+}
+
+int imgfs_refs_put(struct imgfs_file* imgfs_file, uint64_t offset, int* dead)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->refs.offsets);
+    M_REQUIRE_NON_NULL(dead);
+
+    struct imgfs_refs* refs = &imgfs_file->refs;
+    *dead = 0;
+    if (offset == 0) return ERR_NONE;
+
+    // Unknown blob (metadata changed behind our back): never declare it dead
+    const uint64_t bucket = find_bucket(refs, offset);
+    if (refs->offsets[bucket] == 0) return ERR_NONE;
+
+    if (--refs->counts[bucket] == 0) {
+        remove_bucket(refs, bucket);
+        *dead = 1;
+    }
+
+    return ERR_NONE;
+}
+
+uint32_t imgfs_refs_count(const struct imgfs_file* imgfs_file, uint64_t offset)
+{
+    if (imgfs_file == NULL || imgfs_file->refs.offsets == NULL || offset == 0) return 0;
+
+    const uint64_t bucket = find_bucket(&imgfs_file->refs, offset);
+    return imgfs_file->refs.counts[bucket];
+}
+
+void imgfs_refs_free(struct imgfs_file* imgfs_file)
+{
+    if (imgfs_file != NULL) {
+        free(imgfs_file->refs.offsets);
+        free(imgfs_file->refs.counts);
+        zero_init_var(imgfs_file->refs);
+    }
+}
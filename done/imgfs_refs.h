@@ -0,0 +1,67 @@
+/**
+ * @file imgfs_refs.h
+ * @brief Reference counts of the blobs of an imgFS.
+ *
+ * Deduplicated images share their blobs (same offsets): each blob, known
+ * by its offset, counts the valid images that use it, so that do_delete()
+ * knows when a blob becomes garbage and can free its space at once.
+ * The counts only live in memory (a hash table keyed by offset) and are
+ * built from the metadata by do_open() and do_create().
+ */
+
+#pragma once
+
+#include "imgfs.h" // for struct imgfs_file, struct imgfs_refs
+
+#include <stdint.h> // for uint32_t, uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Builds the reference counts of the blobs from the metadata.
+ *
+ * @param imgfs_file The main in-memory structure (header and metadata already read)
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_refs_build(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Adds a reference to the blob at offset (its first one if it is new).
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param offset The position of the blob in the file.
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_refs_get(struct imgfs_file* imgfs_file, uint64_t offset);
+
+/**
+ * @brief Removes a reference to the blob at offset.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param offset The position of the blob in the file.
+ * @param dead Set to 1 if that was the last reference (the blob is garbage), 0 otherwise.
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_refs_put(struct imgfs_file* imgfs_file, uint64_t offset, int* dead);
+
+/**
+ * @brief Number of references to the blob at offset.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param offset The position of the blob in the file.
+ * @return The number of valid images using the blob (0 if unknown).
+ */
+uint32_t imgfs_refs_count(const struct imgfs_file* imgfs_file, uint64_t offset);
+
+/**
+ * @brief Frees the in-memory reference counts.
+ *
+ * @param imgfs_file The main in-memory structure
+ */
+void imgfs_refs_free(struct imgfs_file* imgfs_file);
+
+#ifdef __cplusplus
+}
+#endif
@@ -5,15 +5,25 @@
  * @author Konstantinos Prasopoulos
  */
 
+#define _GNU_SOURCE // for pthread_rwlockattr_setkind_np
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h> // uint16_t
+#include <inttypes.h> // PRIu32
+#include <limits.h> // INT_MAX
 
 #include "error.h"
 #include "util.h" // atouint16
 #include "imgfs.h"
+#include "imgfs_gbcollect.h"
+#include "imgfs_index.h"
 #include "http_net.h"
+#include "resize_pool.h"
+#include "derived_cache.h"
+#include "image_cache.h"
+#include "image_content.h"
 #include "imgfs_server_service.h"
 
 #include <vips/vips.h>
@@ -22,13 +32,54 @@
 
 // Main in-memory structure for imgFS
 static struct imgfs_file imgfs_file;
+static const char* imgfs_path; // to reopen the imgFS after a compaction
+static int gc_running; // a compaction is ongoing (protected by gc_mutex)
 static uint16_t server_port;
-static pthread_mutex_t mutex;
+// Readers (list, read of an existing resolution) share the imgFS, writers have it alone
+static pthread_rwlock_t imgfs_lock;
+static pthread_mutex_t gc_mutex;
+// Creates the thumbnails of the inserted images in the background
+static struct resize_pool resize_pool;
+
+#define RESIZE_WORKERS 2
+
+// Images resized to the other resolutions asked for (res=WxH)
+static struct derived_cache derived_cache;
+
+#define DERIVED_CACHE_ENTRIES 4096
+#define DERIVED_CACHE_CAPACITY (64 * 1024 * 1024)
+#define UNBOUNDED_HEIGHT 10000000 // VIPS_MAX_COORD: only the width limits the resizing
+
+// Images recently read, served without the imgFS lock
+static struct image_cache image_cache;
+
+#define IMAGE_CACHE_CAPACITY (32 * 1024 * 1024)
+
+// Serialized list, shared by the replies still sending it
+struct list_json {
+    char* text;
+    size_t len;
+    uint32_t version; // of the imgFS it was listed from
+    size_t refs; // the replies sending it, plus one while it is the latest (protected by list_mutex)
+};
+
+// Latest serialized list, rebuilt only once the imgFS changed (protected by list_mutex)
+static struct list_json* list_json;
+static pthread_mutex_t list_mutex;
+
+#define MAX_ETAG_SIZE 32
+
+#define LIST_DEFAULT_LIMIT 100 // images per page, when only after or prefix is given
+#define MAX_LIMIT_STR_SIZE 5
+#define MAX_FORMAT_STR_SIZE 8
+#define LIST_STREAM_CHUNK_SIZE (16 * 1024) // records sent per chunk (at most)
 
 #define URI_ROOT "/imgfs"
 
 #define MAX_RES_STR_SIZE 9
 
+#define GC_TMP_SUFFIX ".gc"
+
 /**********************************************************************
  * Sends error message.
  ********************************************************************** */
@@ -44,6 +95,21 @@ static int reply_error_msg(int connection, int error)
                       err_msg, strlen(err_msg));
 }
 
+/**********************************************************************
+ * Initializes imgfs_lock, preferring writers: a steady flow of reads
+ * must not starve inserts and deletes.
+ ********************************************************************** */
+static int init_imgfs_lock(void)
+{
+    pthread_rwlockattr_t attr;
+    if (pthread_rwlockattr_init(&attr) != 0) return ERR_THREADING;
+
+    int ret = pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP) == 0
+              && pthread_rwlock_init(&imgfs_lock, &attr) == 0 ? ERR_NONE : ERR_THREADING;
+    pthread_rwlockattr_destroy(&attr);
+    return ret;
+}
+
 /**********************************************************************
  * Sends 302 OK message.
  ********************************************************************** */
@@ -60,7 +126,9 @@ static int reply_302_msg(int connection)
 
 /********************************************************************//**
  * Startup function. Create imgFS file and load in-memory structure.
- * Pass the imgFS file name as argv[1] and optionnaly port number as argv[2]
+ * Pass the imgFS file name as argv[1] and optionnaly port number as argv[2],
+ * then optionally "-acceptors <nb>" and "-backlog <nb>" (see http_set_acceptors()),
+ * "-workers <nb>" and "-queue_size <nb>" (see http_set_workers())
  ********************************************************************** */
 int server_startup (int argc, char **argv)
 {
@@ -72,15 +140,80 @@ int server_startup (int argc, char **argv)
 
     char* filename = argv[1];
     M_REQUIRE_NON_NULL(filename);
+    imgfs_path = filename;
+    argc -= 2; argv += 2; // Skip program and file names
+
+    // Check if port number is given
+    uint16_t port = DEFAULT_LISTENING_PORT;
+    if (argc > 0 && argv[0][0] != '-') {
+        port = atouint16(argv[0]);
+        --argc; ++argv;
+    }
+
+    // Options of the event loops accepting the connections, and of the
+    // pool of workers handling the requests
+    size_t nb_acceptors = HTTP_DEFAULT_ACCEPTORS;
+    uint32_t backlog = HTTP_DEFAULT_BACKLOG;
+    size_t nb_workers = HTTP_DEFAULT_WORKERS;
+    size_t queue_size = HTTP_DEFAULT_QUEUE_SIZE;
+    while (argc > 0) {
+        if (strcmp("-acceptors", argv[0]) == 0) {
+            if (argc < 2) return ERR_NOT_ENOUGH_ARGUMENTS; // One argument for -acceptors
+            nb_acceptors = atouint32(argv[1]);
+            if (nb_acceptors == 0) return ERR_INVALID_ARGUMENT;
+            argc -= 2; argv += 2; // Go to next option
+        } else if (strcmp("-backlog", argv[0]) == 0) {
+            if (argc < 2) return ERR_NOT_ENOUGH_ARGUMENTS; // One argument for -backlog
+            backlog = atouint32(argv[1]);
+            if (backlog == 0 || backlog > INT_MAX) return ERR_INVALID_ARGUMENT;
+            argc -= 2; argv += 2; // Go to next option
+        } else if (strcmp("-workers", argv[0]) == 0) {
+            if (argc < 2) return ERR_NOT_ENOUGH_ARGUMENTS; // One argument for -workers
+            nb_workers = atouint32(argv[1]);
+            if (nb_workers == 0) return ERR_INVALID_ARGUMENT;
+            argc -= 2; argv += 2; // Go to next option
+        } else if (strcmp("-queue_size", argv[0]) == 0) {
+            if (argc < 2) return ERR_NOT_ENOUGH_ARGUMENTS; // One argument for -queue_size
+            queue_size = atouint32(argv[1]);
+            if (queue_size == 0) return ERR_INVALID_ARGUMENT;
+            argc -= 2; argv += 2; // Go to next option
+        } else {
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
+    int err = http_set_acceptors(nb_acceptors, (int) backlog);
+    if (err) return err;
+    err = http_set_workers(nb_workers, queue_size);
+    if (err) return err;
 
     // Open file in read and write mode
-    int err = do_open(filename, "rb+", &imgfs_file);
+    err = do_open_mapped(filename, "rb+", &imgfs_file);
     if (err) return err;
 
     print_header(&imgfs_file.header); fflush(stdout);
 
-    // Check if port number is given
-    uint16_t port = (argc == 3) ? atouint16(argv[2]) : DEFAULT_LISTENING_PORT;
+    // Initialize locks
+    if (init_imgfs_lock() != ERR_NONE) return ERR_THREADING;
+    if (pthread_mutex_init(&gc_mutex, NULL) != 0) return ERR_THREADING;
+    if (pthread_mutex_init(&list_mutex, NULL) != 0) return ERR_THREADING;
+
+    // Open (or create) the companion file of the resized images
+    char derived_path[FILENAME_MAX];
+    if (snprintf(derived_path, sizeof(derived_path), "%s" DERIVED_CACHE_SUFFIX, imgfs_path) >= (int) sizeof(derived_path)) {
+        return ERR_INVALID_FILENAME;
+    }
+    err = derived_cache_open(&derived_cache, derived_path, DERIVED_CACHE_ENTRIES, DERIVED_CACHE_CAPACITY);
+    if (err) return err;
+
+    err = image_cache_init(&image_cache, IMAGE_CACHE_CAPACITY, imgfs_file.header.version);
+    if (err) return err;
+
+    err = resize_pool_start(&resize_pool, &imgfs_file, &imgfs_lock, RESIZE_WORKERS);
+    if (err) return err;
+
+    // Last: the event loops and the workers handle the requests as soon
+    // as they are started, so everything they use must be ready
+    server_port = port;
     err = http_init(port, handle_http_message);
 
     // If initialization with the given port fails, try the default port
@@ -88,14 +221,11 @@ int server_startup (int argc, char **argv)
 
     if (err < 0 && port != DEFAULT_LISTENING_PORT) {
         port = DEFAULT_LISTENING_PORT;
+        server_port = port;
         err = http_init(port, handle_http_message);
         if (err < 0) return err;
     }
     printf("ImgFS server started on http://localhost:%u\n", port); fflush(stdout);
-    server_port = port;
-
-    // Initialize mutex
-    if (pthread_mutex_init(&mutex, NULL) != 0) return ERR_THREADING;
 
     return ERR_NONE;
 }
@@ -107,37 +237,293 @@ int server_startup (int argc, char **argv)
 void server_shutdown (void)
 {
     fprintf(stderr, "Shutting down...\n");
-    vips_shutdown();
+    // The HTTP workers and the resize workers may still be using vips
     http_close();
+    resize_pool_stop(&resize_pool);
+    vips_shutdown();
+    derived_cache_close(&derived_cache);
+    image_cache_free(&image_cache);
     do_close(&imgfs_file);
-    pthread_mutex_destroy(&mutex);
+    pthread_rwlock_destroy(&imgfs_lock);
+    pthread_mutex_destroy(&gc_mutex);
+    pthread_mutex_destroy(&list_mutex);
+    // No reply is left to send it
+    if (list_json != NULL) free(list_json->text);
+    free(list_json); list_json = NULL;
 }
 
 /**********************************************************************
- * Handles a list request
+ * Whether an If-None-Match value ("*", or a list of possibly weak
+ * entity tags) matches etag.
  ********************************************************************** */
-int handle_list_call(int connection)
+static int etag_matches(const struct http_string* if_none_match, const char* etag)
 {
-    char* joutput = NULL;
-    int ret;
+    const size_t etag_len = strlen(etag);
+    const char* p = if_none_match->val;
+    const char* const end = if_none_match->val + if_none_match->len;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == ',')) ++p;
+        if (end - p >= 2 && strncmp(p, "W/", 2) == 0) p += 2;
+        if (p < end && *p == '*') return 1;
+        if ((size_t) (end - p) >= etag_len && strncmp(p, etag, etag_len) == 0) return 1;
+        while (p < end && *p != ',') ++p;
+    }
+    return 0;
+}
 
-    // Prepare the json format of the imgfs file
-    if (pthread_mutex_lock(&mutex) != ERR_NONE) return reply_error_msg(connection, ERR_THREADING);
-    ret = do_list(&imgfs_file, JSON, &joutput);
-    if (pthread_mutex_unlock(&mutex) != ERR_NONE) return reply_error_msg(connection, ERR_THREADING);
+/**********************************************************************
+ * Handles a request for a page of the list (limit, after and/or prefix
+ * given): it costs the size of the page, not of the imgFS.
+ ********************************************************************** */
+static int handle_list_page_call(const char* limit_str, const char* after, const char* prefix, int connection)
+{
+    size_t limit = LIST_DEFAULT_LIMIT;
+    if (*limit_str != '\0') {
+        limit = atouint16(limit_str);
+        if (limit == 0 || limit > LIST_MAX_LIMIT) return reply_error_msg(connection, ERR_INVALID_ARGUMENT);
+    }
 
-    // If do_list reply an error
-    if(ret != ERR_NONE) {
-        if (joutput != NULL) free(joutput); joutput = NULL;
+    char* joutput = NULL;
+    if (pthread_rwlock_rdlock(&imgfs_lock) != ERR_NONE) return reply_error_msg(connection, ERR_THREADING);
+    int ret = do_list_page(&imgfs_file, prefix, after, limit, &joutput);
+    if (pthread_rwlock_unlock(&imgfs_lock) != ERR_NONE) ret = ERR_THREADING;
+    if (ret != ERR_NONE) {
+        free(joutput); joutput = NULL;
         return reply_error_msg(connection, ret);
     }
 
-    // Reply the json format of the file
     ret = http_reply(connection, HTTP_OK, "Content-Type: application/json\r\n", joutput, strlen(joutput));
     free(joutput); joutput = NULL;
     return ret < 0 ? reply_error_msg(connection, ret) : ERR_NONE;
 }
 
+/**********************************************************************
+ * Handles a request for the list as a stream of NDJSON records, sent
+ * in chunks as they are listed.
+ ********************************************************************** */
+static int handle_list_stream_call(const char* after, const char* prefix, int connection)
+{
+    int ret = http_reply_chunked(connection, HTTP_OK, "Content-Type: application/x-ndjson" HTTP_LINE_DELIM);
+    if (ret != ERR_NONE) return ret;
+
+    // One buffer of records at a time: the imgFS is not locked while they are sent
+    char buffer[LIST_STREAM_CHUNK_SIZE];
+    char cursor[MAX_IMG_ID + 1] = { 0 };
+    strncpy(cursor, after, MAX_IMG_ID);
+    int done = 0;
+    while (!done && ret == ERR_NONE) {
+        size_t len = 0;
+        if (pthread_rwlock_rdlock(&imgfs_lock) != ERR_NONE) return ERR_THREADING;
+        ret = do_list_ndjson(&imgfs_file, prefix, cursor, buffer, sizeof(buffer), &len, &done);
+        if (pthread_rwlock_unlock(&imgfs_lock) != ERR_NONE) return ERR_THREADING;
+        if (ret == ERR_NONE && len > 0) ret = http_send_chunk(connection, buffer, len);
+    }
+
+    // Without the last chunk, the client knows the list is incomplete
+    return ret == ERR_NONE ? http_send_chunk(connection, NULL, 0) : ret;
+}
+
+/**********************************************************************
+ * Drops a reference to list; the last one frees it. Must be called
+ * with list_mutex held.
+ ********************************************************************** */
+static void list_json_put(struct list_json* list)
+{
+    if (list != NULL && --list->refs == 0) {
+        free(list->text);
+        free(list);
+    }
+}
+
+/**********************************************************************
+ * Gets a reference to the list of the imgFS at version, rebuilt if it
+ * changed. Must be called with imgfs_lock held.
+ ********************************************************************** */
+static int list_json_get(uint32_t version, struct list_json** list)
+{
+    if (pthread_mutex_lock(&list_mutex) != ERR_NONE) return ERR_THREADING;
+
+    int ret = ERR_NONE;
+    if (list_json == NULL || list_json->version != version) {
+        struct list_json* latest = calloc(1, sizeof(*latest));
+        ret = latest == NULL ? ERR_OUT_OF_MEMORY : do_list(&imgfs_file, JSON, &latest->text);
+        if (ret == ERR_NONE) {
+            latest->len = strlen(latest->text);
+            latest->version = version;
+            latest->refs = 1;
+            // The replies still sending the previous one keep it
+            list_json_put(list_json);
+            list_json = latest;
+        } else {
+            free(latest);
+        }
+    }
+    if (ret == ERR_NONE) {
+        ++list_json->refs;
+        *list = list_json;
+    }
+
+    pthread_mutex_unlock(&list_mutex);
+    return ret;
+}
+
+/**********************************************************************
+ * Drops the reference of a reply to list.
+ ********************************************************************** */
+static void list_json_release(struct list_json* list)
+{
+    if (pthread_mutex_lock(&list_mutex) != ERR_NONE) return;
+    list_json_put(list);
+    pthread_mutex_unlock(&list_mutex);
+}
+
+/**********************************************************************
+ * Handles a list request
+ ********************************************************************** */
+int handle_list_call(struct http_message* msg, int connection)
+{
+    // Paginated: only that page
+    char limit_str[MAX_LIMIT_STR_SIZE + 1] = { 0 };
+    char after[MAX_IMG_ID + 1] = { 0 };
+    char prefix[MAX_IMG_ID + 1] = { 0 };
+    char format[MAX_FORMAT_STR_SIZE + 1] = { 0 };
+    if (http_get_var(&msg->uri, "limit", limit_str, MAX_LIMIT_STR_SIZE) < 0
+        || http_get_var(&msg->uri, "after", after, MAX_IMG_ID) < 0
+        || http_get_var(&msg->uri, "prefix", prefix, MAX_IMG_ID) < 0
+        || http_get_var(&msg->uri, "format", format, MAX_FORMAT_STR_SIZE) < 0) {
+        return reply_error_msg(connection, ERR_INVALID_ARGUMENT);
+    }
+
+    // Streamed: constant memory, whatever the number of images
+    if (*format != '\0') {
+        if (strcmp(format, "ndjson") != 0 || *limit_str != '\0') return reply_error_msg(connection, ERR_INVALID_ARGUMENT);
+        return handle_list_stream_call(after, prefix, connection);
+    }
+    if (*limit_str != '\0' || *after != '\0' || *prefix != '\0') {
+        return handle_list_page_call(limit_str, after, prefix, connection);
+    }
+
+    if (pthread_rwlock_rdlock(&imgfs_lock) != ERR_NONE) return reply_error_msg(connection, ERR_THREADING);
+    const uint32_t version = imgfs_file.header.version;
+
+    // The list is the same as long as the version is
+    char etag[MAX_ETAG_SIZE];
+    snprintf(etag, sizeof(etag), "\"imgfs-%" PRIu32 "\"", version);
+    char headers[MAX_ETAG_SIZE + 64];
+    snprintf(headers, sizeof(headers), "Content-Type: application/json" HTTP_LINE_DELIM "ETag: %s" HTTP_LINE_DELIM, etag);
+
+    // The client already has it: no body, so nothing to list
+    struct http_string if_none_match;
+    if (http_get_header(msg, "If-None-Match", &if_none_match) == 1 && etag_matches(&if_none_match, etag)) {
+        if (pthread_rwlock_unlock(&imgfs_lock) != ERR_NONE) return reply_error_msg(connection, ERR_THREADING);
+        const int ret = http_reply(connection, HTTP_NOT_MODIFIED, headers, "", 0);
+        return ret < 0 ? reply_error_msg(connection, ret) : ERR_NONE;
+    }
+
+    // Rebuild the json format of the imgfs file only if it changed (only reads it)
+    struct list_json* list = NULL;
+    int ret = list_json_get(version, &list);
+    if (pthread_rwlock_unlock(&imgfs_lock) != ERR_NONE && ret == ERR_NONE) ret = ERR_THREADING;
+    if (ret != ERR_NONE) {
+        if (list != NULL) list_json_release(list);
+        return reply_error_msg(connection, ret);
+    }
+
+    // Reply the json format of the file, sent from the shared copy
+    ret = http_reply(connection, HTTP_OK, headers, list->text, list->len);
+    list_json_release(list);
+    return ret < 0 ? reply_error_msg(connection, ret) : ERR_NONE;
+}
+
+/**********************************************************************
+ * Whether reading img_id in the given resolution would first have to
+ * create (write) it; if so, index is set to its slot.
+ * Must be called with imgfs_lock held.
+ ********************************************************************** */
+static int needs_resize(const char* img_id, int resolution, size_t* index)
+{
+    // Unknown image: do_read only reports the error
+    if (resolution == ORIG_RES || imgfs_index_find(&imgfs_file, img_id, index) != ERR_NONE) return 0;
+
+    const struct img_metadata* md = &imgfs_file.metadata[*index];
+    return md->offset[resolution] == 0 || md->size[resolution] == 0;
+}
+
+/**********************************************************************
+ * Reads the original of img_id (and its SHA). Must be called with
+ * imgfs_lock held.
+ ********************************************************************** */
+static int read_original(const char* img_id, unsigned char* sha, char** buffer, uint32_t* size)
+{
+    size_t index = 0;
+    int ret = imgfs_index_find(&imgfs_file, img_id, &index);
+    if (ret != ERR_NONE) return ret;
+
+    const struct img_metadata* md = &imgfs_file.metadata[index];
+    memcpy(sha, md->SHA, SHA256_DIGEST_LENGTH);
+    *size = md->size[ORIG_RES];
+    *buffer = malloc(*size);
+    if (*buffer == NULL) return ERR_OUT_OF_MEMORY;
+
+    return imgfs_pread(&imgfs_file, *buffer, *size, md->offset[ORIG_RES]);
+}
+
+/**********************************************************************
+ * Handles a read request in another resolution than the fixed ones:
+ * from the derived images cache, or resized (then cached) on the fly.
+ ********************************************************************** */
+static int handle_read_derived(const char* img_id, uint16_t width, uint16_t height, int connection)
+{
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    char* original = NULL;
+    uint32_t original_size = 0;
+
+    // Cached by SHA: a deleted (or replaced) image is never served from it
+    if (pthread_rwlock_rdlock(&imgfs_lock) != ERR_NONE) return reply_error_msg(connection, ERR_THREADING);
+    size_t index = 0;
+    int ret = imgfs_index_find(&imgfs_file, img_id, &index);
+    if (ret == ERR_NONE) memcpy(sha, imgfs_file.metadata[index].SHA, SHA256_DIGEST_LENGTH);
+    if (pthread_rwlock_unlock(&imgfs_lock) != ERR_NONE) return reply_error_msg(connection, ERR_THREADING);
+    if (ret != ERR_NONE) return reply_error_msg(connection, ret);
+
+    char* image_buffer = NULL;
+    uint32_t image_size = 0;
+    ret = derived_cache_get(&derived_cache, sha, width, height, &image_buffer, &image_size);
+    if (ret == ERR_NONE) {
+        ret = http_reply(connection, HTTP_OK, "Content-Type: image/jpeg\r\n", image_buffer, image_size);
+        free(image_buffer); image_buffer = NULL;
+        return ret < 0 ? reply_error_msg(connection, ret) : ERR_NONE;
+    }
+    if (ret != ERR_IMAGE_NOT_FOUND) return reply_error_msg(connection, ret);
+
+    // Not cached yet: resize it without the lock
+    if (pthread_rwlock_rdlock(&imgfs_lock) != ERR_NONE) return reply_error_msg(connection, ERR_THREADING);
+    ret = read_original(img_id, sha, &original, &original_size);
+    if (pthread_rwlock_unlock(&imgfs_lock) != ERR_NONE) ret = ERR_THREADING;
+    if (ret != ERR_NONE) {
+        free(original); original = NULL;
+        return reply_error_msg(connection, ret);
+    }
+
+    void* resized = NULL;
+    size_t resized_size = 0;
+    ret = create_resized_img(original, original_size, width, height != 0 ? height : UNBOUNDED_HEIGHT,
+                             &resized, &resized_size);
+    free(original); original = NULL;
+    if (ret != ERR_NONE) return reply_error_msg(connection, ret);
+
+    // Kept for the next requests of that size, if there is room: the
+    // reply does not depend on it
+    if (derived_cache_put(&derived_cache, sha, width, height, resized, (uint32_t) resized_size) != ERR_NONE) {
+        debug_printf("handle_read_derived(): %s %ux%u not cached\n", img_id, width, height);
+    }
+
+    ret = http_reply(connection, HTTP_OK, "Content-Type: image/jpeg\r\n", resized, resized_size);
+    g_free(resized); resized = NULL;
+    return ret < 0 ? reply_error_msg(connection, ret) : ERR_NONE;
+}
+
 /**********************************************************************
  * Handles a read request
  ********************************************************************** */
@@ -158,16 +544,54 @@ int handle_read_call(struct http_message* msg, int connection)
 
     // Converting res string to an int
     int resolution = resolution_atoi(res_str);
-    if (resolution == -1) return reply_error_msg(connection, ERR_RESOLUTIONS);
+    if (resolution == -1) {
+        // Or to any width and height
+        uint16_t width = 0;
+        uint16_t height = 0;
+        ret = derived_res_parse(res_str, &width, &height);
+        return ret != ERR_NONE ? reply_error_msg(connection, ret) : handle_read_derived(img_id, width, height, connection);
+    }
 
     // Create a buffer to send image
     char* image_buffer = NULL;
     uint32_t image_size = 0;
 
-    // Read the image
-    if (pthread_mutex_lock(&mutex) != ERR_NONE) return reply_error_msg(connection, ERR_THREADING);
-    int err = do_read(img_id, resolution, &image_buffer, &image_size, &imgfs_file);
-    if (pthread_mutex_unlock(&mutex) != ERR_NONE) return reply_error_msg(connection, ERR_THREADING);
+    // A hot image does not even need the imgFS
+    int err = image_cache_get(&image_cache, img_id, resolution, &image_buffer, &image_size);
+    if (err == ERR_NONE) {
+        ret = http_reply(connection, HTTP_OK, "Content-Type: image/jpeg\r\n", image_buffer, image_size);
+        free(image_buffer); image_buffer = NULL;
+        return ret < 0 ? reply_error_msg(connection, ret) : ERR_NONE;
+    }
+
+    // Read the image: in parallel with other readers if it exists in that resolution
+    err = ERR_NONE;
+    size_t index = 0;
+    uint32_t version = 0; // of what was read
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    if (pthread_rwlock_rdlock(&imgfs_lock) != ERR_NONE) return reply_error_msg(connection, ERR_THREADING);
+    int resize = needs_resize(img_id, resolution, &index);
+    if (!resize) err = do_read(img_id, resolution, &image_buffer, &image_size, &imgfs_file);
+    else memcpy(sha, imgfs_file.metadata[index].SHA, SHA256_DIGEST_LENGTH);
+    version = imgfs_file.header.version;
+    if (pthread_rwlock_unlock(&imgfs_lock) != ERR_NONE) return reply_error_msg(connection, ERR_THREADING);
+
+    // Resize it without the lock, once for all the concurrent reads of it
+    if (resize && resize_pool_resize(&resize_pool, index, resolution, sha) == ERR_NONE) {
+        if (pthread_rwlock_rdlock(&imgfs_lock) != ERR_NONE) return reply_error_msg(connection, ERR_THREADING);
+        resize = needs_resize(img_id, resolution, &index);
+        if (!resize) err = do_read(img_id, resolution, &image_buffer, &image_size, &imgfs_file);
+        version = imgfs_file.header.version;
+        if (pthread_rwlock_unlock(&imgfs_lock) != ERR_NONE) return reply_error_msg(connection, ERR_THREADING);
+    }
+
+    // Otherwise (e.g. the image was replaced meanwhile) do_read writes the resized image: alone
+    if (resize) {
+        if (pthread_rwlock_wrlock(&imgfs_lock) != ERR_NONE) return reply_error_msg(connection, ERR_THREADING);
+        err = do_read(img_id, resolution, &image_buffer, &image_size, &imgfs_file);
+        version = imgfs_file.header.version;
+        if (pthread_rwlock_unlock(&imgfs_lock) != ERR_NONE) return reply_error_msg(connection, ERR_THREADING);
+    }
 
     // If read fails reply an error
     if (err != ERR_NONE) {
@@ -175,6 +599,11 @@ int handle_read_call(struct http_message* msg, int connection)
         return reply_error_msg(connection, err);
     }
 
+    // A full (or failing) image cache only costs the next reads a lock
+    if (image_cache_put(&image_cache, img_id, resolution, version, image_buffer, image_size) != ERR_NONE) {
+        debug_printf("handle_read_call(): %s not cached\n", img_id);
+    }
+
     // Reply the requested image
     ret = http_reply(connection, HTTP_OK, "Content-Type: image/jpeg\r\n", image_buffer, image_size);
     free(image_buffer); image_buffer = NULL;
@@ -192,9 +621,14 @@ int handle_delete_call(struct http_message* msg, int connection)
     if (ret <= 0) return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
 
     // Delete the image
-    if (pthread_mutex_lock(&mutex) != ERR_NONE) return reply_error_msg(connection, ERR_THREADING);
+    if (pthread_rwlock_wrlock(&imgfs_lock) != ERR_NONE) return reply_error_msg(connection, ERR_THREADING);
     ret = do_delete(img_id, &imgfs_file);
-    if (pthread_mutex_unlock(&mutex) != ERR_NONE) return reply_error_msg(connection, ERR_THREADING);
+    // Before anybody can read it again
+    if (ret == ERR_NONE) {
+        image_cache_invalidate(&image_cache, img_id);
+        image_cache_set_version(&image_cache, imgfs_file.header.version);
+    }
+    if (pthread_rwlock_unlock(&imgfs_lock) != ERR_NONE) return reply_error_msg(connection, ERR_THREADING);
 
     // If deletion failed reply an error
     if (ret != ERR_NONE) return reply_error_msg(connection, ret);
@@ -214,10 +648,21 @@ int handle_insert_call(struct http_message* msg, int connection)
     int ret = http_get_var(&msg->uri, "name", name, MAX_IMGFS_NAME);
     if (ret <= 0) return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
 
+    // Hash and decode the image without blocking anybody
+    struct img_digest digest;
+    ret = do_insert_prepare(msg->body.val, msg->body.len, &digest);
+    if (ret != ERR_NONE) return reply_error_msg(connection, ret);
+
     // Insert the image in the database
-    if (pthread_mutex_lock(&mutex) != ERR_NONE) return reply_error_msg(connection, ERR_THREADING);
-    ret = do_insert(msg->body.val, msg->body.len, name, &imgfs_file);
-    if (pthread_mutex_unlock(&mutex) != ERR_NONE) return reply_error_msg(connection, ERR_THREADING);
+    if (pthread_rwlock_wrlock(&imgfs_lock) != ERR_NONE) return reply_error_msg(connection, ERR_THREADING);
+    ret = do_insert_prepared(msg->body.val, msg->body.len, name, &digest, &imgfs_file);
+    // Then have its thumbnails created before they are asked for
+    size_t index = 0;
+    if (ret == ERR_NONE && imgfs_index_find(&imgfs_file, name, &index) == ERR_NONE) {
+        resize_pool_submit(&resize_pool, index, imgfs_file.metadata[index].SHA);
+    }
+    image_cache_set_version(&image_cache, imgfs_file.header.version);
+    if (pthread_rwlock_unlock(&imgfs_lock) != ERR_NONE) return reply_error_msg(connection, ERR_THREADING);
 
     // If inserting failed, reply an error
     if (ret != ERR_NONE) return reply_error_msg(connection, ret);
@@ -227,6 +672,96 @@ int handle_insert_call(struct http_message* msg, int connection)
     return ret < 0 ? reply_error_msg(connection, ret) : ERR_NONE;
 }
 
+/**********************************************************************
+ * Copies the remaining slots a few at a time, so that other requests
+ * are served in between, then swaps the files and reopens the imgFS.
+ ********************************************************************** */
+static int run_gc(struct imgfs_gc* gc, const char* tmp_path, int64_t* reclaimed)
+{
+    // Starting and copying only read the imgFS (the copy is ours alone)
+    if (pthread_rwlock_rdlock(&imgfs_lock) != ERR_NONE) return ERR_THREADING;
+    int ret = imgfs_gc_start(gc, &imgfs_file, tmp_path);
+    if (pthread_rwlock_unlock(&imgfs_lock) != ERR_NONE) return ERR_THREADING;
+    if (ret != ERR_NONE) return ret;
+
+    int done = 0;
+    while (!done && ret == ERR_NONE) {
+        if (pthread_rwlock_rdlock(&imgfs_lock) != ERR_NONE) return ERR_THREADING;
+        ret = imgfs_gc_step(gc, IMGFS_GC_STEP_SLOTS, &done);
+        if (pthread_rwlock_unlock(&imgfs_lock) != ERR_NONE) return ERR_THREADING;
+    }
+
+    // Nothing may change between the catch-up and the reopening
+    if (pthread_rwlock_wrlock(&imgfs_lock) != ERR_NONE) return ERR_THREADING;
+    // The compacted file is opened before it replaces the current one:
+    // if it cannot be, nothing is replaced and the server keeps on with
+    // the current one (the resize pool also holds on to imgfs_file)
+    struct imgfs_file compacted;
+    zero_init_var(compacted);
+    if (ret == ERR_NONE) ret = imgfs_gc_finish(gc, imgfs_path, &compacted, reclaimed);
+    if (ret == ERR_NONE) {
+        do_close(&imgfs_file);
+        imgfs_file = compacted;
+    }
+    if (ret == ERR_NONE) image_cache_set_version(&image_cache, imgfs_file.header.version);
+    if (pthread_rwlock_unlock(&imgfs_lock) != ERR_NONE) return ERR_THREADING;
+
+    return ret;
+}
+
+/**********************************************************************
+ * Handles a garbage collection request
+ ********************************************************************** */
+int handle_gc_call(int connection)
+{
+    char tmp_path[FILENAME_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s" GC_TMP_SUFFIX, imgfs_path) >= (int) sizeof(tmp_path)) {
+        return reply_error_msg(connection, ERR_INVALID_FILENAME);
+    }
+
+    // Only one compaction at a time
+    if (pthread_mutex_lock(&gc_mutex) != ERR_NONE) return reply_error_msg(connection, ERR_THREADING);
+    const int busy = gc_running;
+    gc_running = 1;
+    if (pthread_mutex_unlock(&gc_mutex) != ERR_NONE) return reply_error_msg(connection, ERR_THREADING);
+    if (busy) return reply_error_msg(connection, ERR_RUNTIME);
+
+    struct imgfs_gc gc;
+    zero_init_var(gc);
+    int64_t reclaimed = 0;
+    int ret = run_gc(&gc, tmp_path, &reclaimed);
+
+    // Whatever happened, the compaction is over
+    imgfs_gc_abort(&gc);
+    if (pthread_mutex_lock(&gc_mutex) != ERR_NONE) return reply_error_msg(connection, ERR_THREADING);
+    gc_running = 0;
+    if (pthread_mutex_unlock(&gc_mutex) != ERR_NONE) return reply_error_msg(connection, ERR_THREADING);
+
+    if (ret != ERR_NONE) return reply_error_msg(connection, ret);
+
+    // Reply the reclaimed space
+    char body[ERR_MSG_SIZE];
+    snprintf(body, sizeof(body), "{ \"reclaimed\": %lld }", (long long) reclaimed);
+    ret = http_reply(connection, HTTP_OK, "Content-Type: application/json\r\n", body, strlen(body));
+    return ret < 0 ? reply_error_msg(connection, ret) : ERR_NONE;
+}
+
+/**********************************************************************
+ * Handles a request for the counters of the image cache
+ ********************************************************************** */
+static int handle_stats_call(int connection)
+{
+    struct image_cache_stats stats;
+    image_cache_get_stats(&image_cache, &stats);
+
+    char body[ERR_MSG_SIZE];
+    snprintf(body, sizeof(body),
+             "{ \"cache\": { \"hits\": %zu, \"misses\": %zu, \"entries\": %zu, \"bytes\": %zu } }",
+             stats.hits, stats.misses, stats.nb_entries, stats.nb_bytes);
+    const int ret = http_reply(connection, HTTP_OK, "Content-Type: application/json\r\n", body, strlen(body));
+    return ret < 0 ? reply_error_msg(connection, ret) : ERR_NONE;
+}
+
 /**********************************************************************
  * Simple handling of http message. TO BE UPDATED WEEK 13
  ********************************************************************** */
@@ -241,7 +776,7 @@ int handle_http_message(struct http_message* msg, int connection)
     debug_printf("handle_http_message() on connection %d. URI: %.*s\n", connection, (int) msg->uri.len, msg->uri.val);
 
     if (http_match_uri(msg, URI_ROOT "/list")) {
-        return handle_list_call(connection);
+        return handle_list_call(msg, connection);
     }
     if (http_match_uri(msg, URI_ROOT "/insert") && http_match_verb(&msg->method, "POST")) {
         return handle_insert_call(msg, connection);
@@ -252,6 +787,12 @@ int handle_http_message(struct http_message* msg, int connection)
     if(http_match_uri(msg, URI_ROOT "/delete")) {
         return handle_delete_call(msg, connection);
     }
+    if(http_match_uri(msg, URI_ROOT "/gc")) {
+        return handle_gc_call(connection);
+    }
+    if(http_match_uri(msg, URI_ROOT "/stats")) {
+        return handle_stats_call(connection);
+    }
 
     return reply_error_msg(connection, ERR_INVALID_COMMAND);
 }
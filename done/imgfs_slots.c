@@ -0,0 +1,105 @@
+/**
+ * @file imgfs_slots.c
+ * @brief Bitmap of the free slots of the metadata array.
+ */
+
+#include "imgfs_slots.h"
+#include "util.h"
+
+#include <stdint.h> // for uint64_t
+#include <stdlib.h> // for calloc, free
+#include <string.h> // for memset
+
+#define BITS_PER_WORD 64
+
+/*******************************************************************
+ * Number of words needed for the bitmap of max_files slots.
+ */
+static size_t nb_words(uint32_t max_files)
+{
+    return ((size_t) max_files + BITS_PER_WORD - 1) / BITS_PER_WORD;
+}
+
+/*******************************************************************
+ * Bit of the slot at position index in its word.
+ */
+static uint64_t slot_bit(size_t index)
+{
+    return (uint64_t) 1 << (index % BITS_PER_WORD);
+}
+
+int imgfs_slots_build(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+
+    zero_init_var(imgfs_file->free_slots);
+
+    // At least one word, so that the bitmap of an empty array is not NULL
+    const size_t n = nb_words(imgfs_file->header.max_files);
+    imgfs_file->free_slots.words = calloc(n > 0 ? n : 1, sizeof(uint64_t));
+    if (imgfs_file->free_slots.words == NULL) return ERR_OUT_OF_MEMORY;
+
+    for (size_t i = 0; i < imgfs_file->header.max_files; ++i) {
+        if (!imgfs_file->metadata[i].is_valid) imgfs_slots_release(imgfs_file, i);
+    }
+    imgfs_file->free_slots.hint = 0;
+
+    return ERR_NONE;
+}
+
+int imgfs_slots_find(struct imgfs_file* imgfs_file, size_t* index)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(imgfs_file->free_slots.words);
+    M_REQUIRE_NON_NULL(index);
+
+    struct imgfs_slots* slots = &imgfs_file->free_slots;
+    const size_t n = nb_words(imgfs_file->header.max_files);
+
+    while (slots->hint < n) {
+        uint64_t* word = &slots->words[slots->hint];
+        if (*word == 0) {
+            // No free slot left in this word: never look at it again until a release
+            ++slots->hint;
+            continue;
+        }
+
+        const size_t i = slots->hint * BITS_PER_WORD + (size_t) __builtin_ctzll(*word);
+        if (!imgfs_file->metadata[i].is_valid) {
+            *index = i;
+            return ERR_NONE;
+        }
+        // The metadata was made valid behind our back: forget this slot
+        *word &= ~slot_bit(i);
+    }
+
+    return ERR_IMGFS_FULL;
+}
+
+void imgfs_slots_take(struct imgfs_file* imgfs_file, size_t index)
+{
+    if (imgfs_file == NULL || imgfs_file->free_slots.words == NULL) return;
+    if (index >= imgfs_file->header.max_files) return;
+
+    imgfs_file->free_slots.words[index / BITS_PER_WORD] &= ~slot_bit(index);
+}
+
+void imgfs_slots_release(struct imgfs_file* imgfs_file, size_t index)
+{
+    if (imgfs_file == NULL || imgfs_file->free_slots.words == NULL) return;
+    if (index >= imgfs_file->header.max_files) return;
+
+    const size_t word = index / BITS_PER_WORD;
+    imgfs_file->free_slots.words[word] |= slot_bit(index);
+    if (word < imgfs_file->free_slots.hint) imgfs_file->free_slots.hint = word;
+}
+
+void imgfs_slots_free(struct imgfs_file* imgfs_file)
+{
+    if (imgfs_file != NULL) {
+        free(imgfs_file->free_slots.words);
+        zero_init_var(imgfs_file->free_slots);
+    }
+}
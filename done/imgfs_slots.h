@@ -0,0 +1,63 @@
+/**
+ * @file imgfs_slots.h
+ * @brief Bitmap of the free slots of the metadata array.
+ *
+ * One bit per metadata slot (set if the slot is free), scanned a 64-bit
+ * word at a time; the first word that may hold a free slot is remembered,
+ * so that do_insert() does not walk the whole metadata array.
+ * It only lives in memory and is built by do_open() and do_create().
+ */
+
+#pragma once
+
+#include "imgfs.h" // for struct imgfs_file, struct imgfs_slots
+
+#include <stddef.h> // for size_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Builds the bitmap of the free slots from the metadata.
+ *
+ * @param imgfs_file The main in-memory structure (header and metadata already read)
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_slots_build(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Finds a free slot of the metadata array (the first one).
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param index Where to put the position of the free slot.
+ * @return ERR_NONE if found, ERR_IMGFS_FULL otherwise (or some other error code).
+ */
+int imgfs_slots_find(struct imgfs_file* imgfs_file, size_t* index);
+
+/**
+ * @brief Marks the slot at position index as used.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param index The position of the slot in the metadata array.
+ */
+void imgfs_slots_take(struct imgfs_file* imgfs_file, size_t index);
+
+/**
+ * @brief Marks the slot at position index as free.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param index The position of the slot in the metadata array.
+ */
+void imgfs_slots_release(struct imgfs_file* imgfs_file, size_t index);
+
+/**
+ * @brief Frees the in-memory bitmap.
+ *
+ * @param imgfs_file The main in-memory structure
+ */
+void imgfs_slots_free(struct imgfs_file* imgfs_file);
+
+#ifdef __cplusplus
+}
+#endif
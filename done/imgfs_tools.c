@@ -6,14 +6,23 @@
  */
 
 #include "imgfs.h"
+#include "imgfs_extents.h"
+#include "imgfs_index.h"
+#include "imgfs_refs.h"
+#include "imgfs_slots.h"
 #include "util.h"
 
+#include <errno.h>         // for errno, EINTR
+#include <fcntl.h>         // for fcntl
 #include <inttypes.h>      // for PRIxN macros
 #include <openssl/sha.h>   // for SHA256_DIGEST_LENGTH
 #include <stdint.h>        // for uint8_t
 #include <stdio.h>         // for sprintf
 #include <stdlib.h>        // for calloc
-#include <string.h>        // for strcmp
+#include <string.h>        // for strcmp, strchr, memcpy
+#include <sys/mman.h>      // for mmap, msync, munmap
+#include <sys/stat.h>      // for fstat
+#include <unistd.h>        // for pread, pwrite, sysconf
 
 /*******************************************************************
  * Human-readable SHA
@@ -67,52 +76,285 @@ ORIGINAL: %" PRIu32 " x %" PRIu32 "\n",
     printf("*****************************************\n");
 }
 
-int do_open(const char* imgfs_filename, const char* open_mode, struct imgfs_file* imgfs_file)
+/*******************************************************************
+ * Size of the header and metadata region of the file.
+ */
+static size_t mapped_size(const struct imgfs_file* imgfs_file)
+{
+    return sizeof(struct imgfs_header) + imgfs_file->header.max_files * sizeof(struct img_metadata);
+}
+
+/*******************************************************************
+ * Whether the (mapped) file was opened for writing.
+ */
+static int is_writable(FILE* file)
 {
+    const int flags = fcntl(fileno(file), F_GETFL);
+    return flags != -1 && (flags & O_ACCMODE) != O_RDONLY;
+}
+
+/*******************************************************************
+ * Synchronously flushes the pages of the mapping covering [off, off + len[.
+ */
+static int sync_mapping(const struct imgfs_file* imgfs_file, size_t off, size_t len)
+{
+    const size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    const size_t start = off - off % page_size; // msync needs a page-aligned address
+
+    if (msync((char*) imgfs_file->map + start, off + len - start, MS_SYNC) != 0) return ERR_IO;
 
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Maps the header and metadata of the (already opened) file.
+ */
+static int map_metadata(struct imgfs_file* imgfs_file, int writable)
+{
+    const int fd = fileno(imgfs_file->file);
+
+    // Read the header first, to know the size of the metadata
+    int ret = imgfs_pread(imgfs_file, &imgfs_file->header, sizeof(struct imgfs_header), 0);
+    if (ret != ERR_NONE) return ret;
+
+    // Accessing a mapping past the end of the file would crash: check it is complete
+    struct stat st;
+    const size_t size = mapped_size(imgfs_file);
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < size) return ERR_IO;
+
+    // Shared with the file if we may write, private (copy-on-write) otherwise
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, writable ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return ERR_IO;
+
+    imgfs_file->map = map;
+    imgfs_file->metadata = (struct img_metadata*) ((char*) map + sizeof(struct imgfs_header));
+
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Opens the file and reads (or maps) its header and metadata.
+ */
+static int open_imgfs(const char* imgfs_filename, const char* open_mode, struct imgfs_file* imgfs_file, int mapped)
+{
     M_REQUIRE_NON_NULL(imgfs_file);
     M_REQUIRE_NON_NULL(imgfs_filename);
     M_REQUIRE_NON_NULL(open_mode);
 
+    zero_init_var(imgfs_file->index);
+    zero_init_var(imgfs_file->content_index);
+    zero_init_var(imgfs_file->sorted);
+    zero_init_var(imgfs_file->free_slots);
+    zero_init_var(imgfs_file->extents);
+    zero_init_var(imgfs_file->refs);
+    imgfs_file->metadata = NULL;
+    imgfs_file->map = NULL;
+
     //Opening file in "open_mode".
     imgfs_file->file = fopen(imgfs_filename, open_mode);
 
     if(imgfs_file->file == NULL) {
         return ERR_IO;
     }
-    //Reading the header of the imgs_file
-    size_t read_header = fread(&(imgfs_file->header), sizeof(struct imgfs_header), 1, imgfs_file->file);
 
-    if (read_header == 0) {
-        fclose(imgfs_file->file);
-        return ERR_IO;
+    const int writable = strchr(open_mode, '+') != NULL || open_mode[0] == 'w' || open_mode[0] == 'a';
+
+    if (mapped) {
+        int ret = map_metadata(imgfs_file, writable);
+        if (ret != ERR_NONE) {
+            fclose(imgfs_file->file); imgfs_file->file = NULL;
+            return ret;
+        }
+    } else {
+        //Reading the header of the imgs_file
+        if (imgfs_pread(imgfs_file, &imgfs_file->header, sizeof(struct imgfs_header), 0) != ERR_NONE) {
+            fclose(imgfs_file->file);
+            return ERR_IO;
+        }
+
+        // Dynamically allocating memory to metadata of the imgfs_file.
+        imgfs_file->metadata = calloc((imgfs_file->header).max_files, sizeof(struct img_metadata));
+
+        if(imgfs_file->metadata == NULL) {
+            fclose(imgfs_file->file);
+            return ERR_OUT_OF_MEMORY;
+        }
+
+        //Reading the metadata
+        int ret = imgfs_pread(imgfs_file, imgfs_file->metadata, (imgfs_file->header).max_files * sizeof(struct img_metadata),
+                              sizeof(struct imgfs_header));
+
+        if(ret != ERR_NONE) {
+            fclose(imgfs_file->file);
+            free(imgfs_file->metadata); imgfs_file->metadata = NULL;
+            return ERR_IO;
+        }
+    }
+
+    // Load the img_id and content indexes (rebuilt if missing or stale, rewritten only if we may write)
+    int ret = imgfs_index_load(imgfs_file, writable);
+    if (ret == ERR_NONE) ret = imgfs_slots_build(imgfs_file);
+    if (ret == ERR_NONE) ret = imgfs_refs_build(imgfs_file);
+    if (ret != ERR_NONE) {
+        do_close(imgfs_file);
+        return ret;
     }
 
-    // Dynamically allocating memory to metadata of the imgfs_file.
-    imgfs_file->metadata = calloc((imgfs_file->header).max_files, sizeof(struct img_metadata));
+    return ERR_NONE;
+
+}
+
+int do_open(const char* imgfs_filename, const char* open_mode, struct imgfs_file* imgfs_file)
+{
+    return open_imgfs(imgfs_filename, open_mode, imgfs_file, 0);
+}
+
+int do_open_mapped(const char* imgfs_filename, const char* open_mode, struct imgfs_file* imgfs_file)
+{
+    return open_imgfs(imgfs_filename, open_mode, imgfs_file, 1);
+}
+
+int file_pread(FILE* file, void* buffer, size_t size, uint64_t offset)
+{
+    M_REQUIRE_NON_NULL(file);
+    M_REQUIRE_NON_NULL(buffer);
+
+    const int fd = fileno(file);
+    char* const bytes = buffer;
 
-    if(imgfs_file->metadata == NULL) {
-        fclose(imgfs_file->file);
-        return ERR_OUT_OF_MEMORY;
+    // pread may return less than asked for (or be interrupted): loop until everything is read
+    size_t done = 0;
+    while (done < size) {
+        const ssize_t n = pread(fd, bytes + done, size - done, (off_t) (offset + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return ERR_IO; // error or unexpected end of file
+        done += (size_t) n;
     }
 
-    //Reading the metadata
-    size_t read_metadata = fread(imgfs_file->metadata, sizeof(struct img_metadata), (imgfs_file->header).max_files, imgfs_file->file);
+    return ERR_NONE;
+}
 
+int file_pwrite(FILE* file, const void* buffer, size_t size, uint64_t offset)
+{
+    M_REQUIRE_NON_NULL(file);
+    M_REQUIRE_NON_NULL(buffer);
 
-    if(read_metadata != (imgfs_file->header).max_files) {
-        fclose(imgfs_file->file);
-        free(imgfs_file->metadata); imgfs_file->metadata = NULL;
-        return ERR_IO;
+    const int fd = fileno(file);
+    const char* const bytes = buffer;
+
+    size_t done = 0;
+    while (done < size) {
+        const ssize_t n = pwrite(fd, bytes + done, size - done, (off_t) (offset + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return ERR_IO;
+        done += (size_t) n;
     }
 
     return ERR_NONE;
+}
 
+int imgfs_pread(const struct imgfs_file* imgfs_file, void* buffer, size_t size, uint64_t offset)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    return file_pread(imgfs_file->file, buffer, size, offset);
+}
+
+int imgfs_pwrite(struct imgfs_file* imgfs_file, const void* buffer, size_t size, uint64_t offset)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    return file_pwrite(imgfs_file->file, buffer, size, offset);
+}
+
+int imgfs_file_size(const struct imgfs_file* imgfs_file, uint64_t* size)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(size);
+
+    struct stat st;
+    if (fstat(fileno(imgfs_file->file), &st) != 0) return ERR_IO;
+
+    *size = (uint64_t) st.st_size;
+    return ERR_NONE;
+}
+
+int imgfs_write_header(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+
+    if (imgfs_file->map != NULL) {
+        // A private mapping would silently keep the changes in memory
+        if (!is_writable(imgfs_file->file)) return ERR_IO;
+
+        memcpy(imgfs_file->map, &imgfs_file->header, sizeof(struct imgfs_header));
+        return sync_mapping(imgfs_file, 0, sizeof(struct imgfs_header));
+    }
+
+    // The header is at the begining of the file
+    return imgfs_pwrite(imgfs_file, &imgfs_file->header, sizeof(struct imgfs_header), 0);
+}
+
+int imgfs_write_metadata(struct imgfs_file* imgfs_file, size_t index)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    if (index >= imgfs_file->header.max_files) return ERR_INVALID_ARGUMENT;
+
+    const size_t off = sizeof(struct imgfs_header) + index * sizeof(struct img_metadata);
+
+    if (imgfs_file->map != NULL) {
+        // The metadata already lives in the mapping: only flush it
+        if (!is_writable(imgfs_file->file)) return ERR_IO;
+
+        return sync_mapping(imgfs_file, off, sizeof(struct img_metadata));
+    }
+
+    return imgfs_pwrite(imgfs_file, &imgfs_file->metadata[index], sizeof(struct img_metadata), off);
+}
+
+int imgfs_write_blob(struct imgfs_file* imgfs_file, const void* buffer, uint32_t size, uint64_t* offset)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(buffer);
+    M_REQUIRE_NON_NULL(offset);
+
+    // Reuse the space of a deleted blob if some is large enough
+    *offset = 0;
+    if (imgfs_file->extents.table != NULL) {
+        int ret = imgfs_extents_alloc(imgfs_file, size, offset);
+        if (ret != ERR_NONE) return ret;
+    }
+
+    // Otherwise append it at the end of the file
+    const int reused = *offset != 0;
+    if (!reused) {
+        int ret = imgfs_file_size(imgfs_file, offset);
+        if (ret != ERR_NONE) return ret;
+    }
+
+    const int ret = imgfs_pwrite(imgfs_file, buffer, size, *offset);
+    // Give the space back rather than lose it
+    if (ret != ERR_NONE && reused) imgfs_extents_release(imgfs_file, *offset, size);
+    return ret;
 }
 
 void do_close(struct imgfs_file* imgfs_file)
 {
     if(imgfs_file != NULL) {
+        // The mapping, the indexes, the free slots and the reference counts only exist while the file is open
+        if (imgfs_file->file != NULL) {
+            if (imgfs_file->map != NULL) {
+                munmap(imgfs_file->map, mapped_size(imgfs_file));
+                imgfs_file->map = NULL;
+                imgfs_file->metadata = NULL;
+            }
+            imgfs_index_free(imgfs_file);
+            imgfs_slots_free(imgfs_file);
+            imgfs_refs_free(imgfs_file);
+        }
         if(imgfs_file->metadata != NULL) {
             free(imgfs_file->metadata);
             imgfs_file->metadata = NULL;
@@ -25,7 +25,7 @@ struct command_mapping {
 };
 
 // Number of commands
-#define NUM_COMMANDS 6
+#define NUM_COMMANDS 7
 
 // Array of all necessary command mappings (mapping command names to their functions)
 const struct command_mapping commands[NUM_COMMANDS] = {
@@ -34,7 +34,8 @@ const struct command_mapping commands[NUM_COMMANDS] = {
     {"help", help},
     {"delete", do_delete_cmd},
     {"read", do_read_cmd},
-    {"insert", do_insert_cmd}
+    {"insert", do_insert_cmd},
+    {"gc", do_gbcollect_cmd}
 };
 
 /*******************************************************************************
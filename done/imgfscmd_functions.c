@@ -12,6 +12,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <sys/stat.h> // for stat
 
 // default values
 static const uint32_t default_max_files = 128;
@@ -151,6 +152,8 @@ int help(int useless _unused, char** useless_too _unused)
     "      default resolution is \"original\".\n"
     "  insert <imgFS_filename> <imgID> <filename>: insert a new image in the imgFS.\n"
     "  delete <imgFS_filename> <imgID>: delete image imgID from imgFS.\n"
+    "  gc <imgFS_filename> <tmp imgFS_filename>: performs garbage collection on imgFS.\n"
+    "      the compacted imgFS is built in the temporary file first.\n"
     , default_max_files, MAX_UINT32, default_thumb_res, default_thumb_res, MAX_THUMB_RES,
     MAX_THUMB_RES, default_small_res, default_small_res, MAX_SMALL_RES, MAX_SMALL_RES
     );
@@ -372,3 +375,27 @@ int do_insert_cmd(int argc, char **argv)
     do_close(&myfile);
     return error;
 }
+
+int do_gbcollect_cmd(int argc, char **argv)
+{
+    M_REQUIRE_NON_NULL(argv);
+    if (argc != 2) return ERR_NOT_ENOUGH_ARGUMENTS;
+
+    const char* filename = argv[0];
+    const char* tmp_filename = argv[1];
+    M_REQUIRE_NON_NULL(filename);
+    M_REQUIRE_NON_NULL(tmp_filename);
+
+    // Size before, to know how much was reclaimed
+    struct stat st;
+    if (stat(filename, &st) != 0) return ERR_IO;
+    const long long old_size = (long long) st.st_size;
+
+    int error = do_gbcollect(filename, tmp_filename);
+    if (error != ERR_NONE) return error;
+
+    if (stat(filename, &st) != 0) return ERR_IO;
+    printf("%lld byte(s) reclaimed\n", old_size - (long long) st.st_size);
+
+    return ERR_NONE;
+}
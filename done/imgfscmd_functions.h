@@ -36,3 +36,8 @@ int do_insert_cmd(int argc, char* argv[]);
  * Reads an image from the imgFS.
  *******************************************************************/
 int do_read_cmd(int argc, char* argv[]);
+
+/********************************************************************
+ * Compacts the imgFS and reports the reclaimed space.
+ *******************************************************************/
+int do_gbcollect_cmd(int argc, char* argv[]);
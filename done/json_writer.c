@@ -0,0 +1,160 @@
+/**
+ * @file json_writer.c
+ * @brief Minimal JSON emitter writing into a single buffer.
+ */
+
+#include "json_writer.h"
+#include "error.h"
+
+#include <stdlib.h> // for malloc, realloc, free
+#include <string.h> // for memcpy, memset, strlen
+
+#define JSON_WRITER_MIN_CAPACITY 64
+
+/*******************************************************************
+ * Makes room for extra more bytes (and a null terminator).
+ */
+static int reserve(struct json_writer* writer, size_t extra)
+{
+    if (writer->error != ERR_NONE) return writer->error;
+    if (writer->len + extra < writer->capacity) return ERR_NONE;
+
+    if (!writer->growable) {
+        writer->error = ERR_OUT_OF_MEMORY;
+        return writer->error;
+    }
+
+    size_t capacity = writer->capacity;
+    while (writer->len + extra >= capacity) capacity *= 2;
+    char* buffer = realloc(writer->buffer, capacity);
+    if (buffer == NULL) {
+        writer->error = ERR_OUT_OF_MEMORY;
+        return writer->error;
+    }
+    writer->buffer = buffer;
+    writer->capacity = capacity;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * The letter of the two-char escape of c, as json-c writes it
+ * (it also escapes '/'), or '\0' if c has none.
+ */
+static char short_escape(unsigned char c)
+{
+    switch (c) {
+    case '"':  return '"';
+    case '\\': return '\\';
+    case '/':  return '/';
+    case '\b': return 'b';
+    case '\f': return 'f';
+    case '\n': return 'n';
+    case '\r': return 'r';
+    case '\t': return 't';
+    default:   return '\0';
+    }
+}
+
+/********************************************************************/
+int json_writer_init_buffer(struct json_writer* writer, char* buffer, size_t capacity)
+{
+    M_REQUIRE_NON_NULL(writer);
+    M_REQUIRE_NON_NULL(buffer);
+    if (capacity == 0) return ERR_INVALID_ARGUMENT;
+
+    memset(writer, 0, sizeof(*writer));
+    writer->buffer = buffer;
+    writer->capacity = capacity;
+    return ERR_NONE;
+}
+
+/********************************************************************/
+int json_writer_init(struct json_writer* writer, size_t capacity_hint)
+{
+    M_REQUIRE_NON_NULL(writer);
+
+    memset(writer, 0, sizeof(*writer));
+    writer->capacity = capacity_hint < JSON_WRITER_MIN_CAPACITY ? JSON_WRITER_MIN_CAPACITY : capacity_hint;
+    writer->buffer = malloc(writer->capacity);
+    if (writer->buffer == NULL) return ERR_OUT_OF_MEMORY;
+    writer->growable = 1;
+    return ERR_NONE;
+}
+
+/********************************************************************/
+int json_writer_raw(struct json_writer* writer, const char* text, size_t len)
+{
+    M_REQUIRE_NON_NULL(writer);
+    M_REQUIRE_NON_NULL(text);
+
+    const int ret = reserve(writer, len);
+    if (ret != ERR_NONE) return ret;
+    memcpy(writer->buffer + writer->len, text, len);
+    writer->len += len;
+    return ERR_NONE;
+}
+
+/********************************************************************/
+int json_writer_literal(struct json_writer* writer, const char* text)
+{
+    M_REQUIRE_NON_NULL(text);
+    return json_writer_raw(writer, text, strlen(text));
+}
+
+/********************************************************************/
+int json_writer_string(struct json_writer* writer, const char* str, size_t max_len)
+{
+    M_REQUIRE_NON_NULL(writer);
+    M_REQUIRE_NON_NULL(str);
+    static const char hex[] = "0123456789abcdef";
+
+    // Measured first, so that a fixed buffer can be filled up
+    size_t len = 0;
+    size_t escaped_len = 2;
+    for (; len < max_len && str[len] != '\0'; ++len) {
+        const unsigned char c = (unsigned char) str[len];
+        escaped_len += short_escape(c) != '\0' ? 2 : c < 0x20 ? 6 : 1;
+    }
+    const int ret = reserve(writer, escaped_len);
+    if (ret != ERR_NONE) return ret;
+
+    char* out = writer->buffer + writer->len;
+    *out++ = '"';
+    for (size_t i = 0; i < len; ++i) {
+        const unsigned char c = (unsigned char) str[i];
+        const char escape = short_escape(c);
+        if (escape != '\0') {
+            *out++ = '\\';
+            *out++ = escape;
+        } else if (c < 0x20) {
+            memcpy(out, "\\u00", 4);
+            out[4] = hex[c >> 4];
+            out[5] = hex[c & 0xf];
+            out += 6;
+        } else {
+            *out++ = (char) c;
+        }
+    }
+    *out++ = '"';
+    writer->len = (size_t) (out - writer->buffer);
+    return ERR_NONE;
+}
+
+/********************************************************************/
+int json_writer_finish(struct json_writer* writer)
+{
+    M_REQUIRE_NON_NULL(writer);
+
+    // reserve() always keeps room for it
+    if (writer->error != ERR_NONE) return writer->error;
+    writer->buffer[writer->len] = '\0';
+    return ERR_NONE;
+}
+
+/********************************************************************/
+void json_writer_free(struct json_writer* writer)
+{
+    if (writer == NULL) return;
+    if (writer->growable) free(writer->buffer);
+    memset(writer, 0, sizeof(*writer));
+}
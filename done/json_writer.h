@@ -0,0 +1,99 @@
+/**
+ * @file json_writer.h
+ * @brief Minimal JSON emitter writing into a single buffer.
+ *
+ * The text is written as it comes, either into a buffer supplied by the
+ * caller (that is never reallocated: writing past its end is an error)
+ * or into one of the writer's own, grown by doubling. Nothing is
+ * allocated per value, unlike with a json-c tree.
+ *
+ * Errors are sticky: once a write failed, the following ones do nothing
+ * and return the same error, so that a sequence of writes can be checked
+ * once, at its end.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief The buffer being written and its state.
+ */
+struct json_writer {
+    char* buffer;
+    size_t len; // written so far (not counting the null terminator)
+    size_t capacity;
+    int growable; // the buffer is the writer's own: it may be reallocated
+    int error; // first error met, 0 if none
+};
+
+/**
+ * @brief Starts writing into a buffer of the caller.
+ *
+ * @param writer The writer
+ * @param buffer The buffer
+ * @param capacity Its size, in bytes
+ * @return Some error code. 0 if no error.
+ */
+int json_writer_init_buffer(struct json_writer* writer, char* buffer, size_t capacity);
+
+/**
+ * @brief Starts writing into a buffer of the writer's own.
+ *
+ * @param writer The writer
+ * @param capacity_hint Its initial size (the expected size of the text, if known)
+ * @return Some error code. 0 if no error.
+ */
+int json_writer_init(struct json_writer* writer, size_t capacity_hint);
+
+/**
+ * @brief Writes text as it is (punctuation, numbers...).
+ *
+ * @param writer The writer
+ * @param text The text
+ * @param len Its length
+ * @return Some error code. 0 if no error.
+ */
+int json_writer_raw(struct json_writer* writer, const char* text, size_t len);
+
+/**
+ * @brief Writes a null-terminated string as it is.
+ *
+ * @param writer The writer
+ * @param text The text
+ * @return Some error code. 0 if no error.
+ */
+int json_writer_literal(struct json_writer* writer, const char* text);
+
+/**
+ * @brief Writes a JSON string: str quoted and escaped as json-c does.
+ *
+ * @param writer The writer
+ * @param str The string (null-terminated, or max_len chars long)
+ * @param max_len Its maximum length
+ * @return Some error code. 0 if no error.
+ */
+int json_writer_string(struct json_writer* writer, const char* str, size_t max_len);
+
+/**
+ * @brief Null-terminates the text written.
+ *
+ * @param writer The writer
+ * @return Some error code (the first one of the writes). 0 if no error.
+ */
+int json_writer_finish(struct json_writer* writer);
+
+/**
+ * @brief Frees the buffer of the writer (if it is its own).
+ *
+ * @param writer The writer
+ */
+void json_writer_free(struct json_writer* writer);
+
+#ifdef __cplusplus
+}
+#endif
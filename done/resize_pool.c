@@ -0,0 +1,327 @@
+/**
+ * @file resize_pool.c
+ * @brief Background creation of the resized versions of inserted images.
+ */
+
+#include "resize_pool.h"
+#include "image_content.h"
+#include "util.h"
+
+#include <stdlib.h> // for malloc, free
+#include <string.h> // for memcpy, memcmp
+
+
+/*******************************************************************
+ * Whether job is about that image in one of those resolutions.
+ */
+static int same_job(const struct resize_job* job, size_t index, unsigned resolutions)
+{
+    return job->index == index && (job->resolutions & resolutions) != 0;
+}
+
+/*******************************************************************
+ * Reads the original of the image of job and the resolutions of job that
+ * it still misses (if any). Must be called with imgfs_lock held.
+ */
+static int read_original(const struct imgfs_file* imgfs_file, const struct resize_job* job,
+                         char** buffer, size_t* size, unsigned* missing, uint16_t* resized_res)
+{
+    if (job->index >= imgfs_file->header.max_files) return ERR_IMAGE_NOT_FOUND;
+    const struct img_metadata* md = &imgfs_file->metadata[job->index];
+    if (!md->is_valid || memcmp(md->SHA, job->SHA, SHA256_DIGEST_LENGTH) != 0) return ERR_IMAGE_NOT_FOUND;
+
+    // Some may be there already (e.g. shared with a duplicate, or created by a read)
+    *missing = 0;
+    for (int res = 0; res < ORIG_RES; ++res) {
+        if ((job->resolutions & RES_BIT(res)) && (md->offset[res] == 0 || md->size[res] == 0)) *missing |= RES_BIT(res);
+    }
+    if (*missing == 0) return ERR_NONE;
+
+    *size = md->size[ORIG_RES];
+    memcpy(resized_res, imgfs_file->header.resized_res, sizeof(imgfs_file->header.resized_res));
+    *buffer = malloc(*size);
+    if (*buffer == NULL) return ERR_OUT_OF_MEMORY;
+
+    return imgfs_pread(imgfs_file, *buffer, *size, md->offset[ORIG_RES]);
+}
+
+/*******************************************************************
+ * Creates the resized images of job: reading the original and writing the
+ * results under imgfs_lock, resizing without it.
+ */
+static int run_job(struct resize_pool* pool, const struct resize_job* job)
+{
+    char* original = NULL;
+    size_t original_size = 0;
+    unsigned missing = 0;
+    uint16_t resized_res[2 * (NB_RES - 1)];
+
+    if (pthread_rwlock_rdlock(pool->imgfs_lock) != 0) return ERR_THREADING;
+    int ret = read_original(pool->imgfs_file, job, &original, &original_size, &missing, resized_res);
+    if (pthread_rwlock_unlock(pool->imgfs_lock) != 0) ret = ERR_THREADING;
+    if (ret != ERR_NONE || original == NULL) {
+        free(original);
+        return ret;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    ++pool->nb_resized;
+    pthread_mutex_unlock(&pool->mutex);
+
+    struct resized_imgs resized;
+    ret = create_resized_imgs(original, original_size, resized_res, missing, &resized);
+    free(original); original = NULL;
+    if (ret != ERR_NONE) return ret;
+
+    // The image may have changed meanwhile: store_resized_imgs() checks it
+    if (pthread_rwlock_wrlock(pool->imgfs_lock) != 0) {
+        free_resized_imgs(&resized);
+        return ERR_THREADING;
+    }
+    ret = store_resized_imgs(pool->imgfs_file, job->index, job->SHA, &resized);
+    if (pthread_rwlock_unlock(pool->imgfs_lock) != 0) ret = ERR_THREADING;
+
+    free_resized_imgs(&resized);
+    return ret;
+}
+
+/*******************************************************************
+ * Whether a job for that image in one of those resolutions is in flight.
+ * Must be called with pool->mutex held.
+ */
+static int is_inflight(const struct resize_pool* pool, size_t index, unsigned resolutions)
+{
+    for (size_t i = 0; i < pool->nb_inflight; ++i) {
+        if (same_job(&pool->inflight[i], index, resolutions)) return 1;
+    }
+    return 0;
+}
+
+/*******************************************************************
+ * Whether a job for that image in one of those resolutions is queued or
+ * in flight. Must be called with pool->mutex held.
+ */
+static int has_job(const struct resize_pool* pool, size_t index, unsigned resolutions)
+{
+    for (size_t i = 0; i < pool->nb_queued; ++i) {
+        if (same_job(&pool->queue[(pool->head + i) % RESIZE_POOL_QUEUE_SIZE], index, resolutions)) return 1;
+    }
+    return is_inflight(pool, index, resolutions);
+}
+
+/*******************************************************************
+ * Removes the queued jobs for that image in one of those resolutions
+ * (keeping the order of the others). Must be called with pool->mutex held.
+ */
+static void unqueue(struct resize_pool* pool, size_t index, unsigned resolutions)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < pool->nb_queued; ++i) {
+        const struct resize_job* job = &pool->queue[(pool->head + i) % RESIZE_POOL_QUEUE_SIZE];
+        if (same_job(job, index, resolutions)) continue;
+        pool->queue[(pool->head + kept) % RESIZE_POOL_QUEUE_SIZE] = *job;
+        ++kept;
+    }
+    pool->nb_queued = kept;
+}
+
+/*******************************************************************
+ * Records job as in flight. Must be called with pool->mutex held, and
+ * room in the table.
+ */
+static void enter_inflight(struct resize_pool* pool, const struct resize_job* job)
+{
+    pool->inflight[pool->nb_inflight++] = *job;
+}
+
+/*******************************************************************
+ * Removes job from the jobs in flight and wakes up those waiting for it
+ * (or for its room in the table). Must be called with pool->mutex held.
+ */
+static void leave_inflight(struct resize_pool* pool, const struct resize_job* job)
+{
+    for (size_t i = 0; i < pool->nb_inflight; ++i) {
+        if (pool->inflight[i].index == job->index && pool->inflight[i].resolutions == job->resolutions) {
+            pool->inflight[i] = pool->inflight[--pool->nb_inflight];
+            break;
+        }
+    }
+    pthread_cond_broadcast(&pool->job_done);
+    pthread_cond_signal(&pool->job_ready);
+}
+
+/*******************************************************************
+ * Worker thread: runs the queued jobs until the pool is stopped.
+ */
+static void* worker_main(void* arg)
+{
+    struct resize_worker* worker = arg;
+    struct resize_pool* pool = worker->pool;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (1) {
+        // A job stays queued until there is room to record it in flight:
+        // in between, it would be seen by nobody and could be run twice
+        while (!pool->stopping && (pool->nb_queued == 0 || pool->nb_inflight == RESIZE_POOL_MAX_INFLIGHT)) {
+            pthread_cond_wait(&pool->job_ready, &pool->mutex);
+        }
+        if (pool->stopping) break;
+
+        const struct resize_job job = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % RESIZE_POOL_QUEUE_SIZE;
+        --pool->nb_queued;
+
+        // A read is already doing it
+        if (is_inflight(pool, job.index, job.resolutions)) continue;
+
+        enter_inflight(pool, &job);
+        pthread_mutex_unlock(&pool->mutex);
+
+        // Failures are not fatal: the first read resizes lazily
+        const int ret = run_job(pool, &job);
+        if (ret != ERR_NONE && ret != ERR_IMAGE_NOT_FOUND) {
+            debug_printf("resize_pool: slot %zu: %s\n", job.index, ERR_MSG(ret));
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+        leave_inflight(pool, &job);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+/********************************************************************/
+int resize_pool_start(struct resize_pool* pool, struct imgfs_file* imgfs_file,
+                      pthread_rwlock_t* imgfs_lock, size_t nb_workers)
+{
+    M_REQUIRE_NON_NULL(pool);
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_lock);
+    if (nb_workers == 0 || nb_workers > RESIZE_POOL_MAX_WORKERS) return ERR_INVALID_ARGUMENT;
+
+    memset(pool, 0, sizeof(*pool));
+    pool->imgfs_file = imgfs_file;
+    pool->imgfs_lock = imgfs_lock;
+    if (pthread_mutex_init(&pool->mutex, NULL) != 0) return ERR_THREADING;
+    if (pthread_cond_init(&pool->job_ready, NULL) != 0) {
+        pthread_mutex_destroy(&pool->mutex);
+        return ERR_THREADING;
+    }
+    if (pthread_cond_init(&pool->job_done, NULL) != 0) {
+        pthread_cond_destroy(&pool->job_ready);
+        pthread_mutex_destroy(&pool->mutex);
+        return ERR_THREADING;
+    }
+
+    for (size_t i = 0; i < nb_workers; ++i) {
+        pool->workers[i].pool = pool;
+        if (pthread_create(&pool->workers[i].thread, NULL, worker_main, &pool->workers[i]) != 0) {
+            resize_pool_stop(pool);
+            return ERR_THREADING;
+        }
+        pool->nb_workers = i + 1;
+    }
+
+    return ERR_NONE;
+}
+
+/********************************************************************/
+int resize_pool_submit(struct resize_pool* pool, size_t index, const unsigned char* sha)
+{
+    M_REQUIRE_NON_NULL(pool);
+    M_REQUIRE_NON_NULL(sha);
+
+    if (pthread_mutex_lock(&pool->mutex) != 0) return ERR_THREADING;
+    if (!pool->stopping && pool->nb_queued < RESIZE_POOL_QUEUE_SIZE) {
+        struct resize_job* job = &pool->queue[(pool->head + pool->nb_queued) % RESIZE_POOL_QUEUE_SIZE];
+        job->index = index;
+        job->resolutions = RESIZED_RES_ALL;
+        memcpy(job->SHA, sha, SHA256_DIGEST_LENGTH);
+        ++pool->nb_queued;
+        pthread_cond_signal(&pool->job_ready);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return ERR_NONE;
+}
+
+/********************************************************************/
+int resize_pool_wait(struct resize_pool* pool, size_t index, int resolution)
+{
+    if (pool == NULL || pool->nb_workers == 0) return 0;
+
+    int waited = 0;
+    pthread_mutex_lock(&pool->mutex);
+    while (has_job(pool, index, RES_BIT(resolution))) {
+        waited = 1;
+        pthread_cond_wait(&pool->job_done, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return waited;
+}
+
+/********************************************************************/
+int resize_pool_resize(struct resize_pool* pool, size_t index, int resolution, const unsigned char* sha)
+{
+    M_REQUIRE_NON_NULL(pool);
+    M_REQUIRE_NON_NULL(pool->imgfs_file);
+    M_REQUIRE_NON_NULL(sha);
+    if (!(resolution == THUMB_RES || resolution == SMALL_RES)) return ERR_RESOLUTIONS;
+
+    // The other resolutions come (almost) for free with the same decoding
+    struct resize_job job = { .index = index, .resolutions = RESIZED_RES_ALL };
+    memcpy(job.SHA, sha, SHA256_DIGEST_LENGTH);
+
+    if (pthread_mutex_lock(&pool->mutex) != 0) return ERR_THREADING;
+    // Wait for room in the table of the jobs in flight, unless somebody
+    // starts it meanwhile
+    while (!pool->stopping && !is_inflight(pool, index, RES_BIT(resolution))
+           && pool->nb_inflight == RESIZE_POOL_MAX_INFLIGHT) {
+        pthread_cond_wait(&pool->job_done, &pool->mutex);
+    }
+    // Somebody else is doing it: its result will be ours
+    if (is_inflight(pool, index, RES_BIT(resolution))) {
+        while (is_inflight(pool, index, RES_BIT(resolution))) pthread_cond_wait(&pool->job_done, &pool->mutex);
+        pthread_mutex_unlock(&pool->mutex);
+        return ERR_NONE;
+    }
+    // A queued job for it is run now rather than after the ones before it
+    unqueue(pool, index, job.resolutions);
+    // Once the pool is stopping, nothing is shared any more
+    const int recorded = !pool->stopping;
+    if (recorded) enter_inflight(pool, &job);
+    pthread_mutex_unlock(&pool->mutex);
+
+    const int ret = run_job(pool, &job);
+
+    if (recorded) {
+        pthread_mutex_lock(&pool->mutex);
+        leave_inflight(pool, &job);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    return ret;
+}
+
+/********************************************************************/
+void resize_pool_stop(struct resize_pool* pool)
+{
+    if (pool == NULL || pool->imgfs_file == NULL) return;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->stopping = 1;
+    pool->nb_queued = 0;
+    pthread_cond_broadcast(&pool->job_ready);
+    pthread_cond_broadcast(&pool->job_done);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (size_t i = 0; i < pool->nb_workers; ++i) pthread_join(pool->workers[i].thread, NULL);
+    pool->nb_workers = 0;
+
+    pthread_cond_destroy(&pool->job_done);
+    pthread_cond_destroy(&pool->job_ready);
+    pthread_mutex_destroy(&pool->mutex);
+    pool->imgfs_file = NULL;
+}
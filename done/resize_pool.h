@@ -0,0 +1,140 @@
+/**
+ * @file resize_pool.h
+ * @brief Background creation of the resized versions of inserted images.
+ *
+ * Once an image is inserted, the creation of its THUMB_RES and SMALL_RES
+ * versions (from a single decoding of it) is queued for a few worker threads, so that the first read of a thumbnail
+ * does not have to decode and resize the original itself. A worker only
+ * holds the imgFS lock (shared) to read the original and (alone) to write
+ * the result: the resizing itself runs without it.
+ * Jobs are best effort: when the queue is full, or when the pool is
+ * stopped, the image is simply resized lazily by its first read.
+ *
+ * The pool also keeps the table of the resizes in flight, keyed by
+ * (slot, resolution), whoever runs them: a read that needs a missing
+ * resolution either runs the resize itself (resize_pool_resize()),
+ * taking it out of the queue if it was waiting there, or waits for the
+ * one already in flight, so that a burst of reads of a new image decodes
+ * it only once. When RESIZE_POOL_MAX_INFLIGHT resizes are
+ * in flight, the next ones wait for one of them to be over before they
+ * start.
+ */
+
+#pragma once
+
+#include "imgfs.h" // for struct imgfs_file, SHA256_DIGEST_LENGTH
+#include "image_content.h" // for RES_BIT
+
+#include <pthread.h>
+#include <stddef.h> // for size_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RESIZE_POOL_QUEUE_SIZE 256
+#define RESIZE_POOL_MAX_WORKERS 16
+#define RESIZE_POOL_MAX_INFLIGHT 64
+
+/**
+ * @brief One image to resize in some resolutions.
+ */
+struct resize_job {
+    size_t index; // slot of the image in the metadata
+    unsigned resolutions; // RES_BIT() of THUMB_RES and/or SMALL_RES
+    unsigned char SHA[SHA256_DIGEST_LENGTH]; // to detect a deleted (replaced) image
+};
+
+struct resize_pool;
+
+/**
+ * @brief One worker thread.
+ */
+struct resize_worker {
+    pthread_t thread;
+    struct resize_pool* pool;
+};
+
+/**
+ * @brief The queue of jobs and the workers running them.
+ */
+struct resize_pool {
+    struct imgfs_file* imgfs_file;
+    pthread_rwlock_t* imgfs_lock; // the lock protecting imgfs_file
+    pthread_mutex_t mutex; // protects everything below
+    pthread_cond_t job_ready; // to wake up idle workers
+    pthread_cond_t job_done; // to wake up the threads waiting for a job
+    struct resize_job queue[RESIZE_POOL_QUEUE_SIZE]; // circular
+    size_t head; // first queued job
+    size_t nb_queued;
+    struct resize_job inflight[RESIZE_POOL_MAX_INFLIGHT]; // jobs being run, by workers or readers
+    size_t nb_inflight;
+    size_t nb_resized; // resizes run (that had to decode an original)
+    struct resize_worker workers[RESIZE_POOL_MAX_WORKERS];
+    size_t nb_workers;
+    int stopping;
+};
+
+/**
+ * @brief Starts the worker threads.
+ *
+ * @param pool The pool to start
+ * @param imgfs_file The imgFS where the images are resized
+ * @param imgfs_lock The lock protecting imgfs_file
+ * @param nb_workers The number of threads (between 1 and RESIZE_POOL_MAX_WORKERS)
+ * @return Some error code. 0 if no error.
+ */
+int resize_pool_start(struct resize_pool* pool, struct imgfs_file* imgfs_file,
+                      pthread_rwlock_t* imgfs_lock, size_t nb_workers);
+
+/**
+ * @brief Queues the creation of the THUMB_RES and SMALL_RES versions of an image
+ *        (as one job).
+ *        May be called with imgfs_lock held.
+ *
+ * @param pool The pool
+ * @param index The slot of the image in the metadata
+ * @param sha The SHA of the image
+ * @return Some error code. 0 if no error (also when the jobs were dropped).
+ */
+int resize_pool_submit(struct resize_pool* pool, size_t index, const unsigned char* sha);
+
+/**
+ * @brief Waits until a job (queued or running) for that image and resolution
+ *        is over. Must be called without imgfs_lock held.
+ *
+ * @param pool The pool
+ * @param index The slot of the image in the metadata
+ * @param resolution The resolution
+ * @return 1 if there was such a job (the image may now exist in that resolution), 0 otherwise.
+ */
+int resize_pool_wait(struct resize_pool* pool, size_t index, int resolution);
+
+/**
+ * @brief Creates an image in a resolution (and in the other resized ones it
+ *        misses, from the same decoding), unless a resize of it in that
+ *        resolution is already in flight, in which case it waits for it
+ *        instead. A job for it that is only queued is removed from the
+ *        queue, and run by the caller. While RESIZE_POOL_MAX_INFLIGHT
+ *        resizes are in flight, it first waits for one of them to be over.
+ *        Must be called without imgfs_lock held.
+ *
+ * @param pool The (started) pool
+ * @param index The slot of the image in the metadata
+ * @param resolution The resolution (THUMB_RES or SMALL_RES)
+ * @param sha The SHA of the image
+ * @return Some error code. 0 if no error (the image may now exist in that resolution).
+ */
+int resize_pool_resize(struct resize_pool* pool, size_t index, int resolution, const unsigned char* sha);
+
+/**
+ * @brief Drops the queued jobs and stops the worker threads
+ *        (once they are done with their current job).
+ *
+ * @param pool The pool
+ */
+void resize_pool_stop(struct resize_pool* pool);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,18 +1,25 @@
 #include "socket_layer.h"
 #include "error.h"
 #include <sys/socket.h>
+#include <sys/time.h> // for struct timeval
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include "util.h"
 #include <string.h>
 
 // Constant used for the TCP protocol
 #define TCP 0
-// maximum length for the queue of pending connections
+// maximum length for the queue of pending connections (of tcp_server_init())
 #define BACKLOG 16
 
 int tcp_server_init(uint16_t port)
+{
+    return tcp_server_init_with(port, BACKLOG, 0);
+}
+
+int tcp_server_init_with(uint16_t port, int backlog, int reuse_port)
 {
     // Create TCP socket
     int socket_id = socket(AF_INET, SOCK_STREAM, TCP);
@@ -27,6 +34,12 @@ int tcp_server_init(uint16_t port)
         return ERR_IO;
     }
 
+    // Several sockets listening on the same port: the kernel spreads the connections
+    if (reuse_port && setsockopt(socket_id, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1) {
+        close(socket_id);
+        return ERR_IO;
+    }
+
     // Create server address
     struct sockaddr_in socket_addr;
     zero_init_var(socket_addr);
@@ -43,7 +56,7 @@ int tcp_server_init(uint16_t port)
     }
 
     // Start listening for incoming connections
-    if (listen(socket_id, BACKLOG) == -1) {
+    if (listen(socket_id, backlog) == -1) {
         perror("Error in listen");
         close(socket_id);
         return ERR_IO;
@@ -64,6 +77,31 @@ ssize_t tcp_read(int active_socket, char* buf, size_t buflen)
     return recv(active_socket, buf, buflen, 0);
 }
 
+ssize_t tcp_read_nowait(int active_socket, char* buf, size_t buflen)
+{
+    M_REQUIRE_NON_NULL(buf);
+    return recv(active_socket, buf, buflen, MSG_DONTWAIT);
+}
+
+int tcp_set_timeout(int active_socket, unsigned seconds)
+{
+    struct timeval timeout;
+    zero_init_var(timeout);
+    timeout.tv_sec = seconds;
+    if (setsockopt(active_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1
+        || setsockopt(active_socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == -1) {
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
+
+int tcp_set_nonblocking(int socket_id)
+{
+    const int flags = fcntl(socket_id, F_GETFL, 0);
+    if (flags == -1 || fcntl(socket_id, F_SETFL, flags | O_NONBLOCK) == -1) return ERR_IO;
+    return ERR_NONE;
+}
+
 ssize_t tcp_send(int active_socket, const char* response, size_t response_len)
 {
     M_REQUIRE_NON_NULL(response);
@@ -14,7 +14,20 @@
 int tcp_server_init(uint16_t port);
 
 /**
- * @brief Blocking call that accepts a new TCP connection
+ * @brief Same as tcp_server_init(), with backlog pending connections at most
+ *        and, if reuse_port, SO_REUSEPORT: each socket so created on the same
+ *        port gets its share of the incoming connections.
+ */
+int tcp_server_init_with(uint16_t port, int backlog, int reuse_port);
+
+/**
+ * @brief Makes the calls on the socket (e.g. tcp_accept()) fail with errno EAGAIN
+ *        instead of blocking
+ */
+int tcp_set_nonblocking(int socket_id);
+
+/**
+ * @brief Blocking call that accepts a new TCP connection (unless the passive socket is nonblocking)
  */
 int tcp_accept(int passive_socket);
 
@@ -23,4 +36,15 @@ int tcp_accept(int passive_socket);
  */
 ssize_t tcp_read(int active_socket, char* buf, size_t buflen);
 
+/**
+ * @brief Non-blocking version of tcp_read(): fails with errno EAGAIN if there is nothing to read
+ */
+ssize_t tcp_read_nowait(int active_socket, char* buf, size_t buflen);
+
+/**
+ * @brief Makes the blocking reads and sends of the active socket fail after seconds
+ *        without progress (0 for never)
+ */
+int tcp_set_timeout(int active_socket, unsigned seconds);
+
 ssize_t tcp_send(int active_socket, const char* response, size_t response_len);
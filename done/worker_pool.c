@@ -0,0 +1,168 @@
+/**
+ * @file worker_pool.c
+ * @brief Fixed set of worker threads fed by a bounded queue.
+ */
+
+#include "worker_pool.h"
+#include "error.h"
+
+#include <signal.h>
+#include <stdlib.h> // for calloc, free
+#include <string.h> // for memset
+
+/*******************************************************************
+ * Worker thread: runs the queued items until the pool is stopped.
+ */
+static void* worker_main(void* arg)
+{
+    struct worker_pool* pool = arg;
+
+    // The signals are for the main thread
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT );
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    pthread_mutex_lock(&pool->mutex);
+    while (1) {
+        while (!pool->stopping && pool->nb_queued == 0) pthread_cond_wait(&pool->not_empty, &pool->mutex);
+        if (pool->stopping) break;
+
+        void* const item = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % pool->queue_size;
+        --pool->nb_queued;
+        pthread_cond_signal(&pool->not_full);
+        pthread_mutex_unlock(&pool->mutex);
+
+        pool->run(item);
+
+        pthread_mutex_lock(&pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+/*******************************************************************
+ * Queues item and wakes up a worker. Must be called with pool->mutex
+ * held, and room in the queue.
+ */
+static void enqueue(struct worker_pool* pool, void* item)
+{
+    pool->queue[(pool->head + pool->nb_queued) % pool->queue_size] = item;
+    ++pool->nb_queued;
+    pthread_cond_signal(&pool->not_empty);
+}
+
+/********************************************************************/
+int worker_pool_start(struct worker_pool* pool, size_t nb_workers, size_t queue_size,
+                      WorkerRun run, WorkerDrop drop)
+{
+    M_REQUIRE_NON_NULL(pool);
+    M_REQUIRE_NON_NULL(run);
+    if (nb_workers == 0 || nb_workers > WORKER_POOL_MAX_WORKERS || queue_size == 0) return ERR_INVALID_ARGUMENT;
+
+    memset(pool, 0, sizeof(*pool));
+    pool->run = run;
+    pool->drop = drop;
+    pool->queue_size = queue_size;
+    pool->queue = calloc(queue_size, sizeof(*pool->queue));
+    pool->workers = calloc(nb_workers, sizeof(*pool->workers));
+    if (pool->queue == NULL || pool->workers == NULL) {
+        free(pool->queue);
+        free(pool->workers);
+        memset(pool, 0, sizeof(*pool));
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    int initialized = 0;
+    if (pthread_mutex_init(&pool->mutex, NULL) == 0) ++initialized;
+    if (initialized == 1 && pthread_cond_init(&pool->not_empty, NULL) == 0) ++initialized;
+    if (initialized == 2 && pthread_cond_init(&pool->not_full, NULL) == 0) ++initialized;
+    if (initialized < 3) {
+        if (initialized > 1) pthread_cond_destroy(&pool->not_empty);
+        if (initialized > 0) pthread_mutex_destroy(&pool->mutex);
+        free(pool->queue);
+        free(pool->workers);
+        memset(pool, 0, sizeof(*pool));
+        return ERR_THREADING;
+    }
+
+    for (size_t i = 0; i < nb_workers; ++i) {
+        if (pthread_create(&pool->workers[i], NULL, worker_main, pool) != 0) {
+            worker_pool_stop(pool);
+            return ERR_THREADING;
+        }
+        pool->nb_workers = i + 1;
+    }
+
+    return ERR_NONE;
+}
+
+/********************************************************************/
+int worker_pool_submit(struct worker_pool* pool, void* item)
+{
+    M_REQUIRE_NON_NULL(pool);
+    M_REQUIRE_NON_NULL(pool->queue);
+
+    if (pthread_mutex_lock(&pool->mutex) != 0) return ERR_THREADING;
+    while (!pool->stopping && pool->nb_queued == pool->queue_size) {
+        pthread_cond_wait(&pool->not_full, &pool->mutex);
+    }
+    if (pool->stopping) {
+        pthread_mutex_unlock(&pool->mutex);
+        return ERR_THREADING;
+    }
+
+    enqueue(pool, item);
+    pthread_mutex_unlock(&pool->mutex);
+
+    return ERR_NONE;
+}
+
+/********************************************************************/
+int worker_pool_try_submit(struct worker_pool* pool, void* item)
+{
+    M_REQUIRE_NON_NULL(pool);
+    M_REQUIRE_NON_NULL(pool->queue);
+
+    if (pthread_mutex_lock(&pool->mutex) != 0) return ERR_THREADING;
+    int ret = 0;
+    if (pool->stopping) {
+        ret = ERR_THREADING;
+    } else if (pool->nb_queued < pool->queue_size) {
+        enqueue(pool, item);
+        ret = 1;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    return ret;
+}
+
+/********************************************************************/
+void worker_pool_stop(struct worker_pool* pool)
+{
+    if (pool == NULL || pool->queue == NULL) return;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_cond_broadcast(&pool->not_full);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (size_t i = 0; i < pool->nb_workers; ++i) pthread_join(pool->workers[i], NULL);
+
+    // Nobody takes them any more
+    for (; pool->nb_queued > 0; --pool->nb_queued) {
+        if (pool->drop != NULL) pool->drop(pool->queue[pool->head]);
+        pool->head = (pool->head + 1) % pool->queue_size;
+    }
+
+    pthread_cond_destroy(&pool->not_full);
+    pthread_cond_destroy(&pool->not_empty);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->queue);
+    free(pool->workers);
+    memset(pool, 0, sizeof(*pool));
+}
@@ -0,0 +1,95 @@
+/**
+ * @file worker_pool.h
+ * @brief Fixed set of worker threads fed by a bounded queue.
+ *
+ * The threads are created once, by worker_pool_start(), and each of them
+ * runs the items queued by worker_pool_submit(), one at a time, in the
+ * order they were queued. The queue holds at most queue_size items:
+ * submitting to a full queue either waits for a worker to take one
+ * (worker_pool_submit()), so that a burst of work slows down its
+ * producers instead of piling up, or fails at once
+ * (worker_pool_try_submit()), so that its producer can turn it down.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h> // for size_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WORKER_POOL_MAX_WORKERS 256
+
+/**
+ * @brief Runs one item (in a worker thread).
+ */
+typedef void (*WorkerRun)(void* item);
+
+/**
+ * @brief Disposes of an item that will never be run (still queued when
+ *        the pool is stopped).
+ */
+typedef void (*WorkerDrop)(void* item);
+
+/**
+ * @brief The queue of items and the workers running them.
+ */
+struct worker_pool {
+    WorkerRun run;
+    WorkerDrop drop;
+    pthread_mutex_t mutex; // protects everything below
+    pthread_cond_t not_empty; // to wake up idle workers
+    pthread_cond_t not_full; // to wake up waiting producers
+    void** queue; // circular, of queue_size items
+    size_t queue_size;
+    size_t head; // first queued item
+    size_t nb_queued;
+    pthread_t* workers;
+    size_t nb_workers;
+    int stopping;
+};
+
+/**
+ * @brief Starts the worker threads.
+ *
+ * @param pool The pool to start
+ * @param nb_workers The number of threads (between 1 and WORKER_POOL_MAX_WORKERS)
+ * @param queue_size The maximum number of queued items (at least 1)
+ * @param run The function running an item
+ * @param drop The function disposing of an item never run (NULL if nothing to do)
+ * @return Some error code. 0 if no error.
+ */
+int worker_pool_start(struct worker_pool* pool, size_t nb_workers, size_t queue_size,
+                      WorkerRun run, WorkerDrop drop);
+
+/**
+ * @brief Queues an item, waiting for room in the queue if it is full.
+ *
+ * @param pool The pool
+ * @param item The item
+ * @return Some error code (ERR_THREADING once the pool is stopping). 0 if no error.
+ */
+int worker_pool_submit(struct worker_pool* pool, void* item);
+
+/**
+ * @brief Queues an item if there is room for it in the queue, without waiting.
+ *
+ * @param pool The pool
+ * @param item The item
+ * @return 1 if it was queued, 0 if the queue is full, a negative error code otherwise.
+ */
+int worker_pool_try_submit(struct worker_pool* pool, void* item);
+
+/**
+ * @brief Drops the queued items and stops the worker threads
+ *        (once they are done with their current item).
+ *
+ * @param pool The pool
+ */
+void worker_pool_stop(struct worker_pool* pool);
+
+#ifdef __cplusplus
+}
+#endif
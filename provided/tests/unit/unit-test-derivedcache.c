@@ -0,0 +1,340 @@
+#include "derived_cache.h"
+#include "imgfs.h"
+#include "test.h"
+#include <check.h>
+#include <string.h>
+
+#define IMAGE_SIZE 100
+
+// ======================================================================
+START_TEST(derived_res_parse_valid)
+{
+    start_test_print;
+
+    uint16_t width = 0;
+    uint16_t height = 0;
+
+    ck_assert_err_none(derived_res_parse("320x200", &width, &height));
+    ck_assert_uint_eq(width, 320);
+    ck_assert_uint_eq(height, 200);
+
+    ck_assert_err_none(derived_res_parse("64", &width, &height));
+    ck_assert_uint_eq(width, 64);
+    ck_assert_uint_eq(height, 0);
+
+    ck_assert_err_none(derived_res_parse("4096x1", &width, &height));
+    ck_assert_uint_eq(width, DERIVED_RES_MAX);
+    ck_assert_uint_eq(height, 1);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(derived_res_parse_invalid)
+{
+    start_test_print;
+
+    uint16_t width = 0;
+    uint16_t height = 0;
+
+    ck_assert_invalid_arg(derived_res_parse(NULL, &width, &height));
+    ck_assert_invalid_arg(derived_res_parse("64", NULL, &height));
+    ck_assert_invalid_arg(derived_res_parse("64", &width, NULL));
+
+    const char* const invalid[] = { "", "0", "0x10", "10x0", "x10", "10x", "10x10x10", "-10",
+                                    "+10", " 10", "10 ", "4097", "10x4097", "99999999999999999999", "thumb"
+                                  };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i) {
+        ck_assert_err(derived_res_parse(invalid[i], &width, &height), ERR_RESOLUTIONS);
+    }
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(derived_cache_put_get)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    remove(dump);
+
+    struct derived_cache cache;
+    unsigned char sha[SHA256_DIGEST_LENGTH] = { 1 };
+    char image[IMAGE_SIZE];
+    char* buffer = NULL;
+    uint32_t size = 0;
+    memset(image, 'a', sizeof(image));
+
+    ck_assert_invalid_arg(derived_cache_open(&cache, dump, 0, 1000));
+    ck_assert_invalid_arg(derived_cache_open(&cache, dump, 4, 0));
+    ck_assert_err_none(derived_cache_open(&cache, dump, 4, 1000));
+
+    ck_assert_err(derived_cache_get(&cache, sha, 32, 32, &buffer, &size), ERR_IMAGE_NOT_FOUND);
+    ck_assert_invalid_arg(derived_cache_put(&cache, sha, 32, 32, image, 0));
+    ck_assert_invalid_arg(derived_cache_put(&cache, sha, 32, 32, image, 1001));
+    ck_assert_err_none(derived_cache_put(&cache, sha, 32, 32, image, sizeof(image)));
+    // Already there
+    ck_assert_err_none(derived_cache_put(&cache, sha, 32, 32, image, sizeof(image)));
+    ck_assert_uint_eq(cache.nb_bytes, sizeof(image));
+
+    ck_assert_err_none(derived_cache_get(&cache, sha, 32, 32, &buffer, &size));
+    ck_assert_uint_eq(size, sizeof(image));
+    ck_assert_mem_eq(buffer, image, sizeof(image));
+    free(buffer); buffer = NULL;
+
+    // Another resolution (or image) is another entry
+    ck_assert_err(derived_cache_get(&cache, sha, 32, 0, &buffer, &size), ERR_IMAGE_NOT_FOUND);
+    sha[0] = 2;
+    ck_assert_err(derived_cache_get(&cache, sha, 32, 32, &buffer, &size), ERR_IMAGE_NOT_FOUND);
+
+    derived_cache_close(&cache);
+    remove(dump);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(derived_cache_evicts_lru)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    remove(dump);
+
+    struct derived_cache cache;
+    unsigned char sha[SHA256_DIGEST_LENGTH] = { 0 };
+    char image[2 * IMAGE_SIZE];
+    char* buffer = NULL;
+    uint32_t size = 0;
+    memset(image, 'b', sizeof(image));
+
+    // Room for 3 images only
+    ck_assert_err_none(derived_cache_open(&cache, dump, 8, 3 * IMAGE_SIZE));
+    for (uint16_t w = 1; w <= 3; ++w) ck_assert_err_none(derived_cache_put(&cache, sha, w, 0, image, IMAGE_SIZE));
+
+    // 1 is used again, so 2 goes first
+    ck_assert_err_none(derived_cache_get(&cache, sha, 1, 0, &buffer, &size));
+    free(buffer); buffer = NULL;
+    ck_assert_err_none(derived_cache_put(&cache, sha, 4, 0, image, IMAGE_SIZE));
+    ck_assert_err(derived_cache_get(&cache, sha, 2, 0, &buffer, &size), ERR_IMAGE_NOT_FOUND);
+    ck_assert_uint_le(cache.nb_bytes, 3 * IMAGE_SIZE);
+
+    // A bigger one takes the room of more than one (contiguous, hence maybe of all of them)
+    ck_assert_err_none(derived_cache_put(&cache, sha, 5, 0, image, 2 * IMAGE_SIZE));
+    ck_assert_uint_le(cache.nb_bytes, 3 * IMAGE_SIZE);
+    ck_assert_err(derived_cache_get(&cache, sha, 3, 0, &buffer, &size), ERR_IMAGE_NOT_FOUND);
+    ck_assert_err_none(derived_cache_get(&cache, sha, 5, 0, &buffer, &size));
+    ck_assert_uint_eq(size, 2 * IMAGE_SIZE);
+    free(buffer); buffer = NULL;
+    derived_cache_close(&cache);
+
+    // Out of entries rather than out of room
+    remove(dump);
+    ck_assert_err_none(derived_cache_open(&cache, dump, 2, 1000));
+    for (uint16_t w = 1; w <= 3; ++w) ck_assert_err_none(derived_cache_put(&cache, sha, w, 0, image, IMAGE_SIZE));
+    ck_assert_err(derived_cache_get(&cache, sha, 1, 0, &buffer, &size), ERR_IMAGE_NOT_FOUND);
+    ck_assert_err_none(derived_cache_get(&cache, sha, 3, 0, &buffer, &size));
+    free(buffer); buffer = NULL;
+    derived_cache_close(&cache);
+    remove(dump);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(derived_cache_reopen)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    remove(dump);
+
+    struct derived_cache cache;
+    const unsigned char sha[SHA256_DIGEST_LENGTH] = { 3 };
+    char image[IMAGE_SIZE];
+    char* buffer = NULL;
+    uint32_t size = 0;
+    memset(image, 'c', sizeof(image));
+
+    ck_assert_err_none(derived_cache_open(&cache, dump, 4, 1000));
+    ck_assert_err_none(derived_cache_put(&cache, sha, 10, 20, image, sizeof(image)));
+    derived_cache_close(&cache);
+
+    // Kept across restarts
+    ck_assert_err_none(derived_cache_open(&cache, dump, 4, 1000));
+    ck_assert_uint_eq(cache.nb_bytes, sizeof(image));
+    ck_assert_err_none(derived_cache_get(&cache, sha, 10, 20, &buffer, &size));
+    ck_assert_mem_eq(buffer, image, sizeof(image));
+    free(buffer); buffer = NULL;
+    derived_cache_close(&cache);
+
+    // But not with other parameters
+    ck_assert_err_none(derived_cache_open(&cache, dump, 8, 1000));
+    ck_assert_uint_eq(cache.nb_bytes, 0);
+    ck_assert_err(derived_cache_get(&cache, sha, 10, 20, &buffer, &size), ERR_IMAGE_NOT_FOUND);
+    derived_cache_close(&cache);
+    remove(dump);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(derived_cache_drops_invalid_entries)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    remove(dump);
+
+    struct derived_cache cache;
+    const unsigned char sha[SHA256_DIGEST_LENGTH] = { 3 };
+    const unsigned char other[SHA256_DIGEST_LENGTH] = { 4 };
+    char image[IMAGE_SIZE];
+    char* buffer = NULL;
+    uint32_t size = 0;
+    memset(image, 'c', sizeof(image));
+
+    ck_assert_err_none(derived_cache_open(&cache, dump, 4, 1000));
+    ck_assert_err_none(derived_cache_put(&cache, sha, 10, 20, image, sizeof(image)));
+    derived_cache_close(&cache);
+
+    // The other entries: the same key, out of the data area, overlapping the first one
+    struct derived_entry entries[4];
+    FILE* f = fopen(dump, "rb+");
+    ck_assert_ptr_nonnull(f);
+    ck_assert_int_eq(fseek(f, sizeof(struct derived_cache_header), SEEK_SET), 0);
+    ck_assert_uint_eq(fread(entries, sizeof(entries[0]), 4, f), 4);
+    const struct derived_entry valid = entries[0];
+    ck_assert_uint_eq(valid.size, sizeof(image));
+    entries[1] = valid;
+    entries[1].offset += sizeof(image);
+    entries[2] = valid;
+    entries[2].width = 11;
+    entries[2].offset += 1000;
+    entries[3] = valid;
+    memcpy(entries[3].SHA, other, SHA256_DIGEST_LENGTH);
+    entries[3].offset += sizeof(image) / 2;
+    ck_assert_int_eq(fseek(f, sizeof(struct derived_cache_header), SEEK_SET), 0);
+    ck_assert_uint_eq(fwrite(entries, sizeof(entries[0]), 4, f), 4);
+    fclose(f);
+
+    ck_assert_err_none(derived_cache_open(&cache, dump, 4, 1000));
+    ck_assert_uint_eq(cache.nb_bytes, sizeof(image));
+    ck_assert_err(derived_cache_get(&cache, sha, 11, 20, &buffer, &size), ERR_IMAGE_NOT_FOUND);
+    ck_assert_err(derived_cache_get(&cache, other, 10, 20, &buffer, &size), ERR_IMAGE_NOT_FOUND);
+
+    // The dropped entries are free again, and the kept one intact
+    for (uint16_t w = 1; w <= 3; ++w) {
+        memset(image, 'd', sizeof(image));
+        ck_assert_err_none(derived_cache_put(&cache, other, w, 0, image, sizeof(image)));
+    }
+    memset(image, 'c', sizeof(image));
+    ck_assert_err_none(derived_cache_get(&cache, sha, 10, 20, &buffer, &size));
+    ck_assert_uint_eq(size, sizeof(image));
+    ck_assert_mem_eq(buffer, image, sizeof(image));
+    free(buffer); buffer = NULL;
+    derived_cache_close(&cache);
+    remove(dump);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(derived_cache_many_entries)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    remove(dump);
+
+    struct derived_cache cache;
+    unsigned char sha[SHA256_DIGEST_LENGTH] = { 0 };
+    char image[IMAGE_SIZE];
+    char* buffer = NULL;
+    uint32_t size = 0;
+
+    // Twice as many images as entries: the first half is evicted, in order
+    ck_assert_err_none(derived_cache_open(&cache, dump, 64, 1000 * IMAGE_SIZE));
+    for (uint16_t n = 0; n < 128; ++n) {
+        sha[0] = (unsigned char) (n % 4);
+        memset(image, 'a' + n % 26, sizeof(image));
+        ck_assert_err_none(derived_cache_put(&cache, sha, (uint16_t) (1 + n / 4), 0, image, sizeof(image)));
+    }
+    for (uint16_t n = 0; n < 128; ++n) {
+        sha[0] = (unsigned char) (n % 4);
+        const int ret = derived_cache_get(&cache, sha, (uint16_t) (1 + n / 4), 0, &buffer, &size);
+        if (n < 64) {
+            ck_assert_err(ret, ERR_IMAGE_NOT_FOUND);
+        } else {
+            ck_assert_err_none(ret);
+            ck_assert_int_eq(buffer[0], 'a' + n % 26);
+            free(buffer); buffer = NULL;
+        }
+    }
+    derived_cache_close(&cache);
+
+    // Found again once reopened
+    ck_assert_err_none(derived_cache_open(&cache, dump, 64, 1000 * IMAGE_SIZE));
+    sha[0] = 127 % 4;
+    ck_assert_err_none(derived_cache_get(&cache, sha, 1 + 127 / 4, 0, &buffer, &size));
+    free(buffer); buffer = NULL;
+    derived_cache_close(&cache);
+    remove(dump);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(derived_cache_keeps_pinned)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    remove(dump);
+
+    struct derived_cache cache;
+    const unsigned char sha[SHA256_DIGEST_LENGTH] = { 4 };
+    char image[IMAGE_SIZE];
+    char* buffer = NULL;
+    uint32_t size = 0;
+    memset(image, 'd', sizeof(image));
+
+    ck_assert_err_none(derived_cache_open(&cache, dump, 1, 1000));
+    ck_assert_err_none(derived_cache_put(&cache, sha, 1, 0, image, sizeof(image)));
+
+    // Being read (as by derived_cache_get()): it cannot make room
+    cache.pins[0] = 1;
+    ck_assert_err(derived_cache_put(&cache, sha, 2, 0, image, sizeof(image)), ERR_RUNTIME);
+    cache.pins[0] = 0;
+    ck_assert_err_none(derived_cache_get(&cache, sha, 1, 0, &buffer, &size));
+    free(buffer); buffer = NULL;
+
+    ck_assert_err_none(derived_cache_put(&cache, sha, 2, 0, image, sizeof(image)));
+    ck_assert_err(derived_cache_get(&cache, sha, 1, 0, &buffer, &size), ERR_IMAGE_NOT_FOUND);
+    derived_cache_close(&cache);
+    remove(dump);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *derived_cache_test_suite()
+{
+    Suite *s = suite_create("Tests for the derived images cache");
+
+    Add_Test(s, derived_res_parse_valid);
+    Add_Test(s, derived_res_parse_invalid);
+    Add_Test(s, derived_cache_put_get);
+    Add_Test(s, derived_cache_evicts_lru);
+    Add_Test(s, derived_cache_reopen);
+    Add_Test(s, derived_cache_drops_invalid_entries);
+    Add_Test(s, derived_cache_many_entries);
+    Add_Test(s, derived_cache_keeps_pinned);
+
+    return s;
+}
+
+TEST_SUITE(derived_cache_test_suite)
@@ -279,6 +279,163 @@ START_TEST(http_parse_message_full_headers_full_content)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(http_parse_message_pipelined)
+{
+    start_test_print;
+
+    // The next message of the connection follows (keep-alive)
+    const char *str = "POST /imgfs/insert?name=a HTTP/1.1" HTTP_LINE_DELIM "Content-Length: 5" HTTP_HDR_END_DELIM
+                      "HelloGET /imgfs/list HTTP/1.1" HTTP_HDR_END_DELIM;
+    struct http_message msg;
+    int content_len;
+
+    ck_assert_int_eq(http_parse_message(str, strlen(str), &msg, &content_len), 1);
+    ck_assert_int_eq(content_len, 5);
+    ck_assert_http_str_eq(msg.method, "POST");
+    ck_assert_http_str_eq(msg.body, "Hello");
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_parser_feed_null_params)
+{
+    start_test_print;
+
+    struct http_parser parser;
+    struct http_message msg;
+    const char *str = "";
+
+    http_parser_init(&parser);
+    http_parser_init(NULL);
+    ck_assert_invalid_arg(http_parser_feed(NULL, str, 0, &msg));
+    ck_assert_invalid_arg(http_parser_feed(&parser, NULL, 0, &msg));
+    ck_assert_invalid_arg(http_parser_feed(&parser, str, 0, NULL));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_parser_feed_byte_by_byte)
+{
+    start_test_print;
+
+    const char *str = "POST /imgfs/insert?name=a HTTP/1.1" HTTP_LINE_DELIM "Host: localhost:8000" HTTP_LINE_DELIM
+                      "Content-Length: 5" HTTP_HDR_END_DELIM "HelloGET /imgfs/list HTTP/1.1" HTTP_HDR_END_DELIM;
+    const size_t header_len = (size_t) (strstr(str, "Hello") - str);
+    const size_t msg_len = header_len + 5;
+    struct http_parser parser;
+    struct http_message msg;
+    char stream[256];
+
+    // The bytes arrive one at a time
+    http_parser_init(&parser);
+    memset(stream, 0, sizeof(stream));
+    for (size_t n = 1; n < msg_len; ++n) {
+        stream[n - 1] = str[n - 1];
+        ck_assert_int_eq(http_parser_feed(&parser, stream, n, &msg), 0);
+        ck_assert_uint_eq(parser.scanned, n < header_len ? n : header_len);
+        if (n < header_len) {
+            ck_assert_int_eq(parser.stage, HTTP_PARSE_HEADER);
+        } else {
+            ck_assert_int_eq(parser.stage, HTTP_PARSE_BODY);
+            ck_assert_uint_eq(parser.header_len, header_len);
+            ck_assert_uint_eq(parser.content_len, 5);
+            ck_assert_uint_eq(parser.body_received, n - header_len);
+        }
+    }
+
+    // The last byte comes along with the next message, in a moved stream
+    char moved[256];
+    strcpy(moved, str);
+    ck_assert_int_eq(http_parser_feed(&parser, moved, strlen(moved), &msg), 1);
+    ck_assert_int_eq(parser.stage, HTTP_PARSE_DONE);
+    ck_assert_uint_eq(parser.body_received, 5);
+    ck_assert_ptr_eq(msg.method.val, moved);
+    ck_assert_http_str_eq(msg.method, "POST");
+    ck_assert_http_str_eq(msg.uri, "/imgfs/insert?name=a");
+    ck_assert_int_eq(msg.num_headers, 2);
+    ck_assert_has_header(&msg, "Host", "localhost:8000");
+    ck_assert_http_str_eq(msg.body, "Hello");
+
+    // Then the next one
+    http_parser_init(&parser);
+    ck_assert_int_eq(http_parser_feed(&parser, moved + msg_len, strlen(moved + msg_len), &msg), 1);
+    ck_assert_http_str_eq(msg.method, "GET");
+    ck_assert_http_str_eq(msg.uri, "/imgfs/list");
+    ck_assert_int_eq(msg.num_headers, 0);
+    ck_assert_uint_eq(msg.body.len, 0);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_parser_feed_malformed)
+{
+    start_test_print;
+
+    struct http_parser parser;
+    struct http_message msg;
+
+    const char *no_colon = "GET / HTTP/1.1" HTTP_LINE_DELIM "Host" HTTP_HDR_END_DELIM;
+    http_parser_init(&parser);
+    ck_assert_int_lt(http_parser_feed(&parser, no_colon, strlen(no_colon), &msg), 0);
+
+    const char *negative = "POST / HTTP/1.1" HTTP_LINE_DELIM "Content-Length: -3" HTTP_HDR_END_DELIM;
+    http_parser_init(&parser);
+    ck_assert_int_lt(http_parser_feed(&parser, negative, strlen(negative), &msg), 0);
+
+    char many[2048] = "GET / HTTP/1.1" HTTP_LINE_DELIM;
+    for (size_t i = 0; i <= MAX_HEADERS; ++i) strcat(many, "X-Header: 1" HTTP_LINE_DELIM);
+    strcat(many, HTTP_LINE_DELIM);
+    http_parser_init(&parser);
+    ck_assert_int_lt(http_parser_feed(&parser, many, strlen(many), &msg), 0);
+
+    // Fewer bytes than already scanned
+    const char *partial = "GET / HTTP/1.1" HTTP_LINE_DELIM;
+    http_parser_init(&parser);
+    ck_assert_int_eq(http_parser_feed(&parser, partial, strlen(partial), &msg), 0);
+    ck_assert_invalid_arg(http_parser_feed(&parser, partial, 2, &msg));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_get_header_valid)
+{
+    start_test_print;
+
+    const char *str =
+    "GET /imgfs/list HTTP/1.1" HTTP_LINE_DELIM "Host: localhost:8000" HTTP_LINE_DELIM
+    "If-None-Match: \"imgfs-3\"" HTTP_LINE_DELIM "Accept: */*" HTTP_HDR_END_DELIM;
+    struct http_message msg;
+    struct http_string value;
+    int content_len;
+
+    ck_assert_int_eq(http_parse_message(str, strlen(str), &msg, &content_len), 1);
+
+    ck_assert_invalid_arg(http_get_header(NULL, "Host", &value));
+    ck_assert_invalid_arg(http_get_header(&msg, NULL, &value));
+    ck_assert_invalid_arg(http_get_header(&msg, "Host", NULL));
+
+    ck_assert_int_eq(http_get_header(&msg, "If-None-Match", &value), 1);
+    ck_assert_http_str_eq(value, "\"imgfs-3\"");
+    ck_assert_int_eq(http_get_header(&msg, "if-none-match", &value), 1);
+    ck_assert_int_eq(http_get_header(&msg, "accept", &value), 1);
+    ck_assert_http_str_eq(value, "*/*");
+
+    ck_assert_int_eq(http_get_header(&msg, "If-None", &value), 0);
+    ck_assert_int_eq(http_get_header(&msg, "Content-Length", &value), 0);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *http_test_suite()
 {
@@ -300,6 +457,13 @@ Suite *http_test_suite()
     Add_Test(s, http_parse_message_full_headers_no_content);
     Add_Test(s, http_parse_message_full_headers_partial_content);
     Add_Test(s, http_parse_message_full_headers_full_content);
+    Add_Test(s, http_parse_message_pipelined);
+
+    Add_Test(s, http_parser_feed_null_params);
+    Add_Test(s, http_parser_feed_byte_by_byte);
+    Add_Test(s, http_parser_feed_malformed);
+
+    Add_Test(s, http_get_header_valid);
 
     return s;
 }
@@ -0,0 +1,236 @@
+#include "image_cache.h"
+#include "imgfs.h"
+#include "test.h"
+#include <check.h>
+#include <pthread.h>
+#include <string.h>
+
+#define IMAGE_SIZE 100
+#define NB_THREADS 8
+#define NB_LOOPS 1000
+
+// ======================================================================
+START_TEST(image_cache_null_params)
+{
+    start_test_print;
+
+    struct image_cache cache;
+    char* buffer = NULL;
+    uint32_t size = 0;
+    const char image[IMAGE_SIZE] = { 0 };
+
+    ck_assert_invalid_arg(image_cache_init(NULL, 1000, 0));
+    ck_assert_invalid_arg(image_cache_init(&cache, IMAGE_CACHE_SHARDS - 1, 0));
+    ck_assert_err_none(image_cache_init(&cache, 1000, 0));
+    ck_assert_invalid_arg(image_cache_get(NULL, "pic1", THUMB_RES, &buffer, &size));
+    ck_assert_invalid_arg(image_cache_get(&cache, NULL, THUMB_RES, &buffer, &size));
+    ck_assert_invalid_arg(image_cache_get(&cache, "pic1", THUMB_RES, NULL, &size));
+    ck_assert_invalid_arg(image_cache_get(&cache, "pic1", THUMB_RES, &buffer, NULL));
+    ck_assert_invalid_arg(image_cache_put(NULL, "pic1", THUMB_RES, 0, image, sizeof(image)));
+    ck_assert_invalid_arg(image_cache_put(&cache, NULL, THUMB_RES, 0, image, sizeof(image)));
+    ck_assert_invalid_arg(image_cache_put(&cache, "pic1", THUMB_RES, 0, NULL, sizeof(image)));
+    image_cache_invalidate(NULL, "pic1");
+    image_cache_set_version(NULL, 1);
+    image_cache_get_stats(NULL, NULL);
+    image_cache_free(&cache);
+    image_cache_free(NULL);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(image_cache_put_get)
+{
+    start_test_print;
+
+    struct image_cache cache;
+    struct image_cache_stats stats;
+    char image[IMAGE_SIZE];
+    char* buffer = NULL;
+    uint32_t size = 0;
+    memset(image, 'a', sizeof(image));
+
+    ck_assert_err_none(image_cache_init(&cache, 1024 * 1024, 3));
+    ck_assert_err(image_cache_get(&cache, "pic1", THUMB_RES, &buffer, &size), ERR_IMAGE_NOT_FOUND);
+    ck_assert_err_none(image_cache_put(&cache, "pic1", THUMB_RES, 3, image, sizeof(image)));
+
+    ck_assert_err_none(image_cache_get(&cache, "pic1", THUMB_RES, &buffer, &size));
+    ck_assert_uint_eq(size, sizeof(image));
+    ck_assert_mem_eq(buffer, image, sizeof(image));
+    free(buffer); buffer = NULL;
+
+    // Another resolution (or image) is another entry
+    ck_assert_err(image_cache_get(&cache, "pic1", SMALL_RES, &buffer, &size), ERR_IMAGE_NOT_FOUND);
+    ck_assert_err(image_cache_get(&cache, "pic2", THUMB_RES, &buffer, &size), ERR_IMAGE_NOT_FOUND);
+
+    // Put again: replaced, not duplicated
+    image[0] = 'b';
+    ck_assert_err_none(image_cache_put(&cache, "pic1", THUMB_RES, 3, image, sizeof(image)));
+    ck_assert_err_none(image_cache_get(&cache, "pic1", THUMB_RES, &buffer, &size));
+    ck_assert_int_eq(buffer[0], 'b');
+    free(buffer); buffer = NULL;
+
+    image_cache_get_stats(&cache, &stats);
+    ck_assert_uint_eq(stats.hits, 2);
+    ck_assert_uint_eq(stats.misses, 3);
+    ck_assert_uint_eq(stats.nb_entries, 1);
+    ck_assert_uint_eq(stats.nb_bytes, sizeof(image));
+
+    image_cache_free(&cache);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(image_cache_invalidation)
+{
+    start_test_print;
+
+    struct image_cache cache;
+    struct image_cache_stats stats;
+    char image[IMAGE_SIZE];
+    char* buffer = NULL;
+    uint32_t size = 0;
+    memset(image, 'c', sizeof(image));
+
+    ck_assert_err_none(image_cache_init(&cache, 1024 * 1024, 0));
+    ck_assert_err_none(image_cache_put(&cache, "pic1", THUMB_RES, 0, image, sizeof(image)));
+    ck_assert_err_none(image_cache_put(&cache, "pic1", ORIG_RES, 0, image, sizeof(image)));
+    ck_assert_err_none(image_cache_put(&cache, "pic2", THUMB_RES, 0, image, sizeof(image)));
+
+    // All the resolutions of a deleted image
+    image_cache_invalidate(&cache, "pic1");
+    ck_assert_err(image_cache_get(&cache, "pic1", THUMB_RES, &buffer, &size), ERR_IMAGE_NOT_FOUND);
+    ck_assert_err(image_cache_get(&cache, "pic1", ORIG_RES, &buffer, &size), ERR_IMAGE_NOT_FOUND);
+    ck_assert_err_none(image_cache_get(&cache, "pic2", THUMB_RES, &buffer, &size));
+    free(buffer); buffer = NULL;
+
+    // Everything once the imgFS changed
+    image_cache_set_version(&cache, 1);
+    ck_assert_err(image_cache_get(&cache, "pic2", THUMB_RES, &buffer, &size), ERR_IMAGE_NOT_FOUND);
+    image_cache_get_stats(&cache, &stats);
+    ck_assert_uint_eq(stats.nb_entries, 0);
+
+    // Nor is what was read before it changed cached
+    ck_assert_err_none(image_cache_put(&cache, "pic2", THUMB_RES, 0, image, sizeof(image)));
+    ck_assert_err(image_cache_get(&cache, "pic2", THUMB_RES, &buffer, &size), ERR_IMAGE_NOT_FOUND);
+    ck_assert_err_none(image_cache_put(&cache, "pic2", THUMB_RES, 1, image, sizeof(image)));
+    ck_assert_err_none(image_cache_get(&cache, "pic2", THUMB_RES, &buffer, &size));
+    free(buffer); buffer = NULL;
+
+    image_cache_free(&cache);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(image_cache_evicts_lru)
+{
+    start_test_print;
+
+    struct image_cache cache;
+    struct image_cache_stats stats;
+    char image[4 * IMAGE_SIZE];
+    char* buffer = NULL;
+    uint32_t size = 0;
+    memset(image, 'd', sizeof(image));
+
+    // Room for 3 images per shard; all the resolutions of an image share a shard
+    ck_assert_err_none(image_cache_init(&cache, IMAGE_CACHE_SHARDS * 3 * IMAGE_SIZE, 0));
+    ck_assert_err_none(image_cache_put(&cache, "pic1", THUMB_RES, 0, image, IMAGE_SIZE));
+    ck_assert_err_none(image_cache_put(&cache, "pic1", SMALL_RES, 0, image, IMAGE_SIZE));
+    ck_assert_err_none(image_cache_put(&cache, "pic1", ORIG_RES, 0, image, IMAGE_SIZE));
+
+    // THUMB_RES is used again, so SMALL_RES goes first
+    ck_assert_err_none(image_cache_get(&cache, "pic1", THUMB_RES, &buffer, &size));
+    free(buffer); buffer = NULL;
+    ck_assert_err_none(image_cache_put(&cache, "pic1", 3, 0, image, IMAGE_SIZE));
+    ck_assert_err(image_cache_get(&cache, "pic1", SMALL_RES, &buffer, &size), ERR_IMAGE_NOT_FOUND);
+    ck_assert_err_none(image_cache_get(&cache, "pic1", THUMB_RES, &buffer, &size));
+    free(buffer); buffer = NULL;
+
+    // Too big for a shard: not cached
+    ck_assert_err_none(image_cache_put(&cache, "pic2", ORIG_RES, 0, image, 4 * IMAGE_SIZE));
+    ck_assert_err(image_cache_get(&cache, "pic2", ORIG_RES, &buffer, &size), ERR_IMAGE_NOT_FOUND);
+
+    image_cache_get_stats(&cache, &stats);
+    ck_assert_uint_le(stats.nb_bytes, 3 * IMAGE_SIZE);
+
+    image_cache_free(&cache);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+static void* cache_user(void* arg)
+{
+    struct image_cache* cache = arg;
+    char image[IMAGE_SIZE];
+    char img_id[MAX_IMG_ID + 1];
+    memset(image, 'e', sizeof(image));
+
+    for (int i = 0; i < NB_LOOPS; ++i) {
+        snprintf(img_id, sizeof(img_id), "pic%d", i % 50);
+        char* buffer = NULL;
+        uint32_t size = 0;
+        const int ret = image_cache_get(cache, img_id, i % NB_RES, &buffer, &size);
+        if (ret == ERR_NONE && (size != sizeof(image) || memcmp(buffer, image, size) != 0)) {
+            free(buffer);
+            return (void*) 1;
+        }
+        free(buffer);
+        if (ret != ERR_NONE) image_cache_put(cache, img_id, i % NB_RES, 0, image, sizeof(image));
+        if (i % 97 == 0) image_cache_invalidate(cache, img_id);
+    }
+    return NULL;
+}
+
+START_TEST(image_cache_concurrent)
+{
+    start_test_print;
+
+    struct image_cache cache;
+    struct image_cache_stats stats;
+    pthread_t threads[NB_THREADS];
+
+    // Small enough for evictions to happen too
+    ck_assert_err_none(image_cache_init(&cache, IMAGE_CACHE_SHARDS * 5 * IMAGE_SIZE, 0));
+    for (size_t i = 0; i < NB_THREADS; ++i) {
+        ck_assert_int_eq(pthread_create(&threads[i], NULL, cache_user, &cache), 0);
+    }
+    for (size_t i = 0; i < NB_THREADS; ++i) {
+        void* ret = NULL;
+        ck_assert_int_eq(pthread_join(threads[i], &ret), 0);
+        ck_assert_ptr_null(ret);
+    }
+
+    image_cache_get_stats(&cache, &stats);
+    ck_assert_uint_eq(stats.hits + stats.misses, NB_THREADS * NB_LOOPS);
+    ck_assert_uint_le(stats.nb_bytes, IMAGE_CACHE_SHARDS * 5 * IMAGE_SIZE);
+    ck_assert_uint_eq(stats.nb_bytes, stats.nb_entries * IMAGE_SIZE);
+
+    image_cache_free(&cache);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *image_cache_test_suite()
+{
+    Suite *s = suite_create("Tests for the in-memory image cache");
+
+    Add_Test(s, image_cache_null_params);
+    Add_Test(s, image_cache_put_get);
+    Add_Test(s, image_cache_invalidation);
+    Add_Test(s, image_cache_evicts_lru);
+    Add_Test(s, image_cache_concurrent);
+
+    return s;
+}
+
+TEST_SUITE(image_cache_test_suite)
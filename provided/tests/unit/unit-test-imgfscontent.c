@@ -262,6 +262,54 @@ START_TEST(lazily_resize_valid_fallible)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(lazily_resize_all_valid)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+
+    long file_size;
+    struct imgfs_file file;
+    void* small = NULL;
+    size_t small_size = 0;
+    char original[72876];
+    read_file(original, DATA_DIR "/papillon.jpg", 72876);
+
+    ck_assert_invalid_arg(lazily_resize_all(NULL, 0));
+
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err(lazily_resize_all(&file, 3), ERR_INVALID_IMGID);
+    ck_assert_err_none(lazily_resize_all(&file, 0));
+
+    // Both resolutions, one after the other at the end of the file
+    ck_assert_uint_ne(file.metadata[0].size[THUMB_RES], 0);
+    ck_assert_uint_ne(file.metadata[0].size[SMALL_RES], 0);
+    ck_assert_int_eq(fseek(file.file, 0, SEEK_END), 0);
+    file_size = ftell(file.file);
+    ck_assert_uint_eq(file_size, 192659 + file.metadata[0].size[THUMB_RES] + file.metadata[0].size[SMALL_RES]);
+
+    // The biggest one is as if it was created alone
+    ck_assert_err_none(create_resized_img(original, sizeof(original), 256, 256, &small, &small_size));
+    ck_assert_uint_eq(file.metadata[0].size[SMALL_RES], small_size);
+    g_free(small);
+
+    // Nothing more to do
+    ck_assert_err_none(lazily_resize_all(&file, 0));
+    ck_assert_int_eq(fseek(file.file, 0, SEEK_END), 0);
+    ck_assert_int_eq(ftell(file.file), file_size);
+    do_close(&file);
+
+    // Checks that metadata is correctly persisted
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_uint_ne(file.metadata[0].offset[THUMB_RES], 0);
+    ck_assert_uint_ne(file.metadata[0].offset[SMALL_RES], 0);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *imgfs_content_test_suite()
 {
@@ -275,6 +323,7 @@ Suite *imgfs_content_test_suite()
     Add_Test(s, lazily_resize_already_exists);
     Add_Test(s, lazily_resize_valid);
     Add_Test(s, lazily_resize_valid_fallible);
+    Add_Test(s, lazily_resize_all_valid);
 
     return s;
 }
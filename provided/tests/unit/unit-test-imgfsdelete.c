@@ -46,6 +46,19 @@ START_TEST(do_delete_read_only)
     ck_assert_err_none(do_open(dump, "rb", &file));
 
     ck_assert_err(do_delete("pic1", &file), ERR_IO);
+    // Nothing changed
+    ck_assert_int_eq(file.metadata[0].is_valid, NON_EMPTY);
+    ck_assert_int_eq(file.header.version, 2);
+    ck_assert_int_eq(file.header.nb_files, 2);
+
+    do_close(&file);
+
+    // Same through a (private) mapping
+    ck_assert_err_none(do_open_mapped(dump, "rb", &file));
+
+    ck_assert_err(do_delete("pic1", &file), ERR_IO);
+    ck_assert_int_eq(file.metadata[0].is_valid, NON_EMPTY);
+    ck_assert_int_eq(file.header.nb_files, 2);
 
     do_close(&file);
 
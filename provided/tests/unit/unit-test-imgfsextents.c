@@ -0,0 +1,211 @@
+#include "imgfs.h"
+#include "imgfs_extents.h"
+#include "test.h"
+#include <check.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define PIC1_SIZE 72876
+#define PIC2_SIZE 98119
+#define MURE_SIZE 40861
+
+static long long file_size(const char* filename)
+{
+    struct stat st;
+    ck_assert_int_eq(stat(filename, &st), 0);
+    return (long long) st.st_size;
+}
+
+// ======================================================================
+START_TEST(imgfs_extents_null_params)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    uint64_t offset = 0;
+
+    ck_assert_invalid_arg(imgfs_extents_create(NULL, 0));
+    ck_assert_invalid_arg(imgfs_extents_load(NULL, 0, 0, 0));
+    ck_assert_invalid_arg(imgfs_extents_alloc(NULL, 1, &offset));
+    ck_assert_invalid_arg(imgfs_extents_release(NULL, 1, 1));
+
+    memset(&file, 0, sizeof(file));
+    ck_assert_invalid_arg(imgfs_extents_alloc(&file, 1, &offset));
+    ck_assert_invalid_arg(imgfs_extents_release(&file, 1, 1));
+    imgfs_extents_free(NULL);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_extents_first_fit)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    uint64_t offset = 0;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+
+    // No index region: the allocator only lives in memory
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_ptr_nonnull(file.extents.table);
+    ck_assert_uint_eq(file.extents.offset, 0);
+    ck_assert_err_none(imgfs_extents_alloc(&file, 1000, &offset));
+    ck_assert_uint_eq(offset, 0);
+
+    const uint64_t pic1 = file.metadata[0].offset[ORIG_RES];
+    ck_assert_err_none(do_delete("pic1", &file));
+
+    // The space of pic1 is given piece by piece, while it is large enough
+    ck_assert_err_none(imgfs_extents_alloc(&file, 1000, &offset));
+    ck_assert_uint_eq(offset, pic1);
+    ck_assert_err_none(imgfs_extents_alloc(&file, PIC1_SIZE, &offset));
+    ck_assert_uint_eq(offset, 0);
+    ck_assert_err_none(imgfs_extents_alloc(&file, PIC1_SIZE - 1000, &offset));
+    ck_assert_uint_eq(offset, pic1 + 1000);
+    ck_assert_err_none(imgfs_extents_alloc(&file, 1, &offset));
+    ck_assert_uint_eq(offset, 0);
+
+    do_close(&file);
+    ck_assert_ptr_null(file.extents.table);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_extents_reused_by_insert)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    char pic1[PIC1_SIZE];
+    char pic2[PIC2_SIZE];
+    char mure[MURE_SIZE];
+    read_file(pic1, DATA_DIR "/papillon.jpg", PIC1_SIZE);
+    read_file(pic2, DATA_DIR "/coquelicots.jpg", PIC2_SIZE);
+    read_file(mure, DATA_DIR "/mure.jpg", MURE_SIZE);
+
+    struct imgfs_file file = { .header.max_files = 10,
+                               .header.resized_res = { 32, 32, 64, 64 } };
+    ck_assert_err_none(do_create(dump, &file));
+    ck_assert_uint_eq(file.extents.offset, file.content_index.offset + file.content_index.capacity * sizeof(uint32_t));
+    ck_assert_err_none(do_insert(pic1, PIC1_SIZE, "pic1", &file));
+    ck_assert_err_none(do_insert(pic2, PIC2_SIZE, "pic2", &file));
+    const uint64_t offset = file.metadata[0].offset[ORIG_RES];
+    ck_assert_err_none(do_delete("pic1", &file));
+    do_close(&file);
+    const long long size = file_size(dump);
+
+    // The free extent was persisted: mure goes where pic1 was
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(do_insert(mure, MURE_SIZE, "mure", &file));
+    ck_assert_uint_eq(file.metadata[0].offset[ORIG_RES], offset);
+    do_close(&file);
+    ck_assert_int_eq(file_size(dump), size);
+
+    char* image = NULL;
+    uint32_t image_size = 0;
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_err_none(do_read("mure", ORIG_RES, &image, &image_size, &file));
+    ck_assert_uint_eq(image_size, MURE_SIZE);
+    ck_assert_mem_eq(image, mure, MURE_SIZE);
+    free(image);
+    image = NULL;
+    ck_assert_err_none(do_read("pic2", ORIG_RES, &image, &image_size, &file));
+    ck_assert_uint_eq(image_size, PIC2_SIZE);
+    ck_assert_mem_eq(image, pic2, PIC2_SIZE);
+    free(image);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_extents_shared_blob)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    char pic1[PIC1_SIZE];
+    uint64_t offset = 0;
+    read_file(pic1, DATA_DIR "/papillon.jpg", PIC1_SIZE);
+
+    struct imgfs_file file = { .header.max_files = 10,
+                               .header.resized_res = { 32, 32, 64, 64 } };
+    ck_assert_err_none(do_create(dump, &file));
+    ck_assert_err_none(do_insert(pic1, PIC1_SIZE, "pic1", &file));
+    ck_assert_err_none(do_insert(pic1, PIC1_SIZE, "pic3", &file));
+
+    // pic3 still uses the blob: it is not free
+    ck_assert_err_none(do_delete("pic1", &file));
+    ck_assert_err_none(imgfs_extents_alloc(&file, 1, &offset));
+    ck_assert_uint_eq(offset, 0);
+
+    // Now it is
+    ck_assert_err_none(do_delete("pic3", &file));
+    ck_assert_err_none(imgfs_extents_alloc(&file, PIC1_SIZE, &offset));
+    ck_assert_uint_ne(offset, 0);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_extents_stale_rebuild)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    char pic1[PIC1_SIZE];
+    char pic2[PIC2_SIZE];
+    uint64_t offset = 0;
+    read_file(pic1, DATA_DIR "/papillon.jpg", PIC1_SIZE);
+    read_file(pic2, DATA_DIR "/coquelicots.jpg", PIC2_SIZE);
+
+    struct imgfs_file file = { .header.max_files = 10,
+                               .header.resized_res = { 32, 32, 64, 64 } };
+    ck_assert_err_none(do_create(dump, &file));
+    ck_assert_err_none(do_insert(pic1, PIC1_SIZE, "pic1", &file));
+    ck_assert_err_none(do_insert(pic2, PIC2_SIZE, "pic2", &file));
+    const uint64_t pic1_offset = file.metadata[0].offset[ORIG_RES];
+
+    // pic1 is freed behind the back of the allocator, and the region gets stale
+    file.metadata[0].is_valid = EMPTY;
+    file.header.nb_files = 1;
+    file.header.version += 1;
+    ck_assert_err_none(imgfs_write_metadata(&file, 0));
+    ck_assert_err_none(imgfs_write_header(&file));
+    do_close(&file);
+
+    // The gap left by pic1 is found again
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(imgfs_extents_alloc(&file, PIC1_SIZE, &offset));
+    ck_assert_uint_eq(offset, pic1_offset);
+    ck_assert_err_none(imgfs_extents_alloc(&file, 1, &offset));
+    ck_assert_uint_eq(offset, 0);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_extents_test_suite()
+{
+    Suite *s = suite_create("Tests for the free extents allocator implementation");
+
+    Add_Test(s, imgfs_extents_null_params);
+    Add_Test(s, imgfs_extents_first_fit);
+    Add_Test(s, imgfs_extents_reused_by_insert);
+    Add_Test(s, imgfs_extents_shared_blob);
+    Add_Test(s, imgfs_extents_stale_rebuild);
+
+    return s;
+}
+
+TEST_SUITE(imgfs_extents_test_suite)
@@ -0,0 +1,266 @@
+#include "imgfs.h"
+#include "imgfs_gbcollect.h"
+#include "imgfs_index.h"
+#include "test.h"
+#include <check.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Size of test02.imgfs: header and 100 metadata, then pic1 (72876 bytes) and pic2 (98119 bytes)
+#define TEST02_METADATA_END (sizeof(struct imgfs_header) + 100 * sizeof(struct img_metadata))
+#define PIC1_SIZE 72876
+#define PIC2_SIZE 98119
+
+static long long file_size(const char* filename)
+{
+    struct stat st;
+    ck_assert_int_eq(stat(filename, &st), 0);
+    return (long long) st.st_size;
+}
+
+// ======================================================================
+START_TEST(do_gbcollect_null_params)
+{
+    start_test_print;
+
+    struct imgfs_gc gc;
+    int done = 0;
+
+    ck_assert_invalid_arg(do_gbcollect(NULL, "tmp"));
+    ck_assert_invalid_arg(do_gbcollect(IMGFS("test02"), NULL));
+    ck_assert_invalid_arg(imgfs_gc_start(NULL, NULL, "tmp"));
+    ck_assert_invalid_arg(imgfs_gc_start(&gc, NULL, "tmp"));
+    ck_assert_invalid_arg(imgfs_gc_step(NULL, 1, &done));
+    ck_assert_invalid_arg(imgfs_gc_finish(NULL, "tmp", NULL, NULL));
+    imgfs_gc_abort(NULL);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_gbcollect_deleted_image)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DECLARE_DUMP_PREFIXED(tmp);
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(do_delete("pic1", &file));
+    const uint32_t version = file.header.version;
+    do_close(&file);
+
+    ck_assert_err_none(do_gbcollect(dump, dumptmp));
+
+    // Only pic2 is left, after the (new) index region
+    ck_assert_int_eq(file_size(dump), TEST02_METADATA_END + imgfs_index_region_size(100) + PIC2_SIZE);
+    ck_assert_int_ne(access(dumptmp, F_OK), 0);
+
+    char* expected = NULL;
+    uint32_t expected_size = 0;
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+    ck_assert_err_none(do_read("pic2", ORIG_RES, &expected, &expected_size, &file));
+    do_close(&file);
+
+    char* image = NULL;
+    uint32_t image_size = 0;
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_int_eq(file.header.version, version + 1);
+    ck_assert_int_eq(file.header.nb_files, 1);
+    ck_assert_int_eq(file.metadata[0].is_valid, EMPTY);
+    ck_assert_int_eq(file.metadata[1].offset[ORIG_RES], TEST02_METADATA_END + imgfs_index_region_size(100));
+    ck_assert_err(do_read("pic1", ORIG_RES, &image, &image_size, &file), ERR_IMAGE_NOT_FOUND);
+    ck_assert_err_none(do_read("pic2", ORIG_RES, &image, &image_size, &file));
+    do_close(&file);
+
+    ck_assert_uint_eq(image_size, expected_size);
+    ck_assert_mem_eq(image, expected, image_size);
+    free(image);
+    free(expected);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_gbcollect_shared_blob)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DECLARE_DUMP_PREFIXED(tmp);
+
+    char image[PIC1_SIZE];
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    read_file(image, DATA_DIR "/papillon.jpg", PIC1_SIZE);
+
+    // pic3 has the same content as pic1
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(do_insert(image, PIC1_SIZE, "pic3", &file));
+    do_close(&file);
+
+    ck_assert_err_none(do_gbcollect(dump, dumptmp));
+
+    // The blob is copied once and stays shared
+    ck_assert_int_eq(file_size(dump), TEST02_METADATA_END + imgfs_index_region_size(100) + PIC1_SIZE + PIC2_SIZE);
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_int_eq(file.header.nb_files, 3);
+    ck_assert_str_eq(file.metadata[2].img_id, "pic3");
+    ck_assert_int_eq(file.metadata[2].offset[ORIG_RES], file.metadata[0].offset[ORIG_RES]);
+    ck_assert_int_eq(file.metadata[2].size[ORIG_RES], PIC1_SIZE);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_gbcollect_incremental)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DECLARE_DUMP_PREFIXED(tmp);
+
+    char image[82234];
+    struct imgfs_file file;
+    struct imgfs_gc gc;
+    int done = 1;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    read_file(image, DATA_DIR "/brouillard.jpg", 82234);
+
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(imgfs_gc_start(&gc, &file, dumptmp));
+    ck_assert_err_none(imgfs_gc_step(&gc, 1, &done));
+    ck_assert_int_eq(done, 0);
+
+    // pic1 was already copied when it is replaced
+    ck_assert_err_none(do_delete("pic1", &file));
+    ck_assert_err_none(do_insert(image, 82234, "pic3", &file));
+
+    int64_t reclaimed = 0;
+    ck_assert_err_none(imgfs_gc_finish(&gc, dump, NULL, &reclaimed));
+    imgfs_gc_abort(&gc);
+    do_close(&file);
+
+    // The copy of pic1, made before it was deleted, is left as garbage
+    // (as its original was): only the new index region makes a difference
+    ck_assert_int_eq(reclaimed, -(int64_t) imgfs_index_region_size(100));
+
+    char* read = NULL;
+    uint32_t read_size = 0;
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_int_eq(file.header.nb_files, 2);
+    ck_assert_str_eq(file.metadata[0].img_id, "pic3");
+    ck_assert_err(do_read("pic1", ORIG_RES, &read, &read_size, &file), ERR_IMAGE_NOT_FOUND);
+    ck_assert_err_none(do_read("pic3", ORIG_RES, &read, &read_size, &file));
+    do_close(&file);
+
+    ck_assert_uint_eq(read_size, 82234);
+    ck_assert_mem_eq(read, image, 82234);
+    free(read);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_gbcollect_reused_space)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DECLARE_DUMP_PREFIXED(tmp);
+
+    char pic1[PIC1_SIZE];
+    char mure[40861];
+    struct imgfs_gc gc;
+    int done = 1;
+    read_file(pic1, DATA_DIR "/papillon.jpg", PIC1_SIZE);
+    read_file(mure, DATA_DIR "/mure.jpg", 40861);
+
+    struct imgfs_file file = { .header.max_files = 10,
+                               .header.resized_res = { 32, 32, 64, 64 } };
+    ck_assert_err_none(do_create(dump, &file));
+    ck_assert_err_none(do_insert(pic1, PIC1_SIZE, "pic1", &file));
+    const uint64_t offset = file.metadata[0].offset[ORIG_RES];
+    do_close(&file);
+
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(imgfs_gc_start(&gc, &file, dumptmp));
+    ck_assert_err_none(imgfs_gc_step(&gc, 1, &done));
+
+    // mure takes the space of pic1, already copied
+    ck_assert_err_none(do_delete("pic1", &file));
+    ck_assert_err_none(do_insert(mure, 40861, "mure", &file));
+    ck_assert_int_eq(file.metadata[0].offset[ORIG_RES], offset);
+
+    ck_assert_err_none(imgfs_gc_finish(&gc, dump, NULL, NULL));
+    imgfs_gc_abort(&gc);
+    do_close(&file);
+
+    // The copy of mure is not the one of pic1
+    char* read = NULL;
+    uint32_t read_size = 0;
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_err_none(do_read("mure", ORIG_RES, &read, &read_size, &file));
+    do_close(&file);
+
+    ck_assert_uint_eq(read_size, 40861);
+    ck_assert_mem_eq(read, mure, 40861);
+    free(read);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_gbcollect_reopened)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DECLARE_DUMP_PREFIXED(tmp);
+
+    struct imgfs_file file;
+    struct imgfs_file compacted;
+    struct imgfs_gc gc;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(imgfs_gc_start(&gc, &file, dumptmp));
+    ck_assert_err_none(imgfs_gc_finish(&gc, dump, &compacted, NULL));
+    imgfs_gc_abort(&gc);
+    do_close(&file);
+
+    // The compacted copy is the file now at dump: what is written to it stays
+    ck_assert_int_eq(compacted.header.nb_files, 2);
+    ck_assert_ptr_nonnull(compacted.map);
+    ck_assert_err_none(do_delete("pic1", &compacted));
+    do_close(&compacted);
+
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_int_eq(file.header.nb_files, 1);
+    ck_assert_int_eq(file.metadata[0].is_valid, EMPTY);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_gbcollect_test_suite()
+{
+    Suite *s = suite_create("Tests for the garbage collection implementation");
+
+    Add_Test(s, do_gbcollect_null_params);
+    Add_Test(s, do_gbcollect_deleted_image);
+    Add_Test(s, do_gbcollect_shared_blob);
+    Add_Test(s, do_gbcollect_incremental);
+    Add_Test(s, do_gbcollect_reused_space);
+    Add_Test(s, do_gbcollect_reopened);
+
+    return s;
+}
+
+TEST_SUITE(imgfs_gbcollect_test_suite)
@@ -0,0 +1,321 @@
+#include "imgfs.h"
+#include "imgfs_index.h"
+#include "test.h"
+#include <check.h>
+#include <string.h>
+
+// ======================================================================
+START_TEST(imgfs_index_null_params)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    size_t index = 0;
+    const unsigned char sha[SHA256_DIGEST_LENGTH] = { 0 };
+
+    ck_assert_invalid_arg(imgfs_index_find(NULL, "pic1", &index));
+    ck_assert_invalid_arg(imgfs_index_insert(NULL, 0));
+    ck_assert_invalid_arg(imgfs_index_remove(NULL, 0));
+    ck_assert_invalid_arg(imgfs_index_load(NULL, 0));
+
+    memset(&file, 0, sizeof(file));
+    ck_assert_invalid_arg(imgfs_index_find(&file, "pic1", &index));
+    ck_assert_invalid_arg(imgfs_index_find_content(&file, sha, 0, &index));
+    ck_assert_invalid_arg(imgfs_index_find_content(NULL, sha, 0, &index));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_index_legacy_file)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    size_t index = 42;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    // No region in older files: the index only lives in memory
+    ck_assert_uint_eq(file.index.offset, 0);
+    ck_assert_uint_eq(file.index.capacity, imgfs_index_capacity(100));
+
+    ck_assert_err_none(imgfs_index_find(&file, "pic1", &index));
+    ck_assert_uint_eq(index, 0);
+    ck_assert_err_none(imgfs_index_find(&file, "pic2", &index));
+    ck_assert_uint_eq(index, 1);
+    ck_assert_err(imgfs_index_find(&file, "pic3", &index), ERR_IMAGE_NOT_FOUND);
+
+    ck_assert_err_none(do_delete("pic1", &file));
+    ck_assert_err(imgfs_index_find(&file, "pic1", &index), ERR_IMAGE_NOT_FOUND);
+    ck_assert_err_none(imgfs_index_find(&file, "pic2", &index));
+    ck_assert_uint_eq(index, 1);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_index_persisted)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file = { .header.max_files = 10,
+                               .header.resized_res = { 32, 32, 64, 64 } };
+    ck_assert_err_none(do_create(dump, &file));
+    ck_assert_uint_eq(file.header.unused_64, sizeof(struct imgfs_header) + 10 * sizeof(struct img_metadata));
+    ck_assert_uint_eq(file.index.offset, file.header.unused_64 + sizeof(struct imgfs_index_header));
+    ck_assert_uint_eq(file.content_index.offset, file.index.offset + imgfs_index_capacity(10) * sizeof(uint32_t));
+    do_close(&file);
+
+    // Manually mark an image as valid and index it
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    strcpy(file.metadata[3].img_id, "pic1");
+    file.metadata[3].is_valid = NON_EMPTY;
+    ck_assert_err_none(imgfs_index_insert(&file, 3));
+    ck_assert_err_none(imgfs_index_sync(&file));
+    do_close(&file);
+
+    // The metadata was not written: finding pic1 proves the buckets were read back
+    size_t index = 0;
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    file.metadata[3].is_valid = NON_EMPTY;
+    strcpy(file.metadata[3].img_id, "pic1");
+    ck_assert_err_none(imgfs_index_find(&file, "pic1", &index));
+    ck_assert_uint_eq(index, 3);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_index_stale_rebuilt)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file = { .header.max_files = 10,
+                               .header.resized_res = { 32, 32, 64, 64 } };
+    ck_assert_err_none(do_create(dump, &file));
+
+    // Valid image in the metadata, but the on-disk index knows nothing about it
+    strcpy(file.metadata[5].img_id, "pic5");
+    file.metadata[5].is_valid = NON_EMPTY;
+    file.header.nb_files = 1;
+    file.header.version = 1;
+    ck_assert_int_eq(fseek(file.file, 0, SEEK_SET), 0);
+    ck_assert_uint_eq(fwrite(&file.header, sizeof(file.header), 1, file.file), 1);
+    ck_assert_int_eq(fseek(file.file, (long) (sizeof(file.header) + 5 * sizeof(struct img_metadata)), SEEK_SET), 0);
+    ck_assert_uint_eq(fwrite(&file.metadata[5], sizeof(struct img_metadata), 1, file.file), 1);
+    do_close(&file);
+
+    size_t index = 0;
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(imgfs_index_find(&file, "pic5", &index));
+    ck_assert_uint_eq(index, 5);
+    do_close(&file);
+
+    // The rebuilt index was written back with the current version
+    struct imgfs_index_header index_header;
+    FILE* f = fopen(dump, "rb");
+    ck_assert_ptr_nonnull(f);
+    ck_assert_int_eq(fseek(f, (long) file.header.unused_64, SEEK_SET), 0);
+    ck_assert_uint_eq(fread(&index_header, sizeof(index_header), 1, f), 1);
+    fclose(f);
+    ck_assert_mem_eq(index_header.magic, IMGFS_INDEX_MAGIC, IMGFS_INDEX_MAGIC_SIZE);
+    ck_assert_uint_eq(index_header.version, 1);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_index_corrupted_rebuilt)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file = { .header.max_files = 10,
+                               .header.resized_res = { 32, 32, 64, 64 } };
+    ck_assert_err_none(do_create(dump, &file));
+    do_close(&file);
+
+    // One image, with up-to-date indexes
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    strcpy(file.metadata[5].img_id, "pic5");
+    file.metadata[5].is_valid = NON_EMPTY;
+    file.header.nb_files = 1;
+    file.header.version = 1;
+    ck_assert_err_none(imgfs_write_metadata(&file, 5));
+    ck_assert_err_none(imgfs_write_header(&file));
+    ck_assert_err_none(imgfs_index_insert(&file, 5));
+    ck_assert_err_none(imgfs_index_sync(&file));
+    const uint64_t offset = file.index.offset;
+    const uint64_t capacity = file.index.capacity;
+    do_close(&file);
+
+    // Buckets out of range, then no free bucket: both must be rebuilt
+    const uint32_t values[] = { 0xFFFFFFFF, 7 };
+    for (size_t v = 0; v < sizeof(values) / sizeof(values[0]); ++v) {
+        FILE* f = fopen(dump, "rb+");
+        ck_assert_ptr_nonnull(f);
+        ck_assert_int_eq(fseek(f, (long) offset, SEEK_SET), 0);
+        for (uint64_t b = 0; b < capacity; ++b) {
+            ck_assert_uint_eq(fwrite(&values[v], sizeof(uint32_t), 1, f), 1);
+        }
+        fclose(f);
+
+        size_t index = 0;
+        ck_assert_err_none(do_open(dump, "rb", &file));
+        ck_assert_err_none(imgfs_index_find(&file, "pic5", &index));
+        ck_assert_uint_eq(index, 5);
+        ck_assert_err(imgfs_index_find(&file, "pic6", &index), ERR_IMAGE_NOT_FOUND);
+        do_close(&file);
+    }
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_index_write_failure)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file = { .header.max_files = 10,
+                               .header.resized_res = { 32, 32, 64, 64 } };
+    ck_assert_err_none(do_create(dump, &file));
+    do_close(&file);
+
+    // The buckets cannot be written, but both tables in memory follow anyway
+    size_t index = 0;
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    strcpy(file.metadata[3].img_id, "pic1");
+    file.metadata[3].SHA[0] = 1;
+    file.metadata[3].is_valid = NON_EMPTY;
+    ck_assert_err(imgfs_index_insert(&file, 3), ERR_IO);
+    ck_assert_err_none(imgfs_index_find(&file, "pic1", &index));
+    ck_assert_uint_eq(index, 3);
+    ck_assert_err_none(imgfs_index_find_content(&file, file.metadata[3].SHA, 0, &index));
+    ck_assert_uint_eq(index, 3);
+
+    ck_assert_err(imgfs_index_remove(&file, 3), ERR_IO);
+    ck_assert_err(imgfs_index_find(&file, "pic1", &index), ERR_IMAGE_NOT_FOUND);
+    ck_assert_err(imgfs_index_find_content(&file, file.metadata[3].SHA, 0, &index), ERR_IMAGE_NOT_FOUND);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_index_content)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    size_t index = 42;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    memcpy(sha, file.metadata[1].SHA, SHA256_DIGEST_LENGTH);
+
+    ck_assert_err_none(imgfs_index_find_content(&file, sha, 0, &index));
+    ck_assert_uint_eq(index, 1);
+    // The excepted image itself is never reported
+    ck_assert_err(imgfs_index_find_content(&file, sha, 1, &index), ERR_IMAGE_NOT_FOUND);
+
+    sha[0] ^= 0xFF;
+    ck_assert_err(imgfs_index_find_content(&file, sha, 0, &index), ERR_IMAGE_NOT_FOUND);
+
+    ck_assert_err_none(do_delete("pic2", &file));
+    ck_assert_err(imgfs_index_find_content(&file, file.metadata[1].SHA, 0, &index), ERR_IMAGE_NOT_FOUND);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_index_sorted)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file = { .header.max_files = 10,
+                               .header.resized_res = { 32, 32, 64, 64 } };
+    const char* const ids[] = { "pic5", "apple", "pic10", "zebra", "pic1" };
+    const size_t slots[] = { 7, 0, 3, 9, 4 };
+
+    ck_assert_err_none(do_create(dump, &file));
+    ck_assert_uint_eq(file.sorted.nb, 0);
+    ck_assert_uint_eq(imgfs_index_rank(&file, "pic", 0), 0);
+
+    for (size_t i = 0; i < sizeof(ids) / sizeof(ids[0]); ++i) {
+        strcpy(file.metadata[slots[i]].img_id, ids[i]);
+        file.metadata[slots[i]].is_valid = NON_EMPTY;
+        ck_assert_err_none(imgfs_index_insert(&file, slots[i]));
+    }
+
+    // apple, pic1, pic10, pic5, zebra
+    ck_assert_uint_eq(file.sorted.nb, 5);
+    ck_assert_uint_eq(file.sorted.slots[0], 0);
+    ck_assert_uint_eq(file.sorted.slots[1], 4);
+    ck_assert_uint_eq(file.sorted.slots[2], 3);
+    ck_assert_uint_eq(file.sorted.slots[3], 7);
+    ck_assert_uint_eq(file.sorted.slots[4], 9);
+    ck_assert_uint_eq(imgfs_index_rank(&file, "pic", 0), 1);
+    ck_assert_uint_eq(imgfs_index_rank(&file, "pic1", 0), 1);
+    ck_assert_uint_eq(imgfs_index_rank(&file, "pic1", 1), 2);
+    ck_assert_uint_eq(imgfs_index_rank(&file, "a", 0), 0);
+    ck_assert_uint_eq(imgfs_index_rank(&file, "zz", 0), 5);
+
+    // Removed like a deletion does: invalid first
+    file.metadata[3].is_valid = EMPTY;
+    ck_assert_err_none(imgfs_index_remove(&file, 3));
+    ck_assert_uint_eq(file.sorted.nb, 4);
+    ck_assert_uint_eq(file.sorted.slots[2], 7);
+    ck_assert_uint_eq(imgfs_index_rank(&file, "pic1", 1), 2);
+
+    // Rebuilt by do_open (the metadata of the others was not written)
+    ck_assert_err_none(imgfs_write_metadata(&file, 7));
+    ck_assert_err_none(imgfs_write_metadata(&file, 0));
+    do_close(&file);
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_uint_eq(file.sorted.nb, 2);
+    ck_assert_uint_eq(file.sorted.slots[0], 0);
+    ck_assert_uint_eq(file.sorted.slots[1], 7);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_index_test_suite()
+{
+    Suite *s = suite_create("Tests for the img_id and content index implementation");
+
+    Add_Test(s, imgfs_index_null_params);
+    Add_Test(s, imgfs_index_legacy_file);
+    Add_Test(s, imgfs_index_persisted);
+    Add_Test(s, imgfs_index_stale_rebuilt);
+    Add_Test(s, imgfs_index_corrupted_rebuilt);
+    Add_Test(s, imgfs_index_write_failure);
+    Add_Test(s, imgfs_index_content);
+    Add_Test(s, imgfs_index_sorted);
+
+    return s;
+}
+
+TEST_SUITE(imgfs_index_test_suite)
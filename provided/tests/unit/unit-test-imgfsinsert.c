@@ -1,6 +1,8 @@
 #include "imgfs.h"
+#include "imgfs_index.h"
 #include "test.h"
 #include <check.h>
+#include <stdlib.h>
 #include <string.h>
 #include <vips/vips.h>
 
@@ -103,6 +105,41 @@ START_TEST(do_insert_invalid_file_mode)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(do_insert_failure_rolled_back)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    char image[72876];
+    struct imgfs_file file;
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    read_file(image, DATA_DIR "/papillon.jpg", 72876);
+
+    const struct imgfs_header header = file.header;
+    const size_t md_size = file.header.max_files * sizeof(struct img_metadata);
+    struct img_metadata* metadata = malloc(md_size);
+    ck_assert_ptr_nonnull(metadata);
+    memcpy(metadata, file.metadata, md_size);
+
+    // A duplicate: nothing is written before the header, which fails
+    ck_assert_err(do_insert(image, 72876, "pic3", &file), ERR_IO);
+
+    ck_assert_int_eq(file.header.nb_files, header.nb_files);
+    ck_assert_int_eq(file.header.version, header.version);
+    ck_assert_mem_eq(file.metadata, metadata, md_size);
+    size_t index = 0;
+    ck_assert_err(imgfs_index_find(&file, "pic3", &index), ERR_IMAGE_NOT_FOUND);
+
+    free(metadata);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 START_TEST(do_insert_duplicate)
 {
@@ -338,6 +375,40 @@ START_TEST(do_insert_write_initializes_metadata)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(do_insert_prepared_valid)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    char image[82234];
+    struct imgfs_file file;
+    struct img_digest digest;
+
+    ck_assert_invalid_arg(do_insert_prepare(NULL, 0, &digest));
+    ck_assert_invalid_arg(do_insert_prepare(image, 0, NULL));
+    ck_assert_invalid_arg(do_insert_prepared(image, 0, "pic3", NULL, &file));
+
+    // The digest is computed without any imgFS
+    read_file(image, DATA_DIR "/brouillard.jpg", 82234);
+    ck_assert_err_none(do_insert_prepare(image, 82234, &digest));
+    ck_assert_int_eq(digest.orig_res[0], 600);
+    ck_assert_int_eq(digest.orig_res[1], 400);
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(do_insert_prepared(image, 82234, "pic3", &digest, &file));
+    ck_assert_int_eq(file.header.nb_files, 3);
+    ck_assert_str_eq(file.metadata[2].img_id, "pic3");
+    ck_assert_mem_eq(file.metadata[2].SHA, digest.SHA, SHA256_DIGEST_LENGTH);
+    ck_assert_int_eq(file.metadata[2].orig_res[0], 600);
+    ck_assert_int_eq(file.metadata[2].offset[ORIG_RES], 192659);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *imgfs_content_test_suite()
 {
@@ -348,10 +419,12 @@ Suite *imgfs_content_test_suite()
     Add_Test(s, do_insert_duplicate_id);
     Add_Test(s, do_insert_invalid_image);
     Add_Test(s, do_insert_invalid_file_mode);
+    Add_Test(s, do_insert_failure_rolled_back);
     Add_Test(s, do_insert_duplicate);
     Add_Test(s, do_insert_valid);
     Add_Test(s, do_insert_write_correct_metadata);
     Add_Test(s, do_insert_write_initializes_metadata);
+    Add_Test(s, do_insert_prepared_valid);
 
     return s;
 }
@@ -1,8 +1,10 @@
 #include "imgfs.h"
+#include "imgfs_index.h"
 #include "imgfscmd_functions.h"
 #include "test.h"
 #include "util.h"
 #include <check.h>
+#include <string.h>
 
 // ======================================================================
 START_TEST(do_list_null_params)
@@ -92,6 +94,140 @@ START_TEST(do_list_json_non_emtpy)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(do_list_page_null_params)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    char *out = NULL;
+
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+    ck_assert_invalid_arg(do_list_page(NULL, NULL, NULL, 10, &out));
+    ck_assert_invalid_arg(do_list_page(&file, NULL, NULL, 10, NULL));
+    ck_assert_invalid_arg(do_list_page(&file, NULL, NULL, 0, &out));
+    ck_assert_invalid_arg(do_list_page(&file, NULL, NULL, LIST_MAX_LIMIT + 1, &out));
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_list_page_valid)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    char *out = NULL;
+    struct imgfs_file file = { .header.max_files = 10,
+                               .header.resized_res = { 32, 32, 64, 64 } };
+    const char* const ids[] = { "pic3", "dog", "pic1", "cat", "pic2" };
+
+    // Indexed as do_insert does
+    ck_assert_err_none(do_create(dump, &file));
+    for (size_t i = 0; i < sizeof(ids) / sizeof(ids[0]); ++i) {
+        strcpy(file.metadata[i].img_id, ids[i]);
+        file.metadata[i].is_valid = NON_EMPTY;
+        ck_assert_err_none(imgfs_index_insert(&file, i));
+    }
+
+    ck_assert_err_none(do_list_page(&file, NULL, NULL, 10, &out));
+    ck_assert_str_eq(out, "{ \"Images\": [ \"cat\", \"dog\", \"pic1\", \"pic2\", \"pic3\" ] }");
+    free(out); out = NULL;
+
+    // Page by page
+    ck_assert_err_none(do_list_page(&file, NULL, NULL, 2, &out));
+    ck_assert_str_eq(out, "{ \"Images\": [ \"cat\", \"dog\" ], \"next\": \"dog\" }");
+    free(out); out = NULL;
+    ck_assert_err_none(do_list_page(&file, NULL, "dog", 2, &out));
+    ck_assert_str_eq(out, "{ \"Images\": [ \"pic1\", \"pic2\" ], \"next\": \"pic2\" }");
+    free(out); out = NULL;
+    ck_assert_err_none(do_list_page(&file, "", "pic2", 2, &out));
+    ck_assert_str_eq(out, "{ \"Images\": [ \"pic3\" ] }");
+    free(out); out = NULL;
+
+    // With a prefix (and a cursor that does not exist)
+    ck_assert_err_none(do_list_page(&file, "pic", NULL, 2, &out));
+    ck_assert_str_eq(out, "{ \"Images\": [ \"pic1\", \"pic2\" ], \"next\": \"pic2\" }");
+    free(out); out = NULL;
+    ck_assert_err_none(do_list_page(&file, "pic", "pic15", 1, &out));
+    ck_assert_str_eq(out, "{ \"Images\": [ \"pic2\" ], \"next\": \"pic2\" }");
+    free(out); out = NULL;
+    ck_assert_err_none(do_list_page(&file, "pic", "pic2", 1, &out));
+    ck_assert_str_eq(out, "{ \"Images\": [ \"pic3\" ] }");
+    free(out); out = NULL;
+    ck_assert_err_none(do_list_page(&file, "do", "a", 5, &out));
+    ck_assert_str_eq(out, "{ \"Images\": [ \"dog\" ] }");
+    free(out); out = NULL;
+    ck_assert_err_none(do_list_page(&file, "none", NULL, 5, &out));
+    ck_assert_str_eq(out, "{ \"Images\": [ ] }");
+    free(out); out = NULL;
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_list_ndjson_valid)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file = { .header.max_files = 10,
+                               .header.resized_res = { 32, 32, 64, 64 } };
+    const char* const ids[] = { "pic2", "a\"b\\c", "pic1", "tab\t" };
+    char buffer[LIST_NDJSON_MAX_RECORD + 30];
+    char cursor[MAX_IMG_ID + 1] = { 0 };
+    size_t len = 0;
+    int done = 0;
+
+    ck_assert_err_none(do_create(dump, &file));
+    for (size_t i = 0; i < sizeof(ids) / sizeof(ids[0]); ++i) {
+        strcpy(file.metadata[i].img_id, ids[i]);
+        file.metadata[i].is_valid = NON_EMPTY;
+        ck_assert_err_none(imgfs_index_insert(&file, i));
+    }
+
+    ck_assert_invalid_arg(do_list_ndjson(NULL, NULL, cursor, buffer, sizeof(buffer), &len, &done));
+    ck_assert_invalid_arg(do_list_ndjson(&file, NULL, NULL, buffer, sizeof(buffer), &len, &done));
+    ck_assert_invalid_arg(do_list_ndjson(&file, NULL, cursor, NULL, sizeof(buffer), &len, &done));
+    ck_assert_invalid_arg(do_list_ndjson(&file, NULL, cursor, buffer, LIST_NDJSON_MAX_RECORD - 1, &len, &done));
+
+    // Room for 2 records per call (escaped as needed)
+    ck_assert_err_none(do_list_ndjson(&file, NULL, cursor, buffer, sizeof(buffer), &len, &done));
+    ck_assert_int_eq(done, 0);
+    ck_assert_str_eq(cursor, "pic1");
+    const char first[] = "{\"img_id\":\"a\\\"b\\\\c\"}\n{\"img_id\":\"pic1\"}\n";
+    ck_assert_uint_eq(len, strlen(first));
+    ck_assert_mem_eq(buffer, first, len);
+
+    ck_assert_err_none(do_list_ndjson(&file, NULL, cursor, buffer, sizeof(buffer), &len, &done));
+    ck_assert_int_eq(done, 1);
+    const char second[] = "{\"img_id\":\"pic2\"}\n{\"img_id\":\"tab\\t\"}\n";
+    ck_assert_uint_eq(len, strlen(second));
+    ck_assert_mem_eq(buffer, second, len);
+
+    // With a prefix
+    cursor[0] = '\0';
+    ck_assert_err_none(do_list_ndjson(&file, "pic", cursor, buffer, LIST_NDJSON_MAX_RECORD, &len, &done));
+    ck_assert_int_eq(done, 0);
+    ck_assert_str_eq(cursor, "pic1");
+    ck_assert_err_none(do_list_ndjson(&file, "pic", cursor, buffer, LIST_NDJSON_MAX_RECORD, &len, &done));
+    ck_assert_int_eq(done, 1);
+    ck_assert_str_eq(cursor, "pic2");
+    ck_assert_err_none(do_list_ndjson(&file, "zz", cursor, buffer, LIST_NDJSON_MAX_RECORD, &len, &done));
+    ck_assert_int_eq(done, 1);
+    ck_assert_uint_eq(len, 0);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *imgfs_structures_test_suite()
 {
@@ -105,6 +241,10 @@ Suite *imgfs_structures_test_suite()
 
     Add_Test(s, do_list_json_emtpy);
     Add_Test(s, do_list_json_non_emtpy);
+
+    Add_Test(s, do_list_page_null_params);
+    Add_Test(s, do_list_page_valid);
+    Add_Test(s, do_list_ndjson_valid);
     return s;
 }
 
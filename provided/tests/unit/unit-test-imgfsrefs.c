@@ -0,0 +1,148 @@
+#include "imgfs.h"
+#include "imgfs_extents.h"
+#include "imgfs_refs.h"
+#include "test.h"
+#include <check.h>
+#include <string.h>
+
+#define PIC1_SIZE 72876
+
+// ======================================================================
+START_TEST(imgfs_refs_null_params)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    int dead = 0;
+
+    ck_assert_invalid_arg(imgfs_refs_build(NULL));
+    ck_assert_invalid_arg(imgfs_refs_get(NULL, 1));
+    ck_assert_invalid_arg(imgfs_refs_put(NULL, 1, &dead));
+
+    memset(&file, 0, sizeof(file));
+    ck_assert_invalid_arg(imgfs_refs_build(&file));
+    ck_assert_invalid_arg(imgfs_refs_get(&file, 1));
+    ck_assert_invalid_arg(imgfs_refs_put(&file, 1, &dead));
+    ck_assert_uint_eq(imgfs_refs_count(NULL, 1), 0);
+    imgfs_refs_free(NULL);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_refs_get_put)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    int dead = 1;
+    memset(&file, 0, sizeof(file));
+    file.header.max_files = 10;
+    file.metadata = calloc(10, sizeof(struct img_metadata));
+    ck_assert_ptr_nonnull(file.metadata);
+    ck_assert_err_none(imgfs_refs_build(&file));
+
+    // Many blobs hashed in a small table, then some of them dropped
+    for (uint64_t offset = 1000; offset < 1030; ++offset) ck_assert_err_none(imgfs_refs_get(&file, offset));
+    ck_assert_err_none(imgfs_refs_get(&file, 1007));
+    ck_assert_uint_eq(imgfs_refs_count(&file, 1007), 2);
+
+    ck_assert_err_none(imgfs_refs_put(&file, 1007, &dead));
+    ck_assert_int_eq(dead, 0);
+    ck_assert_err_none(imgfs_refs_put(&file, 1007, &dead));
+    ck_assert_int_eq(dead, 1);
+    ck_assert_uint_eq(imgfs_refs_count(&file, 1007), 0);
+    for (uint64_t offset = 1000; offset < 1030; offset += 2) {
+        ck_assert_err_none(imgfs_refs_put(&file, offset, &dead));
+        ck_assert_int_eq(dead, 1);
+    }
+
+    // The other ones are still found
+    for (uint64_t offset = 1001; offset < 1030; offset += 2) {
+        ck_assert_uint_eq(imgfs_refs_count(&file, offset), offset == 1007 ? 0 : 1);
+    }
+
+    // Unknown blobs are never dead
+    ck_assert_err_none(imgfs_refs_put(&file, 5000, &dead));
+    ck_assert_int_eq(dead, 0);
+
+    imgfs_refs_free(&file);
+    ck_assert_ptr_null(file.refs.offsets);
+    free(file.metadata);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_refs_open)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+
+    ck_assert_uint_eq(imgfs_refs_count(&file, file.metadata[0].offset[ORIG_RES]), 1);
+    ck_assert_uint_eq(imgfs_refs_count(&file, file.metadata[1].offset[ORIG_RES]), 1);
+    ck_assert_uint_eq(file.refs.nb, 2);
+
+    do_close(&file);
+    ck_assert_ptr_null(file.refs.offsets);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_refs_dedup_delete)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    char pic1[PIC1_SIZE];
+    uint64_t offset = 0;
+    read_file(pic1, DATA_DIR "/papillon.jpg", PIC1_SIZE);
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    // pic3 shares the blob of pic1
+    ck_assert_err_none(do_insert(pic1, PIC1_SIZE, "pic3", &file));
+    const uint64_t blob = file.metadata[0].offset[ORIG_RES];
+    ck_assert_uint_eq(file.metadata[2].offset[ORIG_RES], blob);
+    ck_assert_uint_eq(imgfs_refs_count(&file, blob), 2);
+
+    // Still used: not garbage
+    ck_assert_err_none(do_delete("pic1", &file));
+    ck_assert_uint_eq(imgfs_refs_count(&file, blob), 1);
+    ck_assert_err_none(imgfs_extents_alloc(&file, 1, &offset));
+    ck_assert_uint_eq(offset, 0);
+
+    // Last reference: the space is free at once
+    ck_assert_err_none(do_delete("pic3", &file));
+    ck_assert_uint_eq(imgfs_refs_count(&file, blob), 0);
+    ck_assert_err_none(imgfs_extents_alloc(&file, PIC1_SIZE, &offset));
+    ck_assert_uint_eq(offset, blob);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_refs_test_suite()
+{
+    Suite *s = suite_create("Tests for the reference counts of the blobs");
+
+    Add_Test(s, imgfs_refs_null_params);
+    Add_Test(s, imgfs_refs_get_put);
+    Add_Test(s, imgfs_refs_open);
+    Add_Test(s, imgfs_refs_dedup_delete);
+
+    return s;
+}
+
+TEST_SUITE(imgfs_refs_test_suite)
@@ -2,6 +2,7 @@
 #include "imgfs.h"
 #include "test.h"
 #include <check.h>
+#include <string.h>
 #include <vips/vips.h>
 
 // ======================================================================
@@ -52,6 +53,72 @@ START_TEST(get_resolution_valid)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(jpeg_header_resolution_valid)
+{
+    start_test_print;
+
+    char image_buffer[98119];
+    uint32_t height = 0, width = 0;
+
+    read_file(image_buffer, DATA_DIR "/mure.jpg", 40861);
+    ck_assert_err_none(jpeg_header_resolution(&height, &width, image_buffer, 40861));
+    ck_assert_uint_eq(height, 455);
+    ck_assert_uint_eq(width, 640);
+
+    read_file(image_buffer, DATA_DIR "/coquelicots.jpg", 98119);
+    ck_assert_err_none(jpeg_header_resolution(&height, &width, image_buffer, 98119));
+    ck_assert_uint_eq(height, 800);
+    ck_assert_uint_eq(width, 1200);
+
+    // Baseline (not progressive) ones too
+    read_file(image_buffer, DATA_DIR "/coquelicots_thumb.jpg", 12319);
+    ck_assert_err_none(jpeg_header_resolution(&height, &width, image_buffer, 12319));
+    ck_assert_uint_eq(height, 42);
+    ck_assert_uint_eq(width, 64);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(jpeg_header_resolution_invalid)
+{
+    start_test_print;
+
+    uint32_t height = 0, width = 0;
+    char image_buffer[82234];
+    read_file(image_buffer, DATA_DIR "/brouillard.jpg", 82234);
+
+    ck_assert_invalid_arg(jpeg_header_resolution(NULL, &width, image_buffer, 1));
+    ck_assert_invalid_arg(jpeg_header_resolution(&height, NULL, image_buffer, 1));
+    ck_assert_invalid_arg(jpeg_header_resolution(&height, &width, NULL, 1));
+
+    // Truncated before the frame header
+    ck_assert_err(jpeg_header_resolution(&height, &width, image_buffer, 20), ERR_IMGLIB);
+
+    // Not a JPEG
+    const char not_jpeg[] = "GIF89a, not a JPEG at all";
+    ck_assert_err(jpeg_header_resolution(&height, &width, not_jpeg, sizeof(not_jpeg)), ERR_IMGLIB);
+
+    // Start of scan before any frame header
+    const char no_frame[] = { (char) 0xFF, (char) 0xD8, (char) 0xFF, (char) 0xDA, 0, 8, 0, 0, 0, 0, 0, 0 };
+    ck_assert_err(jpeg_header_resolution(&height, &width, no_frame, sizeof(no_frame)), ERR_IMGLIB);
+
+    // Lossless frame: left to vips
+    char lossless[32] = { (char) 0xFF, (char) 0xD8, (char) 0xFF, (char) 0xC3, 0, 11, 8, 0, 10, 0, 20, 1 };
+    ck_assert_err(jpeg_header_resolution(&height, &width, lossless, sizeof(lossless)), ERR_IMGLIB);
+
+    // The same as a baseline frame, with fill bytes before its marker
+    const char baseline[] = { (char) 0xFF, (char) 0xD8, (char) 0xFF, (char) 0xFF, (char) 0xC0, 0, 11, 8, 0, 10, 0, 20, 1, 0, 0, 0 };
+    ck_assert_err_none(jpeg_header_resolution(&height, &width, baseline, sizeof(baseline)));
+    ck_assert_uint_eq(height, 10);
+    ck_assert_uint_eq(width, 20);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *imgfs_get_resolution_test_suite()
 {
@@ -60,6 +127,8 @@ Suite *imgfs_get_resolution_test_suite()
     Add_Test(s, get_resolution_null);
     Add_Test(s, get_resolution_invalid_buffer);
     Add_Test(s, get_resolution_valid);
+    Add_Test(s, jpeg_header_resolution_valid);
+    Add_Test(s, jpeg_header_resolution_invalid);
 
     return s;
 }
@@ -0,0 +1,140 @@
+#include "imgfs.h"
+#include "imgfs_slots.h"
+#include "test.h"
+#include <check.h>
+#include <string.h>
+
+// ======================================================================
+START_TEST(imgfs_slots_null_params)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    size_t index = 0;
+
+    ck_assert_invalid_arg(imgfs_slots_build(NULL));
+    ck_assert_invalid_arg(imgfs_slots_find(NULL, &index));
+
+    memset(&file, 0, sizeof(file));
+    ck_assert_invalid_arg(imgfs_slots_build(&file));
+    ck_assert_invalid_arg(imgfs_slots_find(&file, &index));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_slots_open)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    size_t index = 0;
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+
+    // pic1 and pic2 use the first two slots
+    ck_assert_ptr_nonnull(file.free_slots.words);
+    ck_assert_err_none(imgfs_slots_find(&file, &index));
+    ck_assert_uint_eq(index, 2);
+
+    file.metadata[0].is_valid = EMPTY;
+    imgfs_slots_release(&file, 0);
+    ck_assert_err_none(imgfs_slots_find(&file, &index));
+    ck_assert_uint_eq(index, 0);
+
+    do_close(&file);
+    ck_assert_ptr_null(file.free_slots.words);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_slots_many_words)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    memset(&file, 0, sizeof(file));
+    file.header.max_files = 200;
+    file.metadata = calloc(200, sizeof(struct img_metadata));
+    ck_assert_ptr_nonnull(file.metadata);
+
+    // Only slots 130 and 199 are free
+    for (size_t i = 0; i < 200; ++i) file.metadata[i].is_valid = NON_EMPTY;
+    file.metadata[130].is_valid = EMPTY;
+    file.metadata[199].is_valid = EMPTY;
+    ck_assert_err_none(imgfs_slots_build(&file));
+
+    size_t index = 0;
+    ck_assert_err_none(imgfs_slots_find(&file, &index));
+    ck_assert_uint_eq(index, 130);
+    file.metadata[130].is_valid = NON_EMPTY;
+    imgfs_slots_take(&file, 130);
+
+    ck_assert_err_none(imgfs_slots_find(&file, &index));
+    ck_assert_uint_eq(index, 199);
+    file.metadata[199].is_valid = NON_EMPTY;
+    imgfs_slots_take(&file, 199);
+
+    ck_assert_err(imgfs_slots_find(&file, &index), ERR_IMGFS_FULL);
+
+    // Released slots are found again, even before the last one found
+    file.metadata[5].is_valid = EMPTY;
+    imgfs_slots_release(&file, 5);
+    ck_assert_err_none(imgfs_slots_find(&file, &index));
+    ck_assert_uint_eq(index, 5);
+
+    // A slot made valid without telling the bitmap is skipped
+    file.metadata[5].is_valid = NON_EMPTY;
+    ck_assert_err(imgfs_slots_find(&file, &index), ERR_IMGFS_FULL);
+
+    imgfs_slots_free(&file);
+    free(file.metadata);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_slots_insert_delete)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    char image[82234];
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    read_file(image, DATA_DIR "/brouillard.jpg", 82234);
+
+    // The slot freed by do_delete is the one reused by do_insert
+    ck_assert_err_none(do_delete("pic1", &file));
+    ck_assert_err_none(do_insert(image, 82234, "pic3", &file));
+    ck_assert_str_eq(file.metadata[0].img_id, "pic3");
+    ck_assert_int_eq(file.metadata[0].is_valid, NON_EMPTY);
+
+    size_t index = 0;
+    ck_assert_err_none(imgfs_slots_find(&file, &index));
+    ck_assert_uint_eq(index, 2);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *imgfs_slots_test_suite()
+{
+    Suite *s = suite_create("Tests for the free slots bitmap implementation");
+
+    Add_Test(s, imgfs_slots_null_params);
+    Add_Test(s, imgfs_slots_open);
+    Add_Test(s, imgfs_slots_many_words);
+    Add_Test(s, imgfs_slots_insert_delete);
+
+    return s;
+}
+
+TEST_SUITE(imgfs_slots_test_suite)
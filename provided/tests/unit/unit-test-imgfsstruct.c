@@ -4,7 +4,7 @@
 // ======================================================================
 #define SIZE_imgfs_header 64
 #define SIZE_img_metadata 216
-#define SIZE_imgfs_file   80
+#define SIZE_imgfs_file   368
 
 #define OFFSET_imgfs_header_name        0
 #define OFFSET_imgfs_header_version     32
@@ -22,6 +22,13 @@
 #define OFFSET_imgfs_file_file     0
 #define OFFSET_imgfs_file_header   8
 #define OFFSET_imgfs_file_metadata 72
+#define OFFSET_imgfs_file_index    80
+#define OFFSET_imgfs_file_content_index 104
+#define OFFSET_imgfs_file_map      128
+#define OFFSET_imgfs_file_free_slots 136
+#define OFFSET_imgfs_file_extents 152
+#define OFFSET_imgfs_file_refs 320
+#define OFFSET_imgfs_file_sorted 352
 
 // ======================================================================
 #define test_member(T, M)                                                                                              \
@@ -90,6 +97,13 @@ START_TEST(imgfs_file)
     test_member(imgfs_file, file);
     test_member(imgfs_file, header);
     test_member(imgfs_file, metadata);
+    test_member(imgfs_file, index);
+    test_member(imgfs_file, content_index);
+    test_member(imgfs_file, map);
+    test_member(imgfs_file, free_slots);
+    test_member(imgfs_file, extents);
+    test_member(imgfs_file, refs);
+    test_member(imgfs_file, sorted);
 
     end_test_print;
 }
@@ -111,6 +111,97 @@ START_TEST(do_open_correct_metadata)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(do_open_mapped_metadata)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    struct imgfs_file mapped;
+    ck_assert_err_none(do_open(IMGFS("test02"), "rb", &file));
+    ck_assert_err_none(do_open_mapped(IMGFS("test02"), "rb", &mapped));
+
+    ck_assert_ptr_nonnull(mapped.map);
+    ck_assert_ptr_eq(mapped.metadata, (struct img_metadata*) ((char*) mapped.map + sizeof(struct imgfs_header)));
+    ck_assert_mem_eq(&mapped.header, &file.header, sizeof(struct imgfs_header));
+    ck_assert_mem_eq(mapped.metadata, file.metadata, file.header.max_files * sizeof(struct img_metadata));
+
+    // Private mapping: nothing may be written
+    ck_assert_err(do_delete("pic1", &mapped), ERR_IO);
+    ck_assert_int_eq(mapped.header.version, file.header.version);
+
+    do_close(&mapped);
+    ck_assert_ptr_null(mapped.map);
+    ck_assert_ptr_null(mapped.metadata);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(do_open_mapped_write)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open_mapped(dump, "rb+", &file));
+    const uint32_t version = file.header.version;
+    ck_assert_err_none(do_delete("pic1", &file));
+    do_close(&file);
+
+    // The changes made through the mapping are in the file
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_int_eq(file.header.version, version + 1);
+    ck_assert_int_eq(file.header.nb_files, 1);
+    ck_assert_int_eq(file.metadata[0].is_valid, EMPTY);
+    ck_assert_int_eq(file.metadata[1].is_valid, NON_EMPTY);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(imgfs_positional_io)
+{
+    start_test_print;
+    DECLARE_DUMP;
+
+    struct imgfs_file file;
+    struct imgfs_header header;
+    uint64_t size = 0;
+    char bytes[4] = { 0 };
+    const char written[4] = { 'a', 'b', 'c', 'd' };
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_err_none(imgfs_pread(&file, &header, sizeof(header), 0));
+    ck_assert_mem_eq(&header, &file.header, sizeof(header));
+    ck_assert_err_none(imgfs_file_size(&file, &size));
+    ck_assert_uint_eq(size, 192659);
+
+    // Reading past the end or writing a read-only file fails
+    ck_assert_err(imgfs_pread(&file, bytes, sizeof(bytes), size - 2), ERR_IO);
+    ck_assert_err(imgfs_pwrite(&file, written, sizeof(written), size), ERR_IO);
+    do_close(&file);
+
+    // Positional writes do not depend on (nor move) the position of the FILE*
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(imgfs_pwrite(&file, written, sizeof(written), size));
+    ck_assert_err_none(imgfs_pread(&file, bytes, sizeof(bytes), size));
+    ck_assert_mem_eq(bytes, written, sizeof(bytes));
+    ck_assert_int_eq(ftell(file.file), 0);
+    ck_assert_err_none(imgfs_file_size(&file, &size));
+    ck_assert_uint_eq(size, 192659 + sizeof(written));
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 START_TEST(do_close_null_param)
 {
@@ -147,6 +238,9 @@ Suite *imgfs_tools_suite_RES()
     Add_Test(s, do_open_invalid_mode);
     Add_Test(s, do_open_correct_header);
     Add_Test(s, do_open_correct_metadata);
+    Add_Test(s, do_open_mapped_metadata);
+    Add_Test(s, do_open_mapped_write);
+    Add_Test(s, imgfs_positional_io);
 
     Add_Test(s, do_close_null_param);
     Add_Test(s, do_close_null_file);
@@ -0,0 +1,137 @@
+#include "json_writer.h"
+#include "error.h"
+#include "test.h"
+#include <check.h>
+#include <string.h>
+
+// ======================================================================
+START_TEST(json_writer_null_params)
+{
+    start_test_print;
+
+    struct json_writer writer;
+    char buffer[16];
+
+    ck_assert_invalid_arg(json_writer_init(NULL, 0));
+    ck_assert_invalid_arg(json_writer_init_buffer(NULL, buffer, sizeof(buffer)));
+    ck_assert_invalid_arg(json_writer_init_buffer(&writer, NULL, sizeof(buffer)));
+    ck_assert_invalid_arg(json_writer_init_buffer(&writer, buffer, 0));
+    ck_assert_err_none(json_writer_init_buffer(&writer, buffer, sizeof(buffer)));
+    ck_assert_invalid_arg(json_writer_raw(NULL, "a", 1));
+    ck_assert_invalid_arg(json_writer_raw(&writer, NULL, 1));
+    ck_assert_invalid_arg(json_writer_literal(&writer, NULL));
+    ck_assert_invalid_arg(json_writer_string(NULL, "a", 1));
+    ck_assert_invalid_arg(json_writer_string(&writer, NULL, 1));
+    ck_assert_invalid_arg(json_writer_finish(NULL));
+    json_writer_free(NULL);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(json_writer_escapes)
+{
+    start_test_print;
+
+    struct json_writer writer;
+    ck_assert_err_none(json_writer_init(&writer, 0));
+    ck_assert_err_none(json_writer_literal(&writer, "["));
+    ck_assert_err_none(json_writer_string(&writer, "a\"b\\c/d\ne\x01", 100));
+    ck_assert_err_none(json_writer_raw(&writer, ",", 1));
+    ck_assert_err_none(json_writer_string(&writer, "truncated", 5));
+    ck_assert_err_none(json_writer_literal(&writer, "]"));
+    ck_assert_err_none(json_writer_finish(&writer));
+
+    ck_assert_str_eq(writer.buffer, "[\"a\\\"b\\\\c\\/d\\ne\\u0001\",\"trunc\"]");
+    ck_assert_uint_eq(writer.len, strlen(writer.buffer));
+
+    json_writer_free(&writer);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(json_writer_escapes_like_json_c)
+{
+    start_test_print;
+
+    // Short forms where json-c has them (also for '/'), \u00XX otherwise
+    char buffer[64];
+    struct json_writer writer;
+    ck_assert_err_none(json_writer_init_buffer(&writer, buffer, sizeof(buffer)));
+    ck_assert_err_none(json_writer_string(&writer, "/\b\f\n\r\t\x1f\x7f", 100));
+    ck_assert_err_none(json_writer_finish(&writer));
+
+    ck_assert_str_eq(buffer, "\"\\/\\b\\f\\n\\r\\t\\u001f\x7f\"");
+    ck_assert_uint_eq(writer.len, strlen(buffer));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(json_writer_grows)
+{
+    start_test_print;
+
+    struct json_writer writer;
+    ck_assert_err_none(json_writer_init(&writer, 1));
+    for (int i = 0; i < 1000; ++i) {
+        ck_assert_err_none(json_writer_string(&writer, "0123456789", 100));
+    }
+    ck_assert_err_none(json_writer_finish(&writer));
+    ck_assert_uint_eq(writer.len, 12000);
+    ck_assert_uint_eq(strlen(writer.buffer), 12000);
+    ck_assert_uint_gt(writer.capacity, 12000);
+    ck_assert_int_eq(strncmp(writer.buffer + 11988, "\"0123456789\"", 12), 0);
+
+    json_writer_free(&writer);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(json_writer_fixed_buffer)
+{
+    start_test_print;
+
+    struct json_writer writer;
+    char buffer[8];
+
+    // Exactly fits (with its null terminator)
+    ck_assert_err_none(json_writer_init_buffer(&writer, buffer, sizeof(buffer)));
+    ck_assert_err_none(json_writer_string(&writer, "abcde", 100));
+    ck_assert_err_none(json_writer_finish(&writer));
+    ck_assert_str_eq(buffer, "\"abcde\"");
+
+    // Too long: the error sticks, and the buffer is never overrun
+    ck_assert_err_none(json_writer_init_buffer(&writer, buffer, sizeof(buffer)));
+    ck_assert_err_none(json_writer_literal(&writer, "[1,"));
+    ck_assert_err(json_writer_literal(&writer, "2,3,4,5"), ERR_OUT_OF_MEMORY);
+    ck_assert_err(json_writer_literal(&writer, "]"), ERR_OUT_OF_MEMORY);
+    ck_assert_err(json_writer_finish(&writer), ERR_OUT_OF_MEMORY);
+    ck_assert_uint_eq(writer.len, 3);
+    json_writer_free(&writer);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *json_writer_test_suite()
+{
+    Suite *s = suite_create("Tests for the JSON writer");
+
+    Add_Test(s, json_writer_null_params);
+    Add_Test(s, json_writer_escapes);
+    Add_Test(s, json_writer_escapes_like_json_c);
+    Add_Test(s, json_writer_grows);
+    Add_Test(s, json_writer_fixed_buffer);
+
+    return s;
+}
+
+TEST_SUITE(json_writer_test_suite)
@@ -0,0 +1,346 @@
+#include "image_content.h"
+#include "imgfs.h"
+#include "resize_pool.h"
+#include "test.h"
+#include <check.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NB_READERS 8
+#include <vips/vips.h>
+
+// ======================================================================
+START_TEST(resize_pool_null_params)
+{
+    start_test_print;
+
+    struct resize_pool pool;
+    struct imgfs_file file;
+    pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+    const unsigned char sha[SHA256_DIGEST_LENGTH] = { 0 };
+
+    ck_assert_invalid_arg(resize_pool_start(NULL, &file, &lock, 1));
+    ck_assert_invalid_arg(resize_pool_start(&pool, NULL, &lock, 1));
+    ck_assert_invalid_arg(resize_pool_start(&pool, &file, NULL, 1));
+    ck_assert_invalid_arg(resize_pool_start(&pool, &file, &lock, 0));
+    ck_assert_invalid_arg(resize_pool_start(&pool, &file, &lock, RESIZE_POOL_MAX_WORKERS + 1));
+    ck_assert_invalid_arg(resize_pool_submit(NULL, 0, sha));
+    ck_assert_int_eq(resize_pool_wait(NULL, 0, THUMB_RES), 0);
+    resize_pool_stop(NULL);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(store_resized_imgs_checks_image)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+
+    struct imgfs_file file;
+    char thumb[] = "not really a thumbnail";
+    char small[] = "not really a small image";
+    char other[] = "other";
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    uint64_t size_before = 0;
+    uint64_t size_after = 0;
+    struct resized_imgs resized = { .buffer = { thumb, small, NULL },
+                                    .size = { sizeof(thumb), sizeof(small), 0 } };
+
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    memcpy(sha, file.metadata[0].SHA, SHA256_DIGEST_LENGTH);
+    ck_assert_err_none(imgfs_file_size(&file, &size_before));
+
+    // Deleted or replaced image: nothing written
+    sha[0] ^= 1;
+    ck_assert_err(store_resized_imgs(&file, 0, sha, &resized), ERR_IMAGE_NOT_FOUND);
+    ck_assert_err(store_resized_imgs(&file, 3, file.metadata[0].SHA, &resized), ERR_IMAGE_NOT_FOUND);
+    ck_assert_uint_eq(file.metadata[0].offset[THUMB_RES], 0);
+
+    // Both at once
+    ck_assert_err_none(store_resized_imgs(&file, 0, file.metadata[0].SHA, &resized));
+    const uint64_t offset = file.metadata[0].offset[THUMB_RES];
+    ck_assert_uint_ne(offset, 0);
+    ck_assert_uint_ne(file.metadata[0].offset[SMALL_RES], 0);
+    ck_assert_uint_eq(file.metadata[0].size[THUMB_RES], sizeof(thumb));
+    ck_assert_uint_eq(file.metadata[0].size[SMALL_RES], sizeof(small));
+    ck_assert_err_none(imgfs_file_size(&file, &size_after));
+    ck_assert_uint_eq(size_after, size_before + sizeof(thumb) + sizeof(small));
+
+    // Stored once only
+    resized.buffer[THUMB_RES] = other;
+    resized.size[THUMB_RES] = sizeof(other);
+    ck_assert_err_none(store_resized_imgs(&file, 0, file.metadata[0].SHA, &resized));
+    ck_assert_uint_eq(file.metadata[0].offset[THUMB_RES], offset);
+    ck_assert_uint_eq(file.metadata[0].size[THUMB_RES], sizeof(thumb));
+    do_close(&file);
+
+    // Persisted
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_uint_eq(file.metadata[0].offset[THUMB_RES], offset);
+    ck_assert_uint_eq(file.metadata[0].size[SMALL_RES], sizeof(small));
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(resize_pool_creates_resolutions)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+
+    struct imgfs_file file;
+    struct resize_pool pool;
+    pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(resize_pool_start(&pool, &file, &lock, 2));
+
+    ck_assert_err_none(resize_pool_submit(&pool, 0, file.metadata[0].SHA));
+    ck_assert_err_none(resize_pool_submit(&pool, 1, file.metadata[1].SHA));
+    resize_pool_wait(&pool, 0, THUMB_RES);
+    resize_pool_wait(&pool, 0, SMALL_RES);
+    resize_pool_wait(&pool, 1, THUMB_RES);
+    resize_pool_wait(&pool, 1, SMALL_RES);
+
+    // Nothing left to wait for
+    ck_assert_int_eq(resize_pool_wait(&pool, 0, THUMB_RES), 0);
+    ck_assert_int_eq(resize_pool_wait(&pool, 1, SMALL_RES), 0);
+
+    pthread_rwlock_rdlock(&lock);
+    for (size_t i = 0; i < 2; ++i) {
+        for (int res = THUMB_RES; res <= SMALL_RES; ++res) {
+            ck_assert_uint_ne(file.metadata[i].offset[res], 0);
+            ck_assert_uint_ne(file.metadata[i].size[res], 0);
+        }
+    }
+    pthread_rwlock_unlock(&lock);
+
+    resize_pool_stop(&pool);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(resize_pool_skips_deleted_image)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+
+    struct imgfs_file file;
+    struct resize_pool pool;
+    pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    memcpy(sha, file.metadata[0].SHA, SHA256_DIGEST_LENGTH);
+    ck_assert_err_none(do_delete("pic1", &file));
+
+    ck_assert_err_none(resize_pool_start(&pool, &file, &lock, 1));
+    ck_assert_err_none(resize_pool_submit(&pool, 0, sha));
+    resize_pool_wait(&pool, 0, THUMB_RES);
+    resize_pool_wait(&pool, 0, SMALL_RES);
+    resize_pool_stop(&pool);
+
+    ck_assert_uint_eq(file.metadata[0].offset[THUMB_RES], 0);
+    ck_assert_uint_eq(file.metadata[0].offset[SMALL_RES], 0);
+
+    // A stopped pool has nothing to wait for
+    ck_assert_int_eq(resize_pool_wait(&pool, 0, THUMB_RES), 0);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+struct reader_arg {
+    struct resize_pool* pool;
+    const unsigned char* sha;
+    int ret;
+};
+
+static void* resize_reader(void* arg)
+{
+    struct reader_arg* reader = arg;
+    reader->ret = resize_pool_resize(reader->pool, 0, THUMB_RES, reader->sha);
+    return NULL;
+}
+
+// ======================================================================
+START_TEST(resize_pool_resize_single_flight)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+
+    struct imgfs_file file;
+    struct resize_pool pool;
+    pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+    pthread_t threads[NB_READERS];
+    struct reader_arg readers[NB_READERS];
+    uint64_t size_before = 0;
+    uint64_t size_after = 0;
+
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(imgfs_file_size(&file, &size_before));
+    ck_assert_err_none(resize_pool_start(&pool, &file, &lock, 1));
+    ck_assert_err(resize_pool_resize(&pool, 0, ORIG_RES, file.metadata[0].SHA), ERR_RESOLUTIONS);
+
+    for (size_t i = 0; i < NB_READERS; ++i) {
+        readers[i].pool = &pool;
+        readers[i].sha = file.metadata[0].SHA;
+        ck_assert_int_eq(pthread_create(&threads[i], NULL, resize_reader, &readers[i]), 0);
+    }
+    for (size_t i = 0; i < NB_READERS; ++i) {
+        ck_assert_int_eq(pthread_join(threads[i], NULL), 0);
+        ck_assert_err_none(readers[i].ret);
+    }
+    ck_assert_uint_eq(pool.nb_resized, 1);
+    resize_pool_stop(&pool);
+
+    // One thumbnail (and small image, from the same decoding) only was written
+    ck_assert_uint_ne(file.metadata[0].size[THUMB_RES], 0);
+    ck_assert_uint_ne(file.metadata[0].size[SMALL_RES], 0);
+    ck_assert_err_none(imgfs_file_size(&file, &size_after));
+    ck_assert_uint_eq(size_after, size_before + file.metadata[0].size[THUMB_RES] + file.metadata[0].size[SMALL_RES]);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(resize_pool_resize_waits_for_room)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+
+    struct imgfs_file file;
+    struct resize_pool pool;
+    pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+    pthread_t threads[NB_READERS];
+    struct reader_arg readers[NB_READERS];
+
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(resize_pool_start(&pool, &file, &lock, 1));
+
+    // The table of the resizes in flight is full (of other images)
+    pthread_mutex_lock(&pool.mutex);
+    for (size_t i = 0; i < RESIZE_POOL_MAX_INFLIGHT; ++i) {
+        pool.inflight[i].index = 1000 + i;
+        pool.inflight[i].resolutions = RESIZED_RES_ALL;
+    }
+    pool.nb_inflight = RESIZE_POOL_MAX_INFLIGHT;
+    pthread_mutex_unlock(&pool.mutex);
+
+    for (size_t i = 0; i < NB_READERS; ++i) {
+        readers[i].pool = &pool;
+        readers[i].sha = file.metadata[0].SHA;
+        ck_assert_int_eq(pthread_create(&threads[i], NULL, resize_reader, &readers[i]), 0);
+    }
+    usleep(100000);
+    ck_assert_uint_eq(pool.nb_resized, 0);
+
+    // One of them is over: the readers still share a single resize
+    pthread_mutex_lock(&pool.mutex);
+    --pool.nb_inflight;
+    pthread_cond_broadcast(&pool.job_done);
+    pthread_mutex_unlock(&pool.mutex);
+    for (size_t i = 0; i < NB_READERS; ++i) {
+        ck_assert_int_eq(pthread_join(threads[i], NULL), 0);
+        ck_assert_err_none(readers[i].ret);
+    }
+    ck_assert_uint_eq(pool.nb_resized, 1);
+
+    pthread_mutex_lock(&pool.mutex);
+    pool.nb_inflight = 0;
+    pthread_mutex_unlock(&pool.mutex);
+    resize_pool_stop(&pool);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(resize_pool_resize_takes_queued_job)
+{
+    start_test_print;
+    DECLARE_DUMP;
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+
+    struct imgfs_file file;
+    struct resize_pool pool;
+    pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+    pthread_t thread;
+    struct reader_arg reader;
+
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    ck_assert_err_none(resize_pool_start(&pool, &file, &lock, 1));
+
+    // The worker cannot take any job: the one of the image stays queued
+    pthread_mutex_lock(&pool.mutex);
+    for (size_t i = 0; i < RESIZE_POOL_MAX_INFLIGHT; ++i) {
+        pool.inflight[i].index = 1000 + i;
+        pool.inflight[i].resolutions = RESIZED_RES_ALL;
+    }
+    pool.nb_inflight = RESIZE_POOL_MAX_INFLIGHT;
+    pthread_mutex_unlock(&pool.mutex);
+    ck_assert_err_none(resize_pool_submit(&pool, 0, file.metadata[0].SHA));
+
+    reader.pool = &pool;
+    reader.sha = file.metadata[0].SHA;
+    ck_assert_int_eq(pthread_create(&thread, NULL, resize_reader, &reader), 0);
+    usleep(50000);
+
+    // Room for the read only (the worker is not woken up): it runs the job
+    pthread_mutex_lock(&pool.mutex);
+    --pool.nb_inflight;
+    pthread_cond_broadcast(&pool.job_done);
+    pthread_mutex_unlock(&pool.mutex);
+    ck_assert_int_eq(pthread_join(thread, NULL), 0);
+    ck_assert_err_none(reader.ret);
+    ck_assert_uint_eq(pool.nb_queued, 0);
+    ck_assert_uint_eq(pool.nb_resized, 1);
+    ck_assert_uint_ne(file.metadata[0].size[THUMB_RES], 0);
+
+    pthread_mutex_lock(&pool.mutex);
+    pool.nb_inflight = 0;
+    pthread_mutex_unlock(&pool.mutex);
+    resize_pool_stop(&pool);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *resize_pool_test_suite()
+{
+    Suite *s = suite_create("Tests for the background resize pool");
+
+    Add_Test(s, resize_pool_null_params);
+    Add_Test(s, store_resized_imgs_checks_image);
+    Add_Test(s, resize_pool_creates_resolutions);
+    Add_Test(s, resize_pool_skips_deleted_image);
+    Add_Test(s, resize_pool_resize_single_flight);
+    Add_Test(s, resize_pool_resize_waits_for_room);
+    Add_Test(s, resize_pool_resize_takes_queued_job);
+
+    return s;
+}
+
+TEST_SUITE_VIPS(resize_pool_test_suite)
@@ -0,0 +1,195 @@
+#include "worker_pool.h"
+#include "error.h"
+#include "util.h"
+#include "test.h"
+#include <check.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NB_ITEMS 1000
+#define NB_PRODUCERS 4
+
+static pthread_mutex_t counter_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t nb_run = 0;
+static size_t nb_dropped = 0;
+static int run_flags[NB_ITEMS];
+
+/********************************************************************/
+static void count_run(void* item)
+{
+    pthread_mutex_lock(&counter_mutex);
+    ++nb_run;
+    if (item != NULL) ++*(int*) item;
+    pthread_mutex_unlock(&counter_mutex);
+}
+
+/********************************************************************/
+static void slow_run(void* item _unused)
+{
+    usleep(200000);
+    count_run(NULL);
+}
+
+/********************************************************************/
+static void count_drop(void* item _unused)
+{
+    pthread_mutex_lock(&counter_mutex);
+    ++nb_dropped;
+    pthread_mutex_unlock(&counter_mutex);
+}
+
+/********************************************************************/
+static void reset_counters(void)
+{
+    nb_run = 0;
+    nb_dropped = 0;
+    memset(run_flags, 0, sizeof(run_flags));
+}
+
+// ======================================================================
+START_TEST(worker_pool_null_params)
+{
+    start_test_print;
+
+    struct worker_pool pool;
+
+    ck_assert_invalid_arg(worker_pool_start(NULL, 1, 1, count_run, NULL));
+    ck_assert_invalid_arg(worker_pool_start(&pool, 1, 1, NULL, NULL));
+    ck_assert_invalid_arg(worker_pool_start(&pool, 0, 1, count_run, NULL));
+    ck_assert_invalid_arg(worker_pool_start(&pool, WORKER_POOL_MAX_WORKERS + 1, 1, count_run, NULL));
+    ck_assert_invalid_arg(worker_pool_start(&pool, 1, 0, count_run, NULL));
+    ck_assert_invalid_arg(worker_pool_submit(NULL, NULL));
+    worker_pool_stop(NULL);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(worker_pool_runs_each_item_once)
+{
+    start_test_print;
+
+    struct worker_pool pool;
+    reset_counters();
+
+    // A small queue: the submissions wait for the workers
+    ck_assert_err_none(worker_pool_start(&pool, 4, 8, count_run, count_drop));
+    for (size_t i = 0; i < NB_ITEMS; ++i) {
+        ck_assert_err_none(worker_pool_submit(&pool, &run_flags[i]));
+    }
+    while (1) {
+        pthread_mutex_lock(&counter_mutex);
+        const size_t done = nb_run;
+        pthread_mutex_unlock(&counter_mutex);
+        if (done == NB_ITEMS) break;
+        usleep(1000);
+    }
+    worker_pool_stop(&pool);
+
+    ck_assert_uint_eq(nb_dropped, 0);
+    for (size_t i = 0; i < NB_ITEMS; ++i) ck_assert_int_eq(run_flags[i], 1);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+static void* produce(void* arg)
+{
+    struct worker_pool* pool = arg;
+    for (size_t i = 0; i < NB_ITEMS / NB_PRODUCERS; ++i) {
+        if (worker_pool_submit(pool, NULL) != ERR_NONE) return arg;
+    }
+    return NULL;
+}
+
+START_TEST(worker_pool_concurrent_producers)
+{
+    start_test_print;
+
+    struct worker_pool pool;
+    pthread_t producers[NB_PRODUCERS];
+    reset_counters();
+
+    ck_assert_err_none(worker_pool_start(&pool, 3, 2, count_run, count_drop));
+    for (size_t i = 0; i < NB_PRODUCERS; ++i) {
+        ck_assert_int_eq(pthread_create(&producers[i], NULL, produce, &pool), 0);
+    }
+    for (size_t i = 0; i < NB_PRODUCERS; ++i) {
+        void* ret = &pool;
+        pthread_join(producers[i], &ret);
+        ck_assert_ptr_null(ret);
+    }
+    worker_pool_stop(&pool);
+
+    // Whatever was not run yet was dropped
+    ck_assert_uint_eq(nb_run + nb_dropped, NB_PRODUCERS * (NB_ITEMS / NB_PRODUCERS));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(worker_pool_stop_drops_queued)
+{
+    start_test_print;
+
+    struct worker_pool pool;
+    reset_counters();
+
+    // The only worker is busy with the first item while the others are queued
+    ck_assert_err_none(worker_pool_start(&pool, 1, 4, slow_run, count_drop));
+    for (size_t i = 0; i < 4; ++i) ck_assert_err_none(worker_pool_submit(&pool, NULL));
+    usleep(50000);
+    worker_pool_stop(&pool);
+
+    ck_assert_uint_eq(nb_run, 1);
+    ck_assert_uint_eq(nb_dropped, 3);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(worker_pool_try_submit_when_full)
+{
+    start_test_print;
+
+    struct worker_pool pool;
+    reset_counters();
+
+    ck_assert_invalid_arg(worker_pool_try_submit(NULL, NULL));
+
+    // The worker is busy with the first item: two more fill the queue
+    ck_assert_err_none(worker_pool_start(&pool, 1, 2, slow_run, count_drop));
+    ck_assert_int_eq(worker_pool_try_submit(&pool, NULL), 1);
+    usleep(50000);
+    ck_assert_int_eq(worker_pool_try_submit(&pool, NULL), 1);
+    ck_assert_int_eq(worker_pool_try_submit(&pool, NULL), 1);
+    ck_assert_int_eq(worker_pool_try_submit(&pool, NULL), 0);
+    worker_pool_stop(&pool);
+
+    ck_assert_uint_eq(nb_run, 1);
+    ck_assert_uint_eq(nb_dropped, 2);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *worker_pool_test_suite()
+{
+    Suite *s = suite_create("Tests for the worker pool");
+
+    Add_Test(s, worker_pool_null_params);
+    Add_Test(s, worker_pool_runs_each_item_once);
+    Add_Test(s, worker_pool_concurrent_producers);
+    Add_Test(s, worker_pool_stop_drops_queued);
+    Add_Test(s, worker_pool_try_submit_when_full);
+
+    return s;
+}
+
+TEST_SUITE(worker_pool_test_suite)